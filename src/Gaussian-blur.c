@@ -43,17 +43,213 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
 #include "util.h"
+#include "post-process.h"
+#include "band-schedule.h"
+#include "memory.h"
+
+//
+// compute Deriche 4th order recursive Gaussian filter coefficients for this radius (sigma)
+// coefficients[0..3] are the causal input coefficients, [4..7] the anti-causal input coefficients,
+// and [8..11] the feedback coefficients shared by both passes, normalized for unit gain
+//
+void initRecursiveGaussian(double radius, double *coefficients) {
+  int i;
+  double a0=1.68;
+  double a1=3.735;
+  double b0=1.783;
+  double b1=1.723;
+  double w0=0.6318;
+  double w1=1.997;
+  double c0=-0.6803;
+  double c1=-0.2598;
+  double cos_w0;
+  double sin_w0;
+  double cos_w1;
+  double sin_w1;
+  double *n;
+  double *m;
+  double *d;
+  double gain;
+
+  n=coefficients;
+  m=coefficients + 4;
+  d=coefficients + 8;
+  cos_w0=cos(w0 / radius);
+  sin_w0=sin(w0 / radius);
+  cos_w1=cos(w1 / radius);
+  sin_w1=sin(w1 / radius);
+
+  n[0]=a0 + c0;
+  n[1]=(exp(-b1 / radius) * ((c1 * sin_w1) - ((c0 + (2.0 * a0)) * cos_w1))) + (exp(-b0 / radius) * ((a1 * sin_w0) - (((2.0 * c0) + a0) * cos_w0)));
+  n[2]=(2.0 * exp(-(b0 + b1) / radius) * (((a0 + c0) * cos_w1 * cos_w0) - (a1 * cos_w1 * sin_w0) - (c1 * cos_w0 * sin_w1))) + (c0 * exp(-2.0 * b0 / radius)) + (a0 * exp(-2.0 * b1 / radius));
+  n[3]=(exp(-(b1 + (2.0 * b0)) / radius) * ((c1 * sin_w1) - (c0 * cos_w1))) + (exp(-(b0 + (2.0 * b1)) / radius) * ((a1 * sin_w0) - (a0 * cos_w0)));
+  d[0]=(-2.0 * exp(-b1 / radius) * cos_w1) - (2.0 * exp(-b0 / radius) * cos_w0);
+  d[1]=(4.0 * cos_w1 * cos_w0 * exp(-(b0 + b1) / radius)) + exp(-2.0 * b1 / radius) + exp(-2.0 * b0 / radius);
+  d[2]=(-2.0 * cos_w0 * exp(-(b0 + (2.0 * b1)) / radius)) - (2.0 * cos_w1 * exp(-(b1 + (2.0 * b0)) / radius));
+  d[3]=exp(-2.0 * (b0 + b1) / radius);
+
+  // anti-causal coefficients follow from symmetry of the impulse response
+  m[0]=n[1] - (d[0] * n[0]);
+  m[1]=n[2] - (d[1] * n[0]);
+  m[2]=n[3] - (d[2] * n[0]);
+  m[3]=-d[3] * n[0];
+
+  // normalize so the sum of the impulse response is 1.0, the same as the normalized direct kernel
+  gain=(n[0] + n[1] + n[2] + n[3] + m[0] + m[1] + m[2] + m[3]) / (1.0 + d[0] + d[1] + d[2] + d[3]);
+  for (i=0; i < 4; i++) {
+    n[i]/=gain;
+    m[i]/=gain;
+  }
+}
+
+//
+// apply recursive Gaussian filter to num_lines adjacent lines of line_length pixels each
+// pixel_step and dest_step are the distances between pixels along a line in source and dest (1 for rows, image width for columns)
+// the causal pass writes to dest, the anti-causal pass adds to dest and multiplies by scale
+// both passes start with zero state so pixels outside the image are treated as zero, the same as the direct kernel
+// state must hold 24 doubles per line (last 4 inputs and outputs for each color)
+//
+void blurLinesRecursive(pixel_composition_t *source, pixel_composition_t *dest, int num_lines, int line_length, uint64_t pixel_step, uint64_t dest_step, double *coefficients, double *state, double scale) {
+  int i;
+  int line;
+  int color;
+  double *n;
+  double *m;
+  double *d;
+  double input[3];
+  double output[3];
+  double *x;
+  double *y;
+  pixel_composition_t *source_p;
+  pixel_composition_t *dest_p;
+
+  n=coefficients;
+  m=coefficients + 4;
+  d=coefficients + 8;
+
+  //
+  // causal pass
+  //
+  memset(state, 0, ((size_t)num_lines * 24 * sizeof(double)));
+  for (i=0; i < line_length; i++) {
+    source_p=source + ((uint64_t)i * pixel_step);
+    dest_p=dest + ((uint64_t)i * dest_step);
+    x=state;
+    for (line=0; line < num_lines; line++) {
+      y=x + 12;
+      input[0]=BSR_GET_PIXEL(source_p->r);
+      input[1]=BSR_GET_PIXEL(source_p->g);
+      input[2]=BSR_GET_PIXEL(source_p->b);
+      for (color=0; color < 3; color++) {
+        output[color]=(n[0] * input[color]) + (n[1] * x[color]) + (n[2] * x[3 + color]) + (n[3] * x[6 + color]) - (d[0] * y[color]) - (d[1] * y[3 + color]) - (d[2] * y[6 + color]) - (d[3] * y[9 + color]);
+        x[9 + color]=x[6 + color];
+        x[6 + color]=x[3 + color];
+        x[3 + color]=x[color];
+        x[color]=input[color];
+        y[9 + color]=y[6 + color];
+        y[6 + color]=y[3 + color];
+        y[3 + color]=y[color];
+        y[color]=output[color];
+      } // end for color
+      dest_p->r=BSR_SET_PIXEL(output[0]);
+      dest_p->g=BSR_SET_PIXEL(output[1]);
+      dest_p->b=BSR_SET_PIXEL(output[2]);
+      source_p++;
+      dest_p++;
+      x+=24;
+    } // end for line
+  } // end for i
+
+  //
+  // anti-causal pass
+  //
+  memset(state, 0, ((size_t)num_lines * 24 * sizeof(double)));
+  for (i=line_length - 1; i >= 0; i--) {
+    source_p=source + ((uint64_t)i * pixel_step);
+    dest_p=dest + ((uint64_t)i * dest_step);
+    x=state;
+    for (line=0; line < num_lines; line++) {
+      y=x + 12;
+      input[0]=BSR_GET_PIXEL(source_p->r);
+      input[1]=BSR_GET_PIXEL(source_p->g);
+      input[2]=BSR_GET_PIXEL(source_p->b);
+      for (color=0; color < 3; color++) {
+        output[color]=(m[0] * x[color]) + (m[1] * x[3 + color]) + (m[2] * x[6 + color]) + (m[3] * x[9 + color]) - (d[0] * y[color]) - (d[1] * y[3 + color]) - (d[2] * y[6 + color]) - (d[3] * y[9 + color]);
+        x[9 + color]=x[6 + color];
+        x[6 + color]=x[3 + color];
+        x[3 + color]=x[color];
+        x[color]=input[color];
+        y[9 + color]=y[6 + color];
+        y[6 + color]=y[3 + color];
+        y[3 + color]=y[color];
+        y[color]=output[color];
+      } // end for color
+      dest_p->r=BSR_SET_PIXEL((BSR_GET_PIXEL(dest_p->r) + output[0]) * scale);
+      dest_p->g=BSR_SET_PIXEL((BSR_GET_PIXEL(dest_p->g) + output[1]) * scale);
+      dest_p->b=BSR_SET_PIXEL((BSR_GET_PIXEL(dest_p->b) + output[2]) * scale);
+      source_p++;
+      dest_p++;
+      x+=24;
+    } // end for line
+  } // end for i
+}
+
+//
+// select direct kernel or recursive filter
+// the recursive filter time does not depend on radius but it is only accurate for radius >= 0.5
+//
+int useRecursiveGaussian(bsr_config_t *bsr_config) {
+  int use_recursive;
+
+  if (bsr_config->Gaussian_blur_method == 2) {
+    use_recursive=1;
+  } else if (bsr_config->Gaussian_blur_method == 1) {
+    use_recursive=0;
+  } else if (bsr_config->Gaussian_blur_radius >= BSR_BLUR_RECURSIVE_MIN_RADIUS) {
+    use_recursive=1;
+  } else {
+    use_recursive=0;
+  }
+  if (bsr_config->Gaussian_blur_radius < 0.5) {
+    use_recursive=0;
+  }
+
+  return(use_recursive);
+}
+
+//
+// number of BSR_BAND_LINES row slots in the ring that holds horizontal pass output for the direct kernel.
+// A slot is reused once every vertical band that reads it is done, so the ring needs the bands within
+// the kernel radius on both sides plus one band in flight per thread. Returns 0 for the recursive filter,
+// which blurs in place
+//
+int blurRingBands(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int blur_res_y) {
+  int num_bands;
+  int radius_bands;
+  int ring_bands;
+
+  if ((bsr_config->Gaussian_blur_radius <= 0.0) || (useRecursiveGaussian(bsr_config) == 1)) {
+    return(0);
+  }
+  num_bands=(blur_res_y + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+  radius_bands=(((int)ceil(bsr_config->Gaussian_blur_radius) * 3) + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+  ring_bands=(2 * radius_bands) + 2 + (bsr_state->num_worker_threads + 1);
+  if (ring_bands > num_bands) {
+    ring_bands=num_bands;
+  }
+
+  return(ring_bands);
+}
 
 int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   int i;
   double radius;
-  int lines_per_thread;
   int sample_width;
   int half_sample_width;
   int blur_res_x;
   int blur_res_y;
-  uint64_t blur_i;
   int blur_x;
   int blur_y;
   int source_x;
@@ -61,10 +257,7 @@ int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   int kernel_i;
   int current_image_res_x;
   int current_image_res_y;
-  int current_image_x;
-  int current_image_y;
   uint64_t current_image_offset;
-  uint64_t image_offset;
   double *G_kernel_array;
   double *G_kernel_p;
   double G_kernel_sum;
@@ -72,11 +265,39 @@ int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   struct timespec starttime;
   struct timespec endtime;
   double elapsed_time;
+  struct timespec vertical_starttime;
+  struct timespec vertical_endtime;
+  double vertical_elapsed_time=0.0;
   pixel_composition_t *current_image_p;
   pixel_composition_t *image_blur_p;
   double G_r;
   double G_g;
   double G_b;
+  int use_recursive;
+  int num_bands;
+  int num_vertical_bands;
+  int num_tasks;
+  int task;
+  int band;
+  int *first_dependency;
+  int *last_dependency;
+  int ring_bands;
+  int ring_band;
+  int first_user;
+  int last_user;
+  int *task_stage;
+  int *task_band;
+  int block_width;
+  double recursive_coefficients[12];
+  double *recursive_state=NULL;
+  pixel_composition_t *column_block=NULL;
+  int strip_i;
+  double G_strip[BSR_BLUR_COLUMN_BLOCK * 3];
+  double *G_strip_p;
+  double *blur_line;
+  pixel_composition_t *blur_row;
+  double inv_camera_pixel_limit;
+  double blur_limit;
 
   //
   // all threads: determine Gaussian kernel width
@@ -85,12 +306,21 @@ int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   sample_width=((int)ceil(radius) * 6) + 1;
   half_sample_width=((int)ceil(radius) * 3) + 1;
 
+  //
+  // all threads: select direct kernel or recursive filter
+  //
+  use_recursive=useRecursiveGaussian(bsr_config);
+
   //
   // main thread: display status message if not in CGI mode
   //
   if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
     clock_gettime(CLOCK_REALTIME, &starttime);
-    printf("Applying Gaussian blur with radius %.3f...", radius);
+    if (use_recursive == 1) {
+      printf("Applying recursive Gaussian blur with radius %.3f...", radius);
+    } else {
+      printf("Applying Gaussian blur with radius %.3f...", radius);
+    }
     fflush(stdout);
   }
 
@@ -128,186 +358,271 @@ int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   } // end for kernel
 
   //
-  // all threads: get current image pointer and resolution
+  // all threads: get current image resolution and normalization factor
   //
-  current_image_p=bsr_state->current_image_buf;
   current_image_res_x=bsr_state->current_image_res_x;
   current_image_res_y=bsr_state->current_image_res_y;
   blur_res_x=current_image_res_x;
   blur_res_y=current_image_res_y;
-  lines_per_thread=(int)ceil(((double)current_image_res_y / (double)(bsr_state->num_worker_threads + 1)));
-  if (lines_per_thread < 1) {
-    lines_per_thread=1;
-  }
+  inv_camera_pixel_limit=bsr_state->composition_scale / bsr_state->camera_pixel_limit;
 
   //
-  // worker threads:  wait for main thread to say go
-  // main thread: tell worker threads to go
+  // all threads: blur input is limited to [0..blur_limit], 16-bit buffers can not hold values above BSR_HALF_LIMIT
   //
-  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    waitForMainThread(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_PREP_BEGIN);
-  } else {
-    // main thread
-    for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_GAUSSIAN_BLUR_PREP_BEGIN;
-    }
-  } // end if not main thread
+#if BSR_COMPOSITION_BITS == 16
+  blur_limit=BSR_HALF_LIMIT;
+#else
+  blur_limit=BSR_BLUR_RESCALE;
+#endif
 
   //
-  // all threads: temporarily re-scale image as GaussianBlur() requires values in the range [0..1].
-  // /this is undone at the end of GaussianBlur()
+  // all threads: initialize recursive filter and allocate state and a copy of one block of columns. The recursive
+  // filter runs in place in the image buffer so the vertical pass filters from the copy
   //
-  current_image_x=0;
-  lines_per_thread=(int)ceil(((double)current_image_res_y / (double)(bsr_state->num_worker_threads + 1)));
-  if (lines_per_thread < 1) {
-    lines_per_thread=1;
-  }
-  current_image_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  current_image_p=bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)current_image_y);
-  for (image_offset=0; ((image_offset < ((uint64_t)bsr_state->current_image_res_x * (uint64_t)lines_per_thread)) && (current_image_y < current_image_res_y)); image_offset++) {
-    G_r=current_image_p->r;
-    G_g=current_image_p->g;
-    G_b=current_image_p->b;
-    G_r /= BSR_BLUR_RESCALE;
-    G_g /= BSR_BLUR_RESCALE;
-    G_b /= BSR_BLUR_RESCALE;
-    limitIntensity(bsr_config, &G_r, &G_g, &G_b);
-    current_image_p->r=G_r;
-    current_image_p->g=G_g;
-    current_image_p->b=G_b;
-
-    // if end of this line, move to next line
-    current_image_x++;
-    if (current_image_x == bsr_state->current_image_res_x) {
-      current_image_x=0;
-      current_image_y++;
+  if (use_recursive == 1) {
+    initRecursiveGaussian(radius, recursive_coefficients);
+    recursive_state=(double *)malloc((size_t)BSR_BLUR_COLUMN_BLOCK * 24 * sizeof(double));
+    column_block=(pixel_composition_t *)malloc((size_t)BSR_BLUR_COLUMN_BLOCK * (size_t)blur_res_y * sizeof(pixel_composition_t));
+    if ((recursive_state == NULL) || (column_block == NULL)) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for recursive Gaussian blur\n");
+        fflush(stdout);
+      }
+      return(1);
     }
-    current_image_p++;
-  } // end for i
+  }
 
   //
-  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
-  // main thread: wait until all other threads are done and then signal that they can continue to next step.
+  // all threads: allocate line buffers for the horizontal pass
   //
-  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_GAUSSIAN_BLUR_PREP_COMPLETE;
-    waitForMainThread(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_HORIZONTAL_BEGIN);
-  } else {
-    waitForWorkerThreads(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_PREP_COMPLETE);
-    // ready to continue, set all worker thread status to begin horizontal
-    for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_GAUSSIAN_BLUR_HORIZONTAL_BEGIN;
+  blur_line=(double *)malloc((size_t)blur_res_x * 3 * sizeof(double));
+  blur_row=(pixel_composition_t *)malloc((size_t)blur_res_x * sizeof(pixel_composition_t));
+  if ((blur_line == NULL) || (blur_row == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for Gaussian blur line buffer\n");
+      fflush(stdout);
     }
-  } // end if not main thread
+    return(1);
+  }
 
   //
-  // all threads: apply Gaussian 1D kernel to each pixel horizontally and put output in blur buffer
-  //
-  blur_x=0;
-  blur_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  image_blur_p=bsr_state->image_blur_buf + ((uint64_t)blur_res_x * (uint64_t)blur_y);
-  for (blur_i=0; ((blur_i < ((uint64_t)blur_res_x * (uint64_t)lines_per_thread)) && (blur_y < blur_res_y)); blur_i++) {
-    // apply Gaussian kernel to this pixel horizontally
-    G_r=0.0;
-    G_g=0.0;
-    G_b=0.0;
-    G_kernel_p=G_kernel_array;
-    for (kernel_i=-half_sample_width + 1; kernel_i < half_sample_width; kernel_i++) {
-      source_x=blur_x + kernel_i;
-      if ((source_x >= 0) && (source_x < current_image_res_x)) {
-        current_image_offset=((uint64_t)blur_y * (uint64_t)blur_res_x) + (uint64_t)source_x;
-        current_image_p=bsr_state->current_image_buf + current_image_offset;
-        G_r+=(current_image_p->r * *G_kernel_p);
-        G_g+=(current_image_p->g * *G_kernel_p);
-        G_b+=(current_image_p->b * *G_kernel_p);
-      } // end if within current image bounds
-      G_kernel_p++;
-    } // end for kernel
-
-    // copy blurred pixel to blur buffer
-    image_blur_p->r=G_r;
-    image_blur_p->g=G_g;
-    image_blur_p->b=G_b;
-
-    // if end of this line, move to next line
-    blur_x++;
-    if (blur_x == blur_res_x) {
-      blur_x=0;
-      blur_y++;
+  // all threads: build the band task list. Stage 0 is the horizontal pass over bands of BSR_BAND_LINES rows.
+  // Stage 1 is the vertical pass: the direct kernel works on the same row bands and only needs the horizontal
+  // output of the bands within the kernel radius, the recursive filter works on blocks of BSR_BLUR_COLUMN_BLOCK
+  // columns spanning the whole image so it needs every horizontal band.
+  // The direct kernel keeps horizontal output in a ring of ring_bands slots (image_blur_buf) and writes the
+  // vertical output back to the image buffer, the recursive filter works in place in the image buffer
+  //
+  num_bands=(blur_res_y + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+  if (use_recursive == 1) {
+    num_vertical_bands=(blur_res_x + BSR_BLUR_COLUMN_BLOCK - 1) / BSR_BLUR_COLUMN_BLOCK;
+  } else {
+    num_vertical_bands=num_bands;
+  }
+  ring_bands=bsr_state->blur_ring_bands;
+  first_dependency=(int *)malloc((size_t)num_vertical_bands * sizeof(int));
+  last_dependency=(int *)malloc((size_t)num_vertical_bands * sizeof(int));
+  task_stage=(int *)malloc((size_t)(num_bands + num_vertical_bands) * sizeof(int));
+  task_band=(int *)malloc((size_t)(num_bands + num_vertical_bands) * sizeof(int));
+  if ((first_dependency == NULL) || (last_dependency == NULL) || (task_stage == NULL) || (task_band == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for Gaussian blur task list\n");
+      fflush(stdout);
+    }
+    return(1);
+  }
+  for (band=0; band < num_vertical_bands; band++) {
+    if (use_recursive == 1) {
+      first_dependency[band]=0;
+      last_dependency[band]=num_bands - 1;
+    } else {
+      first_dependency[band]=((band * BSR_BAND_LINES) - (half_sample_width - 1)) / BSR_BAND_LINES;
+      if (first_dependency[band] < 0) {
+        first_dependency[band]=0;
+      }
+      last_dependency[band]=(((band + 1) * BSR_BAND_LINES) - 1 + (half_sample_width - 1)) / BSR_BAND_LINES;
+      if (last_dependency[band] > (num_bands - 1)) {
+        last_dependency[band]=num_bands - 1;
+      }
     }
-    image_blur_p++;
-  } // end for blur_i
+  }
+  num_tasks=buildBandTasks(num_bands, num_vertical_bands, last_dependency, task_stage, task_band);
 
   //
-  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
-  // main thread: wait until all other threads are done and then signal that they can continue to next step.
+  // worker threads:  wait for main thread to say go
+  // main thread: reset band scheduler and tell worker threads to go
   //
   if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_GAUSSIAN_BLUR_HORIZONTAL_COMPLETE;
-    waitForMainThread(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_VERTICAL_BEGIN);
+    waitForMainThread(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_BEGIN);
   } else {
-    waitForWorkerThreads(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_HORIZONTAL_COMPLETE);
-    // ready to continue, set all worker thread status to begin vertical
+    // main thread
+    initBandSchedule(bsr_state);
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_GAUSSIAN_BLUR_VERTICAL_BEGIN;
+      bsr_state->status_array[i].status=THREAD_STATUS_GAUSSIAN_BLUR_BEGIN;
     }
   } // end if not main thread
 
   //
-  // all threads: apply Gaussian 1D kernel to each pixel vertically and put output back in 'current_image_buffer'
-  // note in this step we use image_blur_buf as source and current_iamge_buf as dest so some variable names will be backwards
-  //
-  blur_x=0;
-  blur_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  image_blur_p=bsr_state->current_image_buf + ((uint64_t)blur_res_x * (uint64_t)blur_y);
-  for (blur_i=0; ((blur_i < ((uint64_t)blur_res_x * (uint64_t)lines_per_thread)) && (blur_y < blur_res_y)); blur_i++) {
-    //
-    // apply Gaussian kernel to this pixel vertically
-    //
-    G_r=0.0;
-    G_g=0.0;
-    G_b=0.0;
-    G_kernel_p=G_kernel_array;
-    for (kernel_i=-half_sample_width + 1; kernel_i < half_sample_width; kernel_i++) {
-      source_y=blur_y + kernel_i;
-      if ((source_y >= 0) && (source_y < current_image_res_y)) {
-        current_image_offset=((uint64_t)source_y * (uint64_t)blur_res_x) + (uint64_t)blur_x;
-        current_image_p=bsr_state->image_blur_buf + current_image_offset;
-        G_r+=(current_image_p->r * *G_kernel_p);
-        G_g+=(current_image_p->g * *G_kernel_p);
-        G_b+=(current_image_p->b * *G_kernel_p);
-      } // end if within current image bounds
-      G_kernel_p++;
-    } // end for kernel
-
-    // undo scaling
-    G_r *= BSR_BLUR_RESCALE;
-    G_g *= BSR_BLUR_RESCALE;
-    G_b *= BSR_BLUR_RESCALE;
-
-    // copy blurred pixel to blur buffer
-    image_blur_p->r=G_r;
-    image_blur_p->g=G_g;
-    image_blur_p->b=G_b;
-
-    // if end of this line, move to next line
-    blur_x++;
-    if (blur_x == blur_res_x) {
-      blur_x=0;
-      blur_y++;
-    }
-    image_blur_p++;
-  } // end for blur_i
+  // all threads: claim tasks until none are left
+  //
+  bsr_state->status_array[bsr_state->perthread->my_thread_id].pass_time=0.0;
+  for (task=claimBandTask(bsr_state); task < num_tasks; task=claimBandTask(bsr_state)) {
+    band=task_band[task];
+    if (task_stage[task] == 0) {
+      //
+      // horizontal pass: for each line in this band, copy the line to blur_row while applying camera gamma
+      // and intensity limit (post_process_stage) and limiting values to [0..blur_limit] (temporarily re-scaled to
+      // [0..1] for limitIntensity()). Then apply Gaussian 1D kernel (or recursive filter) to each pixel
+      // horizontally and put output in blur buffer. The line stays in cache so the image buffer is only read once here.
+      //
+      // direct kernel: before reusing a ring slot wait for the vertical bands that read its previous band
+      if ((use_recursive == 0) && (band >= ring_bands)) {
+        first_user=band - ring_bands;
+        while ((first_user > 0) && (last_dependency[first_user - 1] >= (band - ring_bands))) {
+          first_user--;
+        }
+        last_user=band - ring_bands;
+        while ((last_user < (num_bands - 1)) && (first_dependency[last_user + 1] <= (band - ring_bands))) {
+          last_user++;
+        }
+        waitForBands(bsr_state, 1, first_user, last_user);
+      }
+      ring_band=(use_recursive == 1) ? 0 : (band % ring_bands);
+      for (blur_y=band * BSR_BAND_LINES; ((blur_y < ((band + 1) * BSR_BAND_LINES)) && (blur_y < blur_res_y)); blur_y++) {
+        current_image_offset=(uint64_t)blur_y * (uint64_t)blur_res_x;
+        current_image_p=bsr_state->current_image_buf + current_image_offset;
+        if (bsr_state->post_process_stage == 1) {
+          postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, blur_line, blur_res_x);
+        } else {
+          for (blur_x=0; blur_x < blur_res_x; blur_x++) {
+            blur_line[(blur_x * 3)]=BSR_GET_PIXEL(current_image_p[blur_x].r);
+            blur_line[(blur_x * 3) + 1]=BSR_GET_PIXEL(current_image_p[blur_x].g);
+            blur_line[(blur_x * 3) + 2]=BSR_GET_PIXEL(current_image_p[blur_x].b);
+          }
+        }
+        for (blur_x=0; blur_x < blur_res_x; blur_x++) {
+          G_r=blur_line[(blur_x * 3)] / blur_limit;
+          G_g=blur_line[(blur_x * 3) + 1] / blur_limit;
+          G_b=blur_line[(blur_x * 3) + 2] / blur_limit;
+          limitIntensity(bsr_config, &G_r, &G_g, &G_b);
+          blur_row[blur_x].r=BSR_SET_PIXEL(G_r * blur_limit);
+          blur_row[blur_x].g=BSR_SET_PIXEL(G_g * blur_limit);
+          blur_row[blur_x].b=BSR_SET_PIXEL(G_b * blur_limit);
+        }
+
+        if (use_recursive == 1) {
+          blurLinesRecursive(blur_row, current_image_p, 1, blur_res_x, 1, 1, recursive_coefficients, recursive_state, 1.0);
+        } else {
+          image_blur_p=bsr_state->image_blur_buf + ((uint64_t)((ring_band * BSR_BAND_LINES) + (blur_y - (band * BSR_BAND_LINES))) * (uint64_t)blur_res_x);
+          for (blur_x=0; blur_x < blur_res_x; blur_x++) {
+            // apply Gaussian kernel to this pixel horizontally
+            G_r=0.0;
+            G_g=0.0;
+            G_b=0.0;
+            G_kernel_p=G_kernel_array;
+            for (kernel_i=-half_sample_width + 1; kernel_i < half_sample_width; kernel_i++) {
+              source_x=blur_x + kernel_i;
+              if ((source_x >= 0) && (source_x < blur_res_x)) {
+                G_r+=(BSR_GET_PIXEL(blur_row[source_x].r) * *G_kernel_p);
+                G_g+=(BSR_GET_PIXEL(blur_row[source_x].g) * *G_kernel_p);
+                G_b+=(BSR_GET_PIXEL(blur_row[source_x].b) * *G_kernel_p);
+              } // end if within current image bounds
+              G_kernel_p++;
+            } // end for kernel
+
+            // copy blurred pixel to blur buffer
+            image_blur_p->r=BSR_SET_PIXEL(G_r);
+            image_blur_p->g=BSR_SET_PIXEL(G_g);
+            image_blur_p->b=BSR_SET_PIXEL(G_b);
+            image_blur_p++;
+          } // end for blur_x
+        } // end if use_recursive
+      } // end for blur_y
+    } else {
+      //
+      // vertical pass: apply Gaussian 1D kernel to each pixel vertically and put output back in 'current_image_buffer'
+      // note in this step we use image_blur_buf as source and current_iamge_buf as dest so some variable names will be backwards
+      //
+      if (use_recursive == 1) {
+        // recursive filter: copy this block of BSR_BLUR_COLUMN_BLOCK columns and filter it row by row over the whole image
+        waitForBands(bsr_state, 0, 0, last_dependency[band]);
+        clock_gettime(CLOCK_MONOTONIC, &vertical_starttime);
+        blur_x=band * BSR_BLUR_COLUMN_BLOCK;
+        block_width=blur_res_x - blur_x;
+        if (block_width > BSR_BLUR_COLUMN_BLOCK) {
+          block_width=BSR_BLUR_COLUMN_BLOCK;
+        }
+        for (blur_y=0; blur_y < blur_res_y; blur_y++) {
+          memcpy((column_block + ((uint64_t)blur_y * (uint64_t)block_width)), (bsr_state->current_image_buf + ((uint64_t)blur_y * (uint64_t)blur_res_x) + (uint64_t)blur_x), ((size_t)block_width * sizeof(pixel_composition_t)));
+        }
+        blurLinesRecursive(column_block, (bsr_state->current_image_buf + blur_x), block_width, blur_res_y, (uint64_t)block_width, (uint64_t)blur_res_x, recursive_coefficients, recursive_state, 1.0);
+      } else {
+        //
+        // direct kernel: for each row in this band, accumulate a strip of BSR_BLUR_COLUMN_BLOCK
+        // adjacent pixels for each kernel tap so each source row is read sequentially. Taps are summed in
+        // the same order as one pixel at a time so results are identical.
+        //
+        waitForBands(bsr_state, 0, first_dependency[band], last_dependency[band]);
+        clock_gettime(CLOCK_MONOTONIC, &vertical_starttime);
+        for (blur_y=band * BSR_BAND_LINES; ((blur_y < ((band + 1) * BSR_BAND_LINES)) && (blur_y < blur_res_y)); blur_y++) {
+          for (blur_x=0; blur_x < blur_res_x; blur_x+=BSR_BLUR_COLUMN_BLOCK) {
+            block_width=blur_res_x - blur_x;
+            if (block_width > BSR_BLUR_COLUMN_BLOCK) {
+              block_width=BSR_BLUR_COLUMN_BLOCK;
+            }
+            memset(G_strip, 0, ((size_t)block_width * 3 * sizeof(double)));
+            G_kernel_p=G_kernel_array;
+            for (kernel_i=-half_sample_width + 1; kernel_i < half_sample_width; kernel_i++) {
+              source_y=blur_y + kernel_i;
+              if ((source_y >= 0) && (source_y < current_image_res_y)) {
+                current_image_offset=((uint64_t)(((source_y / BSR_BAND_LINES) % ring_bands) * BSR_BAND_LINES + (source_y % BSR_BAND_LINES)) * (uint64_t)blur_res_x) + (uint64_t)blur_x;
+                current_image_p=bsr_state->image_blur_buf + current_image_offset;
+                G_strip_p=G_strip;
+                for (strip_i=0; strip_i < block_width; strip_i++) {
+                  G_strip_p[0]+=(BSR_GET_PIXEL(current_image_p->r) * *G_kernel_p);
+                  G_strip_p[1]+=(BSR_GET_PIXEL(current_image_p->g) * *G_kernel_p);
+                  G_strip_p[2]+=(BSR_GET_PIXEL(current_image_p->b) * *G_kernel_p);
+                  G_strip_p+=3;
+                  current_image_p++;
+                } // end for strip_i
+              } // end if within current image bounds
+              G_kernel_p++;
+            } // end for kernel
+
+            // copy blurred strip to image buffer
+            image_blur_p=bsr_state->current_image_buf + ((uint64_t)blur_y * (uint64_t)blur_res_x) + (uint64_t)blur_x;
+            G_strip_p=G_strip;
+            for (strip_i=0; strip_i < block_width; strip_i++) {
+              image_blur_p->r=BSR_SET_PIXEL(G_strip_p[0]);
+              image_blur_p->g=BSR_SET_PIXEL(G_strip_p[1]);
+              image_blur_p->b=BSR_SET_PIXEL(G_strip_p[2]);
+              G_strip_p+=3;
+              image_blur_p++;
+            } // end for strip_i
+          } // end for blur_x
+        } // end for blur_y
+      } // end if use_recursive
+      clock_gettime(CLOCK_MONOTONIC, &vertical_endtime);
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].pass_time+=((double)vertical_endtime.tv_sec + ((double)vertical_endtime.tv_nsec / 1.0E9)) - ((double)vertical_starttime.tv_sec + ((double)vertical_starttime.tv_nsec / 1.0E9));
+    } // end if task_stage
+    setBandDone(bsr_state, task_stage[task], band);
+  } // end for task
 
   //
   // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
   // main thread: wait until all other threads are done and then signal that they can continue to next step.
   //
   if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_GAUSSIAN_BLUR_VERTICAL_COMPLETE;
+    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_GAUSSIAN_BLUR_COMPLETE;
     waitForMainThread(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_CONTINUE);
   } else {
-    waitForWorkerThreads(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_VERTICAL_COMPLETE);
+    waitForWorkerThreads(bsr_state, THREAD_STATUS_GAUSSIAN_BLUR_COMPLETE);
+    // blur ring is dead
+    releaseImageBuffer(bsr_state->image_blur_buf, bsr_state->blur_buffer_size);
+    // sum time spent in vertical tasks by all threads
+    for (i=0; i <= bsr_state->num_worker_threads; i++) {
+      vertical_elapsed_time+=bsr_state->status_array[i].pass_time;
+    }
     // ready to continue, set all worker thread status to continue
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
       bsr_state->status_array[i].status=THREAD_STATUS_GAUSSIAN_BLUR_CONTINUE;
@@ -321,8 +636,25 @@ int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     clock_gettime(CLOCK_REALTIME, &endtime);
     elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
     printf(" (%.3fs)\n", elapsed_time);
+    // vertical pass reads the blur buffer and writes the image buffer once each, time is summed over all threads
+    if (vertical_elapsed_time > 0.0) {
+      printf("Vertical blur pass: %.3fs thread time, %.1fMB/s per thread\n", vertical_elapsed_time, ((double)blur_res_x * (double)blur_res_y * (double)sizeof(pixel_composition_t) * 2.0 / 1.0E6 / vertical_elapsed_time));
+    }
     fflush(stdout);
   } // end if main thread
 
+  //
+  // all threads: free kernel, recursive filter state, line buffers and task list
+  //
+  free(G_kernel_array);
+  free(recursive_state);
+  free(column_block);
+  free(blur_line);
+  free(blur_row);
+  free(first_dependency);
+  free(last_dependency);
+  free(task_stage);
+  free(task_band);
+
   return(0);
 }
@@ -39,6 +39,10 @@
 #ifndef BSR_GAUSSIAN_BLUR_H
 #define BSR_GAUSSIAN_BLUR_H
 
+void initRecursiveGaussian(double radius, double *coefficients);
+void blurLinesRecursive(pixel_composition_t *source, pixel_composition_t *dest, int num_lines, int line_length, uint64_t pixel_step, uint64_t dest_step, double *coefficients, double *state, double scale);
+int useRecursiveGaussian(bsr_config_t *bsr_config);
+int blurRingBands(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int blur_res_y);
 int GaussianBlur(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_GAUSSIN_BLUR_H
@@ -39,9 +39,133 @@
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include "util.h"
+#include "post-process.h"
+#include "band-schedule.h"
+
+//
+// fast natural log for positive normal numbers, error < 1E-12
+// branch free so loops over rows of pixels can be vectorized by the compiler
+//
+double fastLog(double x) {
+  union {
+    double d;
+    uint64_t u;
+  } bits;
+  double exponent;
+  double m;
+  double s;
+  double s2;
+  double p;
+  double adjust;
+
+  // split x into exponent and mantissa in [1..2)
+  bits.d=x;
+  exponent=(double)((int)((bits.u >> 52) & 0x7ff) - 1023);
+  bits.u=(bits.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+  m=bits.d;
+
+  // move mantissa to [sqrt(0.5)..sqrt(2)) for faster series convergence
+  adjust=(double)(m > M_SQRT2);
+  m=m * (1.0 - (0.5 * adjust));
+  exponent+=adjust;
+
+  // log(m) = 2 * atanh((m - 1) / (m + 1))
+  s=(m - 1.0) / (m + 1.0);
+  s2=s * s;
+  p=(1.0 / 11.0) + (s2 * (1.0 / 13.0));
+  p=(1.0 / 9.0) + (s2 * p);
+  p=(1.0 / 7.0) + (s2 * p);
+  p=(1.0 / 5.0) + (s2 * p);
+  p=(1.0 / 3.0) + (s2 * p);
+  p=1.0 + (s2 * p);
+
+  return((exponent * M_LN2) + (2.0 * s * p));
+}
+
+//
+// fast exp, relative error < 1E-13, results below about 1E-300 are flushed to zero
+//
+double fastExp(double x) {
+  union {
+    double d;
+    uint64_t u;
+  } bits;
+  double k;
+  double r;
+  double p;
+
+  // clamp to range of normal doubles
+  if (x < -690.0) {
+    x=-690.0;
+  } else if (x > 709.0) {
+    x=709.0;
+  }
+
+  // exp(x) = 2^k * exp(r) with |r| <= ln(2) / 2
+  k=floor((x * M_LOG2E) + 0.5);
+  r=x - (k * M_LN2);
+  p=(1.0 / 3628800.0) + (r * (1.0 / 39916800.0));
+  p=(1.0 / 362880.0) + (r * p);
+  p=(1.0 / 40320.0) + (r * p);
+  p=(1.0 / 5040.0) + (r * p);
+  p=(1.0 / 720.0) + (r * p);
+  p=(1.0 / 120.0) + (r * p);
+  p=(1.0 / 24.0) + (r * p);
+  p=(1.0 / 6.0) + (r * p);
+  p=(1.0 / 2.0) + (r * p);
+  p=1.0 + (r * p);
+  p=1.0 + (r * p);
+  bits.u=(uint64_t)((int)k + 1023) << 52;
+
+  return(p * bits.d);
+}
+
+//
+// build Lanczos weight table for one axis
+// for each output pixel i, first[i] is the first source pixel and count[i] the number of source pixels
+// (0 to 2 * Lanczos_order) inside the source image, with weights starting at weights[i * 2 * Lanczos_order].
+// Weights are the same kernel values as evaluating the 2D Lanczos footprint directly.
+//
+void initLanczosTable(int source_res, int resize_res, double source_w, int Lanczos_order, int *first, int *count, double *weights) {
+  int i;
+  int source_i;
+  int source_first;
+  int source_last;
+  double source_center;
+  double L_distance;
+  double *weights_p;
+
+  for (i=0; i < resize_res; i++) {
+    source_center=((double)i * source_w) + (source_w / 2.0) - 0.5;
+    source_first=(int)source_center - Lanczos_order + 1;
+    source_last=(int)source_center + Lanczos_order;
+    if (source_first < 0) {
+      source_first=0;
+    }
+    if (source_last > (source_res - 1)) {
+      source_last=source_res - 1;
+    }
+    first[i]=source_first;
+    count[i]=0;
+    weights_p=weights + ((size_t)i * (size_t)(2 * Lanczos_order));
+    for (source_i=source_first; source_i <= source_last; source_i++) {
+      L_distance=source_center - (double)source_i;
+      if (L_distance == 0.0) {
+        *weights_p=1.0;
+      } else if ((L_distance >= -(double)Lanczos_order) && (L_distance <= (double)Lanczos_order)) {
+        *weights_p=Lanczos_order * sin(M_PI * L_distance) * sin(M_PI * L_distance / (double)Lanczos_order) / (M_PI * M_PI * L_distance * L_distance);
+      } else {
+        *weights_p=0.0;
+      }
+      weights_p++;
+      count[i]++;
+    } // end for source_i
+  } // end for i
+}
 
 int resizeLanczos(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   struct timespec starttime;
@@ -49,37 +173,45 @@ int resizeLanczos(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   double elapsed_time;
   pixel_composition_t *current_image_p;
   pixel_composition_t *image_resize_p;
-  uint64_t current_image_offset;
+  pixel_composition_t *image_scratch_p;
   int resize_res_x;
   int resize_res_y;
   double source_w;
-  double half_source_w;
-  double source_x_center;
-  double source_y_center;
-  int source_x;
   int source_y;
   int resize_x;
   int resize_y;
   double L_kernel;
-  double L_x_r;
-  double L_x_g;
-  double L_x_b;
-  double L_y_r;
-  double L_y_g;
-  double L_y_b;
-  double L_distance_x;
-  double L_distance_y;
-  uint64_t resize_i;
-  int i_x;
-  int i_y;
+  double L_r;
+  double L_g;
+  double L_b;
+  double *L_weights_p;
+  double *L_source_p;
+  double *L_accum_p;
   int Lanczos_order;
+  int taps;
   int current_image_res_x;
   int current_image_res_y;
-  int lines_per_thread;
   int i;
-  int current_image_x;
-  int current_image_y;
-  uint64_t image_offset;
+  int tap;
+  int *x_first=NULL;
+  int *x_count=NULL;
+  double *x_weights=NULL;
+  int *y_first=NULL;
+  int *y_count=NULL;
+  double *y_weights=NULL;
+  unsigned char *row_used=NULL;
+  double *log_row=NULL;
+  double *accum_row=NULL;
+  double inv_camera_pixel_limit;
+  int num_bands;
+  int num_resize_bands;
+  int num_tasks;
+  int task;
+  int band;
+  int *first_dependency=NULL;
+  int *last_dependency=NULL;
+  int *task_stage=NULL;
+  int *task_band=NULL;
 
   //
   // all threads: get current image resolution and calculate resize resolution
@@ -89,7 +221,15 @@ int resizeLanczos(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   resize_res_x=bsr_state->resize_res_x;
   resize_res_y=bsr_state->resize_res_y;
   source_w=1.0 / bsr_config->output_scaling_factor;
-  half_source_w=source_w / 2.0;
+  if (bsr_config->Lanczos_order < 2) {
+    Lanczos_order=2;
+  } else if (bsr_config->Lanczos_order > 10) {
+    Lanczos_order=10;
+  } else {
+    Lanczos_order=bsr_config->Lanczos_order;
+  }
+  taps=2 * Lanczos_order;
+  inv_camera_pixel_limit=bsr_state->composition_scale / bsr_state->camera_pixel_limit;
 
   //
   // main thread: display status message if not in CGI mode
@@ -101,170 +241,180 @@ int resizeLanczos(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   }
 
   //
-  // worker threads:  wait for main thread to say go
-  // main thread: tell worker threads to go
+  // all threads: allocate and build horizontal and vertical weight tables, and per thread row buffers
   //
-  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    waitForMainThread(bsr_state, THREAD_STATUS_LANCZOS_PREP_BEGIN);
-  } else {
-    // main thread
-    for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_LANCZOS_PREP_BEGIN;
+  x_first=(int *)malloc((size_t)resize_res_x * sizeof(int));
+  x_count=(int *)malloc((size_t)resize_res_x * sizeof(int));
+  x_weights=(double *)malloc((size_t)resize_res_x * (size_t)taps * sizeof(double));
+  y_first=(int *)malloc((size_t)resize_res_y * sizeof(int));
+  y_count=(int *)malloc((size_t)resize_res_y * sizeof(int));
+  y_weights=(double *)malloc((size_t)resize_res_y * (size_t)taps * sizeof(double));
+  row_used=(unsigned char *)malloc((size_t)current_image_res_y * sizeof(unsigned char));
+  log_row=(double *)malloc((size_t)current_image_res_x * 3 * sizeof(double));
+  accum_row=(double *)malloc((size_t)resize_res_x * 3 * sizeof(double));
+  if ((x_first == NULL) || (x_count == NULL) || (x_weights == NULL) || (y_first == NULL) || (y_count == NULL) || (y_weights == NULL) || (row_used == NULL) || (log_row == NULL) || (accum_row == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for Lanczos weight tables\n");
+      fflush(stdout);
     }
-  } // end if not main thread
+    exit(1);
+  }
+  initLanczosTable(current_image_res_x, resize_res_x, source_w, Lanczos_order, x_first, x_count, x_weights);
+  initLanczosTable(current_image_res_y, resize_res_y, source_w, Lanczos_order, y_first, y_count, y_weights);
+
+  // only source rows used by at least one output row need the horizontal pass
+  memset(row_used, 0, (size_t)current_image_res_y);
+  for (resize_y=0; resize_y < resize_res_y; resize_y++) {
+    for (tap=0; tap < y_count[resize_y]; tap++) {
+      row_used[y_first[resize_y] + tap]=1;
+    }
+  }
 
   //
-  // all threads: convert to log scale to reduce clipping artifacts. This will be undone
-  // at the end of resizeLanczos()
+  // all threads: build the band task list. Stage 0 is the horizontal pass over bands of BSR_BAND_LINES source rows,
+  // stage 1 is the vertical pass over bands of BSR_BAND_LINES output rows which only needs the source bands
+  // covered by its vertical taps
   //
-  current_image_x=0;
-  lines_per_thread=(int)ceil(((double)current_image_res_y / (double)(bsr_state->num_worker_threads + 1)));
-  if (lines_per_thread < 1) {
-    lines_per_thread=1;
+  num_bands=(current_image_res_y + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+  num_resize_bands=(resize_res_y + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+  first_dependency=(int *)malloc((size_t)num_resize_bands * sizeof(int));
+  last_dependency=(int *)malloc((size_t)num_resize_bands * sizeof(int));
+  task_stage=(int *)malloc((size_t)(num_bands + num_resize_bands) * sizeof(int));
+  task_band=(int *)malloc((size_t)(num_bands + num_resize_bands) * sizeof(int));
+  if ((first_dependency == NULL) || (last_dependency == NULL) || (task_stage == NULL) || (task_band == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for Lanczos task list\n");
+      fflush(stdout);
+    }
+    exit(1);
   }
-  current_image_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  current_image_p=bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)current_image_y);
-  for (image_offset=0; ((image_offset < ((uint64_t)bsr_state->current_image_res_x * (uint64_t)lines_per_thread)) && (current_image_y < current_image_res_y)); image_offset++) {
-    L_x_r=current_image_p->r;
-    L_x_g=current_image_p->g;
-    L_x_b=current_image_p->b;
-    L_x_r=log(BSR_RESIZE_LOG_OFFSET + L_x_r); 
-    L_x_g=log(BSR_RESIZE_LOG_OFFSET + L_x_g);
-    L_x_b=log(BSR_RESIZE_LOG_OFFSET + L_x_b);
-    current_image_p->r=L_x_r;
-    current_image_p->g=L_x_g;
-    current_image_p->b=L_x_b;
-
-    // if end of this line, move to next line
-    current_image_x++;
-    if (current_image_x == bsr_state->current_image_res_x) {
-      current_image_x=0;
-      current_image_y++;
+  for (band=0; band < num_resize_bands; band++) {
+    resize_y=band * BSR_BAND_LINES;
+    first_dependency[band]=y_first[resize_y] / BSR_BAND_LINES;
+    resize_y=((band + 1) * BSR_BAND_LINES) - 1;
+    if (resize_y > (resize_res_y - 1)) {
+      resize_y=resize_res_y - 1;
     }
-    current_image_p++;
-  } // end for i
+    last_dependency[band]=(y_first[resize_y] + y_count[resize_y] - 1) / BSR_BAND_LINES;
+  }
+  num_tasks=buildBandTasks(num_bands, num_resize_bands, last_dependency, task_stage, task_band);
 
   //
-  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
-  // main thread: wait until all other threads are done and then signal that they can continue to next step.
+  // worker threads:  wait for main thread to say go
+  // main thread: reset band scheduler and tell worker threads to go
   //
   if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_LANCZOS_PREP_COMPLETE;
-    waitForMainThread(bsr_state, THREAD_STATUS_LANCZOS_RESAMPLE_BEGIN);
+    waitForMainThread(bsr_state, THREAD_STATUS_LANCZOS_BEGIN);
   } else {
-    waitForWorkerThreads(bsr_state, THREAD_STATUS_LANCZOS_PREP_COMPLETE);
-    // ready to continue, set all worker thread status to continue
+    // main thread
+    initBandSchedule(bsr_state);
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_LANCZOS_RESAMPLE_BEGIN;
+      bsr_state->status_array[i].status=THREAD_STATUS_LANCZOS_BEGIN;
     }
   } // end if not main thread
 
   //
-  // all threads: copy rendered image to resize buffer using Lanczos interpolation
+  // all threads: claim tasks until none are left
   //
-  if (bsr_config->Lanczos_order < 2) {
-    Lanczos_order=2;
-  } else if (bsr_config->Lanczos_order > 10) {
-    Lanczos_order=10;
-  } else {
-    Lanczos_order=bsr_config->Lanczos_order;
-  }
-  resize_x=0;
-  lines_per_thread=(int)ceil(((double)resize_res_y / (double)(bsr_state->num_worker_threads + 1)));
-  if (lines_per_thread < 1) {
-    lines_per_thread=1;
-  }
-  resize_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  image_resize_p=bsr_state->image_resize_buf + ((uint64_t)resize_res_x * (uint64_t)resize_y);
-  for (resize_i=0; ((resize_i < ((uint64_t)resize_res_x * (uint64_t)lines_per_thread)) && (resize_y < resize_res_y)); resize_i++) {
-    source_x_center=((double)resize_x * source_w) + half_source_w - 0.5;
-    source_y_center=((double)resize_y * source_w) + half_source_w - 0.5;
-    L_y_r=0.0;
-    L_y_g=0.0;
-    L_y_b=0.0;
-    for (i_y=((int)source_y_center - Lanczos_order + 1); i_y <= ((int)source_y_center + Lanczos_order); i_y++) {
-      source_y=i_y;
-
-      // L_x
-      L_x_r=0.0;
-      L_x_g=0.0;
-      L_x_b=0.0;
-      for (i_x=((int)source_x_center - Lanczos_order + 1); i_x <= ((int)source_x_center + Lanczos_order); i_x++) {
-        source_x=i_x;
-        if ((source_x >= 0) && (source_x < current_image_res_x) && (source_y >= 0) && (source_y < current_image_res_y)) {
-          current_image_offset=((uint64_t)source_y * (uint64_t)current_image_res_x) + (uint64_t)source_x;
-          current_image_p=bsr_state->current_image_buf + current_image_offset;
-          L_distance_x=source_x_center - (double)i_x;
-          if (L_distance_x == 0.0) {
-            L_x_r+=current_image_p->r;
-            L_x_g+=current_image_p->g;
-            L_x_b+=current_image_p->b;
-          } else if ((L_distance_x >= -(double)Lanczos_order) && (L_distance_x <= (double)Lanczos_order)) {
-            L_kernel=Lanczos_order * sin(M_PI * L_distance_x) * sin(M_PI * L_distance_x / (double)Lanczos_order) / (M_PI * M_PI * L_distance_x * L_distance_x);
-            L_x_r+=(current_image_p->r * L_kernel);
-            L_x_g+=(current_image_p->g * L_kernel);
-            L_x_b+=(current_image_p->b * L_kernel);
-          } else {
-            // L_x == 0
-          } // end if L_distance_x
-        } // end if within composition buffer bounds
-      } // end for i_x
-
-      // L_y
-      L_distance_y=source_y_center - (double)i_y;
-      if (L_distance_y == 0.0) {
-        L_y_r+=L_x_r;
-        L_y_g+=L_x_g;
-        L_y_b+=L_x_b;
-      } else if ((L_distance_y >= -(double)Lanczos_order) && (L_distance_y <= (double)Lanczos_order)) {
-        L_kernel=Lanczos_order * sin(M_PI * L_distance_y) * sin(M_PI * L_distance_y / (double)Lanczos_order) / (M_PI * M_PI * L_distance_y * L_distance_y);
-        L_y_r+=(L_x_r * L_kernel);
-        L_y_g+=(L_x_g * L_kernel);
-        L_y_b+=(L_x_b * L_kernel);
-      } else {
-        // L_y = 0
-      } // end if L_distance_y
-    } // end for i_y
+  for (task=claimBandTask(bsr_state); task < num_tasks; task=claimBandTask(bsr_state)) {
+    band=task_band[task];
+    if (task_stage[task] == 0) {
+      //
+      // horizontal pass. For each used source row in this band, convert to log scale to reduce clipping
+      // artifacts (undone after the vertical pass) and resample horizontally into the scratch buffer
+      //
+      for (source_y=band * BSR_BAND_LINES; ((source_y < ((band + 1) * BSR_BAND_LINES)) && (source_y < current_image_res_y)); source_y++) {
+        if (row_used[source_y] == 0) {
+          continue;
+        }
 
-    // undo log scaling
-    L_y_r=exp(L_y_r) - BSR_RESIZE_LOG_OFFSET;
-    L_y_g=exp(L_y_g) - BSR_RESIZE_LOG_OFFSET;
-    L_y_b=exp(L_y_b) - BSR_RESIZE_LOG_OFFSET;
+        // convert source row to log scale, applying camera gamma and intensity limit first if not already done (post_process_stage)
+        current_image_p=bsr_state->current_image_buf + ((uint64_t)source_y * (uint64_t)current_image_res_x);
+        if (bsr_state->post_process_stage == 2) {
+          postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, log_row, current_image_res_x);
+        } else {
+          for (i=0; i < current_image_res_x; i++) {
+            log_row[(i * 3)]=BSR_GET_PIXEL(current_image_p[i].r);
+            log_row[(i * 3) + 1]=BSR_GET_PIXEL(current_image_p[i].g);
+            log_row[(i * 3) + 2]=BSR_GET_PIXEL(current_image_p[i].b);
+          }
+        }
+        for (i=0; i < (current_image_res_x * 3); i++) {
+          log_row[i]=fastLog(BSR_RESIZE_LOG_OFFSET + log_row[i]);
+        }
 
-    // handle negative clipping, which is common
-    if (L_y_r < 0.0) {
-      L_y_r=0.0;
-    }
-    if (L_y_g < 0.0) {
-      L_y_g=0.0;
-    }
-    if (L_y_b < 0.0) {
-      L_y_b=0.0;
-    }
+        // resample horizontally
+        image_scratch_p=bsr_state->image_resize_scratch_buf + ((uint64_t)source_y * (uint64_t)resize_res_x);
+        for (resize_x=0; resize_x < resize_res_x; resize_x++) {
+          L_r=0.0;
+          L_g=0.0;
+          L_b=0.0;
+          L_weights_p=x_weights + ((size_t)resize_x * (size_t)taps);
+          L_source_p=log_row + ((size_t)x_first[resize_x] * 3);
+          for (tap=0; tap < x_count[resize_x]; tap++) {
+            L_kernel=*L_weights_p;
+            L_r+=(L_source_p[0] * L_kernel);
+            L_g+=(L_source_p[1] * L_kernel);
+            L_b+=(L_source_p[2] * L_kernel);
+            L_weights_p++;
+            L_source_p+=3;
+          }
+          image_scratch_p->r=BSR_SET_PIXEL(L_r);
+          image_scratch_p->g=BSR_SET_PIXEL(L_g);
+          image_scratch_p->b=BSR_SET_PIXEL(L_b);
+          image_scratch_p++;
+        } // end for resize_x
+      } // end for source_y
+    } else {
+      //
+      // vertical pass from scratch buffer to resize buffer for this band of output rows
+      // whole scratch rows are accumulated for each tap so memory is read sequentially
+      //
+      waitForBands(bsr_state, 0, first_dependency[band], last_dependency[band]);
+      for (resize_y=band * BSR_BAND_LINES; ((resize_y < ((band + 1) * BSR_BAND_LINES)) && (resize_y < resize_res_y)); resize_y++) {
+        memset(accum_row, 0, ((size_t)resize_res_x * 3 * sizeof(double)));
+        L_weights_p=y_weights + ((size_t)resize_y * (size_t)taps);
+        for (tap=0; tap < y_count[resize_y]; tap++) {
+          L_kernel=*L_weights_p;
+          image_scratch_p=bsr_state->image_resize_scratch_buf + ((uint64_t)(y_first[resize_y] + tap) * (uint64_t)resize_res_x);
+          L_accum_p=accum_row;
+          for (resize_x=0; resize_x < resize_res_x; resize_x++) {
+            L_accum_p[0]+=(BSR_GET_PIXEL(image_scratch_p->r) * L_kernel);
+            L_accum_p[1]+=(BSR_GET_PIXEL(image_scratch_p->g) * L_kernel);
+            L_accum_p[2]+=(BSR_GET_PIXEL(image_scratch_p->b) * L_kernel);
+            L_accum_p+=3;
+            image_scratch_p++;
+          }
+          L_weights_p++;
+        } // end for tap
 
-    // copy to output buffer
-    image_resize_p->r=L_y_r;
-    image_resize_p->g=L_y_g;
-    image_resize_p->b=L_y_b;
-
-    // if end of this line, move to next line
-    resize_x++;
-    if (resize_x == resize_res_x) {
-      resize_x=0;
-      resize_y++;
-    }
-    image_resize_p++;
-  }
+        // undo log scaling, handle negative clipping (which is common) and copy to output buffer
+        image_resize_p=bsr_state->image_resize_buf + ((uint64_t)resize_y * (uint64_t)resize_res_x);
+        L_accum_p=accum_row;
+        for (resize_x=0; resize_x < resize_res_x; resize_x++) {
+          L_r=fastExp(L_accum_p[0]) - BSR_RESIZE_LOG_OFFSET;
+          L_g=fastExp(L_accum_p[1]) - BSR_RESIZE_LOG_OFFSET;
+          L_b=fastExp(L_accum_p[2]) - BSR_RESIZE_LOG_OFFSET;
+          image_resize_p->r=BSR_SET_PIXEL((L_r < 0.0) ? 0.0 : L_r);
+          image_resize_p->g=BSR_SET_PIXEL((L_g < 0.0) ? 0.0 : L_g);
+          image_resize_p->b=BSR_SET_PIXEL((L_b < 0.0) ? 0.0 : L_b);
+          L_accum_p+=3;
+          image_resize_p++;
+        }
+      } // end for resize_y
+    } // end if task_stage
+    setBandDone(bsr_state, task_stage[task], band);
+  } // end for task
 
   //
   // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
   // main thread: wait until all other threads are done and then signal that they can continue to next step.
   //
   if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_LANCZOS_RESAMPLE_COMPLETE;
+    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_LANCZOS_COMPLETE;
     waitForMainThread(bsr_state, THREAD_STATUS_LANCZOS_CONTINUE);
   } else {
-    waitForWorkerThreads(bsr_state, THREAD_STATUS_LANCZOS_RESAMPLE_COMPLETE);
+    waitForWorkerThreads(bsr_state, THREAD_STATUS_LANCZOS_COMPLETE);
     // main thread: update current_image_buf pointer
     if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
       bsr_state->current_image_buf=bsr_state->image_resize_buf;
@@ -288,5 +438,22 @@ int resizeLanczos(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     }
   } // end if main thread
 
+  //
+  // all threads: free weight tables, row buffers and task list
+  //
+  free(x_first);
+  free(x_count);
+  free(x_weights);
+  free(y_first);
+  free(y_count);
+  free(y_weights);
+  free(row_used);
+  free(log_row);
+  free(accum_row);
+  free(first_dependency);
+  free(last_dependency);
+  free(task_stage);
+  free(task_band);
+
   return(0);
 }
@@ -39,6 +39,9 @@
 #ifndef BSR_LANCZOS_H
 #define BSR_LANCZOS_H
 
+double fastLog(double x);
+double fastExp(double x);
+void initLanczosTable(int source_res, int resize_res, double source_w, int Lanczos_order, int *first, int *count, double *weights);
 int resizeLanczos(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_LANCZOS_H
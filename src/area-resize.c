@@ -0,0 +1,249 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "util.h"
+#include "post-process.h"
+
+//
+// resize by an integer reduction factor N, averaging each NxN block of source pixels
+// in a single pass. This is equivalent to supersampling and conserves total intensity.
+// Source rows are released from memory as each thread finishes its band.
+//
+int resizeArea(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  pixel_composition_t *current_image_p;
+  pixel_composition_t *image_resize_p;
+  int resize_res_x;
+  int resize_res_y;
+  int current_image_res_x;
+  int current_image_res_y;
+  int area_factor;
+  int lines_per_thread;
+  int resize_x;
+  int resize_y;
+  int source_x;
+  int source_y;
+  int source_x_end;
+  int source_y_end;
+  int block_i;
+  int i;
+  double *area_row=NULL;
+  double *area_row_p;
+  double *area_line=NULL;
+  double *area_line_p;
+  double area_scale;
+  uint64_t release_start;
+  uint64_t release_end;
+  uint64_t page_size;
+  double inv_camera_pixel_limit;
+
+  //
+  // all threads: get current image resolution, reduction factor and normalization factor
+  //
+  current_image_res_x=bsr_state->current_image_res_x;
+  current_image_res_y=bsr_state->current_image_res_y;
+  resize_res_x=bsr_state->resize_res_x;
+  resize_res_y=bsr_state->resize_res_y;
+  area_factor=bsr_state->resize_area_factor;
+  inv_camera_pixel_limit=bsr_state->composition_scale / bsr_state->camera_pixel_limit;
+
+  //
+  // main thread: display status message if not in CGI mode
+  //
+  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Resizing image from %dx%d to %dx%d (%dx%d area average)...", current_image_res_x, current_image_res_y, resize_res_x, resize_res_y, area_factor, area_factor);
+    fflush(stdout);
+  }
+
+  //
+  // all threads: allocate row accumulator and source line buffer
+  //
+  area_row=(double *)malloc((size_t)resize_res_x * 3 * sizeof(double));
+  area_line=(double *)malloc((size_t)current_image_res_x * 3 * sizeof(double));
+  if ((area_row == NULL) || (area_line == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for area resize\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  //
+  // worker threads:  wait for main thread to say go
+  // main thread: tell worker threads to go
+  //
+  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+    waitForMainThread(bsr_state, THREAD_STATUS_AREA_RESIZE_BEGIN);
+  } else {
+    // main thread
+    for (i=1; i <= bsr_state->num_worker_threads; i++) {
+      bsr_state->status_array[i].status=THREAD_STATUS_AREA_RESIZE_BEGIN;
+    }
+  } // end if not main thread
+
+  //
+  // all threads: average each block of source pixels for this thread's band of output rows
+  //
+  lines_per_thread=(int)ceil(((double)resize_res_y / (double)(bsr_state->num_worker_threads + 1)));
+  if (lines_per_thread < 1) {
+    lines_per_thread=1;
+  }
+  for (resize_y=bsr_state->perthread->my_thread_id * lines_per_thread; ((resize_y < ((bsr_state->perthread->my_thread_id + 1) * lines_per_thread)) && (resize_y < resize_res_y)); resize_y++) {
+    memset(area_row, 0, ((size_t)resize_res_x * 3 * sizeof(double)));
+    source_y_end=(resize_y + 1) * area_factor;
+    if (source_y_end > current_image_res_y) {
+      source_y_end=current_image_res_y;
+    }
+    for (source_y=resize_y * area_factor; source_y < source_y_end; source_y++) {
+      // get source line, applying camera gamma and intensity limit if not already done (post_process_stage)
+      current_image_p=bsr_state->current_image_buf + ((uint64_t)source_y * (uint64_t)current_image_res_x);
+      if (bsr_state->post_process_stage == 2) {
+        postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, area_line, current_image_res_x);
+      } else {
+        for (source_x=0; source_x < current_image_res_x; source_x++) {
+          area_line[(source_x * 3)]=BSR_GET_PIXEL(current_image_p[source_x].r);
+          area_line[(source_x * 3) + 1]=BSR_GET_PIXEL(current_image_p[source_x].g);
+          area_line[(source_x * 3) + 2]=BSR_GET_PIXEL(current_image_p[source_x].b);
+        }
+      }
+      area_line_p=area_line;
+      area_row_p=area_row;
+      for (resize_x=0; resize_x < resize_res_x; resize_x++) {
+        source_x_end=(resize_x + 1) * area_factor;
+        if (source_x_end > current_image_res_x) {
+          source_x_end=current_image_res_x;
+        }
+        for (source_x=resize_x * area_factor; source_x < source_x_end; source_x++) {
+          area_row_p[0]+=area_line_p[0];
+          area_row_p[1]+=area_line_p[1];
+          area_row_p[2]+=area_line_p[2];
+          area_line_p+=3;
+        }
+        area_row_p+=3;
+      } // end for resize_x
+    } // end for source_y
+
+    // divide by number of source pixels in each block, which may be less than NxN at the right and bottom edges
+    image_resize_p=bsr_state->image_resize_buf + ((uint64_t)resize_y * (uint64_t)resize_res_x);
+    area_row_p=area_row;
+    block_i=source_y_end - (resize_y * area_factor);
+    for (resize_x=0; resize_x < resize_res_x; resize_x++) {
+      source_x_end=(resize_x + 1) * area_factor;
+      if (source_x_end > current_image_res_x) {
+        source_x_end=current_image_res_x;
+      }
+      area_scale=1.0 / (double)(block_i * (source_x_end - (resize_x * area_factor)));
+      image_resize_p->r=BSR_SET_PIXEL(area_row_p[0] * area_scale);
+      image_resize_p->g=BSR_SET_PIXEL(area_row_p[1] * area_scale);
+      image_resize_p->b=BSR_SET_PIXEL(area_row_p[2] * area_scale);
+      area_row_p+=3;
+      image_resize_p++;
+    } // end for resize_x
+  } // end for resize_y
+
+  //
+  // all threads: release pages of source rows in this thread's band, they are not used again.
+  // Only whole pages inside the band are released, pages shared with neighboring bands are kept.
+  // The source is kept if another output still has to be made from it
+  //
+  page_size=(uint64_t)sysconf(_SC_PAGESIZE);
+  if (bsr_config->huge_pages == 2) {
+    page_size=2097152;
+  } else if (bsr_config->huge_pages == 3) {
+    page_size=1073741824;
+  }
+  source_y=bsr_state->perthread->my_thread_id * lines_per_thread * area_factor;
+  source_y_end=(bsr_state->perthread->my_thread_id + 1) * lines_per_thread * area_factor;
+  if (source_y_end > current_image_res_y) {
+    source_y_end=current_image_res_y;
+  }
+  if ((bsr_state->keep_source_image == 0) && (source_y < source_y_end)) {
+    release_start=(uint64_t)source_y * (uint64_t)current_image_res_x * sizeof(pixel_composition_t);
+    release_end=(uint64_t)source_y_end * (uint64_t)current_image_res_x * sizeof(pixel_composition_t);
+    release_start=((release_start + page_size - 1) / page_size) * page_size;
+    release_end=(release_end / page_size) * page_size;
+    if (release_end > release_start) {
+      madvise(((char *)bsr_state->current_image_buf + release_start), (size_t)(release_end - release_start), MADV_REMOVE);
+    }
+  }
+
+  //
+  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+  // main thread: wait until all other threads are done and then signal that they can continue to next step.
+  //
+  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_AREA_RESIZE_COMPLETE;
+    waitForMainThread(bsr_state, THREAD_STATUS_AREA_RESIZE_CONTINUE);
+  } else {
+    waitForWorkerThreads(bsr_state, THREAD_STATUS_AREA_RESIZE_COMPLETE);
+    // main thread: update current_image_buf pointer
+    bsr_state->current_image_buf=bsr_state->image_resize_buf;
+    bsr_state->current_image_res_x=resize_res_x;
+    bsr_state->current_image_res_y=resize_res_y;
+    for (i=1; i <= bsr_state->num_worker_threads; i++) {
+      bsr_state->status_array[i].status=THREAD_STATUS_AREA_RESIZE_CONTINUE;
+    }
+  } // end if not main thread
+
+  //
+  // main thread: output execution time if not in CGI mode
+  //
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &endtime);
+      elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+      printf(" (%.3fs)\n", elapsed_time);
+      fflush(stdout);
+    }
+  } // end if main thread
+
+  free(area_row);
+  free(area_line);
+
+  return(0);
+}
@@ -0,0 +1,166 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include "util.h"
+
+//
+// Band scheduler for two stage image passes (for example horizontal then vertical blur).
+// Each stage is split into bands of rows (or columns) and every thread builds the same task list with
+// buildBandTasks(), ordered so that each task comes after all of the tasks it depends on. Threads claim
+// the next task from the shared counter, wait only for the bands that task reads, run it and mark it done.
+// Because tasks are claimed in dependency order a thread never waits on a task that has not been claimed,
+// and a slow band only holds up the bands that actually need it instead of the whole stage.
+//
+
+//
+// main thread: start a new scheduled pass. Must be called while the worker threads are waiting at a
+// checkpoint. Bands marked done by previous passes have an older generation so nothing needs to be cleared
+//
+int initBandSchedule(bsr_state_t *bsr_state) {
+  bsr_state->band_schedule->generation++;
+  bsr_state->band_schedule->next_task=0;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return(0);
+}
+
+//
+// all threads: build the ordered task list. All stage 0 bands come in order, and each stage 1 band is
+// placed right after the last stage 0 band it depends on (last_dependency[] must be non-decreasing).
+// Returns the number of tasks
+//
+int buildBandTasks(int num_bands, int num_next_bands, int *last_dependency, int *task_stage, int *task_band) {
+  int band;
+  int next_band;
+  int num_tasks;
+
+  num_tasks=0;
+  next_band=0;
+  for (band=0; band < num_bands; band++) {
+    task_stage[num_tasks]=0;
+    task_band[num_tasks]=band;
+    num_tasks++;
+    while ((next_band < num_next_bands) && (last_dependency[next_band] <= band)) {
+      task_stage[num_tasks]=1;
+      task_band[num_tasks]=next_band;
+      num_tasks++;
+      next_band++;
+    }
+  }
+  while (next_band < num_next_bands) {
+    task_stage[num_tasks]=1;
+    task_band[num_tasks]=next_band;
+    num_tasks++;
+    next_band++;
+  }
+
+  return(num_tasks);
+}
+
+//
+// all threads: claim the next task index from the shared queue
+//
+int claimBandTask(bsr_state_t *bsr_state) {
+  return((int)__atomic_fetch_add(&bsr_state->band_schedule->next_task, 1, __ATOMIC_ACQ_REL));
+}
+
+//
+// all threads: mark a band of a stage done. Release ordering makes the band's output visible
+// to any thread that sees the flag
+//
+int setBandDone(bsr_state_t *bsr_state, int stage, int band) {
+  __atomic_store_n(&bsr_state->band_done[(stage * bsr_state->band_schedule_max_bands) + band], bsr_state->band_schedule->generation, __ATOMIC_RELEASE);
+
+  return(0);
+}
+
+//
+// all threads: check without waiting if a band of a stage is done
+//
+int isBandDone(bsr_state_t *bsr_state, int stage, int band) {
+  return(__atomic_load_n(&bsr_state->band_done[(stage * bsr_state->band_schedule_max_bands) + band], __ATOMIC_ACQUIRE) == bsr_state->band_schedule->generation);
+}
+
+//
+// all threads: wait until bands first_band..last_band of a stage are done
+//
+int waitForBands(bsr_state_t *bsr_state, int stage, int first_band, int last_band) {
+  int band;
+  int generation;
+  int loop_count;
+  int *band_done;
+
+  generation=bsr_state->band_schedule->generation;
+  band_done=bsr_state->band_done + (stage * bsr_state->band_schedule_max_bands);
+  loop_count=0;
+  for (band=first_band; band <= last_band; band++) {
+    while (__atomic_load_n(&band_done[band], __ATOMIC_ACQUIRE) != generation) {
+      // periodically check for exceptions
+      loop_count++;
+      if ((loop_count % 10000) == 0) {
+        checkExceptions(bsr_state);
+        loop_count=1;
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// all threads: mark a band of a multi-level pass done. Bands are numbered across all levels and use the
+// flags of both stages, so a pass can have up to twice band_schedule_max_bands bands
+//
+int setLevelBandDone(bsr_state_t *bsr_state, int band) {
+  return(setBandDone(bsr_state, (band / bsr_state->band_schedule_max_bands), (band % bsr_state->band_schedule_max_bands)));
+}
+
+//
+// all threads: wait until bands first_band..last_band of a multi-level pass are done
+//
+int waitForLevelBands(bsr_state_t *bsr_state, int first_band, int last_band) {
+  int band;
+
+  for (band=first_band; band <= last_band; band++) {
+    waitForBands(bsr_state, (band / bsr_state->band_schedule_max_bands), (band % bsr_state->band_schedule_max_bands), (band % bsr_state->band_schedule_max_bands));
+  }
+
+  return(0);
+}
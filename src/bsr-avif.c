@@ -44,57 +44,26 @@
 #include "util.h"
 #include "cgi.h"
 #include "icc-profiles.h"
+#include "bsr-grid.h"
+#include "bsr-avif.h"
+#include "bsr-output.h"
 
 #ifdef BSR_USE_AVIF
 #include <avif/avif.h>
 #endif
 
-int outputAvif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
-
 #ifdef BSR_USE_AVIF
 
-  FILE *output_file=NULL;
-  struct timespec starttime;
-  struct timespec endtime;
-  double elapsed_time;
-  avifEncoder *avif_encoder;
-  avifRWData avif_output=AVIF_DATA_EMPTY;
+//
+// create avif_image from RGB pixels in output format, with color profile signaled in the container
+//
+static avifImage *createAvifImage(bsr_config_t *bsr_config, int width, int height, unsigned char *pixels, size_t row_bytes) {
   avifRGBImage avif_rgb;
   avifImage *avif_image;
-  int bytes_per_pixel=3;
-  avifResult avif_result;
-  int avif_quantizer;
 
-  //
-  // display status update if not in CGI mode
-  //
-  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
-    clock_gettime(CLOCK_REALTIME, &starttime);
-    printf("Writing %s...", bsr_config->output_file_name);
-    fflush(stdout);
-  }
-
-  //
-  // if not CGI mode, open output file
-  //
-  if (bsr_config->cgi_mode != 1) {
-    output_file=fopen(bsr_config->output_file_name, "wb");
-    if (output_file == NULL) {
-      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
-      fflush(stdout);
-      exit(1);
-    }
-  }
-  
-  //
-  // initialize avif_image
-  //
-  avif_image=avifImageCreate(bsr_state->current_image_res_x, bsr_state->current_image_res_y, bsr_config->bits_per_color, AVIF_PIXEL_FORMAT_YUV444);
+  avif_image=avifImageCreate(width, height, bsr_config->bits_per_color, AVIF_PIXEL_FORMAT_YUV444);
   if (avif_image == NULL) {
-    if (bsr_config->cgi_mode != 1) {
-      printf("Error: avifImageCreate() failed (invalid arguments or memory allocation failed)\n");
-    }
-    exit(1);
+    return(NULL);
   }
 
   //
@@ -148,31 +117,30 @@ int outputAvif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   //
   memset(&avif_rgb, 0, sizeof(avif_rgb));
   avifRGBImageSetDefaults(&avif_rgb, avif_image);
-  avif_rgb.width=bsr_state->current_image_res_x;
-  avif_rgb.height=bsr_state->current_image_res_y;
+  avif_rgb.width=width;
+  avif_rgb.height=height;
   avif_rgb.depth=bsr_config->bits_per_color;
   avif_rgb.format=AVIF_RGB_FORMAT_RGB;
-  avif_rgb.pixels=bsr_state->image_output_buf;
-  if (bsr_config->bits_per_color == 8) {
-    bytes_per_pixel=3;
-  } else if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12) || (bsr_config->bits_per_color == 16)) {
-    bytes_per_pixel=6;
-    if (bsr_config->bits_per_color == 16) {
-      avif_rgb.isFloat=AVIF_TRUE;
-    }       
+  avif_rgb.pixels=pixels;
+  if (bsr_config->bits_per_color == 16) {
+    avif_rgb.isFloat=AVIF_TRUE;
   }
-  avif_rgb.rowBytes=bytes_per_pixel * bsr_state->current_image_res_x;
+  avif_rgb.rowBytes=(uint32_t)row_bytes;
   avifImageRGBToYUV(avif_image, &avif_rgb);
 
-  //
-  // compress image
-  //
+  return(avif_image);
+}
+
+//
+// create encoder with quality and speed settings
+//
+static avifEncoder *createAvifEncoder(bsr_config_t *bsr_config, int max_threads) {
+  avifEncoder *avif_encoder;
+  int avif_quantizer;
+
   avif_encoder=avifEncoderCreate();
-  if (avif_image == NULL) {
-    if (bsr_config->cgi_mode != 1) {
-      printf("Error: avifEncoderCreate() failed (memory allocation failed)\n");
-    }
-    exit(1);
+  if (avif_encoder == NULL) {
+    return(NULL);
   }
   //  avif_encoder->quality=bsr_config->compression_quality;
   // for backwards compatibility with older versions that do not take quality directly, set min/max quantizer level
@@ -184,7 +152,52 @@ int outputAvif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   }
   avif_encoder->minQuantizer=avif_quantizer;
   avif_encoder->maxQuantizer=avif_quantizer;
-  avif_encoder->maxThreads=bsr_config->num_threads;
+  avif_encoder->maxThreads=max_threads;
+  if (bsr_config->encoder_speed >= 0) {
+    avif_encoder->speed=bsr_config->encoder_speed;
+  }
+
+  return(avif_encoder);
+}
+
+//
+// main thread: encode whole image as a single image, libavif is multi-threaded internally
+//
+int outputAvifImage(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file) {
+  avifEncoder *avif_encoder;
+  avifRWData avif_output=AVIF_DATA_EMPTY;
+  avifImage *avif_image;
+  int bytes_per_pixel;
+  int result;
+  avifResult avif_result;
+  struct iovec iov;
+
+  //
+  // initialize avif_image
+  //
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  avif_image=createAvifImage(bsr_config, bsr_state->current_image_res_x, bsr_state->current_image_res_y, bsr_state->image_output_buf, (size_t)bytes_per_pixel * (size_t)bsr_state->current_image_res_x);
+  if (avif_image == NULL) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: avifImageCreate() failed (invalid arguments or memory allocation failed)\n");
+    }
+    exit(1);
+  }
+
+  //
+  // compress image
+  //
+  avif_encoder=createAvifEncoder(bsr_config, bsr_config->num_threads);
+  if (avif_encoder == NULL) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: avifEncoderCreate() failed (memory allocation failed)\n");
+    }
+    exit(1);
+  }
   avif_result=avifEncoderAddImage(avif_encoder, avif_image, 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
   if (avif_result != AVIF_RESULT_OK) {
     if (bsr_config->cgi_mode != 1) {
@@ -200,35 +213,270 @@ int outputAvif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     exit(1);
   }
 
-
   //
-  // output image data
+  // output image data, libavif owns the buffer so it is written with one writev() rather than passed by reference
   //
-  if (bsr_config->cgi_mode != 1) {
-    fwrite(avif_output.data, 1, avif_output.size, output_file);
+  fflush(output_file);
+  iov.iov_base=avif_output.data;
+  iov.iov_len=avif_output.size;
+  result=writeOutputVector(fileno(output_file), &iov, 1, NULL);
+
+  // clean up
+  avifRWDataFree(&avif_output);
+  avifImageDestroy(avif_image);
+  avifEncoderDestroy(avif_encoder);
+
+  return(result);
+}
+
+//
+// all threads: encode one grid tile as a single image file with a single-threaded encoder, then keep its coded data
+// and item properties. Tiles in the last column or row are padded from a copy in compression_buf1
+//
+int encodeAvifTile(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int tile, unsigned char **tile_buf, size_t *tile_buf_size, size_t *tile_buf_used) {
+  avifEncoder *avif_encoder;
+  avifRWData avif_output=AVIF_DATA_EMPTY;
+  avifImage *avif_image;
+  avifResult avif_result;
+  int bytes_per_pixel;
+  int tile_x;
+  int tile_y;
+  int tile_width;
+  int tile_height;
+
+  bsr_state->grid_tiles[tile].data_size=SIZE_MAX;
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  getGridTileRect(bsr_state, tile, &tile_x, &tile_y, &tile_width, &tile_height);
+  if ((tile_width == bsr_state->grid_tile_width) && (tile_height == bsr_state->grid_tile_height)) {
+    avif_image=createAvifImage(bsr_config, tile_width, tile_height, bsr_state->row_pointers[tile_y] + ((size_t)tile_x * (size_t)bytes_per_pixel), (size_t)bytes_per_pixel * (size_t)bsr_state->current_image_res_x);
   } else {
-    fwrite(avif_output.data, 1, avif_output.size, stdout);
+    copyGridTilePixels(bsr_config, bsr_state, tile, bsr_state->compression_buf1, (size_t)bytes_per_pixel * (size_t)bsr_state->grid_tile_width);
+    avif_image=createAvifImage(bsr_config, bsr_state->grid_tile_width, bsr_state->grid_tile_height, bsr_state->compression_buf1, (size_t)bytes_per_pixel * (size_t)bsr_state->grid_tile_width);
+  }
+  if (avif_image == NULL) {
+    return(1);
+  }
+  avif_encoder=createAvifEncoder(bsr_config, 1);
+  if (avif_encoder == NULL) {
+    avifImageDestroy(avif_image);
+    return(1);
+  }
+  avif_result=avifEncoderAddImage(avif_encoder, avif_image, 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
+  if (avif_result == AVIF_RESULT_OK) {
+    avif_result=avifEncoderFinish(avif_encoder, &avif_output);
+  }
+  if (avif_result == AVIF_RESULT_OK) {
+    addGridTile(bsr_state, tile, avif_output.data, avif_output.size, tile_buf, tile_buf_size, tile_buf_used);
   }
 
+  // clean up
+  avifRWDataFree(&avif_output);
+  avifImageDestroy(avif_image);
+  avifEncoderDestroy(avif_encoder);
+
+  return(0);
+}
+
+#endif // BSR_USE_AVIF
+
+//
+// all threads: write one deep zoom tile as a complete AVIF file with a single-threaded encoder
+//
+int outputAvifTile(bsr_config_t *bsr_config, FILE *output_file, unsigned char *pixels, int width, int height) {
+#ifdef BSR_USE_AVIF
+  avifEncoder *avif_encoder;
+  avifRWData avif_output=AVIF_DATA_EMPTY;
+  avifImage *avif_image;
+  avifResult avif_result;
+  struct iovec iov;
+  int bytes_per_pixel;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  avif_image=createAvifImage(bsr_config, width, height, pixels, (size_t)bytes_per_pixel * (size_t)width);
+  if (avif_image == NULL) {
+    return(1);
+  }
+  avif_encoder=createAvifEncoder(bsr_config, 1);
+  if (avif_encoder == NULL) {
+    avifImageDestroy(avif_image);
+    return(1);
+  }
+  avif_result=avifEncoderAddImage(avif_encoder, avif_image, 1, AVIF_ADD_IMAGE_FLAG_SINGLE);
+  if (avif_result == AVIF_RESULT_OK) {
+    avif_result=avifEncoderFinish(avif_encoder, &avif_output);
+  }
+  if (avif_result == AVIF_RESULT_OK) {
+    fflush(output_file);
+    iov.iov_base=avif_output.data;
+    iov.iov_len=avif_output.size;
+    if (writeOutputVector(fileno(output_file), &iov, 1, NULL) != 0) {
+      avif_result=AVIF_RESULT_IO_ERROR;
+    }
+  }
+
+  // clean up
+  avifRWDataFree(&avif_output);
+  avifImageDestroy(avif_image);
+  avifEncoderDestroy(avif_encoder);
+  if (avif_result != AVIF_RESULT_OK) {
+    return(1);
+  }
+#endif // BSR_USE_AVIF
+
+  return(0);
+}
+
+int outputAvif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+
+#ifdef BSR_USE_AVIF
+
+  FILE *output_file=NULL;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  unsigned char *tile_buf=NULL;
+  size_t tile_buf_size=0;
+  size_t tile_buf_used=0;
+  int grid_ok=0;
+  int tile;
+  int i;
+  int result;
+
+  //
+  // without a grid the image is encoded by the main thread only
+  //
+  if ((bsr_state->grid_num_tiles == 0) && (bsr_state->perthread->my_pid != bsr_state->main_pid)) {
+    return(0);
+  }
+
+  //
+  // main thread: display status update if not in CGI mode
+  //
+  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Writing %s...", bsr_config->output_file_name);
+    fflush(stdout);
+  }
+
+  if (bsr_state->grid_num_tiles > 0) {
+    //
+    // worker threads:  wait for main thread to say go
+    // main thread: tell worker threads to go
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
+    } else {
+      // main thread
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: encode every (num_worker_threads + 1)th tile
+    //
+    for (tile=bsr_state->perthread->my_thread_id; tile < bsr_state->grid_num_tiles; tile+=(bsr_state->num_worker_threads + 1)) {
+      encodeAvifTile(bsr_config, bsr_state, tile, &tile_buf, &tile_buf_size, &tile_buf_used);
+    }
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done and then signal that they can continue to next step.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_BEGIN);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+      // ready to continue, set all worker thread status to continue
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: once no thread reads pixels any more, copy coded tiles over their own pixels in image_output_buf.
+    // If any tile failed or does not fit the image is encoded as a single image instead
+    //
+    grid_ok=checkGridTiles(bsr_config, bsr_state);
+    if (grid_ok == 1) {
+      storeGridTiles(bsr_config, bsr_state, tile_buf);
+    }
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done, write file and then signal that they can continue.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_OUTPUT_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_CONTINUE);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_COMPLETE);
+    }
+  } // end if grid_num_tiles
+
   //
-  // display status message and close output file if not CGI mode
+  // main thread: output AVIF image to file or stdout
   //
-  if (bsr_config->cgi_mode != 1) {
-    if (bsr_config->print_status == 1) {
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if (bsr_config->cgi_mode != 1) {
+      output_file=fopen(bsr_config->output_file_name, "wb");
+      if (output_file == NULL) {
+        printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+        fflush(stdout);
+        exit(1);
+      }
+    } else {
+      output_file=stdout;
+    }
+
+    if (grid_ok == 1) {
+      result=outputGridImage(bsr_config, bsr_state, output_file, "avif", "avifmif1miaf", "av01");
+    } else {
+      result=outputAvifImage(bsr_config, bsr_state, output_file);
+    }
+    if (result != 0) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not write %s\n", bsr_config->output_file_name);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    if (bsr_config->cgi_mode != 1) {
+      fclose(output_file);
+    }
+
+    // ready to continue, set all worker thread status to continue
+    if (bsr_state->grid_num_tiles > 0) {
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_CONTINUE;
+      }
+    }
+
+    //
+    // display status message if not CGI mode
+    //
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
       clock_gettime(CLOCK_REALTIME, &endtime);
       elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
       printf(" (%.3fs)\n", elapsed_time);
       fflush(stdout);
     }
+  } // end if main thread
 
-    // close output file
-    fclose(output_file);
+  if (tile_buf != NULL) {
+    free(tile_buf);
   }
 
-  // clean up
-  avifImageDestroy(avif_image);
-  avifEncoderDestroy(avif_encoder);
-
 #endif // BSR_USE_AVIF
 
   return(0);
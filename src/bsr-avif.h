@@ -39,6 +39,9 @@
 #ifndef BSR_AVIF_H
 #define BSR_AVIF_H
 
+int outputAvifImage(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file);
+int encodeAvifTile(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int tile, unsigned char **tile_buf, size_t *tile_buf_size, size_t *tile_buf_used);
+int outputAvifTile(bsr_config_t *bsr_config, FILE *output_file, unsigned char *pixels, int width, int height);
 int outputAvif(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_AVIF_H
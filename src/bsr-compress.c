@@ -0,0 +1,303 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "util.h"
+#include "bsr-compress.h"
+
+//
+// Block compressed data file format
+//
+// The 256 byte header is the same as uncompressed data files except the file identifier is BSRENDER_ZL or BSRENDER_ZB.
+// The header is followed by independently compressed blocks of up to BSR_BLOCK_RECORDS star records. Within a block
+// the 33 byte star records are byte shuffled (byte 0 of every record, then byte 1 of every record...) which groups the
+// slowly varying high bytes of each field together before zlib compression. After the last block is a table with a
+// 16 byte entry per block (offset, compressed size, record count) and a 32 byte trailer (table offset, block count,
+// total records, BSR_BLOCK_TABLE_MAGIC). Table and trailer integers are always little-endian.
+//
+
+int shuffleStarRecords(unsigned char *records, unsigned char *shuffled, uint32_t record_count) {
+  uint32_t record;
+  int i;
+  unsigned char *record_p;
+
+  record_p=records;
+  for (record=0; record < record_count; record++) {
+    for (i=0; i < BSR_STAR_RECORD_SIZE; i++) {
+      shuffled[((size_t)i * (size_t)record_count) + record]=record_p[i];
+    }
+    record_p+=BSR_STAR_RECORD_SIZE;
+  }
+
+  return(0);
+}
+
+int unshuffleStarRecords(unsigned char *shuffled, unsigned char *records, uint32_t record_count) {
+  uint32_t record;
+  int i;
+  unsigned char *shuffled_p;
+  unsigned char *record_p;
+
+  //
+  // iterate over each byte plane so reads are sequential, writes are strided by the record size
+  //
+  for (i=0; i < BSR_STAR_RECORD_SIZE; i++) {
+    shuffled_p=shuffled + ((size_t)i * (size_t)record_count);
+    record_p=records + i;
+    for (record=0; record < record_count; record++) {
+      *record_p=*shuffled_p;
+      shuffled_p++;
+      record_p+=BSR_STAR_RECORD_SIZE;
+    }
+  }
+
+  return(0);
+}
+
+int decodeBlock(unsigned char *compressed, uint32_t compressed_size, uint32_t record_count, unsigned char *shuffle_buf, unsigned char *record_buf) {
+  uLongf decoded_size;
+
+  //
+  // decompress one block into record_buf, shuffle_buf must hold record_count star records
+  // returns 0 on success, -1 if block is corrupt
+  //
+  decoded_size=(uLongf)record_count * (uLongf)BSR_STAR_RECORD_SIZE;
+  if (uncompress(shuffle_buf, &decoded_size, compressed, (uLong)compressed_size) != Z_OK) {
+    return(-1);
+  }
+  if (decoded_size != ((uLongf)record_count * (uLongf)BSR_STAR_RECORD_SIZE)) {
+    return(-1);
+  }
+  unshuffleStarRecords(shuffle_buf, record_buf, record_count);
+
+  return(0);
+}
+
+int readFileBytes(int fd, char *file_buf, unsigned char *dest, size_t length, uint64_t offset) {
+  //
+  // copy from mmapped file if available, otherwise pread()
+  //
+  if (file_buf != NULL) {
+    memcpy(dest, file_buf + offset, length);
+    return(0);
+  }
+  if (pread(fd, dest, length, (off_t)offset) != (ssize_t)length) {
+    return(-1);
+  }
+
+  return(0);
+}
+
+int loadBlockTable(int fd, char *file_buf, size_t file_size, bsr_block_t **blocks, uint64_t *block_count, uint64_t *total_records) {
+  unsigned char trailer[BSR_BLOCK_TRAILER_SIZE];
+  unsigned char *table;
+  unsigned char *table_p;
+  uint64_t table_offset;
+  uint64_t i;
+  uint64_t record_sum=0;
+
+  //
+  // read and sanity check block table from end of compressed data file, file_buf may be NULL if not mmapped
+  // returns 0 on success, -1 if the table is missing or inconsistent. *blocks is malloc'ed
+  //
+  if (file_size < (BSR_FILE_HEADER_SIZE + BSR_BLOCK_TRAILER_SIZE)) {
+    return(-1);
+  }
+  if (readFileBytes(fd, file_buf, trailer, BSR_BLOCK_TRAILER_SIZE, (uint64_t)(file_size - BSR_BLOCK_TRAILER_SIZE)) != 0) {
+    return(-1);
+  }
+  if (memcmp(trailer + 24, BSR_BLOCK_TABLE_MAGIC, 8) != 0) {
+    return(-1);
+  }
+  table_offset=loadU64LE(trailer);
+  *block_count=loadU64LE(trailer + 8);
+  *total_records=loadU64LE(trailer + 16);
+  if ((table_offset < BSR_FILE_HEADER_SIZE) || ((table_offset + (*block_count * BSR_BLOCK_ENTRY_SIZE) + BSR_BLOCK_TRAILER_SIZE) != file_size)) {
+    return(-1);
+  }
+
+  table=(unsigned char *)malloc((size_t)(*block_count * BSR_BLOCK_ENTRY_SIZE) + 1);
+  *blocks=(bsr_block_t *)malloc((size_t)(*block_count * sizeof(bsr_block_t)) + 1);
+  if ((table == NULL) || (*blocks == NULL)) {
+    return(-1);
+  }
+  if (readFileBytes(fd, file_buf, table, (size_t)(*block_count * BSR_BLOCK_ENTRY_SIZE), table_offset) != 0) {
+    free(table);
+    return(-1);
+  }
+  table_p=table;
+  for (i=0; i < *block_count; i++) {
+    (*blocks)[i].offset=loadU64LE(table_p);
+    (*blocks)[i].compressed_size=loadU32LE(table_p + 8);
+    (*blocks)[i].record_count=loadU32LE(table_p + 12);
+    if (((*blocks)[i].offset + (*blocks)[i].compressed_size) > table_offset) {
+      free(table);
+      return(-1);
+    }
+    record_sum+=(*blocks)[i].record_count;
+    table_p+=BSR_BLOCK_ENTRY_SIZE;
+  }
+  free(table);
+  if (record_sum != *total_records) {
+    return(-1);
+  }
+
+  return(0);
+}
+
+int openBlockWriter(bsr_block_writer_t *writer, FILE *output_file, int compress, int compression_level, uint32_t block_records) {
+  //
+  // the caller writes the 256 byte header before the first star record
+  //
+  memset(writer, 0, sizeof(bsr_block_writer_t));
+  writer->output_file=output_file;
+  writer->compress=compress;
+  writer->compression_level=compression_level;
+  writer->block_records=block_records;
+  writer->offset=BSR_FILE_HEADER_SIZE;
+  if (compress == 0) {
+    return(0);
+  }
+
+  writer->record_buf=(unsigned char *)malloc((size_t)block_records * BSR_STAR_RECORD_SIZE);
+  writer->shuffle_buf=(unsigned char *)malloc((size_t)block_records * BSR_STAR_RECORD_SIZE);
+  writer->compressed_buf_size=(size_t)compressBound((uLong)block_records * BSR_STAR_RECORD_SIZE);
+  writer->compressed_buf=(unsigned char *)malloc(writer->compressed_buf_size);
+  writer->blocks_allocated=1024;
+  writer->blocks=(bsr_block_t *)malloc(writer->blocks_allocated * sizeof(bsr_block_t));
+  if ((writer->record_buf == NULL) || (writer->shuffle_buf == NULL) || (writer->compressed_buf == NULL) || (writer->blocks == NULL)) {
+    printf("Error: could not allocate memory for block compression\n");
+    fflush(stdout);
+    exit(1);
+  }
+
+  return(0);
+}
+
+int flushBlock(bsr_block_writer_t *writer) {
+  uLongf compressed_size;
+  bsr_block_t *block;
+
+  if (writer->record_count == 0) {
+    return(0);
+  }
+
+  //
+  // shuffle and compress current block, then record its location in the block table
+  //
+  shuffleStarRecords(writer->record_buf, writer->shuffle_buf, writer->record_count);
+  compressed_size=(uLongf)writer->compressed_buf_size;
+  if (compress2(writer->compressed_buf, &compressed_size, writer->shuffle_buf, (uLong)writer->record_count * BSR_STAR_RECORD_SIZE, writer->compression_level) != Z_OK) {
+    printf("Error: block compression failed\n");
+    fflush(stdout);
+    exit(1);
+  }
+  fwrite(writer->compressed_buf, compressed_size, 1, writer->output_file);
+
+  if (writer->block_count == writer->blocks_allocated) {
+    writer->blocks_allocated*=2;
+    writer->blocks=(bsr_block_t *)realloc(writer->blocks, writer->blocks_allocated * sizeof(bsr_block_t));
+    if (writer->blocks == NULL) {
+      printf("Error: could not allocate memory for block table\n");
+      fflush(stdout);
+      exit(1);
+    }
+  }
+  block=&writer->blocks[writer->block_count];
+  block->offset=writer->offset;
+  block->compressed_size=(uint32_t)compressed_size;
+  block->record_count=writer->record_count;
+  writer->block_count++;
+  writer->offset+=(uint64_t)compressed_size;
+  writer->compressed_bytes+=(uint64_t)compressed_size;
+  writer->record_count=0;
+
+  return(0);
+}
+
+int writeStarRecord(bsr_block_writer_t *writer, unsigned char *star_record) {
+  writer->total_records++;
+  if (writer->compress == 0) {
+    fwrite(star_record, BSR_STAR_RECORD_SIZE, 1, writer->output_file);
+    return(0);
+  }
+
+  memcpy(writer->record_buf + ((size_t)writer->record_count * BSR_STAR_RECORD_SIZE), star_record, BSR_STAR_RECORD_SIZE);
+  writer->record_count++;
+  if (writer->record_count == writer->block_records) {
+    flushBlock(writer);
+  }
+
+  return(0);
+}
+
+int closeBlockWriter(bsr_block_writer_t *writer) {
+  unsigned char entry[BSR_BLOCK_ENTRY_SIZE];
+  unsigned char trailer[BSR_BLOCK_TRAILER_SIZE];
+  uint64_t i;
+
+  //
+  // write last partial block, block table and trailer. Does not close output_file
+  //
+  if (writer->compress == 0) {
+    return(0);
+  }
+  flushBlock(writer);
+  for (i=0; i < writer->block_count; i++) {
+    storeU64LE(entry, writer->blocks[i].offset);
+    storeU32LE(entry + 8, writer->blocks[i].compressed_size);
+    storeU32LE(entry + 12, writer->blocks[i].record_count);
+    fwrite(entry, BSR_BLOCK_ENTRY_SIZE, 1, writer->output_file);
+  }
+  storeU64LE(trailer, writer->offset);
+  storeU64LE(trailer + 8, writer->block_count);
+  storeU64LE(trailer + 16, writer->total_records);
+  memcpy(trailer + 24, BSR_BLOCK_TABLE_MAGIC, 8);
+  fwrite(trailer, BSR_BLOCK_TRAILER_SIZE, 1, writer->output_file);
+
+  free(writer->record_buf);
+  free(writer->shuffle_buf);
+  free(writer->compressed_buf);
+  free(writer->blocks);
+
+  return(0);
+}
@@ -0,0 +1,51 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSR_COMPRESS_H
+#define BSR_COMPRESS_H
+
+int shuffleStarRecords(unsigned char *records, unsigned char *shuffled, uint32_t record_count);
+int unshuffleStarRecords(unsigned char *shuffled, unsigned char *records, uint32_t record_count);
+int decodeBlock(unsigned char *compressed, uint32_t compressed_size, uint32_t record_count, unsigned char *shuffle_buf, unsigned char *record_buf);
+int readFileBytes(int fd, char *file_buf, unsigned char *dest, size_t length, uint64_t offset);
+int loadBlockTable(int fd, char *file_buf, size_t file_size, bsr_block_t **blocks, uint64_t *block_count, uint64_t *total_records);
+int openBlockWriter(bsr_block_writer_t *writer, FILE *output_file, int compress, int compression_level, uint32_t block_records);
+int writeStarRecord(bsr_block_writer_t *writer, unsigned char *star_record);
+int closeBlockWriter(bsr_block_writer_t *writer);
+
+#endif // BSR_COMPRESS_H
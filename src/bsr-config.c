@@ -51,12 +51,21 @@ void initConfig(bsr_config_t *bsr_config) {
   bsr_config->config_file_name[255]=0;
   strncpy(bsr_config->data_file_directory, "galaxydata", 255);
   bsr_config->data_file_directory[255]=0;
+  bsr_config->data_cache_directory[0]=0;
   strncpy(bsr_config->output_file_name, "galaxy.png", 255);
   bsr_config->output_file_name[255]=0;
+  bsr_config->num_extra_outputs=0;
   bsr_config->print_status=1;
   bsr_config->num_threads=16;
   bsr_config->per_thread_buffer=1000;
   bsr_config->per_thread_buffer_Airy=100000;
+  bsr_config->huge_pages=0;
+  bsr_config->numa_mode=0;
+  bsr_config->numa_replicate_max_size=0;
+  bsr_config->max_memory=0;
+  bsr_config->composition_precision=32;
+  bsr_config->input_backend=0;
+  bsr_config->input_chunk_size=8;
   bsr_config->cgi_mode=0;
   bsr_config->cgi_max_res_x=999999;
   bsr_config->cgi_max_res_y=999999;
@@ -66,6 +75,7 @@ void initConfig(bsr_config_t *bsr_config) {
   bsr_config->cgi_max_Airy_disk_max_extent=1000;
   bsr_config->cgi_max_Airy_disk_min_extent=3;
   bsr_config->cgi_allow_anti_alias=1;
+  bsr_config->cgi_min_encoder_speed=0;
   bsr_config->Gaia_db_enable=1;
   bsr_config->Gaia_min_parallax_quality=0;
   bsr_config->external_db_enable=1;
@@ -109,14 +119,28 @@ void initConfig(bsr_config_t *bsr_config) {
   bsr_config->skyglow_per_pixel_mag=14.0;
   bsr_config->pre_limit_intensity=1;
   bsr_config->Gaussian_blur_radius=0.0;
+  bsr_config->Gaussian_blur_method=0;
   bsr_config->output_scaling_factor=1.0;
   bsr_config->Lanczos_order=3;
+  bsr_config->resize_method=0;
   bsr_config->draw_crosshairs=0;
   bsr_config->draw_grid_lines=0;
   bsr_config->output_format=0;
   bsr_config->color_profile=-1;
   bsr_config->exr_compression=3;
+  bsr_config->exr_tile_size=0;
+  bsr_config->exr_mipmap=0;
+  bsr_config->tiff_compression=1;
+  bsr_config->tiff_tile_size=256;
+  bsr_config->tiff_pyramid=0;
+  bsr_config->deep_zoom=0;
+  bsr_config->deep_zoom_tile_size=256;
+  bsr_config->stream_output=0;
+  bsr_config->png_compression=2;
+  bsr_config->jpeg_encoding=1;
   bsr_config->compression_quality=80;
+  bsr_config->encoder_speed=-1;
+  bsr_config->grid_tile_size=1024;
   bsr_config->image_format=0;
   bsr_config->hdr_neutral_white_ref=100;
   bsr_config->bits_per_color=8;
@@ -164,6 +188,12 @@ void cleanupValueStr(char *value) {
     }
   }
 
+  if (start == -1) {
+    // empty value
+    value[0]=0;
+    return;
+  }
+
   //
   // find end of value, ignoring trailing spaces or quotes
   //
@@ -236,6 +266,29 @@ int checkOptionStr(char *config_str,  char *option, char *value, char *matchstr)
   return(match);
 }
 
+//
+// like checkOptionStr() but each match appends value to a list of up to max_count strings, empty values are ignored
+//
+int checkOptionStrList(char (*config_list)[256], int *config_count, int max_count, char *option, char *value, char *matchstr) {
+  int match=0;
+
+  if ((strcasestr(option, matchstr) == option) && (strlen(option) == strlen(matchstr))) {
+    match=1;
+    if (value[0] == 0) {
+      // nothing to add
+    } else if (*config_count < max_count) {
+      strncpy(config_list[*config_count], value, 255);
+      config_list[*config_count][255]=0;
+      (*config_count)++;
+    } else {
+      printf("Warning: more than %d %s options, ignoring %s\n", max_count, matchstr, value);
+      fflush(stdout);
+    }
+  }
+
+  return(match);
+}
+
 void setOptionValue(bsr_config_t *bsr_config, char *option, char *value, int from_cgi) {
   int match_count=0;
 
@@ -247,11 +300,20 @@ void setOptionValue(bsr_config_t *bsr_config, char *option, char *value, int fro
   if (from_cgi == 0) {
     match_count+=checkOptionStr(bsr_config->bsrender_cfg_version, option, value, "bsrender_cfg_version");
     match_count+=checkOptionStr(bsr_config->data_file_directory, option, value, "data_file_directory");
+    match_count+=checkOptionStr(bsr_config->data_cache_directory, option, value, "data_cache_directory");
     match_count+=checkOptionStr(bsr_config->output_file_name, option, value, "output_file_name");
+    match_count+=checkOptionStrList(bsr_config->extra_output, &bsr_config->num_extra_outputs, BSR_MAX_EXTRA_OUTPUTS, option, value, "extra_output");
     match_count+=checkOptionBool(&bsr_config->print_status, option, value, "print_status");
     match_count+=checkOptionInt(&bsr_config->num_threads, option, value, "num_threads");
     match_count+=checkOptionInt(&bsr_config->per_thread_buffer, option, value, "per_thread_buffer");
     match_count+=checkOptionInt(&bsr_config->per_thread_buffer_Airy, option, value, "per_thread_buffer_Airy");
+    match_count+=checkOptionInt(&bsr_config->huge_pages, option, value, "huge_pages");
+    match_count+=checkOptionInt(&bsr_config->numa_mode, option, value, "numa_mode");
+    match_count+=checkOptionInt(&bsr_config->numa_replicate_max_size, option, value, "numa_replicate_max_size");
+    match_count+=checkOptionInt(&bsr_config->max_memory, option, value, "max_memory");
+    match_count+=checkOptionInt(&bsr_config->composition_precision, option, value, "composition_precision");
+    match_count+=checkOptionInt(&bsr_config->input_backend, option, value, "input_backend");
+    match_count+=checkOptionInt(&bsr_config->input_chunk_size, option, value, "input_chunk_size");
     match_count+=checkOptionBool(&bsr_config->cgi_mode, option, value, "cgi_mode");
     match_count+=checkOptionInt(&bsr_config->cgi_max_res_x, option, value, "cgi_max_res_x");
     match_count+=checkOptionInt(&bsr_config->cgi_max_res_y, option, value, "cgi_max_res_y");
@@ -261,6 +323,7 @@ void setOptionValue(bsr_config_t *bsr_config, char *option, char *value, int fro
     match_count+=checkOptionInt(&bsr_config->cgi_max_Airy_disk_max_extent, option, value, "cgi_max_Airy_disk_max_extent");
     match_count+=checkOptionInt(&bsr_config->cgi_max_Airy_disk_min_extent, option, value, "cgi_max_Airy_disk_min_extent");
     match_count+=checkOptionBool(&bsr_config->cgi_allow_anti_alias, option, value, "cgi_allow_anti_alias");
+    match_count+=checkOptionInt(&bsr_config->cgi_min_encoder_speed, option, value, "cgi_min_encoder_speed");
   }
 
   //
@@ -309,14 +372,28 @@ void setOptionValue(bsr_config_t *bsr_config, char *option, char *value, int fro
   match_count+=checkOptionDouble(&bsr_config->skyglow_per_pixel_mag, option, value, "skyglow_per_pixel_mag");
   match_count+=checkOptionBool(&bsr_config->pre_limit_intensity, option, value, "pre_limit_intensity");
   match_count+=checkOptionDouble(&bsr_config->Gaussian_blur_radius, option, value, "Gaussian_blur_radius");
+  match_count+=checkOptionInt(&bsr_config->Gaussian_blur_method, option, value, "Gaussian_blur_method");
   match_count+=checkOptionDouble(&bsr_config->output_scaling_factor, option, value, "output_scaling_factor");
   match_count+=checkOptionInt(&bsr_config->Lanczos_order, option, value, "Lanczos_order");
+  match_count+=checkOptionInt(&bsr_config->resize_method, option, value, "resize_method");
   match_count+=checkOptionBool(&bsr_config->draw_crosshairs, option, value, "draw_crosshairs");
   match_count+=checkOptionBool(&bsr_config->draw_grid_lines, option, value, "draw_grid_lines");
   match_count+=checkOptionInt(&bsr_config->output_format, option, value, "output_format");
   match_count+=checkOptionInt(&bsr_config->color_profile, option, value, "color_profile");
   match_count+=checkOptionInt(&bsr_config->exr_compression, option, value, "exr_compression");
+  match_count+=checkOptionInt(&bsr_config->exr_tile_size, option, value, "exr_tile_size");
+  match_count+=checkOptionBool(&bsr_config->exr_mipmap, option, value, "exr_mipmap");
+  match_count+=checkOptionInt(&bsr_config->tiff_compression, option, value, "tiff_compression");
+  match_count+=checkOptionInt(&bsr_config->tiff_tile_size, option, value, "tiff_tile_size");
+  match_count+=checkOptionBool(&bsr_config->tiff_pyramid, option, value, "tiff_pyramid");
+  match_count+=checkOptionInt(&bsr_config->deep_zoom, option, value, "deep_zoom");
+  match_count+=checkOptionInt(&bsr_config->deep_zoom_tile_size, option, value, "deep_zoom_tile_size");
+  match_count+=checkOptionBool(&bsr_config->stream_output, option, value, "stream_output");
+  match_count+=checkOptionInt(&bsr_config->png_compression, option, value, "png_compression");
+  match_count+=checkOptionInt(&bsr_config->jpeg_encoding, option, value, "jpeg_encoding");
   match_count+=checkOptionInt(&bsr_config->compression_quality, option, value, "compression_quality");
+  match_count+=checkOptionInt(&bsr_config->encoder_speed, option, value, "encoder_speed");
+  match_count+=checkOptionInt(&bsr_config->grid_tile_size, option, value, "grid_tile_size");
   match_count+=checkOptionInt(&bsr_config->hdr_neutral_white_ref, option, value, "hdr_neutral_white_ref");
   match_count+=checkOptionDouble(&bsr_config->camera_icrs_x, option, value, "camera_icrs_x");
   match_count+=checkOptionDouble(&bsr_config->camera_icrs_y, option, value, "camera_icrs_y");
@@ -411,6 +488,12 @@ int loadConfigFromFile(bsr_config_t *bsr_config) {
   char segment[256];
   size_t segment_length;
   
+  //
+  // extra_output values are appended to a list. Forget those from the first pass over the command line,
+  // the second pass adds them again after the config file
+  //
+  bsr_config->num_extra_outputs=0;
+
   //
   // attempt to open config file
   //
@@ -606,6 +689,151 @@ int validateConfig(bsr_config_t *bsr_config) {
     bsr_config->num_threads=2;
   }
 
+  //
+  // huge_pages: 0 = normal pages, 1 = transparent huge pages, 2 = 2MB huge pages, 3 = 1GB huge pages
+  //
+  if ((bsr_config->huge_pages < 0) || (bsr_config->huge_pages > 3)) {
+    bsr_config->huge_pages=0;
+  }
+
+  //
+  // numa_mode: 0 = disabled, 1 = pin threads, interleave image buffers, 2 = pin threads, partition image buffers by row band
+  //
+  if ((bsr_config->numa_mode < 0) || (bsr_config->numa_mode > 2)) {
+    bsr_config->numa_mode=0;
+  }
+  if (bsr_config->numa_replicate_max_size < 0) {
+    bsr_config->numa_replicate_max_size=0;
+  }
+
+  //
+  // max_memory: limit in MB for planned peak image buffer memory, 0 = no limit
+  //
+  if (bsr_config->max_memory < 0) {
+    bsr_config->max_memory=0;
+  }
+
+  //
+  // composition_precision: 16, 32, or 64 bits per color in image composition, blur, and resize buffers
+  //
+  if ((bsr_config->composition_precision != 16) && (bsr_config->composition_precision != 32) && (bsr_config->composition_precision != 64)) {
+    bsr_config->composition_precision=32;
+  }
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+  if ((bsr_config->composition_precision == 16) && !__builtin_cpu_supports("f16c")) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: composition_precision=16 requires a cpu with F16C instructions, using 32\n");
+      fflush(stdout);
+    }
+    bsr_config->composition_precision=32;
+  }
+#endif
+
+  //
+  // input_backend: 0 = mmap, 1 = streaming reads, 2 = streaming reads with O_DIRECT
+  //
+  if ((bsr_config->input_backend < 0) || (bsr_config->input_backend > 2)) {
+    bsr_config->input_backend=0;
+  }
+  if (bsr_config->input_chunk_size < 1) {
+    bsr_config->input_chunk_size=1;
+  } else if (bsr_config->input_chunk_size > 1024) {
+    bsr_config->input_chunk_size=1024;
+  }
+
+  //
+  // Gaussian_blur_method: 0 = auto, 1 = direct kernel, 2 = recursive filter
+  //
+  if ((bsr_config->Gaussian_blur_method < 0) || (bsr_config->Gaussian_blur_method > 2)) {
+    bsr_config->Gaussian_blur_method=0;
+  }
+
+  //
+  // resize_method: 0 = Lanczos, 1 = area average for integer reduction factors
+  //
+  if ((bsr_config->resize_method < 0) || (bsr_config->resize_method > 1)) {
+    bsr_config->resize_method=0;
+  }
+
+  //
+  // exr_tile_size: 0 = scanline EXR, otherwise tile size in pixels (16 - 4096)
+  //
+  if (bsr_config->exr_tile_size < 0) {
+    bsr_config->exr_tile_size=0;
+  } else if ((bsr_config->exr_tile_size > 0) && (bsr_config->exr_tile_size < 16)) {
+    bsr_config->exr_tile_size=16;
+  } else if (bsr_config->exr_tile_size > 4096) {
+    bsr_config->exr_tile_size=4096;
+  }
+
+  //
+  // tiff_compression: 0 = none, 1 = deflate with predictor
+  //
+  if ((bsr_config->tiff_compression < 0) || (bsr_config->tiff_compression > 1)) {
+    bsr_config->tiff_compression=1;
+  }
+
+  //
+  // tiff_tile_size: tile size in pixels (16 - 4096), TIFF requires a multiple of 16
+  //
+  if (bsr_config->tiff_tile_size < 16) {
+    bsr_config->tiff_tile_size=16;
+  } else if (bsr_config->tiff_tile_size > 4096) {
+    bsr_config->tiff_tile_size=4096;
+  }
+  bsr_config->tiff_tile_size&=~15;
+
+  //
+  // deep_zoom: 0 = single image, 1 = DZI tile pyramid, 2 = XYZ tile pyramid
+  //
+  if ((bsr_config->deep_zoom < 0) || (bsr_config->deep_zoom > 2)) {
+    bsr_config->deep_zoom=0;
+  }
+
+  //
+  // deep_zoom_tile_size: tile size in pixels (16 - 4096)
+  //
+  if (bsr_config->deep_zoom_tile_size < 16) {
+    bsr_config->deep_zoom_tile_size=16;
+  } else if (bsr_config->deep_zoom_tile_size > 4096) {
+    bsr_config->deep_zoom_tile_size=4096;
+  }
+
+  //
+  // png_compression: 0 = libpng (main thread only), 1 = multi-threaded fast, 2 = multi-threaded default
+  //
+  if ((bsr_config->png_compression < 0) || (bsr_config->png_compression > 2)) {
+    bsr_config->png_compression=2;
+  }
+
+  //
+  // jpeg_encoding: 0 = libjpeg (main thread only), 1 = multi-threaded standard tables, 2 = multi-threaded optimized tables
+  //
+  if ((bsr_config->jpeg_encoding < 0) || (bsr_config->jpeg_encoding > 2)) {
+    bsr_config->jpeg_encoding=1;
+  }
+
+  //
+  // encoder_speed: -1 = encoder default, 0 (slowest) - 10 (fastest) for AVIF and HEIF
+  //
+  if (bsr_config->encoder_speed < -1) {
+    bsr_config->encoder_speed=-1;
+  } else if (bsr_config->encoder_speed > 10) {
+    bsr_config->encoder_speed=10;
+  }
+
+  //
+  // grid_tile_size: 0 = encode AVIF and HEIF as a single image, otherwise tile size in pixels (multiple of 8)
+  //
+  if (bsr_config->grid_tile_size < 0) {
+    bsr_config->grid_tile_size=0;
+  } else if (bsr_config->grid_tile_size > 0) {
+    if (bsr_config->grid_tile_size < BSR_GRID_MIN_TILE_SIZE) {
+      bsr_config->grid_tile_size=BSR_GRID_MIN_TILE_SIZE;
+    }
+    bsr_config->grid_tile_size&=~7;
+  }
+
   //
   // translate output_format to internal config variables
   // 0 = PNG 8-bit unsigned integer per color
@@ -621,6 +849,9 @@ int validateConfig(bsr_config_t *bsr_config) {
   // 10 = HEIF 8-bit unsigned integer per color
   // 11 = HEIF 10-bit unsigned integer per color
   // 12 = HEIF 12-bit unsigned integer per color
+  // 13 = TIFF 8-bit unsigned integer per color
+  // 14 = TIFF 16-bit unsigned integer per color
+  // 15 = TIFF 32-bit floating-point per color
   //
   if (bsr_config->output_format == 0) {
 #ifndef BSR_USE_PNG
@@ -741,6 +972,33 @@ int validateConfig(bsr_config_t *bsr_config) {
     bsr_config->image_format=4;
     bsr_config->image_number_format=0;
     bsr_config->bits_per_color=12;
+  } else if (bsr_config->output_format == 13) {
+#ifndef BSR_USE_TIFF
+    printf("Error: not compiled with TIFF support\n");
+    fflush(stdout);
+    exit(1);
+#endif
+    bsr_config->image_format=5;
+    bsr_config->image_number_format=0;
+    bsr_config->bits_per_color=8;
+  } else if (bsr_config->output_format == 14) {
+#ifndef BSR_USE_TIFF
+    printf("Error: not compiled with TIFF support\n");
+    fflush(stdout);
+    exit(1);
+#endif
+    bsr_config->image_format=5;
+    bsr_config->image_number_format=0;
+    bsr_config->bits_per_color=16;
+  } else if (bsr_config->output_format == 15) {
+#ifndef BSR_USE_TIFF
+    printf("Error: not compiled with TIFF support\n");
+    fflush(stdout);
+    exit(1);
+#endif
+    bsr_config->image_format=5;
+    bsr_config->image_number_format=1;
+    bsr_config->bits_per_color=32;
   } else {
     if ((bsr_config->QUERY_STRING_p == NULL) && (bsr_config->print_status == 1)) {
       printf("Error: invalid output_format (%d). See --help (Output section) for output format codes.\n", bsr_config->output_format);
@@ -758,6 +1016,40 @@ int validateConfig(bsr_config_t *bsr_config) {
     exit(1);
   }
 
+  //
+  // TIFF tiles are written at file offsets, which needs a seekable output file
+  //
+  if ((bsr_config->cgi_mode == 1) && (bsr_config->image_format == 5)) {
+    printf("Error: TIFF output format is not supported in CGI mode\n");
+    fflush(stdout);
+    exit(1);
+  }
+
+  //
+  // extra outputs are written to files next to output_file_name, a CGI response holds one image
+  //
+  if ((bsr_config->cgi_mode == 1) && (bsr_config->num_extra_outputs > 0)) {
+    printf("Error: extra_output is not supported in CGI mode\n");
+    fflush(stdout);
+    exit(1);
+  }
+
+  //
+  // deep zoom tiles are written to a directory tree, PNG, JPG and integer AVIF tiles only
+  //
+  if (bsr_config->deep_zoom != 0) {
+    if (bsr_config->cgi_mode == 1) {
+      printf("Error: deep zoom output is not supported in CGI mode\n");
+      fflush(stdout);
+      exit(1);
+    }
+    if ((bsr_config->image_format != 0) && (bsr_config->image_format != 2) && ((bsr_config->image_format != 3) || (bsr_config->image_number_format != 0))) {
+      printf("Error: deep zoom output requires PNG, JPG or integer AVIF output format\n");
+      fflush(stdout);
+      exit(1);
+    }
+  }
+
   //
   // change output filename if still default "galaxy.png" and non-PNG output format is configured
   //
@@ -781,6 +1073,11 @@ int validateConfig(bsr_config_t *bsr_config) {
        && (strlen(bsr_config->output_file_name) == strlen("galaxy.png"))) {
     strncpy(bsr_config->output_file_name, "galaxy.heif", 255);
     bsr_config->output_file_name[255]=0;
+  } else if ((bsr_config->image_format == 5)\
+       && ((strstr(bsr_config->output_file_name, "galaxy.png") == bsr_config->output_file_name))\
+       && (strlen(bsr_config->output_file_name) == strlen("galaxy.png"))) {
+    strncpy(bsr_config->output_file_name, "galaxy.tif", 255);
+    bsr_config->output_file_name[255]=0;
   }
 
   //
@@ -811,6 +1108,12 @@ int validateConfig(bsr_config_t *bsr_config) {
       bsr_config->color_profile=1;  // PNG,JPG,AVIF default is sRGB
     } else if (bsr_config->image_format == 1) {
       bsr_config->color_profile=0;  // EXR default is none
+    } else if (bsr_config->image_format == 5) {
+      if (bsr_config->image_number_format == 0) {
+        bsr_config->color_profile=1;  // TIFF integer default is sRGB
+      } else {
+        bsr_config->color_profile=0;  // TIFF floating-point default is none
+      }
     }
   } else if (bsr_config->color_profile == 8) {
     if ((bsr_config->QUERY_STRING_p == NULL) && (bsr_config->print_status == 1)) {
@@ -823,3 +1126,105 @@ int validateConfig(bsr_config_t *bsr_config) {
 
   return(0);
 }
+
+//
+// build the configuration of each extra_output from the validated main configuration. An extra_output value is a
+// file name followed by comma separated option=value pairs, for example "preview.jpg,output_format=5,
+// output_scaling_factor=0.25". Only options used after post processing can be set per output since stars, blur and
+// camera settings are shared. color_profile and camera_pixel_limit_mode start from unvalidated_config so their
+// defaults follow each output's format. Returns a malloc'ed array of num_extra_outputs configs, or NULL if none
+//
+bsr_config_t *loadExtraOutputConfigs(bsr_config_t *bsr_config, bsr_config_t *unvalidated_config) {
+  const char *output_options[]={"output_format", "color_profile", "camera_pixel_limit_mode", "output_scaling_factor", "Lanczos_order",\
+                                "resize_method", "exr_compression", "exr_tile_size", "exr_mipmap", "tiff_compression", "tiff_tile_size",\
+                                "tiff_pyramid", "deep_zoom", "deep_zoom_tile_size", "stream_output", "png_compression", "jpeg_encoding",\
+                                "compression_quality", "encoder_speed", "grid_tile_size", "hdr_neutral_white_ref"};
+  bsr_config_t *extra_configs;
+  bsr_config_t *extra_config;
+  char spec[256];
+  char *segment;
+  char *save_p;
+  char *symbol_p;
+  size_t option_length;
+  int allowed;
+  int mixed_limits=0;
+  int output;
+  int i;
+
+  if (bsr_config->num_extra_outputs == 0) {
+    return(NULL);
+  }
+  extra_configs=(bsr_config_t *)malloc((size_t)bsr_config->num_extra_outputs * sizeof(bsr_config_t));
+  if (extra_configs == NULL) {
+    printf("Error: could not allocate memory for extra output configurations\n");
+    fflush(stdout);
+    exit(1);
+  }
+
+  for (output=0; output < bsr_config->num_extra_outputs; output++) {
+    extra_config=&extra_configs[output];
+    memcpy(extra_config, bsr_config, sizeof(bsr_config_t));
+    extra_config->color_profile=unvalidated_config->color_profile;
+    extra_config->camera_pixel_limit_mode=unvalidated_config->camera_pixel_limit_mode;
+
+    //
+    // first segment is the file name, the rest are options for this output
+    //
+    strncpy(spec, bsr_config->extra_output[output], 255);
+    spec[255]=0;
+    segment=strtok_r(spec, ",", &save_p);
+    if (segment != NULL) {
+      strncpy(extra_config->output_file_name, segment, 255);
+      extra_config->output_file_name[255]=0;
+      cleanupValueStr(extra_config->output_file_name);
+    }
+    if ((segment == NULL) || (extra_config->output_file_name[0] == 0) || (strchr(extra_config->output_file_name, '=') != NULL)) {
+      printf("Error: extra_output must start with a file name: %s\n", bsr_config->extra_output[output]);
+      fflush(stdout);
+      exit(1);
+    }
+    segment=strtok_r(NULL, ",", &save_p);
+    while (segment != NULL) {
+      while (*segment == 32) {
+        segment++;
+      }
+      symbol_p=strchr(segment, '=');
+      option_length=(symbol_p != NULL) ? (size_t)(symbol_p - segment) : strlen(segment);
+      allowed=0;
+      for (i=0; i < (int)(sizeof(output_options) / sizeof(output_options[0])); i++) {
+        if ((option_length == strlen(output_options[i])) && (strncasecmp(segment, output_options[i], option_length) == 0)) {
+          allowed=1;
+        }
+      }
+      if ((symbol_p == NULL) || (allowed == 0)) {
+        printf("Error: %.*s cannot be set per output in extra_output %s\n", (int)option_length, segment, bsr_config->extra_output[output]);
+        fflush(stdout);
+        exit(1);
+      }
+      processConfigSegment(extra_config, segment, 0);
+      segment=strtok_r(NULL, ",", &save_p);
+    }
+
+    validateConfig(extra_config);
+    if ((extra_config->pre_limit_intensity == 0) || (extra_config->camera_pixel_limit_mode != bsr_config->camera_pixel_limit_mode)) {
+      mixed_limits=1;
+    }
+  }
+
+  //
+  // pre-limit is applied once to the image shared by all outputs. If the outputs limit pixels differently (for
+  // example a PNG and a floating-point EXR) it is disabled, each output is still limited when it is converted
+  //
+  if ((bsr_config->pre_limit_intensity == 1) && (mixed_limits == 1)) {
+    if (bsr_config->print_status == 1) {
+      printf("Outputs use different pixel limits: disabling pre_limit_intensity\n");
+      fflush(stdout);
+    }
+    bsr_config->pre_limit_intensity=0;
+    for (output=0; output < bsr_config->num_extra_outputs; output++) {
+      extra_configs[output].pre_limit_intensity=0;
+    }
+  }
+
+  return(extra_configs);
+}
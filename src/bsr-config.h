@@ -45,5 +45,6 @@ int loadConfigFromFile(bsr_config_t *bsr_config);
 int loadConfigFromQueryString(bsr_config_t *bsr_config, char *query_string);
 int processCmdArgs(bsr_config_t *bsr_config, int argc, char **argv);
 int validateConfig(bsr_config_t *bsr_config);
+bsr_config_t *loadExtraOutputConfigs(bsr_config_t *bsr_config, bsr_config_t *unvalidated_config);
 
 #endif // BSR_CONFIG_H
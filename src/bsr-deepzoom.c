@@ -0,0 +1,460 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "bsr-png.h"
+#include "bsr-jpeg.h"
+#include "bsr-avif.h"
+#include "bsr-deepzoom.h"
+#include "band-schedule.h"
+
+//
+// set up levels and tiles for a deep zoom tile pyramid. Level 0 is the full resolution image and each level after
+// it is half the size of the one before (rounded up). DZI pyramids go all the way down to 1x1 pixel as the format
+// requires, XYZ pyramids stop when the whole level fits in one tile. Levels after the first are stored in
+// deep_zoom_buf with the same interleaved RGB line layout as image_output_buf, and their linear light values in
+// deep_zoom_linear_buf so each level is reduced from the one before it without the transfer function
+//
+int setDeepZoomLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_res_x, int output_res_y) {
+  int level;
+  int bytes_per_pixel;
+  tile_level_t *deep_zoom_level;
+
+  bsr_state->deep_zoom_num_levels=0;
+  bsr_state->deep_zoom_num_tiles=0;
+  bsr_state->deep_zoom_num_bands=0;
+  bsr_state->deep_zoom_buf_size=0;
+  bsr_state->deep_zoom_linear_buf_size=0;
+  if (bsr_config->deep_zoom == 0) {
+    return(0);
+  }
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+
+  for (level=0; level < BSR_MAX_TILE_LEVELS; level++) {
+    deep_zoom_level=&bsr_state->deep_zoom_levels[level];
+    if (level == 0) {
+      deep_zoom_level->width=output_res_x;
+      deep_zoom_level->height=output_res_y;
+    } else {
+      if ((bsr_state->deep_zoom_levels[level - 1].width == 1) && (bsr_state->deep_zoom_levels[level - 1].height == 1)) {
+        break;
+      }
+      // XYZ: stop when the previous level fits in one tile
+      if ((bsr_config->deep_zoom == 2) && (bsr_state->deep_zoom_levels[level - 1].width <= bsr_config->deep_zoom_tile_size) && (bsr_state->deep_zoom_levels[level - 1].height <= bsr_config->deep_zoom_tile_size)) {
+        break;
+      }
+      deep_zoom_level->width=(bsr_state->deep_zoom_levels[level - 1].width + 1) >> 1;
+      deep_zoom_level->height=(bsr_state->deep_zoom_levels[level - 1].height + 1) >> 1;
+    }
+    deep_zoom_level->tiles_x=(deep_zoom_level->width + bsr_config->deep_zoom_tile_size - 1) / bsr_config->deep_zoom_tile_size;
+    deep_zoom_level->tiles_y=(deep_zoom_level->height + bsr_config->deep_zoom_tile_size - 1) / bsr_config->deep_zoom_tile_size;
+    deep_zoom_level->first_tile=bsr_state->deep_zoom_num_tiles;
+    bsr_state->deep_zoom_num_tiles+=(deep_zoom_level->tiles_x * deep_zoom_level->tiles_y);
+    if (level == 0) {
+      deep_zoom_level->first_band=0;
+      deep_zoom_level->num_bands=0;
+      deep_zoom_level->buf_offset=0;
+    } else {
+      deep_zoom_level->first_band=bsr_state->deep_zoom_num_bands;
+      deep_zoom_level->num_bands=(deep_zoom_level->height + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+      deep_zoom_level->buf_offset=bsr_state->deep_zoom_buf_size;
+      bsr_state->deep_zoom_num_bands+=deep_zoom_level->num_bands;
+      bsr_state->deep_zoom_buf_size+=((size_t)bytes_per_pixel * (size_t)deep_zoom_level->width * (size_t)deep_zoom_level->height);
+      bsr_state->deep_zoom_linear_buf_size+=((size_t)3 * sizeof(float) * (size_t)deep_zoom_level->width * (size_t)deep_zoom_level->height);
+    }
+    bsr_state->deep_zoom_num_levels++;
+  }
+
+  return(0);
+}
+
+//
+// encoded pixels of a deep zoom level
+//
+unsigned char *getDeepZoomLevelBuf(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level) {
+  if (level == 0) {
+    return(bsr_state->image_output_buf);
+  }
+
+  return(bsr_state->deep_zoom_buf + bsr_state->deep_zoom_levels[level].buf_offset);
+}
+
+//
+// linear light RGB values of a deep zoom level after the first, at the same pixel offset as in deep_zoom_buf
+//
+float *getDeepZoomLinearBuf(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level) {
+  size_t bytes_per_pixel;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+
+  return(bsr_state->deep_zoom_linear_buf + ((bsr_state->deep_zoom_levels[level].buf_offset / bytes_per_pixel) * 3));
+}
+
+//
+// output file name without its extension, tile directories and the DZI manifest are named after it
+//
+static int getDeepZoomBaseName(bsr_config_t *bsr_config, char *base_name, size_t base_name_size) {
+  char *extension;
+  char *slash;
+
+  snprintf(base_name, base_name_size, "%s", bsr_config->output_file_name);
+  extension=strrchr(base_name, '.');
+  slash=strrchr(base_name, '/');
+  if ((extension != NULL) && (extension != base_name) && ((slash == NULL) || (extension > (slash + 1)))) {
+    *extension=0;
+  }
+
+  return(0);
+}
+
+//
+// file name extension of tiles
+//
+static char *getDeepZoomExtension(bsr_config_t *bsr_config) {
+  if (bsr_config->image_format == 2) {
+    return("jpg");
+  } else if (bsr_config->image_format == 3) {
+    return("avif");
+  }
+
+  return("png");
+}
+
+//
+// create directory if it does not already exist
+//
+static int makeDeepZoomDirectory(char *path) {
+  if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+    printf("Error: could not create directory %s\n", path);
+    fflush(stdout);
+    exit(1);
+  }
+
+  return(0);
+}
+
+//
+// main thread: create the directory tree for all tiles
+//
+static int makeDeepZoomDirectories(bsr_config_t *bsr_config, bsr_state_t *bsr_state, char *base_name) {
+  char path[BSR_DEEP_ZOOM_MAX_PATH];
+  int level;
+  int file_level;
+  int tile_x;
+
+  if (bsr_config->deep_zoom == 1) {
+    // DZI: base_files/level
+    snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s_files", base_name);
+    makeDeepZoomDirectory(path);
+    for (level=0; level < bsr_state->deep_zoom_num_levels; level++) {
+      file_level=bsr_state->deep_zoom_num_levels - 1 - level;
+      snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s_files/%d", base_name, file_level);
+      makeDeepZoomDirectory(path);
+    }
+  } else {
+    // XYZ: base/z/x
+    makeDeepZoomDirectory(base_name);
+    for (level=0; level < bsr_state->deep_zoom_num_levels; level++) {
+      file_level=bsr_state->deep_zoom_num_levels - 1 - level;
+      snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s/%d", base_name, file_level);
+      makeDeepZoomDirectory(path);
+      for (tile_x=0; tile_x < bsr_state->deep_zoom_levels[level].tiles_x; tile_x++) {
+        snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s/%d/%d", base_name, file_level, tile_x);
+        makeDeepZoomDirectory(path);
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// all threads: encode one tile and write it to a temporary file that is renamed into place when complete, so a
+// viewer never sees a partial tile. Tiles that are completely black are not written (viewers show missing tiles
+// as background) and any stale file from a previous render is removed. DZI edge tiles are cropped to the image,
+// XYZ edge tiles are padded to the full tile size with black
+//
+static int writeDeepZoomTile(bsr_config_t *bsr_config, bsr_state_t *bsr_state, char *base_name, int tile) {
+  char path[BSR_DEEP_ZOOM_MAX_PATH];
+  char temp_path[BSR_DEEP_ZOOM_MAX_PATH + 4];
+  FILE *tile_file;
+  tile_level_t *deep_zoom_level;
+  unsigned char *level_buf;
+  unsigned char *src_p;
+  unsigned char *dest_p;
+  size_t level_row_bytes;
+  size_t tile_row_bytes;
+  size_t copy_bytes;
+  size_t i;
+  size_t j;
+  int bytes_per_pixel;
+  int level;
+  int file_level;
+  int tile_x;
+  int tile_y;
+  int x;
+  int y;
+  int width;
+  int height;
+  int tile_width;
+  int tile_height;
+  int black=1;
+  int result;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  level=bsr_state->deep_zoom_num_levels - 1;
+  while (bsr_state->deep_zoom_levels[level].first_tile > tile) {
+    level--;
+  }
+  deep_zoom_level=&bsr_state->deep_zoom_levels[level];
+  tile_x=(tile - deep_zoom_level->first_tile) % deep_zoom_level->tiles_x;
+  tile_y=(tile - deep_zoom_level->first_tile) / deep_zoom_level->tiles_x;
+  x=tile_x * bsr_config->deep_zoom_tile_size;
+  y=tile_y * bsr_config->deep_zoom_tile_size;
+  width=deep_zoom_level->width - x;
+  if (width > bsr_config->deep_zoom_tile_size) {
+    width=bsr_config->deep_zoom_tile_size;
+  }
+  height=deep_zoom_level->height - y;
+  if (height > bsr_config->deep_zoom_tile_size) {
+    height=bsr_config->deep_zoom_tile_size;
+  }
+  if (bsr_config->deep_zoom == 1) {
+    tile_width=width;
+    tile_height=height;
+  } else {
+    tile_width=bsr_config->deep_zoom_tile_size;
+    tile_height=bsr_config->deep_zoom_tile_size;
+  }
+  file_level=bsr_state->deep_zoom_num_levels - 1 - level;
+  if (bsr_config->deep_zoom == 1) {
+    snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s_files/%d/%d_%d.%s", base_name, file_level, tile_x, tile_y, getDeepZoomExtension(bsr_config));
+  } else {
+    snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s/%d/%d/%d.%s", base_name, file_level, tile_x, tile_y, getDeepZoomExtension(bsr_config));
+  }
+
+  //
+  // copy tile pixels to compression_buf1, checking for any non-zero sample
+  //
+  level_buf=getDeepZoomLevelBuf(bsr_config, bsr_state, level);
+  level_row_bytes=(size_t)bytes_per_pixel * (size_t)deep_zoom_level->width;
+  tile_row_bytes=(size_t)bytes_per_pixel * (size_t)tile_width;
+  copy_bytes=(size_t)bytes_per_pixel * (size_t)width;
+  if ((tile_width != width) || (tile_height != height)) {
+    memset(bsr_state->compression_buf1, 0, tile_row_bytes * (size_t)tile_height);
+  }
+  for (i=0; i < (size_t)height; i++) {
+    src_p=level_buf + ((size_t)(y + i) * level_row_bytes) + ((size_t)x * (size_t)bytes_per_pixel);
+    dest_p=bsr_state->compression_buf1 + (i * tile_row_bytes);
+    memcpy(dest_p, src_p, copy_bytes);
+    if (black == 1) {
+      for (j=0; j < copy_bytes; j++) {
+        if (dest_p[j] != 0) {
+          black=0;
+          break;
+        }
+      }
+    }
+  }
+  if (black == 1) {
+    unlink(path);
+    __atomic_fetch_add(&bsr_state->deep_zoom_black_tiles, 1, __ATOMIC_RELAXED);
+    return(0);
+  }
+
+  //
+  // encode to temporary file and rename
+  //
+  snprintf(temp_path, (BSR_DEEP_ZOOM_MAX_PATH + 4), "%s.tmp", path);
+  tile_file=fopen(temp_path, "wb");
+  if (tile_file == NULL) {
+    printf("Error: could not open %s for writing\n", temp_path);
+    fflush(stdout);
+    exit(1);
+  }
+  if (bsr_config->image_format == 2) {
+    result=outputJpegTile(bsr_config, tile_file, bsr_state->compression_buf1, tile_width, tile_height);
+  } else if (bsr_config->image_format == 3) {
+    result=outputAvifTile(bsr_config, tile_file, bsr_state->compression_buf1, tile_width, tile_height);
+  } else {
+    result=outputPNGTile(bsr_config, tile_file, bsr_state->compression_buf1, tile_width, tile_height, bsr_state->compression_buf2);
+  }
+  if ((fclose(tile_file) != 0) || (result != 0)) {
+    printf("Error: could not write %s\n", temp_path);
+    fflush(stdout);
+    exit(1);
+  }
+  if (rename(temp_path, path) != 0) {
+    printf("Error: could not rename %s to %s\n", temp_path, path);
+    fflush(stdout);
+    exit(1);
+  }
+
+  return(0);
+}
+
+//
+// main thread: write the DZI manifest after all tiles so viewers only find it once the pyramid is complete
+//
+static int outputDeepZoomManifest(bsr_config_t *bsr_config, bsr_state_t *bsr_state, char *base_name) {
+  char path[BSR_DEEP_ZOOM_MAX_PATH];
+  char temp_path[BSR_DEEP_ZOOM_MAX_PATH + 4];
+  FILE *manifest_file;
+
+  snprintf(path, BSR_DEEP_ZOOM_MAX_PATH, "%s.dzi", base_name);
+  snprintf(temp_path, (BSR_DEEP_ZOOM_MAX_PATH + 4), "%s.tmp", path);
+  manifest_file=fopen(temp_path, "wb");
+  if (manifest_file == NULL) {
+    printf("Error: could not open %s for writing\n", temp_path);
+    fflush(stdout);
+    exit(1);
+  }
+  fprintf(manifest_file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(manifest_file, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"%s\" Overlap=\"0\" TileSize=\"%d\">\n", getDeepZoomExtension(bsr_config), bsr_config->deep_zoom_tile_size);
+  fprintf(manifest_file, "  <Size Width=\"%d\" Height=\"%d\"/>\n", bsr_state->deep_zoom_levels[0].width, bsr_state->deep_zoom_levels[0].height);
+  fprintf(manifest_file, "</Image>\n");
+  if (fclose(manifest_file) != 0) {
+    printf("Error: could not write %s\n", temp_path);
+    fflush(stdout);
+    exit(1);
+  }
+  if (rename(temp_path, path) != 0) {
+    printf("Error: could not rename %s to %s\n", temp_path, path);
+    fflush(stdout);
+    exit(1);
+  }
+
+  return(0);
+}
+
+int outputDeepZoom(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  char base_name[256];
+  int tile;
+  int i;
+
+  getDeepZoomBaseName(bsr_config, base_name, 256);
+
+  //
+  // main thread: display status update and create directories
+  //
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &starttime);
+      if (bsr_config->deep_zoom == 1) {
+        printf("Writing deep zoom tiles to %s.dzi...", base_name);
+      } else {
+        printf("Writing deep zoom tiles to %s/...", base_name);
+      }
+      fflush(stdout);
+    }
+    makeDeepZoomDirectories(bsr_config, bsr_state, base_name);
+    bsr_state->deep_zoom_black_tiles=0;
+    initBandSchedule(bsr_state);
+  }
+
+  //
+  // worker threads:  wait for main thread to say go
+  // main thread: tell worker threads to go
+  //
+  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+    waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
+  } else {
+    // main thread
+    for (i=1; i <= bsr_state->num_worker_threads; i++) {
+      bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
+    }
+  } // end if not main thread
+
+  //
+  // all threads: claim and write tiles of all levels, the levels were built by sequencePixels()
+  //
+  for (tile=claimBandTask(bsr_state); tile < bsr_state->deep_zoom_num_tiles; tile=claimBandTask(bsr_state)) {
+    writeDeepZoomTile(bsr_config, bsr_state, base_name, tile);
+  }
+
+  //
+  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+  // main thread: wait until all other threads are done, write manifest and then signal that they can continue
+  //
+  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+    waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_CONTINUE);
+  } else {
+    waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+    if (bsr_config->deep_zoom == 1) {
+      outputDeepZoomManifest(bsr_config, bsr_state, base_name);
+    }
+
+    // ready to continue, set all worker thread status to continue
+    for (i=1; i <= bsr_state->num_worker_threads; i++) {
+      bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_CONTINUE;
+    }
+
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &endtime);
+      elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+      printf(" (%.3fs)\n", elapsed_time);
+      printf("  %d tiles in %d levels, %d black tiles skipped\n", (bsr_state->deep_zoom_num_tiles - bsr_state->deep_zoom_black_tiles), bsr_state->deep_zoom_num_levels, bsr_state->deep_zoom_black_tiles);
+      fflush(stdout);
+    }
+  } // end if not main thread
+
+  return(0);
+}
@@ -42,11 +42,15 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "cgi.h"
 #include "icc-profiles.h"
 #include "bsr-exr.h"
+#include "bsr-output.h"
 #include "sequence-pixels.h"
+#include "band-schedule.h"
 
 #ifdef BSR_USE_EXR
 #include <zlib.h>
@@ -79,7 +83,11 @@ int outputEXRHeader(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *outp
 
   // version
   header_p+=storeU8(header_p, 0x02); // EXR version 2.0
-  header_p+=storeU8(header_p, 0);    // version flags are all zero (no tiles, no long attribute names, no deep data, not multi-part)
+  if (bsr_state->exr_num_levels > 0) {
+    header_p+=storeU8(header_p, 0x02); // version flags: tiled (no long attribute names, no deep data, not multi-part)
+  } else {
+    header_p+=storeU8(header_p, 0);    // version flags are all zero (no tiles, no long attribute names, no deep data, not multi-part)
+  }
   header_p+=storeU8(header_p, 0);    // reserved
   header_p+=storeU8(header_p, 0);    // reserved
 
@@ -157,6 +165,20 @@ int outputEXRHeader(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *outp
   header_p+=storeI32LE(header_p, (int32_t)1);              // attribute value length in bytes
   header_p+=storeU8(header_p, EXR_LINEORDER_INCREASING_Y); // line order
 
+  // tile description
+  if (bsr_state->exr_num_levels > 0) {
+    header_p+=storeStr32(header_p, "tiles");                             // attribute name
+    header_p+=storeStr32(header_p, "tiledesc");                          // attribute type
+    header_p+=storeI32LE(header_p, (int32_t)9);                          // attribute value length in bytes
+    header_p+=storeU32LE(header_p, (uint32_t)bsr_config->exr_tile_size); // tile width
+    header_p+=storeU32LE(header_p, (uint32_t)bsr_config->exr_tile_size); // tile height
+    if (bsr_state->exr_num_levels > 1) {
+      header_p+=storeU8(header_p, (EXR_TILE_MIPMAP_LEVELS | (EXR_TILE_ROUND_DOWN << 4))); // level mode, rounding mode
+    } else {
+      header_p+=storeU8(header_p, EXR_TILE_ONE_LEVEL);                   // level mode
+    }
+  }
+
   // pixel aspect ratio
   header_p+=storeStr32(header_p, "pixelAspectRatio"); // attribute name
   header_p+=storeStr32(header_p, "float");            // attribute type
@@ -230,114 +252,210 @@ int outputEXRHeader(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *outp
   return(header_size);
 }
 
-int outputEXROffsetTable(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file, int header_size, int lines_per_block) {
-  int output_res_x;
-  int output_res_y;
+//
+// number of lines in each thread's section of the image, a multiple of lines_per_block
+//
+static int getEXRLinesPerThread(bsr_state_t *bsr_state, int lines_per_block) {
+  int lines_per_thread;
+
+  lines_per_thread=(int)ceil(((double)bsr_state->current_image_res_y / (double)(bsr_state->num_worker_threads + 1)));
+  if (lines_per_thread % lines_per_block != 0) { // ensure thread boundary is also a block boundary
+    lines_per_thread+=(lines_per_block - (lines_per_thread % lines_per_block));
+  }
+
+  return(lines_per_thread);
+}
+
+//
+// bytes of pixel data in the chunk starting at output_y
+//
+static uint64_t getEXRChunkDataSize(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_y, int lines_per_block) {
+  int lines;
+  int bytes_per_pixel=6;
+
+  if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+    // if pixel data is compressed, load compressed size from compressed_sizes
+    return((uint64_t)bsr_state->compressed_sizes[output_y]);
+  }
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  }
+  lines=lines_per_block;
+  if ((output_y + lines) > bsr_state->current_image_res_y) {
+    lines=bsr_state->current_image_res_y - output_y;
+  }
+
+  return((uint64_t)bytes_per_pixel * (uint64_t)bsr_state->current_image_res_x * (uint64_t)lines);
+}
+
+//
+// all threads: store total bytes of chunks (headers and pixel data) in this thread's section of the image
+//
+static int sumEXRSection(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int lines_per_block) {
+  int lines_per_thread;
+  int first_y;
+  int last_y;
+  int output_y;
+  uint64_t section_size=0;
+  const uint64_t chunk_header_size=8ul; // 8 bytes: y coordinate + pixel_data_size;
+
+  lines_per_thread=getEXRLinesPerThread(bsr_state, lines_per_block);
+  first_y=bsr_state->perthread->my_thread_id * lines_per_thread;
+  last_y=first_y + lines_per_thread;
+  if (last_y > bsr_state->current_image_res_y) {
+    last_y=bsr_state->current_image_res_y;
+  }
+  for (output_y=first_y; output_y < last_y; output_y+=lines_per_block) {
+    section_size+=(chunk_header_size + getEXRChunkDataSize(bsr_config, bsr_state, output_y, lines_per_block));
+  }
+  bsr_state->exr_section_sizes[bsr_state->perthread->my_thread_id]=section_size;
+
+  return(0);
+}
+
+//
+// write offset table entries for the chunks in lines first_y to last_y, the first chunk begins at chunk_offset.
+// Entries are written at file_offset, or sequentially if file_offset is negative
+//
+int outputEXROffsetTable(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd, int64_t file_offset, int lines_per_block, int first_y, int last_y, uint64_t chunk_offset) {
   int offset_table_records;
-  uint64_t offset_table_size;
-  uint64_t chunk_start;
+  unsigned char *offset_table;
+  unsigned char *offset_table_p;
   uint64_t offset;
-  unsigned char offset_buf[8];
   int output_y;
-  int pixel_data_size=0;
+  struct iovec iov;
+  int result;
   const uint64_t chunk_header_size=8ul; // 8 bytes: y coordinate + pixel_data_size;
- 
-  output_res_x=bsr_state->current_image_res_x;
-  output_res_y=bsr_state->current_image_res_y;
 
-  // set static block size for uncompressed data
-  if (bsr_config->bits_per_color == 16) {
-    pixel_data_size=(6 * output_res_x * lines_per_block);
-  } else if (bsr_config->bits_per_color == 32) {
-    pixel_data_size=(12 * output_res_x * lines_per_block);
+  offset_table_records=(last_y - first_y + lines_per_block - 1) / lines_per_block;
+  if (offset_table_records <= 0) {
+    return(0);
   }
-
-  // output entry in offset table
-  offset_table_records=output_res_y / lines_per_block;
-  if ((output_res_y % lines_per_block) != 0) {
-    offset_table_records++;
+  offset_table=(unsigned char *)malloc((size_t)offset_table_records * 8);
+  if (offset_table == NULL) {
+    return(1);
   }
-  offset_table_size=(uint64_t)(8 * offset_table_records);
-  chunk_start=(uint64_t)(header_size + offset_table_size); 
-  offset=chunk_start;
-  offset_buf[0]=0;
-  for (output_y=0; output_y < output_res_y; output_y+=lines_per_block) {
-    // pixel data size
-    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
-      // if pixel data is compressed, load compressed size from compressed_sizes
-      pixel_data_size=bsr_state->compressed_sizes[output_y];
-    }
-    storeU64LE(offset_buf, offset);
-    if (bsr_config->cgi_mode == 1) {
-      fwrite(offset_buf, 8, 1, stdout);
-    } else {
-      fwrite(offset_buf, 8, 1, output_file);
-    }
-    offset+=(chunk_header_size + (uint64_t)pixel_data_size);
+
+  // build entries for this range of chunks
+  offset=chunk_offset;
+  offset_table_p=offset_table;
+  for (output_y=first_y; output_y < last_y; output_y+=lines_per_block) {
+    storeU64LE(offset_table_p, offset);
+    offset_table_p+=8;
+    offset+=(chunk_header_size + getEXRChunkDataSize(bsr_config, bsr_state, output_y, lines_per_block));
   }
 
-  return(0);
+  iov.iov_base=offset_table;
+  iov.iov_len=(size_t)offset_table_records * 8;
+  result=writeVector(fd, &iov, 1, file_offset);
+  free(offset_table);
+
+  return(result);
 }
 
-int outputEXRChunks(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file, int lines_per_block) {
-  int output_res_x;
-  int output_res_y;
-  int pixel_data_size=0;
-  int output_data_size=0;
-  unsigned char pixel_data_size_buf[4];
+//
+// write chunks for lines first_y to last_y. Each chunk header and its pixel data in image_output_buf are passed
+// to the kernel together so pixel data is never copied. Chunks are written at file_offset, or sequentially if
+// file_offset is negative (stdout in CGI mode, where pixel data goes to a pipe by reference)
+//
+int outputEXRChunks(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd, int64_t file_offset, int lines_per_block, int first_y, int last_y) {
+  int bytes_per_pixel=6;
+  uint64_t block_size;
+  uint64_t data_size;
+  uint64_t batch_size;
+  unsigned char chunk_headers[BSR_EXR_WRITE_BATCH][8];
+  struct iovec iov[2 * BSR_EXR_WRITE_BATCH];
+  int chunk;
   int output_y;
-  unsigned char y_coordinate_buf[4];
   unsigned char *image_output_p;
-  
-  output_res_x=bsr_state->current_image_res_x;
-  output_res_y=bsr_state->current_image_res_y;
 
-  // set static block size for uncompressed data
-  if (bsr_config->bits_per_color == 16) {
-    pixel_data_size=(6 * output_res_x * lines_per_block);
-  } else if (bsr_config->bits_per_color == 32) {
-    pixel_data_size=(12 * output_res_x * lines_per_block);
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
   }
+  block_size=(uint64_t)bytes_per_pixel * (uint64_t)bsr_state->current_image_res_x * (uint64_t)lines_per_block;
 
-  pixel_data_size_buf[0]=0;
-  y_coordinate_buf[0]=0;
-  image_output_p=bsr_state->image_output_buf;
-  for (output_y=0; output_y < output_res_y; output_y+=lines_per_block) {
-    // y coordinate
-    storeI32LE(y_coordinate_buf, output_y);
-    if (bsr_config->cgi_mode == 1) {
-      fwrite(y_coordinate_buf, 4, 1, stdout);
-    } else {
-      fwrite(y_coordinate_buf, 4, 1, output_file);
-    }
+  chunk=0;
+  batch_size=0;
+  image_output_p=bsr_state->image_output_buf + ((uint64_t)bytes_per_pixel * (uint64_t)bsr_state->current_image_res_x * (uint64_t)first_y);
+  for (output_y=first_y; output_y < last_y; output_y+=lines_per_block) {
+    // y coordinate and pixel data size
+    data_size=getEXRChunkDataSize(bsr_config, bsr_state, output_y, lines_per_block);
+    storeI32LE(chunk_headers[chunk], output_y);
+    storeI32LE(&chunk_headers[chunk][4], (int32_t)data_size);
+    iov[2 * chunk].iov_base=chunk_headers[chunk];
+    iov[2 * chunk].iov_len=8;
 
-    // pixel data size
-    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
-      // if pixel data is compressed, load compressed size from compressed_sizes
-      output_data_size=bsr_state->compressed_sizes[output_y];
-    } else {
-      output_data_size=pixel_data_size;
-    }
-    storeI32LE(pixel_data_size_buf, output_data_size);
-    if (bsr_config->cgi_mode == 1) {
-      fwrite(pixel_data_size_buf, 4, 1, stdout);
-    } else {
-      fwrite(pixel_data_size_buf, 4, 1, output_file);
-    }
+    // pixel data, even if compressed the block starts at the same place in image_output_buf
+    iov[(2 * chunk) + 1].iov_base=image_output_p;
+    iov[(2 * chunk) + 1].iov_len=(size_t)data_size;
+    image_output_p+=block_size;
+    batch_size+=(8 + data_size);
+    chunk++;
 
-    // pixel data
-    if (bsr_config->cgi_mode == 1) {
-      fwrite(image_output_p, output_data_size, 1, stdout);
-    } else {
-      fwrite(image_output_p, output_data_size, 1, output_file);
+    // write a full batch or the last one
+    if ((chunk == BSR_EXR_WRITE_BATCH) || ((output_y + lines_per_block) >= last_y)) {
+      if (file_offset >= 0) {
+        if (writeVector(fd, iov, (2 * chunk), file_offset) != 0) {
+          return(1);
+        }
+        file_offset+=(int64_t)batch_size;
+      } else if (writeOutputVector(fd, iov, (2 * chunk), &bsr_state->splice_buf) != 0) {
+        return(1);
+      }
+      chunk=0;
+      batch_size=0;
     }
-
-    image_output_p+=pixel_data_size; // even if compressed, this gets us to start of next block
   } // end for output_y
 
   return(0);
 }
 
+#ifdef BSR_USE_EXR
+//
+// deflate one block of pixel data the way OpenEXR ZIP compression does: re-order bytes (first half = even bytes,
+// second half = odd), replace each byte with the difference to the previous one and compress with zlib.
+// reorder_buf and compressed_buf must hold size bytes. Returns zlib status, compressed_size is only valid if Z_OK
+//
+static int deflateEXRBlock(unsigned char *src, int size, unsigned char *reorder_buf, unsigned char *compressed_buf, uint64_t *compressed_size) {
+  unsigned char *reorder_src_p;
+  unsigned char *reorder_dest_p;
+  int half_size;
+  int reorder_i;
+  int mix;
+  int mix_prev;
+  int level;
+
+  // re-order bytes (first half of buffer = even bytes, second half = odd)
+  half_size=size / 2; // with 6 or 12 bytes per pixel this is always exactly divisible by 2
+  reorder_src_p=src;
+  reorder_dest_p=reorder_buf;
+  for (reorder_i=0; reorder_i < half_size; reorder_i++) {
+    *reorder_dest_p=*reorder_src_p; // even byte
+    reorder_src_p++;
+    reorder_dest_p+=half_size;
+    *reorder_dest_p=*reorder_src_p; // odd byte
+    reorder_src_p++;
+    reorder_dest_p-=(half_size - 1);
+  }
+
+  // mix current with previous byte
+  mix_prev=(int)*reorder_buf;
+  reorder_dest_p=reorder_buf;
+  reorder_dest_p++;
+  for (reorder_i=1; reorder_i < size; reorder_i++) {
+    mix=(int)*reorder_dest_p - mix_prev + 384;
+    mix_prev=(int)*reorder_dest_p;
+    *reorder_dest_p=(uint8_t)mix;
+    reorder_dest_p++;
+  }
+
+  // compress pixel data
+  level=6;
+  *compressed_size=(uint64_t)size;
+  return(compress2((Bytef *)compressed_buf, compressed_size, (const Bytef *)reorder_buf, (uLong)size, level));
+}
+#endif // BSR_USE_EXR
+
 int compressEXRDeflate(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int lines_per_block) {
 
 #ifdef BSR_USE_EXR
@@ -348,13 +466,6 @@ int compressEXRDeflate(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int lin
   uint64_t compressed_data_size=0;
   int output_y;
   int lines_remaining;
-  unsigned char *reorder_src_p;
-  unsigned char *reorder_dest_p;
-  int level;
-  int reorder_i;
-  int half_pixel_data_size;
-  int mix;
-  int mix_prev;
   int lines_per_thread;
   unsigned char *image_output_p;
   int y_offset;
@@ -378,18 +489,14 @@ int compressEXRDeflate(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int lin
     bytes_per_pixel=12;
   }
   pixel_data_size=bytes_per_pixel * output_res_x * lines_per_block;
-  half_pixel_data_size = pixel_data_size / 2; // with 6 or 12 bytes per pixel this is always exactly divisible by 2
 
   //
   // lines per thread
   //
-  lines_per_thread=(int)ceil(((double)output_res_y / (double)(bsr_state->num_worker_threads + 1)));
-  if (lines_per_thread % lines_per_block != 0) { // ensure thread boundary is also a block boundary
-    lines_per_thread+=(lines_per_block - (lines_per_thread % lines_per_block));
-  }
+  lines_per_thread=getEXRLinesPerThread(bsr_state, lines_per_block);
 
   //
-  // compression loop. Each thread works on it's assigned section of image. The reorder/mixing steps are peculiar to OpenEXR
+  // compression loop. Each thread works on it's assigned section of image
   //
   lines_remaining=lines_per_block;
   output_y=bsr_state->perthread->my_thread_id * lines_per_thread;
@@ -403,36 +510,9 @@ int compressEXRDeflate(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int lin
     }
     if (lines_remaining != lines_per_block) {
       pixel_data_size=bytes_per_pixel * output_res_x * lines_remaining;
-      half_pixel_data_size = pixel_data_size / 2; // with 6 or 12 bytes per pixel this is always exactly divisible by 2
-    }
-
-    // re-order bytes (first half of buffer = even bytes, second half = odd)
-    reorder_src_p=image_output_p;
-    reorder_dest_p=bsr_state->compression_buf1;
-    for (reorder_i=0; reorder_i < half_pixel_data_size; reorder_i++) {
-      *reorder_dest_p=*reorder_src_p; // even byte
-      reorder_src_p++;
-      reorder_dest_p+=half_pixel_data_size;
-      *reorder_dest_p=*reorder_src_p; // odd byte
-      reorder_src_p++;
-      reorder_dest_p-=(half_pixel_data_size - 1);
-    }
-
-    // mix current with previous byte
-    mix_prev=(int)*bsr_state->compression_buf1;
-    reorder_dest_p=bsr_state->compression_buf1;
-    reorder_dest_p++;
-    for (reorder_i=1; reorder_i < pixel_data_size; reorder_i++) {
-      mix=(int)*reorder_dest_p - mix_prev + 384;
-      mix_prev=(int)*reorder_dest_p;
-      *reorder_dest_p=(uint8_t)mix;
-      reorder_dest_p++;
     }
 
-    // compress pixel data
-    level=6;
-    compressed_data_size=pixel_data_size;
-    z_return=compress2((Bytef *)bsr_state->compression_buf2, &compressed_data_size, (const Bytef *)bsr_state->compression_buf1, (uLong)pixel_data_size, level);
+    z_return=deflateEXRBlock(image_output_p, pixel_data_size, bsr_state->compression_buf1, bsr_state->compression_buf2, &compressed_data_size);
     if (z_return != Z_OK) {
       // if compression fails for any reason, just use uncompressed data.
       if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
@@ -463,6 +543,599 @@ int compressEXRDeflate(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int lin
   return(0);
 }
 
+//
+// lines per chunk of a scanline image for exr_compression
+//
+int getEXRLinesPerBlock(bsr_config_t *bsr_config) {
+  if (bsr_config->exr_compression == 3) {
+    // deflate, 16 line per block
+    return(16);
+  }
+
+  return(1);
+}
+
+//
+// all threads: build the chunks (header and pixel data) of one band of a streamed scanline image from its ring slot in
+// image_output_buf into its slot in stream_out_buf. Compressed sizes are stored in compressed_sizes so the main
+// thread can write the offset table after the last band
+//
+int encodeEXRStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band) {
+  int bytes_per_pixel=6;
+  int lines_per_block;
+  int first_line;
+  int end_line;
+  int output_y;
+  int lines;
+  int slot;
+  int pixel_data_size;
+  uint64_t data_size;
+  unsigned char *image_output_p;
+  unsigned char *output_p;
+  stream_slot_t *stream_slot;
+#ifdef BSR_USE_EXR
+  int z_return;
+#endif
+
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  }
+  lines_per_block=getEXRLinesPerBlock(bsr_config);
+  first_line=band * bsr_state->stream_band_lines;
+  end_line=first_line + bsr_state->stream_band_lines;
+  if (end_line > bsr_state->current_image_res_y) {
+    end_line=bsr_state->current_image_res_y;
+  }
+  slot=band % bsr_state->stream_num_slots;
+  stream_slot=&bsr_state->stream_slots[slot];
+  image_output_p=bsr_state->image_output_buf + ((size_t)slot * bsr_state->stream_slot_size);
+  output_p=bsr_state->stream_out_buf + ((size_t)slot * bsr_state->stream_out_slot_size);
+
+  for (output_y=first_line; output_y < end_line; output_y+=lines_per_block) {
+    lines=lines_per_block;
+    if ((output_y + lines) > bsr_state->current_image_res_y) {
+      lines=bsr_state->current_image_res_y - output_y;
+    }
+    pixel_data_size=bytes_per_pixel * bsr_state->current_image_res_x * lines;
+    data_size=(uint64_t)pixel_data_size;
+
+#ifdef BSR_USE_EXR
+    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+      // compress directly behind the chunk header, keep uncompressed data if compression fails or does not help
+      z_return=deflateEXRBlock(image_output_p, pixel_data_size, bsr_state->compression_buf1, (output_p + 8), &data_size);
+      if ((z_return != Z_OK) || (data_size >= (uint64_t)pixel_data_size)) {
+        data_size=(uint64_t)pixel_data_size;
+        memcpy((output_p + 8), image_output_p, (size_t)pixel_data_size);
+      }
+      bsr_state->compressed_sizes[output_y]=(int)data_size;
+    } else {
+      memcpy((output_p + 8), image_output_p, (size_t)pixel_data_size);
+    }
+#else
+    memcpy((output_p + 8), image_output_p, (size_t)pixel_data_size);
+#endif // BSR_USE_EXR
+
+    // y coordinate and pixel data size
+    storeI32LE(output_p, output_y);
+    storeI32LE((output_p + 4), (int32_t)data_size);
+    output_p+=(8 + data_size);
+    image_output_p+=pixel_data_size;
+  }
+  stream_slot->output_size=(size_t)(output_p - (bsr_state->stream_out_buf + ((size_t)slot * bsr_state->stream_out_slot_size)));
+
+  return(0);
+}
+
+//
+// set up levels and tiles for tiled EXR images. Level n of a mipmap is the image reduced by 2^n (rounded down,
+// at least 1 pixel) and the last level is 1x1 pixel. Levels after the first are stored in exr_mip_buf with the same
+// line layout as image_output_buf
+//
+int setEXRLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_res_x, int output_res_y) {
+  int level;
+  int max_res;
+  int bytes_per_pixel=6;
+  tile_level_t *exr_level;
+
+  bsr_state->exr_num_levels=0;
+  bsr_state->exr_num_tiles=0;
+  bsr_state->exr_num_tile_rows=0;
+  bsr_state->exr_num_bands=0;
+  bsr_state->exr_mip_buf_size=0;
+  if ((bsr_config->image_format != 1) || (bsr_config->exr_tile_size == 0)) {
+    return(0);
+  }
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  }
+
+  // number of levels
+  bsr_state->exr_num_levels=1;
+  if (bsr_config->exr_mipmap == 1) {
+    max_res=(output_res_x > output_res_y) ? output_res_x : output_res_y;
+    while (((max_res >> bsr_state->exr_num_levels) > 0) && (bsr_state->exr_num_levels < BSR_MAX_TILE_LEVELS)) {
+      bsr_state->exr_num_levels++;
+    }
+  }
+
+  for (level=0; level < bsr_state->exr_num_levels; level++) {
+    exr_level=&bsr_state->exr_levels[level];
+    exr_level->width=output_res_x >> level;
+    if (exr_level->width < 1) {
+      exr_level->width=1;
+    }
+    exr_level->height=output_res_y >> level;
+    if (exr_level->height < 1) {
+      exr_level->height=1;
+    }
+    exr_level->tiles_x=(exr_level->width + bsr_config->exr_tile_size - 1) / bsr_config->exr_tile_size;
+    exr_level->tiles_y=(exr_level->height + bsr_config->exr_tile_size - 1) / bsr_config->exr_tile_size;
+    exr_level->first_tile=bsr_state->exr_num_tiles;
+    exr_level->first_tile_row=bsr_state->exr_num_tile_rows;
+    bsr_state->exr_num_tiles+=(exr_level->tiles_x * exr_level->tiles_y);
+    bsr_state->exr_num_tile_rows+=exr_level->tiles_y;
+    if (level == 0) {
+      exr_level->first_band=0;
+      exr_level->num_bands=0;
+      exr_level->buf_offset=0;
+    } else {
+      exr_level->first_band=bsr_state->exr_num_bands;
+      exr_level->num_bands=(exr_level->height + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+      exr_level->buf_offset=bsr_state->exr_mip_buf_size;
+      bsr_state->exr_num_bands+=exr_level->num_bands;
+      bsr_state->exr_mip_buf_size+=((size_t)bytes_per_pixel * (size_t)exr_level->width * (size_t)exr_level->height);
+    }
+  }
+
+  return(0);
+}
+
+//
+// pixels of a tiled EXR level
+//
+static unsigned char *getEXRLevelBuf(bsr_state_t *bsr_state, int level) {
+  if (level == 0) {
+    return(bsr_state->image_output_buf);
+  }
+
+  return(bsr_state->exr_mip_buf + bsr_state->exr_levels[level].buf_offset);
+}
+
+//
+// bytes of pixel data in a tile
+//
+static uint64_t getEXRTileDataSize(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level, int tile_x, int tile_y) {
+  tile_level_t *exr_level;
+  int tile_width;
+  int tile_height;
+  int bytes_per_pixel=6;
+
+  exr_level=&bsr_state->exr_levels[level];
+  if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+    // if pixel data is compressed, load compressed size from compressed_sizes
+    return((uint64_t)bsr_state->compressed_sizes[exr_level->first_tile + (tile_y * exr_level->tiles_x) + tile_x]);
+  }
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  }
+  tile_width=exr_level->width - (tile_x * bsr_config->exr_tile_size);
+  if (tile_width > bsr_config->exr_tile_size) {
+    tile_width=bsr_config->exr_tile_size;
+  }
+  tile_height=exr_level->height - (tile_y * bsr_config->exr_tile_size);
+  if (tile_height > bsr_config->exr_tile_size) {
+    tile_height=bsr_config->exr_tile_size;
+  }
+
+  return((uint64_t)bytes_per_pixel * (uint64_t)tile_width * (uint64_t)tile_height);
+}
+
+//
+// level and row of tiles within that level for a row of tiles in file order
+//
+static int getEXRTileRow(bsr_state_t *bsr_state, int row, int *level, int *tile_y) {
+  *level=bsr_state->exr_num_levels - 1;
+  while ((*level > 0) && (bsr_state->exr_levels[*level].first_tile_row > row)) {
+    (*level)--;
+  }
+  *tile_y=row - bsr_state->exr_levels[*level].first_tile_row;
+
+  return(0);
+}
+
+//
+// bytes of chunks (headers and pixel data) in a row of tiles
+//
+static uint64_t getEXRTileRowSize(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int row) {
+  int level;
+  int tile_x;
+  int tile_y;
+  uint64_t row_size=0;
+  const uint64_t chunk_header_size=20ul; // 20 bytes: tile x, tile y, level x, level y + pixel_data_size
+
+  getEXRTileRow(bsr_state, row, &level, &tile_y);
+  for (tile_x=0; tile_x < bsr_state->exr_levels[level].tiles_x; tile_x++) {
+    row_size+=(chunk_header_size + getEXRTileDataSize(bsr_config, bsr_state, level, tile_x, tile_y));
+  }
+
+  return(row_size);
+}
+
+//
+// reduce one band of lines of the previous level into this level, each pixel is the average of 2x2 pixels.
+// A previous level that is an odd number of pixels wide or high loses its last column or row
+//
+static int reduceEXRBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level, int band) {
+  tile_level_t *exr_level;
+  tile_level_t *src_level;
+  int bytes_per_color=2;
+  size_t row_bytes;
+  size_t src_row_bytes;
+  size_t channel_bytes;
+  size_t src_channel_bytes;
+  int y;
+  int x;
+  int src_x0;
+  int src_x1;
+  int src_y0;
+  int src_y1;
+  int channel;
+  unsigned char *dest_p;
+  unsigned char *src_row0_p;
+  unsigned char *src_row1_p;
+  uint64_t sum;
+
+  exr_level=&bsr_state->exr_levels[level];
+  src_level=&bsr_state->exr_levels[level - 1];
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_color=4;
+  }
+  channel_bytes=(size_t)bytes_per_color * (size_t)exr_level->width;
+  row_bytes=3 * channel_bytes;
+  src_channel_bytes=(size_t)bytes_per_color * (size_t)src_level->width;
+  src_row_bytes=3 * src_channel_bytes;
+
+  for (y=band * BSR_BAND_LINES; ((y < ((band + 1) * BSR_BAND_LINES)) && (y < exr_level->height)); y++) {
+    src_y0=2 * y;
+    src_y1=src_y0 + 1;
+    if (src_y1 >= src_level->height) {
+      src_y1=src_level->height - 1;
+    }
+    for (channel=0; channel < 3; channel++) {
+      dest_p=getEXRLevelBuf(bsr_state, level) + ((size_t)y * row_bytes) + ((size_t)channel * channel_bytes);
+      src_row0_p=getEXRLevelBuf(bsr_state, level - 1) + ((size_t)src_y0 * src_row_bytes) + ((size_t)channel * src_channel_bytes);
+      src_row1_p=getEXRLevelBuf(bsr_state, level - 1) + ((size_t)src_y1 * src_row_bytes) + ((size_t)channel * src_channel_bytes);
+      for (x=0; x < exr_level->width; x++) {
+        src_x0=2 * x;
+        src_x1=src_x0 + 1;
+        if (src_x1 >= src_level->width) {
+          src_x1=src_level->width - 1;
+        }
+        if ((bsr_config->image_number_format == 0) && (bytes_per_color == 4)) {
+          // 32-bit unsigned integer
+          sum=(uint64_t)loadU32LE(src_row0_p + (src_x0 * 4)) + (uint64_t)loadU32LE(src_row0_p + (src_x1 * 4)) + (uint64_t)loadU32LE(src_row1_p + (src_x0 * 4)) + (uint64_t)loadU32LE(src_row1_p + (src_x1 * 4));
+          storeU32LE(dest_p + (x * 4), (uint32_t)((sum + 2) >> 2));
+        } else if (bytes_per_color == 4) {
+          // 32-bit float
+          storeFloatLE(dest_p + (x * 4), 0.25f * (loadFloatLE(src_row0_p + (src_x0 * 4)) + loadFloatLE(src_row0_p + (src_x1 * 4)) + loadFloatLE(src_row1_p + (src_x0 * 4)) + loadFloatLE(src_row1_p + (src_x1 * 4))));
+        } else {
+          // 16-bit half
+          storeHalfLE(dest_p + (x * 2), 0.25f * (halfToFloat(loadU16LE(src_row0_p + (src_x0 * 2))) + halfToFloat(loadU16LE(src_row0_p + (src_x1 * 2))) + halfToFloat(loadU16LE(src_row1_p + (src_x0 * 2))) + halfToFloat(loadU16LE(src_row1_p + (src_x1 * 2)))));
+        }
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// encode one row of tiles in place. The lines of the row are gathered into compression_buf1 tile by tile (each tile
+// line holds the B, G and R pixels of that line). Each tile is then compressed and copied back to the start of the
+// same lines, so the chunk data of the row is contiguous and never larger than the lines it came from
+//
+static int encodeEXRTileRow(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level, int tile_y) {
+  tile_level_t *exr_level;
+  int bytes_per_color=2;
+  size_t channel_bytes;
+  size_t row_bytes;
+  int tile_x;
+  int first_x;
+  int tile_width;
+  int tile_height;
+  int tile_data_size;
+  int y;
+  int channel;
+  unsigned char *row_p;
+  unsigned char *gather_p;
+  unsigned char *tile_p;
+  unsigned char *dest_p;
+  uint64_t compressed_data_size;
+  int tile;
+  int z_return;
+
+  exr_level=&bsr_state->exr_levels[level];
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_color=4;
+  }
+  channel_bytes=(size_t)bytes_per_color * (size_t)exr_level->width;
+  row_bytes=3 * channel_bytes;
+  row_p=getEXRLevelBuf(bsr_state, level) + ((size_t)tile_y * (size_t)bsr_config->exr_tile_size * row_bytes);
+  tile_height=exr_level->height - (tile_y * bsr_config->exr_tile_size);
+  if (tile_height > bsr_config->exr_tile_size) {
+    tile_height=bsr_config->exr_tile_size;
+  }
+
+  // gather tiles
+  gather_p=bsr_state->compression_buf1;
+  for (tile_x=0; tile_x < exr_level->tiles_x; tile_x++) {
+    first_x=tile_x * bsr_config->exr_tile_size;
+    tile_width=exr_level->width - first_x;
+    if (tile_width > bsr_config->exr_tile_size) {
+      tile_width=bsr_config->exr_tile_size;
+    }
+    for (y=0; y < tile_height; y++) {
+      for (channel=0; channel < 3; channel++) {
+        memcpy(gather_p, row_p + ((size_t)y * row_bytes) + ((size_t)channel * channel_bytes) + ((size_t)first_x * (size_t)bytes_per_color), ((size_t)tile_width * (size_t)bytes_per_color));
+        gather_p+=((size_t)tile_width * (size_t)bytes_per_color);
+      }
+    }
+  }
+
+  // uncompressed tiles are stored as gathered
+  if ((bsr_config->exr_compression != 2) && (bsr_config->exr_compression != 3)) {
+    memcpy(row_p, bsr_state->compression_buf1, (size_t)tile_height * row_bytes);
+    return(0);
+  }
+
+#ifdef BSR_USE_EXR
+  //
+  // compress each tile, keeping the smaller of compressed or uncompressed data
+  //
+  tile_p=bsr_state->compression_buf1;
+  dest_p=row_p;
+  for (tile_x=0; tile_x < exr_level->tiles_x; tile_x++) {
+    first_x=tile_x * bsr_config->exr_tile_size;
+    tile_width=exr_level->width - first_x;
+    if (tile_width > bsr_config->exr_tile_size) {
+      tile_width=bsr_config->exr_tile_size;
+    }
+    tile_data_size=3 * bytes_per_color * tile_width * tile_height;
+    tile=exr_level->first_tile + (tile_y * exr_level->tiles_x) + tile_x;
+    z_return=deflateEXRBlock(tile_p, tile_data_size, bsr_state->compression_buf2, bsr_state->compression_buf2 + tile_data_size, &compressed_data_size);
+    if ((z_return == Z_OK) && ((int)compressed_data_size < tile_data_size)) {
+      memcpy(dest_p, bsr_state->compression_buf2 + tile_data_size, (size_t)compressed_data_size);
+      bsr_state->compressed_sizes[tile]=(int)compressed_data_size;
+    } else {
+      // Z_BUF_ERROR just means the tile does not compress
+      if ((z_return != Z_OK) && (z_return != Z_BUF_ERROR) && (bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+        printf("Warning, deflate compression failed for level: %d, tile_x: %d, tile_y: %d\n", level, tile_x, tile_y);
+        fflush(stdout);
+      }
+      memmove(dest_p, tile_p, (size_t)tile_data_size);
+      bsr_state->compressed_sizes[tile]=tile_data_size;
+    }
+    dest_p+=bsr_state->compressed_sizes[tile];
+    tile_p+=tile_data_size;
+  }
+#endif // BSR_USE_EXR
+
+  return(0);
+}
+
+//
+// all threads: build mipmap levels and encode all rows of tiles. Tasks are claimed from the band scheduler:
+// first the mipmap bands of each level in order, each waiting only for the bands of the previous level it reads,
+// then the rows of tiles, which wait until all levels are complete because encoding overwrites pixels in place
+//
+static int encodeEXRTiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int task;
+  int num_tasks;
+  int level;
+  int band;
+  int src_band;
+  int tile_y;
+  int first_src_y;
+  int last_src_y;
+  tile_level_t *exr_level;
+
+  num_tasks=bsr_state->exr_num_bands + bsr_state->exr_num_tile_rows;
+  for (task=claimBandTask(bsr_state); task < num_tasks; task=claimBandTask(bsr_state)) {
+    if (task < bsr_state->exr_num_bands) {
+      //
+      // mipmap band
+      //
+      level=bsr_state->exr_num_levels - 1;
+      while (bsr_state->exr_levels[level].first_band > task) {
+        level--;
+      }
+      exr_level=&bsr_state->exr_levels[level];
+      band=task - exr_level->first_band;
+      if (level > 1) {
+        // wait for the lines of the previous level this band reads
+        first_src_y=2 * band * BSR_BAND_LINES;
+        last_src_y=(2 * (((band + 1) * BSR_BAND_LINES) - 1)) + 1;
+        if (last_src_y >= bsr_state->exr_levels[level - 1].height) {
+          last_src_y=bsr_state->exr_levels[level - 1].height - 1;
+        }
+        src_band=bsr_state->exr_levels[level - 1].first_band;
+        waitForLevelBands(bsr_state, src_band + (first_src_y / BSR_BAND_LINES), src_band + (last_src_y / BSR_BAND_LINES));
+      }
+      reduceEXRBand(bsr_config, bsr_state, level, band);
+      setLevelBandDone(bsr_state, task);
+    } else {
+      //
+      // row of tiles
+      //
+      if (bsr_state->exr_num_bands > 0) {
+        waitForLevelBands(bsr_state, 0, bsr_state->exr_num_bands - 1);
+      }
+      getEXRTileRow(bsr_state, (task - bsr_state->exr_num_bands), &level, &tile_y);
+      encodeEXRTileRow(bsr_config, bsr_state, level, tile_y);
+    }
+  }
+
+  return(0);
+}
+
+//
+// write offset table entries for rows of tiles first_row to last_row - 1 (in file order), the first chunk begins at
+// chunk_offset. Entries are written at file_offset, or sequentially if file_offset is negative
+//
+static int outputEXRTileOffsetTable(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd, int64_t file_offset, int first_row, int last_row, uint64_t chunk_offset) {
+  int level;
+  int tile_x;
+  int tile_y;
+  int row;
+  int num_tiles=0;
+  unsigned char *offset_table;
+  unsigned char *offset_table_p;
+  uint64_t offset;
+  struct iovec iov;
+  int result;
+  const uint64_t chunk_header_size=20ul; // 20 bytes: tile x, tile y, level x, level y + pixel_data_size
+
+  for (row=first_row; row < last_row; row++) {
+    getEXRTileRow(bsr_state, row, &level, &tile_y);
+    num_tiles+=bsr_state->exr_levels[level].tiles_x;
+  }
+  if (num_tiles == 0) {
+    return(0);
+  }
+  offset_table=(unsigned char *)malloc((size_t)num_tiles * 8);
+  if (offset_table == NULL) {
+    return(1);
+  }
+
+  // build entries for this range of tiles
+  offset=chunk_offset;
+  offset_table_p=offset_table;
+  for (row=first_row; row < last_row; row++) {
+    getEXRTileRow(bsr_state, row, &level, &tile_y);
+    for (tile_x=0; tile_x < bsr_state->exr_levels[level].tiles_x; tile_x++) {
+      storeU64LE(offset_table_p, offset);
+      offset_table_p+=8;
+      offset+=(chunk_header_size + getEXRTileDataSize(bsr_config, bsr_state, level, tile_x, tile_y));
+    }
+  }
+
+  iov.iov_base=offset_table;
+  iov.iov_len=(size_t)num_tiles * 8;
+  result=writeVector(fd, &iov, 1, file_offset);
+  free(offset_table);
+
+  return(result);
+}
+
+//
+// write chunks for rows of tiles first_row to last_row - 1 (in file order) straight from the encoded rows.
+// Chunks are written at file_offset, or sequentially if file_offset is negative
+//
+static int outputEXRTileChunks(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd, int64_t file_offset, int first_row, int last_row) {
+  int bytes_per_pixel=6;
+  int level;
+  int tile_x;
+  int tile_y;
+  int row;
+  uint64_t data_size;
+  uint64_t batch_size;
+  unsigned char chunk_headers[BSR_EXR_WRITE_BATCH][20];
+  struct iovec iov[2 * BSR_EXR_WRITE_BATCH];
+  int chunk;
+  unsigned char *data_p;
+
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  }
+
+  chunk=0;
+  batch_size=0;
+  for (row=first_row; row < last_row; row++) {
+    getEXRTileRow(bsr_state, row, &level, &tile_y);
+    data_p=getEXRLevelBuf(bsr_state, level) + ((size_t)tile_y * (size_t)bsr_config->exr_tile_size * (size_t)bytes_per_pixel * (size_t)bsr_state->exr_levels[level].width);
+    for (tile_x=0; tile_x < bsr_state->exr_levels[level].tiles_x; tile_x++) {
+      // tile coordinates, level and pixel data size
+      data_size=getEXRTileDataSize(bsr_config, bsr_state, level, tile_x, tile_y);
+      storeI32LE(chunk_headers[chunk], tile_x);
+      storeI32LE(&chunk_headers[chunk][4], tile_y);
+      storeI32LE(&chunk_headers[chunk][8], level);
+      storeI32LE(&chunk_headers[chunk][12], level);
+      storeI32LE(&chunk_headers[chunk][16], (int32_t)data_size);
+      iov[2 * chunk].iov_base=chunk_headers[chunk];
+      iov[2 * chunk].iov_len=20;
+
+      // pixel data
+      iov[(2 * chunk) + 1].iov_base=data_p;
+      iov[(2 * chunk) + 1].iov_len=(size_t)data_size;
+      data_p+=data_size;
+      batch_size+=(20 + data_size);
+      chunk++;
+
+      // write a full batch or the last one
+      if ((chunk == BSR_EXR_WRITE_BATCH) || (((row + 1) == last_row) && ((tile_x + 1) == bsr_state->exr_levels[level].tiles_x))) {
+        if (file_offset >= 0) {
+          if (writeVector(fd, iov, (2 * chunk), file_offset) != 0) {
+            return(1);
+          }
+          file_offset+=(int64_t)batch_size;
+        } else if (writeOutputVector(fd, iov, (2 * chunk), &bsr_state->splice_buf) != 0) {
+          return(1);
+        }
+        chunk=0;
+        batch_size=0;
+      }
+    }
+  } // end for row
+
+  return(0);
+}
+
+//
+// rows of tiles written by one thread: each thread writes the rows that start within its equal share of the
+// chunk bytes. Returns the total size of all chunks, section_offset is relative to the first chunk
+//
+static uint64_t getEXRTileSection(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int thread_id, int *first_row, int *last_row, int *first_tile, uint64_t *section_offset) {
+  int num_threads;
+  int row;
+  int owner;
+  int level;
+  int tile_y;
+  int num_tiles=0;
+  uint64_t total_size=0;
+  uint64_t row_offset;
+
+  num_threads=bsr_state->num_worker_threads + 1;
+  for (row=0; row < bsr_state->exr_num_tile_rows; row++) {
+    total_size+=getEXRTileRowSize(bsr_config, bsr_state, row);
+  }
+
+  *first_row=bsr_state->exr_num_tile_rows;
+  *last_row=bsr_state->exr_num_tile_rows;
+  *first_tile=bsr_state->exr_num_tiles;
+  *section_offset=total_size;
+  row_offset=0;
+  for (row=0; row < bsr_state->exr_num_tile_rows; row++) {
+    owner=(int)((row_offset * (uint64_t)num_threads) / total_size);
+    if ((owner >= thread_id) && (*first_row == bsr_state->exr_num_tile_rows)) {
+      *first_row=row;
+      *first_tile=num_tiles;
+      *section_offset=row_offset;
+    }
+    if (owner > thread_id) {
+      *last_row=row;
+      break;
+    }
+    row_offset+=getEXRTileRowSize(bsr_config, bsr_state, row);
+    getEXRTileRow(bsr_state, row, &level, &tile_y);
+    num_tiles+=bsr_state->exr_levels[level].tiles_x;
+  }
+  if (*last_row < *first_row) {
+    *last_row=*first_row;
+  }
+
+  return(total_size);
+}
+
 int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   FILE *output_file=NULL;
   struct timespec starttime;
@@ -471,6 +1144,19 @@ int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   int i;
   int header_size;
   int lines_per_block=1;
+  int lines_per_thread;
+  int offset_table_records;
+  int first_y;
+  int last_y;
+  uint64_t chunk_start;
+  uint64_t section_offset;
+  uint64_t file_size;
+  int fd;
+  struct stat fd_stat;
+  int result=0;
+  int first_row;
+  int last_row;
+  int first_tile;
 
   //
   // main thread: display status update if not in CGI mode
@@ -489,6 +1175,9 @@ int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
   } else {
     // main thread
+    if (bsr_state->exr_num_levels > 0) {
+      initBandSchedule(bsr_state);
+    }
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
       bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
     }
@@ -497,7 +1186,10 @@ int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   //
   // all threads: optionally compress pixel data
   //
-  if (bsr_config->exr_compression == 2) {
+  if (bsr_state->exr_num_levels > 0) {
+    // tiled, build mipmap levels and encode tiles
+    encodeEXRTiles(bsr_config, bsr_state);
+  } else if (bsr_config->exr_compression == 2) {
     // deflate, 1 line per block
     lines_per_block=1;
     compressEXRDeflate(bsr_config, bsr_state, lines_per_block);
@@ -507,15 +1199,97 @@ int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     compressEXRDeflate(bsr_config, bsr_state, lines_per_block);
   }
 
+  //
+  // all threads: size of this thread's section of the file
+  //
+  if (bsr_state->exr_num_levels == 0) {
+    sumEXRSection(bsr_config, bsr_state, lines_per_block);
+  }
+
   //
   // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
-  // main thread: wait until all other threads are done and then signal that they can continue to next step.
+  // main thread: wait until all other threads are done, write header and then signal that they can continue to next step.
   //
   if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
     bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
     waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_BEGIN);
   } else {
     waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+
+    if (bsr_state->exr_num_levels > 0) {
+      offset_table_records=bsr_state->exr_num_tiles;
+    } else {
+      offset_table_records=(bsr_state->current_image_res_y + lines_per_block - 1) / lines_per_block;
+    }
+    //
+    // main thread opens the output. Only regular files can be written at offsets, stdout in CGI mode and
+    // pipes or terminals are written in order by the main thread
+    //
+    bsr_state->exr_sequential=1;
+    if (bsr_config->cgi_mode == 1) {
+      fd=STDOUT_FILENO;
+    } else {
+      output_file=fopen(bsr_config->output_file_name, "wb");
+      if (output_file == NULL) {
+        printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+        fflush(stdout);
+        exit(1);
+      }
+      fd=fileno(output_file);
+      if ((fstat(fd, &fd_stat) == 0) && S_ISREG(fd_stat.st_mode)) {
+        bsr_state->exr_sequential=0;
+      }
+    }
+    if (bsr_state->exr_sequential == 1) {
+      //
+      // sequential output: main thread writes header, offset table and chunks
+      //
+      if (bsr_config->cgi_mode == 1) {
+        header_size=outputEXRHeader(bsr_config, bsr_state, NULL);
+        fflush(stdout);
+      } else {
+        header_size=outputEXRHeader(bsr_config, bsr_state, output_file);
+        fflush(output_file);
+      }
+      chunk_start=(uint64_t)header_size + ((uint64_t)offset_table_records * 8ul);
+      if (bsr_state->exr_num_levels > 0) {
+        result=outputEXRTileOffsetTable(bsr_config, bsr_state, fd, -1, 0, bsr_state->exr_num_tile_rows, chunk_start);
+        if (result == 0) {
+          result=outputEXRTileChunks(bsr_config, bsr_state, fd, -1, 0, bsr_state->exr_num_tile_rows);
+        }
+      } else {
+        result=outputEXROffsetTable(bsr_config, bsr_state, fd, -1, lines_per_block, 0, bsr_state->current_image_res_y, chunk_start);
+        if (result == 0) {
+          result=outputEXRChunks(bsr_config, bsr_state, fd, -1, lines_per_block, 0, bsr_state->current_image_res_y);
+        }
+      }
+      if (result != 0) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not write %s\n", bsr_config->output_file_name);
+          fflush(stdout);
+        }
+        exit(1);
+      }
+    } else {
+      //
+      // regular file: main thread writes header and reserves space for the whole file so each thread can write
+      // its own section
+      //
+      header_size=outputEXRHeader(bsr_config, bsr_state, output_file);
+      fflush(output_file);
+      bsr_state->exr_header_size=header_size;
+      file_size=(uint64_t)header_size + ((uint64_t)offset_table_records * 8ul);
+      if (bsr_state->exr_num_levels > 0) {
+        file_size+=getEXRTileSection(bsr_config, bsr_state, 0, &first_row, &last_row, &first_tile, &section_offset);
+      } else {
+        for (i=0; i <= bsr_state->num_worker_threads; i++) {
+          file_size+=bsr_state->exr_section_sizes[i];
+        }
+      }
+      // not all filesystems support fallocate(), sections are written correctly without it
+      fallocate(fileno(output_file), 0, 0, (off_t)file_size);
+    }
+
     // ready to continue, set all worker thread status to continue
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
       bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_BEGIN;
@@ -523,27 +1297,58 @@ int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   } // end if not main thread
 
   //
-  // main thread: output EXR image to file or stdout 
+  // all threads: write offset table entries and chunks for this thread's section directly to the file. Section
+  // offsets are the sum of the sizes of all sections before it
   //
-  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
-    if (bsr_config->cgi_mode != 1) {
-      output_file=fopen(bsr_config->output_file_name, "wb");
-      if (output_file == NULL) {
+  if (bsr_state->exr_sequential == 0) {
+    if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+      fd=fileno(output_file);
+    } else {
+      fd=open(bsr_config->output_file_name, O_WRONLY);
+      if (fd == -1) {
         printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
         fflush(stdout);
         exit(1);
       }
-    } // end if not cgi_mode
-
-    // output file components
-    header_size=outputEXRHeader(bsr_config, bsr_state, output_file);
-    outputEXROffsetTable(bsr_config, bsr_state, output_file, header_size, lines_per_block);
-    outputEXRChunks(bsr_config, bsr_state, output_file, lines_per_block);
-
-    if (bsr_config->cgi_mode != 1) {
-      fclose(output_file);
     }
-  } // end if main thread
+    if (bsr_state->exr_num_levels > 0) {
+      // tiled, this thread's rows of tiles
+      getEXRTileSection(bsr_config, bsr_state, bsr_state->perthread->my_thread_id, &first_row, &last_row, &first_tile, &section_offset);
+      section_offset+=((uint64_t)bsr_state->exr_header_size + ((uint64_t)bsr_state->exr_num_tiles * 8ul));
+      if (first_row < last_row) {
+        if ((outputEXRTileOffsetTable(bsr_config, bsr_state, fd, (int64_t)bsr_state->exr_header_size + ((int64_t)first_tile * 8), first_row, last_row, section_offset) != 0)
+         || (outputEXRTileChunks(bsr_config, bsr_state, fd, (int64_t)section_offset, first_row, last_row) != 0)) {
+          printf("Error: could not write %s\n", bsr_config->output_file_name);
+          fflush(stdout);
+          exit(1);
+        }
+      }
+    } else {
+      // scanlines, this thread's lines
+      lines_per_thread=getEXRLinesPerThread(bsr_state, lines_per_block);
+      first_y=bsr_state->perthread->my_thread_id * lines_per_thread;
+      last_y=first_y + lines_per_thread;
+      if (last_y > bsr_state->current_image_res_y) {
+        last_y=bsr_state->current_image_res_y;
+      }
+      offset_table_records=(bsr_state->current_image_res_y + lines_per_block - 1) / lines_per_block;
+      section_offset=(uint64_t)bsr_state->exr_header_size + ((uint64_t)offset_table_records * 8ul);
+      for (i=0; i < bsr_state->perthread->my_thread_id; i++) {
+        section_offset+=bsr_state->exr_section_sizes[i];
+      }
+      if (first_y < last_y) {
+        if ((outputEXROffsetTable(bsr_config, bsr_state, fd, (int64_t)bsr_state->exr_header_size + ((int64_t)(first_y / lines_per_block) * 8), lines_per_block, first_y, last_y, section_offset) != 0)
+         || (outputEXRChunks(bsr_config, bsr_state, fd, (int64_t)section_offset, lines_per_block, first_y, last_y) != 0)) {
+          printf("Error: could not write %s\n", bsr_config->output_file_name);
+          fflush(stdout);
+          exit(1);
+        }
+      }
+    }
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      close(fd);
+    }
+  } // end if not sequential
 
   //
   // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
@@ -564,15 +1369,15 @@ int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   // main thread: display status message and close output file if not CGI mode
   //
   if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1)) {
+    // close output file
+    fclose(output_file);
+
     if (bsr_config->print_status == 1) {
       clock_gettime(CLOCK_REALTIME, &endtime);
       elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
       printf(" (%.3fs)\n", elapsed_time);
       fflush(stdout);
     }
-
-    // close output file
-    fclose(output_file);
   }
 
   return(0);
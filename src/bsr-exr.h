@@ -82,6 +82,23 @@ typedef enum
     EXR_STORAGE_LAST_TYPE      /**< Invalid value, provided for range checking. */
 } exr_storage_t;
 
+/** Enum representing what type of tile information is contained. */
+typedef enum
+{
+    EXR_TILE_ONE_LEVEL     = 0, /**< Single level of image data. */
+    EXR_TILE_MIPMAP_LEVELS = 1, /**< Mipmapped image data. */
+    EXR_TILE_RIPMAP_LEVELS = 2, /**< Ripmapped image data. */
+    EXR_TILE_LAST_TYPE          /**< Guard / out of range type. */
+} exr_tile_level_mode_t;
+
+/** Enum representing how to scale positions between levels. */
+typedef enum
+{
+    EXR_TILE_ROUND_DOWN = 0,
+    EXR_TILE_ROUND_UP   = 1,
+    EXR_TILE_ROUND_LAST_TYPE
+} exr_tile_round_mode_t;
+
 /** @brief Enum capturing the underlying data type on a channel. */
 typedef enum
 {
@@ -103,6 +120,11 @@ typedef enum
     EXR_PERCEPTUALLY_LINEAR   = 1
 } exr_perceptual_treatment_t;
 
+int outputEXRHeader(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file);
+int outputEXROffsetTable(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd, int64_t file_offset, int lines_per_block, int first_y, int last_y, uint64_t chunk_offset);
+int getEXRLinesPerBlock(bsr_config_t *bsr_config);
+int encodeEXRStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band);
+int setEXRLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_res_x, int output_res_y);
 int outputEXR(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_EXR_H
@@ -0,0 +1,838 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+//
+// AVIF and HEIF grid images: the output image is cut into fixed size tiles that are encoded independently as
+// single images by all threads. The coded data and item properties of each tile are taken from its single image
+// file and the main thread writes one file with a 'grid' derived image item referencing all tiles
+//
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "util.h"
+#include "bsr-grid.h"
+#include "bsr-output.h"
+
+//
+// choose tile size and grid dimensions for output image. Tiles are limited to BSR_GRID_MAX_TILES columns and rows,
+// an image that fits in one tile is encoded as a single image
+//
+int setGridLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_res_x, int output_res_y) {
+  int tile_width;
+  int tile_height;
+  int min_size;
+
+  bsr_state->grid_num_tiles=0;
+  bsr_state->grid_tile_width=0;
+  bsr_state->grid_tile_height=0;
+  bsr_state->grid_columns=0;
+  bsr_state->grid_rows=0;
+  if (((bsr_config->image_format != 3) && (bsr_config->image_format != 4)) || (bsr_config->grid_tile_size == 0) || (bsr_config->deep_zoom != 0)) {
+    return(0);
+  }
+  if ((output_res_x <= bsr_config->grid_tile_size) && (output_res_y <= bsr_config->grid_tile_size)) {
+    return(0);
+  }
+  // HEIF tiles are 4:2:0 and MIAF requires an even grid size for subsampled chroma
+  if ((bsr_config->image_format == 4) && (((output_res_x & 1) != 0) || ((output_res_y & 1) != 0))) {
+    return(0);
+  }
+
+  //
+  // tile dimensions are even (4:2:0 chroma subsampling) and no larger than the image rounded up to a multiple of 8
+  //
+  tile_width=bsr_config->grid_tile_size;
+  min_size=(((output_res_x + BSR_GRID_MAX_TILES - 1) / BSR_GRID_MAX_TILES) + 7) & ~7;
+  if (tile_width < min_size) {
+    tile_width=min_size;
+  }
+  if (tile_width > ((output_res_x + 7) & ~7)) {
+    tile_width=(output_res_x + 7) & ~7;
+  }
+  if (tile_width < BSR_GRID_MIN_TILE_SIZE) {
+    tile_width=BSR_GRID_MIN_TILE_SIZE;
+  }
+  tile_height=bsr_config->grid_tile_size;
+  min_size=(((output_res_y + BSR_GRID_MAX_TILES - 1) / BSR_GRID_MAX_TILES) + 7) & ~7;
+  if (tile_height < min_size) {
+    tile_height=min_size;
+  }
+  if (tile_height > ((output_res_y + 7) & ~7)) {
+    tile_height=(output_res_y + 7) & ~7;
+  }
+  if (tile_height < BSR_GRID_MIN_TILE_SIZE) {
+    tile_height=BSR_GRID_MIN_TILE_SIZE;
+  }
+
+  bsr_state->grid_tile_width=tile_width;
+  bsr_state->grid_tile_height=tile_height;
+  bsr_state->grid_columns=(output_res_x + tile_width - 1) / tile_width;
+  bsr_state->grid_rows=(output_res_y + tile_height - 1) / tile_height;
+  bsr_state->grid_num_tiles=bsr_state->grid_columns * bsr_state->grid_rows;
+
+  return(0);
+}
+
+//
+// pixels of tile inside the output image, tiles in the last column and row are cropped by the grid output size
+//
+int getGridTileRect(bsr_state_t *bsr_state, int tile, int *tile_x, int *tile_y, int *tile_width, int *tile_height) {
+  *tile_x=(tile % bsr_state->grid_columns) * bsr_state->grid_tile_width;
+  *tile_y=(tile / bsr_state->grid_columns) * bsr_state->grid_tile_height;
+  *tile_width=bsr_state->grid_tile_width;
+  if ((*tile_x + *tile_width) > bsr_state->current_image_res_x) {
+    *tile_width=bsr_state->current_image_res_x - *tile_x;
+  }
+  *tile_height=bsr_state->grid_tile_height;
+  if ((*tile_y + *tile_height) > bsr_state->current_image_res_y) {
+    *tile_height=bsr_state->current_image_res_y - *tile_y;
+  }
+
+  return(0);
+}
+
+//
+// copy full size tile to dest, repeating the last column and row of the image into the part outside of the image
+//
+int copyGridTilePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int tile, unsigned char *dest, size_t dest_row_bytes) {
+  int tile_x;
+  int tile_y;
+  int tile_width;
+  int tile_height;
+  int bytes_per_pixel;
+  int x;
+  int y;
+  unsigned char *dest_p;
+  unsigned char *src_p;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  getGridTileRect(bsr_state, tile, &tile_x, &tile_y, &tile_width, &tile_height);
+  for (y=0; y < bsr_state->grid_tile_height; y++) {
+    dest_p=dest + ((size_t)y * dest_row_bytes);
+    if (y < tile_height) {
+      src_p=bsr_state->row_pointers[tile_y + y] + ((size_t)tile_x * (size_t)bytes_per_pixel);
+      memcpy(dest_p, src_p, (size_t)tile_width * (size_t)bytes_per_pixel);
+      src_p=dest_p + ((size_t)(tile_width - 1) * (size_t)bytes_per_pixel);
+      for (x=tile_width; x < bsr_state->grid_tile_width; x++) {
+        memcpy(dest_p + ((size_t)x * (size_t)bytes_per_pixel), src_p, bytes_per_pixel);
+      }
+    } else {
+      memcpy(dest_p, dest + ((size_t)(tile_height - 1) * dest_row_bytes), (size_t)bsr_state->grid_tile_width * (size_t)bytes_per_pixel);
+    }
+  }
+
+  return(0);
+}
+
+//
+// find first box of type in buffer, returns 1 if not found or malformed
+//
+static int findGridBox(unsigned char *buf, size_t buf_size, char *type, unsigned char **box, size_t *box_size, size_t *header_size) {
+  size_t pos=0;
+  uint64_t size;
+  size_t header;
+
+  while ((pos + 8) <= buf_size) {
+    size=loadU32BE(buf + pos);
+    header=8;
+    if (size == 1) {
+      if ((pos + 16) > buf_size) {
+        return(1);
+      }
+      size=loadU64BE(buf + pos + 8);
+      header=16;
+    } else if (size == 0) {
+      size=buf_size - pos;
+    }
+    if ((size < header) || (size > (buf_size - pos))) {
+      return(1);
+    }
+    if (memcmp(buf + pos + 4, type, 4) == 0) {
+      *box=buf + pos;
+      *box_size=(size_t)size;
+      *header_size=header;
+      return(0);
+    }
+    pos+=(size_t)size;
+  }
+
+  return(1);
+}
+
+//
+// read big-endian unsigned integer of size bytes (0, 4 or 8) from iloc box
+//
+static uint64_t loadGridField(unsigned char *src, int size) {
+  if (size == 4) {
+    return((uint64_t)loadU32BE(src));
+  } else if (size == 8) {
+    return(loadU64BE(src));
+  }
+  return(0);
+}
+
+//
+// all threads: take coded data and item properties of the primary item from a tile's single image file.
+// Coded data is appended to tile_buf (this thread's tiles in encoding order), properties are stored in grid_tiles
+//
+int addGridTile(bsr_state_t *bsr_state, int tile, unsigned char *file, size_t file_size, unsigned char **tile_buf, size_t *tile_buf_size, size_t *tile_buf_used) {
+  grid_tile_t *grid_tile;
+  unsigned char *meta;
+  unsigned char *box;
+  unsigned char *ipco;
+  unsigned char *p;
+  unsigned char *end;
+  unsigned char *new_buf;
+  size_t meta_size;
+  size_t box_size;
+  size_t ipco_size;
+  size_t header_size;
+  size_t meta_header_size;
+  size_t ipco_header_size;
+  size_t data_size=0;
+  size_t data_start;
+  uint64_t extent_offset;
+  uint64_t extent_length;
+  uint64_t base_offset;
+  uint32_t primary_id;
+  uint32_t item_id;
+  int version;
+  int flags;
+  int offset_size;
+  int length_size;
+  int base_offset_size;
+  int index_size;
+  int construction_method;
+  int item_count;
+  int extent_count;
+  int association_count;
+  int property_index;
+  int essential;
+  int found=0;
+  int i;
+  int j;
+  int k;
+
+  grid_tile=&bsr_state->grid_tiles[tile];
+  grid_tile->data_size=SIZE_MAX;
+  grid_tile->properties_size=0;
+  grid_tile->num_properties=0;
+
+  if (findGridBox(file, file_size, "meta", &meta, &meta_size, &meta_header_size) != 0) {
+    return(1);
+  }
+  // meta is a full box, children follow version and flags
+  meta+=meta_header_size + 4;
+  meta_size-=meta_header_size + 4;
+
+  //
+  // primary item ID
+  //
+  if (findGridBox(meta, meta_size, "pitm", &box, &box_size, &header_size) != 0) {
+    return(1);
+  }
+  p=box + header_size;
+  if (p[0] == 0) {
+    primary_id=loadU16BE(p + 4);
+  } else {
+    primary_id=loadU32BE(p + 4);
+  }
+
+  //
+  // coded data extents of primary item, file offsets only (construction_method 0)
+  //
+  if (findGridBox(meta, meta_size, "iloc", &box, &box_size, &header_size) != 0) {
+    return(1);
+  }
+  p=box + header_size;
+  end=box + box_size;
+  version=p[0];
+  offset_size=p[4] >> 4;
+  length_size=p[4] & 15;
+  base_offset_size=p[5] >> 4;
+  if ((version == 1) || (version == 2)) {
+    index_size=p[5] & 15;
+  } else {
+    index_size=0;
+  }
+  p+=6;
+  if (version < 2) {
+    item_count=loadU16BE(p);
+    p+=2;
+  } else {
+    item_count=(int)loadU32BE(p);
+    p+=4;
+  }
+  data_start=*tile_buf_used;
+  for (i=0; (i < item_count) && (p < end); i++) {
+    if (version < 2) {
+      item_id=loadU16BE(p);
+      p+=2;
+    } else {
+      item_id=loadU32BE(p);
+      p+=4;
+    }
+    construction_method=0;
+    if ((version == 1) || (version == 2)) {
+      construction_method=loadU16BE(p) & 15;
+      p+=2;
+    }
+    // skip data_reference_index, must be 0 (this file)
+    if (loadU16BE(p) != 0) {
+      construction_method=-1;
+    }
+    p+=2;
+    base_offset=loadGridField(p, base_offset_size);
+    p+=base_offset_size;
+    extent_count=loadU16BE(p);
+    p+=2;
+    for (j=0; (j < extent_count) && (p < end); j++) {
+      p+=index_size;
+      extent_offset=loadGridField(p, offset_size);
+      p+=offset_size;
+      extent_length=loadGridField(p, length_size);
+      p+=length_size;
+      if (item_id == primary_id) {
+        if ((construction_method != 0) || (extent_length == 0) || ((base_offset + extent_offset) > file_size) || (extent_length > (file_size - (base_offset + extent_offset)))) {
+          *tile_buf_used=data_start;
+          return(1);
+        }
+        if ((*tile_buf_used + (size_t)extent_length) > *tile_buf_size) {
+          box_size=(*tile_buf_size * 2) + (size_t)extent_length;
+          new_buf=(unsigned char *)realloc(*tile_buf, box_size);
+          if (new_buf == NULL) {
+            *tile_buf_used=data_start;
+            return(1);
+          }
+          *tile_buf=new_buf;
+          *tile_buf_size=box_size;
+        }
+        memcpy(*tile_buf + *tile_buf_used, file + base_offset + extent_offset, (size_t)extent_length);
+        *tile_buf_used+=(size_t)extent_length;
+        data_size+=(size_t)extent_length;
+        found=1;
+      }
+    }
+  }
+  if (found == 0) {
+    return(1);
+  }
+
+  //
+  // item properties associated with primary item
+  //
+  if ((findGridBox(meta, meta_size, "iprp", &box, &box_size, &header_size) != 0)\
+      || (findGridBox(box + header_size, box_size - header_size, "ipco", &ipco, &ipco_size, &ipco_header_size) != 0)\
+      || (findGridBox(box + header_size, box_size - header_size, "ipma", &box, &box_size, &header_size) != 0)) {
+    *tile_buf_used=data_start;
+    return(1);
+  }
+  p=box + header_size;
+  end=box + box_size;
+  version=p[0];
+  flags=p[3];
+  item_count=(int)loadU32BE(p + 4);
+  p+=8;
+  found=0;
+  for (i=0; (i < item_count) && (p < end) && (found == 0); i++) {
+    if (version < 1) {
+      item_id=loadU16BE(p);
+      p+=2;
+    } else {
+      item_id=loadU32BE(p);
+      p+=4;
+    }
+    association_count=p[0];
+    p++;
+    for (j=0; j < association_count; j++) {
+      if ((flags & 1) == 1) {
+        essential=p[0] >> 7;
+        property_index=loadU16BE(p) & 0x7FFF;
+        p+=2;
+      } else {
+        essential=p[0] >> 7;
+        property_index=p[0] & 0x7F;
+        p++;
+      }
+      if ((item_id != primary_id) || (property_index == 0)) {
+        continue;
+      }
+      // find property box in ipco, index starts at 1
+      box=ipco + ipco_header_size;
+      for (k=1; k < property_index; k++) {
+        if (((box + 8) > (ipco + ipco_size)) || (loadU32BE(box) < 8)) {
+          break;
+        }
+        box+=loadU32BE(box);
+      }
+      if (((box + 8) > (ipco + ipco_size)) || (loadU32BE(box) < 8) || ((box + loadU32BE(box)) > (ipco + ipco_size))) {
+        *tile_buf_used=data_start;
+        return(1);
+      }
+      box_size=loadU32BE(box);
+      if (memcmp(box + 4, "ispe", 4) == 0) {
+        // tile size, checked against grid layout
+        if ((loadU32BE(box + 12) != (uint32_t)bsr_state->grid_tile_width) || (loadU32BE(box + 16) != (uint32_t)bsr_state->grid_tile_height)) {
+          *tile_buf_used=data_start;
+          return(1);
+        }
+        continue;
+      }
+      if ((grid_tile->num_properties >= BSR_GRID_MAX_PROPERTIES) || ((grid_tile->properties_size + box_size) > BSR_GRID_MAX_PROPERTY_SIZE)) {
+        *tile_buf_used=data_start;
+        return(1);
+      }
+      memcpy(grid_tile->properties + grid_tile->properties_size, box, box_size);
+      grid_tile->properties_size+=box_size;
+      grid_tile->essential[grid_tile->num_properties]=(unsigned char)essential;
+      grid_tile->num_properties++;
+    }
+    if (item_id == primary_id) {
+      found=1;
+    }
+  }
+  if (grid_tile->num_properties == 0) {
+    *tile_buf_used=data_start;
+    return(1);
+  }
+
+  grid_tile->data_size=data_size;
+
+  return(0);
+}
+
+//
+// all threads: grid is usable if all tiles were encoded with the same item properties and each tile's coded data
+// fits in its own pixels in image_output_buf
+//
+int checkGridTiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  grid_tile_t *first_tile;
+  grid_tile_t *grid_tile;
+  int bytes_per_pixel;
+  int tile_x;
+  int tile_y;
+  int tile_width;
+  int tile_height;
+  int tile;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  first_tile=&bsr_state->grid_tiles[0];
+  for (tile=0; tile < bsr_state->grid_num_tiles; tile++) {
+    grid_tile=&bsr_state->grid_tiles[tile];
+    getGridTileRect(bsr_state, tile, &tile_x, &tile_y, &tile_width, &tile_height);
+    if ((grid_tile->data_size == SIZE_MAX)\
+        || (grid_tile->data_size > ((size_t)tile_width * (size_t)tile_height * (size_t)bytes_per_pixel))\
+        || (grid_tile->num_properties != first_tile->num_properties)\
+        || (grid_tile->properties_size != first_tile->properties_size)\
+        || (memcmp(grid_tile->essential, first_tile->essential, (size_t)first_tile->num_properties) != 0)\
+        || (memcmp(grid_tile->properties, first_tile->properties, first_tile->properties_size) != 0)) {
+      return(0);
+    }
+  }
+
+  return(1);
+}
+
+//
+// all threads: copy this thread's coded tiles over their own pixels, filling each row of the tile in turn
+//
+int storeGridTiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state, unsigned char *tile_buf) {
+  int bytes_per_pixel;
+  int tile_x;
+  int tile_y;
+  int tile_width;
+  int tile_height;
+  int tile;
+  int y;
+  size_t row_bytes;
+  size_t remaining;
+  unsigned char *src_p;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  src_p=tile_buf;
+  for (tile=bsr_state->perthread->my_thread_id; tile < bsr_state->grid_num_tiles; tile+=(bsr_state->num_worker_threads + 1)) {
+    getGridTileRect(bsr_state, tile, &tile_x, &tile_y, &tile_width, &tile_height);
+    row_bytes=(size_t)tile_width * (size_t)bytes_per_pixel;
+    remaining=bsr_state->grid_tiles[tile].data_size;
+    for (y=tile_y; remaining > 0; y++) {
+      if (remaining < row_bytes) {
+        row_bytes=remaining;
+      }
+      memcpy(bsr_state->row_pointers[y] + ((size_t)tile_x * (size_t)bytes_per_pixel), src_p, row_bytes);
+      src_p+=row_bytes;
+      remaining-=row_bytes;
+    }
+  }
+
+  return(0);
+}
+
+//
+// main thread: write grid image file. Item 1 is the grid, items 2.. are the tiles in raster order. Tiles share the
+// item properties of tile 0 and the grid item gets its colr and pixi properties
+//
+int outputGridImage(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file, char *major_brand, char *compatible_brands, char *item_type) {
+  grid_tile_t *first_tile=&bsr_state->grid_tiles[0];
+  unsigned char *meta;
+  unsigned char *p;
+  unsigned char *property;
+  unsigned char grid_associations[BSR_GRID_MAX_PROPERTIES];
+  unsigned char header[32];
+  struct iovec iov[BSR_OUTPUT_WRITE_BATCH];
+  size_t ftyp_size;
+  size_t meta_size;
+  size_t iloc_size;
+  size_t iinf_size;
+  size_t iref_size;
+  size_t ipco_size;
+  size_t ipma_size;
+  size_t mdat_header_size;
+  size_t grid_data_size;
+  size_t payload_size;
+  size_t offset;
+  size_t row_bytes;
+  size_t remaining;
+  int num_items;
+  int num_grid_associations=0;
+  int offset_size;
+  int bytes_per_pixel;
+  int tile_x;
+  int tile_y;
+  int tile_width;
+  int tile_height;
+  int tile;
+  int i;
+  int y;
+  int fd;
+  int num_iov=0;
+
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+  num_items=bsr_state->grid_num_tiles + 1;
+
+  //
+  // grid item gets properties 1 (ispe for output size) and the colr and pixi properties of the tiles
+  //
+  grid_associations[num_grid_associations]=1;
+  num_grid_associations++;
+  property=first_tile->properties;
+  for (i=0; i < first_tile->num_properties; i++) {
+    if ((memcmp(property + 4, "colr", 4) == 0) || (memcmp(property + 4, "pixi", 4) == 0)) {
+      grid_associations[num_grid_associations]=(unsigned char)(i + 3);
+      num_grid_associations++;
+    }
+    property+=loadU32BE(property);
+  }
+
+  //
+  // sizes of boxes, offsets are 64-bit if the file is larger than 4GB
+  //
+  if ((bsr_state->current_image_res_x > 65535) || (bsr_state->current_image_res_y > 65535)) {
+    grid_data_size=12;
+  } else {
+    grid_data_size=8;
+  }
+  payload_size=grid_data_size;
+  for (tile=0; tile < bsr_state->grid_num_tiles; tile++) {
+    payload_size+=bsr_state->grid_tiles[tile].data_size;
+  }
+  if ((payload_size + 8) > UINT32_MAX) {
+    mdat_header_size=16;
+  } else {
+    mdat_header_size=8;
+  }
+  ftyp_size=16 + strlen(compatible_brands);
+  iinf_size=14 + ((size_t)num_items * 21);
+  iref_size=12 + 12 + ((size_t)bsr_state->grid_num_tiles * 2);
+  ipco_size=8 + 40 + first_tile->properties_size;
+  ipma_size=16 + (3 + (size_t)num_grid_associations) + ((size_t)bsr_state->grid_num_tiles * (size_t)(4 + first_tile->num_properties));
+  offset_size=4;
+  iloc_size=16 + ((size_t)num_items * (size_t)(10 + offset_size));
+  meta_size=12 + 33 + 14 + iloc_size + iinf_size + iref_size + 8 + ipco_size + ipma_size;
+  if ((ftyp_size + meta_size + mdat_header_size + payload_size) > UINT32_MAX) {
+    offset_size=8;
+    iloc_size=16 + ((size_t)num_items * (size_t)(10 + offset_size));
+    meta_size=12 + 33 + 14 + iloc_size + iinf_size + iref_size + 8 + ipco_size + ipma_size;
+  }
+
+  meta=(unsigned char *)malloc(ftyp_size + meta_size);
+  if (meta == NULL) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for grid image header\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+  p=meta;
+
+  //
+  // ftyp
+  //
+  p+=storeU32BE(p, (uint32_t)ftyp_size);
+  memcpy(p, "ftyp", 4);
+  p+=4;
+  memcpy(p, major_brand, 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  memcpy(p, compatible_brands, strlen(compatible_brands));
+  p+=strlen(compatible_brands);
+
+  //
+  // meta, hdlr, pitm
+  //
+  p+=storeU32BE(p, (uint32_t)meta_size);
+  memcpy(p, "meta", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU32BE(p, 33);
+  memcpy(p, "hdlr", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU32BE(p, 0);
+  memcpy(p, "pict", 4);
+  p+=4;
+  memset(p, 0, 13);
+  p+=13;
+  p+=storeU32BE(p, 14);
+  memcpy(p, "pitm", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU16BE(p, 1);
+
+  //
+  // iloc, one extent per item in mdat
+  //
+  p+=storeU32BE(p, (uint32_t)iloc_size);
+  memcpy(p, "iloc", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU8(p, (unsigned char)((offset_size << 4) | 4));
+  p+=storeU8(p, 0);
+  p+=storeU16BE(p, (uint16_t)num_items);
+  offset=ftyp_size + meta_size + mdat_header_size;
+  for (i=0; i < num_items; i++) {
+    p+=storeU16BE(p, (uint16_t)(i + 1));
+    p+=storeU16BE(p, 0);
+    p+=storeU16BE(p, 1);
+    if (offset_size == 8) {
+      p+=storeU64BE(p, (uint64_t)offset);
+    } else {
+      p+=storeU32BE(p, (uint32_t)offset);
+    }
+    if (i == 0) {
+      p+=storeU32BE(p, (uint32_t)grid_data_size);
+      offset+=grid_data_size;
+    } else {
+      p+=storeU32BE(p, (uint32_t)bsr_state->grid_tiles[i - 1].data_size);
+      offset+=bsr_state->grid_tiles[i - 1].data_size;
+    }
+  }
+
+  //
+  // iinf, tiles are hidden items
+  //
+  p+=storeU32BE(p, (uint32_t)iinf_size);
+  memcpy(p, "iinf", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU16BE(p, (uint16_t)num_items);
+  for (i=0; i < num_items; i++) {
+    p+=storeU32BE(p, 21);
+    memcpy(p, "infe", 4);
+    p+=4;
+    if (i == 0) {
+      p+=storeU32BE(p, 0x02000000);
+    } else {
+      p+=storeU32BE(p, 0x02000001);
+    }
+    p+=storeU16BE(p, (uint16_t)(i + 1));
+    p+=storeU16BE(p, 0);
+    if (i == 0) {
+      memcpy(p, "grid", 4);
+    } else {
+      memcpy(p, item_type, 4);
+    }
+    p+=4;
+    p+=storeU8(p, 0);
+  }
+
+  //
+  // iref, grid item derived from tiles in raster order
+  //
+  p+=storeU32BE(p, (uint32_t)iref_size);
+  memcpy(p, "iref", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU32BE(p, (uint32_t)(iref_size - 12));
+  memcpy(p, "dimg", 4);
+  p+=4;
+  p+=storeU16BE(p, 1);
+  p+=storeU16BE(p, (uint16_t)bsr_state->grid_num_tiles);
+  for (i=0; i < bsr_state->grid_num_tiles; i++) {
+    p+=storeU16BE(p, (uint16_t)(i + 2));
+  }
+
+  //
+  // iprp: ipco with grid ispe, tile ispe and tile properties, then ipma
+  //
+  p+=storeU32BE(p, (uint32_t)(8 + ipco_size + ipma_size));
+  memcpy(p, "iprp", 4);
+  p+=4;
+  p+=storeU32BE(p, (uint32_t)ipco_size);
+  memcpy(p, "ipco", 4);
+  p+=4;
+  p+=storeU32BE(p, 20);
+  memcpy(p, "ispe", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU32BE(p, (uint32_t)bsr_state->current_image_res_x);
+  p+=storeU32BE(p, (uint32_t)bsr_state->current_image_res_y);
+  p+=storeU32BE(p, 20);
+  memcpy(p, "ispe", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU32BE(p, (uint32_t)bsr_state->grid_tile_width);
+  p+=storeU32BE(p, (uint32_t)bsr_state->grid_tile_height);
+  memcpy(p, first_tile->properties, first_tile->properties_size);
+  p+=first_tile->properties_size;
+  p+=storeU32BE(p, (uint32_t)ipma_size);
+  memcpy(p, "ipma", 4);
+  p+=4;
+  p+=storeU32BE(p, 0);
+  p+=storeU32BE(p, (uint32_t)num_items);
+  p+=storeU16BE(p, 1);
+  p+=storeU8(p, (unsigned char)num_grid_associations);
+  memcpy(p, grid_associations, (size_t)num_grid_associations);
+  p+=num_grid_associations;
+  for (tile=0; tile < bsr_state->grid_num_tiles; tile++) {
+    p+=storeU16BE(p, (uint16_t)(tile + 2));
+    p+=storeU8(p, (unsigned char)(first_tile->num_properties + 1));
+    p+=storeU8(p, 2);
+    for (i=0; i < first_tile->num_properties; i++) {
+      p+=storeU8(p, (unsigned char)((first_tile->essential[i] << 7) | (i + 3)));
+    }
+  }
+  fflush(output_file);
+  fd=fileno(output_file);
+  iov[0].iov_base=meta;
+  iov[0].iov_len=(size_t)(p - meta);
+  if (writeOutputVector(fd, iov, 1, NULL) != 0) {
+    free(meta);
+    return(1);
+  }
+  free(meta);
+
+  //
+  // mdat: grid descriptor then coded tiles gathered from their pixels in image_output_buf
+  //
+  p=header;
+  if (mdat_header_size == 16) {
+    p+=storeU32BE(p, 1);
+    memcpy(p, "mdat", 4);
+    p+=4;
+    p+=storeU64BE(p, (uint64_t)(mdat_header_size + payload_size));
+  } else {
+    p+=storeU32BE(p, (uint32_t)(mdat_header_size + payload_size));
+    memcpy(p, "mdat", 4);
+    p+=4;
+  }
+  p+=storeU8(p, 0);
+  if (grid_data_size == 12) {
+    p+=storeU8(p, 1);
+  } else {
+    p+=storeU8(p, 0);
+  }
+  p+=storeU8(p, (unsigned char)(bsr_state->grid_rows - 1));
+  p+=storeU8(p, (unsigned char)(bsr_state->grid_columns - 1));
+  if (grid_data_size == 12) {
+    p+=storeU32BE(p, (uint32_t)bsr_state->current_image_res_x);
+    p+=storeU32BE(p, (uint32_t)bsr_state->current_image_res_y);
+  } else {
+    p+=storeU16BE(p, (uint16_t)bsr_state->current_image_res_x);
+    p+=storeU16BE(p, (uint16_t)bsr_state->current_image_res_y);
+  }
+  iov[0].iov_base=header;
+  iov[0].iov_len=(size_t)(p - header);
+  if (writeOutputVector(fd, iov, 1, NULL) != 0) {
+    return(1);
+  }
+
+  // tile rows are gathered into batches of writev() calls
+  for (tile=0; tile < bsr_state->grid_num_tiles; tile++) {
+    getGridTileRect(bsr_state, tile, &tile_x, &tile_y, &tile_width, &tile_height);
+    row_bytes=(size_t)tile_width * (size_t)bytes_per_pixel;
+    remaining=bsr_state->grid_tiles[tile].data_size;
+    for (y=tile_y; remaining > 0; y++) {
+      if (remaining < row_bytes) {
+        row_bytes=remaining;
+      }
+      iov[num_iov].iov_base=bsr_state->row_pointers[y] + ((size_t)tile_x * (size_t)bytes_per_pixel);
+      iov[num_iov].iov_len=row_bytes;
+      num_iov++;
+      if (num_iov == BSR_OUTPUT_WRITE_BATCH) {
+        if (writeOutputVector(fd, iov, num_iov, &bsr_state->splice_buf) != 0) {
+          return(1);
+        }
+        num_iov=0;
+      }
+      remaining-=row_bytes;
+    }
+  }
+  if ((num_iov > 0) && (writeOutputVector(fd, iov, num_iov, &bsr_state->splice_buf) != 0)) {
+    return(1);
+  }
+
+  return(0);
+}
@@ -44,19 +44,109 @@
 #include "util.h"
 #include "cgi.h"
 #include "icc-profiles.h"
+#include "bsr-grid.h"
+#include "bsr-heif.h"
 
 #ifdef BSR_USE_HEIF
 #include <libheif/heif.h>
 #endif
 
-int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
-
 #ifdef BSR_USE_HEIF
 
-  FILE *output_file=NULL;
-  struct timespec starttime;
-  struct timespec endtime;
-  double elapsed_time;
+//
+// color profile signaled in the container
+//
+static void setHeifColorProfile(bsr_config_t *bsr_config, struct heif_color_profile_nclx *h_nclx) {
+  memset(h_nclx, 0, sizeof(struct heif_color_profile_nclx));
+  h_nclx->version=1;
+  h_nclx->full_range_flag=1;
+  if (bsr_config->color_profile == 0) {
+    // Linear transfer function
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_709_5;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_linear;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
+  } else if (bsr_config->color_profile == 2) {
+    // Display-P3
+    h_nclx->color_primaries=heif_color_primaries_SMPTE_EG_432_1;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_IEC_61966_2_4;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
+  } else if (bsr_config->color_profile == 3) {
+    // Rec. 2020
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_2020_2_and_2100_0;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_2020_2_10bit;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_2020_2_non_constant_luminance;
+  } else if (bsr_config->color_profile == 4) {
+    // Rec. 601 NTSC
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_601_6;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_601_6;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_601_6;
+  } else if (bsr_config->color_profile == 5) {
+    // Rec. 601 PAL
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_601_6;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_601_6;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_601_6;
+  } else if (bsr_config->color_profile == 6) {
+    // Rec. 709
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_709_5;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_709_5;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
+  } else if (bsr_config->color_profile == 8) {
+    // Rec. 2100 PQ
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_2020_2_and_2100_0;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_2100_0_PQ;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_SMPTE_ST_2085;
+  } else {
+    // default is sRGB
+    h_nclx->color_primaries=heif_color_primaries_ITU_R_BT_709_5;
+    h_nclx->transfer_characteristics=heif_transfer_characteristic_IEC_61966_2_4;
+    h_nclx->matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
+  }
+}
+
+//
+// create encoder with quality and speed settings. encoder_speed selects an x265 preset, 0 = placebo .. 9 = ultrafast
+//
+static struct heif_encoder *createHeifEncoder(bsr_config_t *bsr_config, struct heif_context *h_ctx, int single_thread) {
+  struct heif_encoder *h_encoder=NULL;
+  const char *x265_presets[11]={"placebo", "veryslow", "slower", "slow", "medium", "fast", "faster", "veryfast", "superfast", "ultrafast", "ultrafast"};
+
+  heif_context_get_encoder_for_format(h_ctx, heif_compression_HEVC, &h_encoder);
+  if (h_encoder == NULL) {
+    return(NULL);
+  }
+  heif_encoder_set_lossy_quality(h_encoder, bsr_config->compression_quality);
+  if (bsr_config->encoder_speed >= 0) {
+    heif_encoder_set_parameter_string(h_encoder, "preset", x265_presets[bsr_config->encoder_speed]);
+  }
+  if (single_thread == 1) {
+    // grid tiles are encoded in parallel by all threads, no x265 thread pool
+    heif_encoder_set_parameter_string(h_encoder, "x265:pools", "none");
+  }
+
+  return(h_encoder);
+}
+
+//
+// heif_writer callback for writing a tile's single image file to a memory stream
+//
+static struct heif_error writeHeifStream(struct heif_context *h_ctx, const void *data, size_t size, void *userdata) {
+  struct heif_error h_error;
+
+  h_error.code=heif_error_Ok;
+  h_error.subcode=heif_suberror_Unspecified;
+  h_error.message="Success";
+  if (fwrite(data, 1, size, (FILE *)userdata) != size) {
+    h_error.code=heif_error_Encoding_error;
+    h_error.message="Could not write to memory stream";
+  }
+
+  return(h_error);
+}
+
+//
+// main thread: encode whole image as a single image, x265 is multi-threaded internally
+//
+int outputHeifImage(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   struct heif_context *h_ctx;
   struct heif_encoder *h_encoder;
   struct heif_image *h_image;
@@ -64,37 +154,17 @@ int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   struct heif_error h_error;
   uint8_t *h_image_plane_p;
   int bytes_per_pixel=0;
-  size_t current_image_size;
+  int h_stride;
+  size_t row_bytes;
+  int y;
   struct heif_color_profile_nclx h_nclx;
   struct heif_image_handle *h_out_image_handle;
 
-  //
-  // display status update if not in CGI mode
-  //
-  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
-    clock_gettime(CLOCK_REALTIME, &starttime);
-    printf("Writing %s...", bsr_config->output_file_name);
-    fflush(stdout);
-  }
-
-  //
-  // if not CGI mode, open output file
-  //
-  if (bsr_config->cgi_mode != 1) {
-    output_file=fopen(bsr_config->output_file_name, "wb");
-    if (output_file == NULL) {
-      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
-      fflush(stdout);
-      exit(1);
-    }
-  }
-  
   //
   // initialize encoder
   //
   h_ctx=heif_context_alloc();
-  heif_context_get_encoder_for_format(h_ctx, heif_compression_HEVC, &h_encoder);
-  heif_encoder_set_lossy_quality(h_encoder, bsr_config->compression_quality);
+  h_encoder=createHeifEncoder(bsr_config, h_ctx, 0);
   if (bsr_config->bits_per_color == 8) {
     h_chroma=heif_chroma_interleaved_RGB;
   } else if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12)) {
@@ -118,47 +188,7 @@ int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   //
   // set color profile
   //
-  if (bsr_config->color_profile == 0) {
-    // Linear transfer function
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_709_5;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_linear;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
-  } else if (bsr_config->color_profile == 2) {
-    // Display-P3
-    h_nclx.color_primaries=heif_color_primaries_SMPTE_EG_432_1;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_IEC_61966_2_4;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
-  } else if (bsr_config->color_profile == 3) {
-    // Rec. 2020
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_2020_2_and_2100_0;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_2020_2_10bit;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_2020_2_non_constant_luminance;
-  } else if (bsr_config->color_profile == 4) {
-    // Rec. 601 NTSC
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_601_6;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_601_6;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_601_6;
-  } else if (bsr_config->color_profile == 5) {
-    // Rec. 601 PAL
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_601_6;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_601_6;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_601_6;
-  } else if (bsr_config->color_profile == 6) {
-    // Rec. 709
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_709_5;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_709_5;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
-  } else if (bsr_config->color_profile == 8) {
-    // Rec. 2100 PQ
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_2020_2_and_2100_0;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_ITU_R_BT_2100_0_PQ;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_SMPTE_ST_2085;
-  } else {
-    // default is sRGB
-    h_nclx.color_primaries=heif_color_primaries_ITU_R_BT_709_5;
-    h_nclx.transfer_characteristics=heif_transfer_characteristic_IEC_61966_2_4;
-    h_nclx.matrix_coefficients=heif_matrix_coefficients_ITU_R_BT_709_5;
-  }
+  setHeifColorProfile(bsr_config, &h_nclx);
   h_error=heif_image_set_nclx_color_profile(h_image, &h_nclx);
   if (h_error.code != heif_error_Ok) {
     if (bsr_config->cgi_mode != 1) {
@@ -173,7 +203,7 @@ int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   // Note to libheif maintainers: Why can't we just set a pointer to where the image data already is?
   // Having to needlessly allocate memory and copy a large (possibly > 1TB) image is sub-optimal
   //
-  h_image_plane_p=heif_image_get_plane(h_image, heif_channel_interleaved, NULL);
+  h_image_plane_p=heif_image_get_plane(h_image, heif_channel_interleaved, &h_stride);
   if (h_image_plane_p == NULL) {
     if (bsr_config->cgi_mode != 1) {
       printf("Error: heif_image_get_plane() returned NULL");
@@ -185,8 +215,11 @@ int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   } else if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12)) {
     bytes_per_pixel=6;
   }
-  current_image_size=(size_t)bytes_per_pixel * (size_t)bsr_state->current_image_res_x * (size_t)bsr_state->current_image_res_y;
-  memcpy(h_image_plane_p, bsr_state->image_output_buf, current_image_size);
+  // rows of the plane may be padded, copy one row at a time
+  row_bytes=(size_t)bytes_per_pixel * (size_t)bsr_state->current_image_res_x;
+  for (y=0; y < bsr_state->current_image_res_y; y++) {
+    memcpy(h_image_plane_p + ((size_t)y * (size_t)h_stride), bsr_state->image_output_buf + ((size_t)y * row_bytes), row_bytes);
+  }
 
   //
   // compress image
@@ -216,24 +249,235 @@ int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     exit(1);
   }
 
+  // clean up
+  heif_image_handle_release(h_out_image_handle);
+  heif_image_release(h_image);
+  heif_context_free(h_ctx);
+
+  return(0);
+}
+
+//
+// all threads: encode one grid tile as a single image file in memory with a single-threaded encoder, then keep its
+// coded data and item properties
+//
+int encodeHeifTile(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int tile, unsigned char **tile_buf, size_t *tile_buf_size, size_t *tile_buf_used) {
+  struct heif_context *h_ctx;
+  struct heif_encoder *h_encoder;
+  struct heif_image *h_image;
+  struct heif_image_handle *h_out_image_handle;
+  struct heif_writer h_writer;
+  struct heif_color_profile_nclx h_nclx;
+  struct heif_error h_error;
+  int h_chroma=heif_chroma_interleaved_RGB;
+  int h_stride;
+  uint8_t *h_image_plane_p;
+  FILE *stream;
+  char *stream_buf=NULL;
+  size_t stream_size=0;
+
+  bsr_state->grid_tiles[tile].data_size=SIZE_MAX;
+
+  h_ctx=heif_context_alloc();
+  if (h_ctx == NULL) {
+    return(1);
+  }
+  h_encoder=createHeifEncoder(bsr_config, h_ctx, 1);
+  if (h_encoder == NULL) {
+    heif_context_free(h_ctx);
+    return(1);
+  }
+  if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12)) {
+    h_chroma=heif_chroma_interleaved_RRGGBB_LE;
+  }
+  h_error=heif_image_create(bsr_state->grid_tile_width, bsr_state->grid_tile_height, heif_colorspace_RGB, h_chroma, &h_image);
+  if (h_error.code != heif_error_Ok) {
+    heif_encoder_release(h_encoder);
+    heif_context_free(h_ctx);
+    return(1);
+  }
+  h_error=heif_image_add_plane(h_image, heif_channel_interleaved, bsr_state->grid_tile_width, bsr_state->grid_tile_height, bsr_config->bits_per_color);
+  if (h_error.code == heif_error_Ok) {
+    setHeifColorProfile(bsr_config, &h_nclx);
+    h_error=heif_image_set_nclx_color_profile(h_image, &h_nclx);
+  }
+  if (h_error.code == heif_error_Ok) {
+    h_image_plane_p=heif_image_get_plane(h_image, heif_channel_interleaved, &h_stride);
+    if (h_image_plane_p == NULL) {
+      h_error.code=heif_error_Memory_allocation_error;
+    } else {
+      copyGridTilePixels(bsr_config, bsr_state, tile, h_image_plane_p, (size_t)h_stride);
+    }
+  }
+
   //
-  // display status message and close output file if not CGI mode
+  // compress tile and write single image file to memory stream
   //
-  if (bsr_config->cgi_mode != 1) {
-    if (bsr_config->print_status == 1) {
+  if (h_error.code == heif_error_Ok) {
+    h_error=heif_context_encode_image(h_ctx, h_image, h_encoder, NULL, &h_out_image_handle);
+    if (h_error.code == heif_error_Ok) {
+      heif_image_handle_release(h_out_image_handle);
+    }
+  }
+  if (h_error.code == heif_error_Ok) {
+    stream=open_memstream(&stream_buf, &stream_size);
+    if (stream != NULL) {
+      h_writer.writer_api_version=1;
+      h_writer.write=writeHeifStream;
+      h_error=heif_context_write(h_ctx, &h_writer, stream);
+      fclose(stream);
+      if (h_error.code == heif_error_Ok) {
+        addGridTile(bsr_state, tile, (unsigned char *)stream_buf, stream_size, tile_buf, tile_buf_size, tile_buf_used);
+      }
+      free(stream_buf);
+    }
+  }
+
+  // clean up
+  heif_image_release(h_image);
+  heif_encoder_release(h_encoder);
+  heif_context_free(h_ctx);
+
+  return(0);
+}
+
+#endif // BSR_USE_HEIF
+
+int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+
+#ifdef BSR_USE_HEIF
+
+  FILE *output_file=NULL;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  unsigned char *tile_buf=NULL;
+  size_t tile_buf_size=0;
+  size_t tile_buf_used=0;
+  int grid_ok=0;
+  int tile;
+  int i;
+
+  //
+  // without a grid the image is encoded by the main thread only
+  //
+  if ((bsr_state->grid_num_tiles == 0) && (bsr_state->perthread->my_pid != bsr_state->main_pid)) {
+    return(0);
+  }
+
+  //
+  // main thread: display status update if not in CGI mode
+  //
+  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Writing %s...", bsr_config->output_file_name);
+    fflush(stdout);
+  }
+
+  if (bsr_state->grid_num_tiles > 0) {
+    //
+    // worker threads:  wait for main thread to say go
+    // main thread: tell worker threads to go
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
+    } else {
+      // main thread
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: encode every (num_worker_threads + 1)th tile
+    //
+    for (tile=bsr_state->perthread->my_thread_id; tile < bsr_state->grid_num_tiles; tile+=(bsr_state->num_worker_threads + 1)) {
+      encodeHeifTile(bsr_config, bsr_state, tile, &tile_buf, &tile_buf_size, &tile_buf_used);
+    }
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done and then signal that they can continue to next step.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_BEGIN);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+      // ready to continue, set all worker thread status to continue
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: once no thread reads pixels any more, copy coded tiles over their own pixels in image_output_buf.
+    // If any tile failed or does not fit the image is encoded as a single image instead
+    //
+    grid_ok=checkGridTiles(bsr_config, bsr_state);
+    if (grid_ok == 1) {
+      storeGridTiles(bsr_config, bsr_state, tile_buf);
+    }
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done, write file and then signal that they can continue.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_OUTPUT_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_CONTINUE);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_COMPLETE);
+    }
+  } // end if grid_num_tiles
+
+  //
+  // main thread: output HEIF image to file
+  //
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if (grid_ok == 1) {
+      output_file=fopen(bsr_config->output_file_name, "wb");
+      if (output_file == NULL) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+          fflush(stdout);
+        }
+        exit(1);
+      }
+      if (outputGridImage(bsr_config, bsr_state, output_file, "heic", "mif1heic", "hvc1") != 0) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not write %s\n", bsr_config->output_file_name);
+          fflush(stdout);
+        }
+        exit(1);
+      }
+      fclose(output_file);
+    } else {
+      outputHeifImage(bsr_config, bsr_state);
+    }
+
+    // ready to continue, set all worker thread status to continue
+    if (bsr_state->grid_num_tiles > 0) {
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_CONTINUE;
+      }
+    }
+
+    //
+    // display status message if not CGI mode
+    //
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
       clock_gettime(CLOCK_REALTIME, &endtime);
       elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
       printf(" (%.3fs)\n", elapsed_time);
       fflush(stdout);
     }
+  } // end if main thread
 
-    // close output file
-//    fclose(output_file);
+  if (tile_buf != NULL) {
+    free(tile_buf);
   }
 
-  // clean up
-  heif_context_free(h_ctx);
-
 #endif // BSR_USE_HEIF
 
   return(0);
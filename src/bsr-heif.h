@@ -39,6 +39,8 @@
 #ifndef BSR_HEIF_H
 #define BSR_HEIF_H
 
+int outputHeifImage(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int encodeHeifTile(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int tile, unsigned char **tile_buf, size_t *tile_buf_size, size_t *tile_buf_used);
 int outputHeif(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_HEIF_H
@@ -39,116 +39,941 @@
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <math.h>
 #include "util.h"
 #include "cgi.h"
 #include "icc-profiles.h"
+#include "bsr-jpeg.h"
+#include "bsr-output.h"
 
 #ifdef BSR_USE_JPEG
 #include <jpeglib.h>
 #include <jerror.h>
 #endif
 
-int outputJpeg(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
-
 #ifdef BSR_USE_JPEG
 
-  FILE *output_file=NULL;
+//
+// set up jpeg_info for an image of image_width pixels and image_height lines
+//
+static void initJpegCompress(bsr_config_t *bsr_config, struct jpeg_compress_struct *jpeg_info, int image_width, int image_height) {
+  jpeg_info->image_width=image_width;
+  jpeg_info->image_height=image_height;
+  jpeg_info->input_components=3;
+  jpeg_info->in_color_space=JCS_RGB;
+  jpeg_set_defaults(jpeg_info);
+  jpeg_set_quality(jpeg_info, bsr_config->compression_quality, 1);
+}
+
+//
+// write ICC profile marker, must be called after jpeg_start_compress()
+//
+static void writeJpegColorProfile(bsr_config_t *bsr_config, struct jpeg_compress_struct *jpeg_info) {
+  if (bsr_config->color_profile == 2) {
+    // Display-P3
+    jpeg_write_icc_profile(jpeg_info, DisplayP3Compat_v4_icc, DisplayP3Compat_v4_icc_len);
+  } else if (bsr_config->color_profile == 3) {
+    // Rec. 2020
+    jpeg_write_icc_profile(jpeg_info, Rec2020Compat_v4_icc, Rec2020Compat_v4_icc_len);
+  } else if (bsr_config->color_profile == 4) {
+    // Rec. 601 NTSC
+    jpeg_write_icc_profile(jpeg_info, Rec601NTSC_v4_icc, Rec601NTSC_v4_icc_len);
+  } else if (bsr_config->color_profile == 5) {
+    // Rec. 601 PAL
+    jpeg_write_icc_profile(jpeg_info, Rec601PAL_v4_icc, Rec601PAL_v4_icc_len);
+  } else if (bsr_config->color_profile == 6) {
+    // Rec. 709
+    jpeg_write_icc_profile(jpeg_info, Rec709_v4_icc, Rec709_v4_icc_len);
+  } else if (bsr_config->color_profile == 8) {
+    // Rec. 2100 PQ
+    jpeg_write_icc_profile(jpeg_info, Rec2100PQ_v4_icc, Rec2100PQ_v4_icc_len);
+  } else {
+    // default is sRGB
+    jpeg_write_icc_profile(jpeg_info, sRGB_v4_icc, sRGB_v4_icc_len);
+  }
+}
+
+//
+// libjpeg destination manager that compresses straight into a growable output buffer (CGI mode)
+//
+typedef struct {
+  struct jpeg_destination_mgr pub;
+  output_buf_t *output_buf;
+} jpeg_output_dest_t;
+
+static void initJpegOutputBuf(j_compress_ptr jpeg_info) {
+  jpeg_output_dest_t *dest=(jpeg_output_dest_t *)jpeg_info->dest;
+
+  if (reserveOutputBuf(dest->output_buf, BSR_OUTPUT_BUF_SIZE) != 0) {
+    exit(1);
+  }
+  dest->pub.next_output_byte=dest->output_buf->data + dest->output_buf->size;
+  dest->pub.free_in_buffer=dest->output_buf->capacity - dest->output_buf->size;
+}
+
+static boolean emptyJpegOutputBuf(j_compress_ptr jpeg_info) {
+  jpeg_output_dest_t *dest=(jpeg_output_dest_t *)jpeg_info->dest;
+
+  // libjpeg filled all of the buffer, double it
+  dest->output_buf->size=dest->output_buf->capacity;
+  if (reserveOutputBuf(dest->output_buf, dest->output_buf->capacity) != 0) {
+    exit(1);
+  }
+  dest->pub.next_output_byte=dest->output_buf->data + dest->output_buf->size;
+  dest->pub.free_in_buffer=dest->output_buf->capacity - dest->output_buf->size;
+
+  return(TRUE);
+}
+
+static void termJpegOutputBuf(j_compress_ptr jpeg_info) {
+  jpeg_output_dest_t *dest=(jpeg_output_dest_t *)jpeg_info->dest;
+
+  dest->output_buf->size=dest->output_buf->capacity - dest->pub.free_in_buffer;
+}
+
+//
+// main thread: compress whole image with libjpeg. In CGI mode the file is compressed into a growable output
+// buffer first and passed to stdout by reference instead of through stdio
+//
+int outputJpegLibjpeg(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file) {
   struct jpeg_compress_struct jpeg_info;
   struct jpeg_error_mgr jpeg_err;
-  struct timespec starttime;
-  struct timespec endtime;
-  double elapsed_time;
+  jpeg_output_dest_t jpeg_dest;
+  output_buf_t jpeg_output={NULL, 0, 0};
+  struct iovec iov;
+  int result=0;
 
   //
-  // display status update if not in CGI mode
+  // initialize jpeg_info
   //
-  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
-    clock_gettime(CLOCK_REALTIME, &starttime);
-    printf("Writing %s...", bsr_config->output_file_name);
-    fflush(stdout);
+  jpeg_info.err=jpeg_std_error(&jpeg_err);
+  jpeg_create_compress(&jpeg_info);
+  if (bsr_config->cgi_mode == 1) {
+    jpeg_dest.pub.init_destination=initJpegOutputBuf;
+    jpeg_dest.pub.empty_output_buffer=emptyJpegOutputBuf;
+    jpeg_dest.pub.term_destination=termJpegOutputBuf;
+    jpeg_dest.output_buf=&jpeg_output;
+    jpeg_info.dest=&jpeg_dest.pub;
+  } else {
+    jpeg_stdio_dest(&jpeg_info, output_file);
   }
+  initJpegCompress(bsr_config, &jpeg_info, bsr_state->current_image_res_x, bsr_state->current_image_res_y);
+  jpeg_start_compress(&jpeg_info, 1);
 
   //
-  // if not CGI mode, open output file
+  // set color profile
   //
-  if (bsr_config->cgi_mode != 1) {
-    output_file=fopen(bsr_config->output_file_name, "wb");
-    if (output_file == NULL) {
-      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
-      fflush(stdout);
-      exit(1);
+  writeJpegColorProfile(bsr_config, &jpeg_info);
+
+  //
+  // compress and output jpeg
+  //
+  jpeg_write_scanlines(&jpeg_info, bsr_state->row_pointers, bsr_state->current_image_res_y);
+  jpeg_finish_compress(&jpeg_info);
+
+  // clean up libjpeg
+  jpeg_destroy_compress(&jpeg_info);
+
+  if (bsr_config->cgi_mode == 1) {
+    fflush(output_file);
+    iov.iov_base=jpeg_output.data;
+    iov.iov_len=jpeg_output.size;
+    result=writeOutputVector(fileno(output_file), &iov, 1, &bsr_state->splice_buf);
+    freeOutputBuf(&jpeg_output);
+  }
+
+  return(result);
+}
+
+//
+// lines per MCU row for the default libjpeg sampling factors (16 for 4:2:0)
+//
+int getJpegMCULines(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  struct jpeg_compress_struct jpeg_info;
+  struct jpeg_error_mgr jpeg_err;
+  int mcu_lines=DCTSIZE;
+  int i;
+
+  jpeg_info.err=jpeg_std_error(&jpeg_err);
+  jpeg_create_compress(&jpeg_info);
+  initJpegCompress(bsr_config, &jpeg_info, bsr_state->current_image_res_x, bsr_state->current_image_res_y);
+  for (i=0; i < jpeg_info.num_components; i++) {
+    if ((jpeg_info.comp_info[i].v_samp_factor * DCTSIZE) > mcu_lines) {
+      mcu_lines=jpeg_info.comp_info[i].v_samp_factor * DCTSIZE;
+    }
+  }
+  jpeg_destroy_compress(&jpeg_info);
+
+  return(mcu_lines);
+}
+
+//
+// build lookup table indexed by the next 16 bits of entropy-coded data, each entry is (code length << 8) | symbol
+//
+static void buildJpegLookup(JHUFF_TBL *table, uint16_t *lookup) {
+  int length;
+  int i;
+  int k=0;
+  int code=0;
+  int fill;
+  int first;
+  int j;
+
+  memset(lookup, 0, 65536 * sizeof(uint16_t));
+  for (length=1; length <= 16; length++) {
+    fill=1 << (16 - length);
+    for (i=0; i < table->bits[length]; i++) {
+      first=code << (16 - length);
+      for (j=0; j < fill; j++) {
+        lookup[first + j]=(uint16_t)((length << 8) | table->huffval[k]);
+      }
+      k++;
+      code++;
     }
+    code<<=1;
   }
-  
+}
+
+//
+// count Huffman symbols in the entropy-coded segment written by jpeg_info, decoded with its own tables.
+// Restart intervals end on byte boundaries followed by an RSTn marker, which are skipped
+//
+static int countJpegSymbols(struct jpeg_compress_struct *jpeg_info, unsigned char *scan, size_t scan_size, uint64_t symbol_counts[4][256]) {
+  uint16_t *lookup;
+  uint16_t *dc_lookup[2];
+  uint16_t *ac_lookup[2];
+  uint64_t acc=0;
+  int nbits=0;
+  int at_marker=0;
+  size_t pos=0;
+  long num_mcus;
+  long mcu;
+  int block;
+  int entry;
+  int symbol;
+  int size;
+  int run;
+  int k;
+  int i;
+  jpeg_component_info *component;
+
+  lookup=(uint16_t *)malloc(4 * 65536 * sizeof(uint16_t));
+  if (lookup == NULL) {
+    return(1);
+  }
+  for (i=0; i < 2; i++) {
+    dc_lookup[i]=lookup + ((size_t)i * 65536);
+    ac_lookup[i]=lookup + ((size_t)(i + 2) * 65536);
+    buildJpegLookup(jpeg_info->dc_huff_tbl_ptrs[i], dc_lookup[i]);
+    buildJpegLookup(jpeg_info->ac_huff_tbl_ptrs[i], ac_lookup[i]);
+  }
+
   //
-  // initialize jpeg_info
+  // top nbits of acc are valid, bytes are added until a marker is reached. 0xFF data bytes are followed by a stuffed 0x00
+  //
+#define BSR_JPEG_FILL_BITS() \
+  while ((nbits <= 56) && (at_marker == 0)) { \
+    if (pos >= scan_size) { \
+      at_marker=1; \
+    } else if (scan[pos] != 0xFF) { \
+      acc|=(uint64_t)scan[pos] << (56 - nbits); \
+      nbits+=8; \
+      pos++; \
+    } else if (((pos + 1) < scan_size) && (scan[pos + 1] == 0x00)) { \
+      acc|=(uint64_t)0xFF << (56 - nbits); \
+      nbits+=8; \
+      pos+=2; \
+    } else { \
+      at_marker=1; \
+    } \
+  }
+#define BSR_JPEG_SKIP_BITS(n) \
+  if ((n) > nbits) { \
+    free(lookup); \
+    return(1); \
+  } \
+  acc<<=(n); \
+  nbits-=(n);
+#define BSR_JPEG_DECODE(table) \
+  BSR_JPEG_FILL_BITS(); \
+  entry=(table)[acc >> 48]; \
+  if (entry == 0) { \
+    free(lookup); \
+    return(1); \
+  } \
+  symbol=entry & 0xFF; \
+  BSR_JPEG_SKIP_BITS(entry >> 8);
+
+  num_mcus=(long)jpeg_info->MCUs_per_row * (long)jpeg_info->MCU_rows_in_scan;
+  for (mcu=0; mcu < num_mcus; mcu++) {
+    if ((jpeg_info->restart_interval > 0) && (mcu > 0) && ((mcu % jpeg_info->restart_interval) == 0)) {
+      // remaining bits are padding, skip RSTn marker
+      if ((nbits >= 8) || (pos + 2 > scan_size) || (scan[pos] != 0xFF) || ((scan[pos + 1] & 0xF8) != 0xD0)) {
+        free(lookup);
+        return(1);
+      }
+      acc=0;
+      nbits=0;
+      at_marker=0;
+      pos+=2;
+    }
+    for (block=0; block < jpeg_info->blocks_in_MCU; block++) {
+      component=jpeg_info->cur_comp_info[jpeg_info->MCU_membership[block]];
+      // DC coefficient: size category followed by size bits
+      BSR_JPEG_DECODE(dc_lookup[component->dc_tbl_no]);
+      symbol_counts[component->dc_tbl_no][symbol]++;
+      BSR_JPEG_FILL_BITS();
+      BSR_JPEG_SKIP_BITS(symbol);
+      // AC coefficients: (run << 4) | size symbols until end of block
+      for (k=1; k < DCTSIZE2; k++) {
+        BSR_JPEG_DECODE(ac_lookup[component->ac_tbl_no]);
+        symbol_counts[component->ac_tbl_no + 2][symbol]++;
+        run=symbol >> 4;
+        size=symbol & 15;
+        if (size != 0) {
+          k+=run;
+          BSR_JPEG_SKIP_BITS(size);
+        } else if (run == 15) {
+          k+=15;
+        } else {
+          break;
+        }
+      }
+    }
+  }
+#undef BSR_JPEG_FILL_BITS
+#undef BSR_JPEG_SKIP_BITS
+#undef BSR_JPEG_DECODE
+
+  free(lookup);
+
+  return(0);
+}
+
+//
+// generate optimal Huffman code lengths limited to 16 bits from symbol counts (JPEG Annex K.2, same as libjpeg's
+// optimize_coding). A reserved symbol with count 1 ensures no code is all 1 bits
+//
+int buildJpegHuffmanTable(uint64_t *symbol_counts, unsigned char *bits, unsigned char *huffval) {
+  uint64_t freq[257];
+  int codesize[257];
+  int others[257];
+  int code_bits[33];
+  uint64_t v;
+  int c1;
+  int c2;
+  int i;
+  int j;
+  int p;
+
+  memcpy(freq, symbol_counts, 256 * sizeof(uint64_t));
+  freq[256]=1;
+  for (i=0; i < 257; i++) {
+    codesize[i]=0;
+    others[i]=-1;
+  }
+
+  //
+  // Huffman's algorithm, merging the two least frequent symbols until one tree remains
+  //
+  while (1) {
+    c1=-1;
+    v=UINT64_MAX;
+    for (i=0; i <= 256; i++) {
+      if ((freq[i] != 0) && (freq[i] <= v)) {
+        v=freq[i];
+        c1=i;
+      }
+    }
+    c2=-1;
+    v=UINT64_MAX;
+    for (i=0; i <= 256; i++) {
+      if ((freq[i] != 0) && (freq[i] <= v) && (i != c1)) {
+        v=freq[i];
+        c2=i;
+      }
+    }
+    if (c2 < 0) {
+      break;
+    }
+    freq[c1]+=freq[c2];
+    freq[c2]=0;
+    codesize[c1]++;
+    while (others[c1] >= 0) {
+      c1=others[c1];
+      codesize[c1]++;
+    }
+    others[c1]=c2;
+    codesize[c2]++;
+    while (others[c2] >= 0) {
+      c2=others[c2];
+      codesize[c2]++;
+    }
+  }
+
+  memset(code_bits, 0, sizeof(code_bits));
+  for (i=0; i <= 256; i++) {
+    if (codesize[i] > 32) {
+      return(1);
+    }
+    if (codesize[i] > 0) {
+      code_bits[codesize[i]]++;
+    }
+  }
+
+  //
+  // limit code lengths to 16 bits by moving pairs of longest codes up the tree
+  //
+  for (i=32; i > 16; i--) {
+    while (code_bits[i] > 0) {
+      j=i - 2;
+      while (code_bits[j] == 0) {
+        j--;
+      }
+      code_bits[i]-=2;
+      code_bits[i - 1]++;
+      code_bits[j + 1]+=2;
+      code_bits[j]--;
+    }
+  }
+  // remove reserved symbol from longest code length
+  while (code_bits[i] == 0) {
+    i--;
+  }
+  code_bits[i]--;
+
+  bits[0]=0;
+  for (i=1; i <= 16; i++) {
+    bits[i]=(unsigned char)code_bits[i];
+  }
+  p=0;
+  for (i=1; i <= 32; i++) {
+    for (j=0; j <= 255; j++) {
+      if (codesize[j] == i) {
+        huffval[p]=(unsigned char)j;
+        p++;
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// encode lines first_line to end_line (rows[0] is first_line) with one restart interval per MCU row into *strip_buf
+// (malloc'ed by libjpeg). The entropy-coded data starts at *header_size, restart markers are renumbered for the
+// lines' position in the image and the trailing EOI is replaced with the restart marker preceding the next lines.
+// If huff_bits is not NULL those Huffman tables are used instead of the standard tables, if symbol_counts is not
+// NULL Huffman symbols are counted into it. Returns 1 if the encoded data could not be parsed
+//
+static int encodeJpegRows(bsr_config_t *bsr_config, int output_res_x, int output_res_y, int mcu_lines, int first_line, int end_line, JSAMPARRAY rows, uint64_t symbol_counts[4][256], unsigned char huff_bits[4][17], unsigned char huff_vals[4][256], unsigned char **strip_buf, size_t *header_size, size_t *scan_size) {
+  struct jpeg_compress_struct jpeg_info;
+  struct jpeg_error_mgr jpeg_err;
+  unsigned long strip_size=0;
+  int first_interval;
+  size_t pos;
+  size_t segment_size;
+  unsigned char *scan;
+  unsigned char *p;
+  int marker;
+  int i;
+
+  *header_size=0;
+  *scan_size=0;
+
+  //
+  // compress lines to memory
   //
   jpeg_info.err=jpeg_std_error(&jpeg_err);
   jpeg_create_compress(&jpeg_info);
-  if (bsr_config->cgi_mode == 1) {
-    jpeg_stdio_dest(&jpeg_info, stdout);
-  } else {
-    jpeg_stdio_dest(&jpeg_info, output_file);
+  jpeg_mem_dest(&jpeg_info, strip_buf, &strip_size);
+  initJpegCompress(bsr_config, &jpeg_info, output_res_x, (end_line - first_line));
+  jpeg_info.restart_in_rows=1;
+  if (huff_bits != NULL) {
+    for (i=0; i < 2; i++) {
+      memcpy(jpeg_info.dc_huff_tbl_ptrs[i]->bits, huff_bits[i], 17);
+      memcpy(jpeg_info.dc_huff_tbl_ptrs[i]->huffval, huff_vals[i], 256);
+      memcpy(jpeg_info.ac_huff_tbl_ptrs[i]->bits, huff_bits[i + 2], 17);
+      memcpy(jpeg_info.ac_huff_tbl_ptrs[i]->huffval, huff_vals[i + 2], 256);
+    }
   }
-  jpeg_info.image_width=bsr_state->current_image_res_x;
-  jpeg_info.image_height=bsr_state->current_image_res_y;
-  jpeg_info.input_components=3;
-  jpeg_info.in_color_space=JCS_RGB;
-  jpeg_set_defaults(&jpeg_info);
-  jpeg_set_quality(&jpeg_info, bsr_config->compression_quality, 1);
   jpeg_start_compress(&jpeg_info, 1);
+  if (first_line == 0) {
+    // only the header of the first lines is written to the output file
+    writeJpegColorProfile(bsr_config, &jpeg_info);
+  }
+  jpeg_write_scanlines(&jpeg_info, rows, (JDIMENSION)(end_line - first_line));
+  jpeg_finish_compress(&jpeg_info);
 
   //
-  // set color profile
+  // find start of entropy-coded data after SOS segment, set image height in SOF segment to full image
   //
-  if (bsr_config->color_profile == 2) {
-    // Display-P3
-    jpeg_write_icc_profile(&jpeg_info, DisplayP3Compat_v4_icc, DisplayP3Compat_v4_icc_len);
-  } else if (bsr_config->color_profile == 3) {
-    // Rec. 2020
-    jpeg_write_icc_profile(&jpeg_info, Rec2020Compat_v4_icc, Rec2020Compat_v4_icc_len);
-  } else if (bsr_config->color_profile == 4) {
-    // Rec. 601 NTSC
-    jpeg_write_icc_profile(&jpeg_info, Rec601NTSC_v4_icc, Rec601NTSC_v4_icc_len);
-  } else if (bsr_config->color_profile == 5) {
-    // Rec. 601 PAL
-    jpeg_write_icc_profile(&jpeg_info, Rec601PAL_v4_icc, Rec601PAL_v4_icc_len);
-  } else if (bsr_config->color_profile == 6) {
-    // Rec. 709
-    jpeg_write_icc_profile(&jpeg_info, Rec709_v4_icc, Rec709_v4_icc_len);
-  } else if (bsr_config->color_profile == 8) {
-    // Rec. 2100 PQ
-    jpeg_write_icc_profile(&jpeg_info, Rec2100PQ_v4_icc, Rec2100PQ_v4_icc_len);
-  } else {
-    // default is sRGB
-    jpeg_write_icc_profile(&jpeg_info, sRGB_v4_icc, sRGB_v4_icc_len);
+  p=*strip_buf;
+  pos=2;
+  while (((pos + 4) <= strip_size) && (p[pos] == 0xFF)) {
+    marker=p[pos + 1];
+    segment_size=((size_t)p[pos + 2] << 8) | (size_t)p[pos + 3];
+    if ((marker >= 0xC0) && (marker <= 0xC2)) {
+      p[pos + 5]=(unsigned char)((output_res_y >> 8) & 0xFF);
+      p[pos + 6]=(unsigned char)(output_res_y & 0xFF);
+    }
+    pos+=2 + segment_size;
+    if (marker == 0xDA) {
+      *header_size=pos;
+      break;
+    }
   }
+  if ((*header_size == 0) || ((*header_size + 2) > strip_size) || (p[strip_size - 2] != 0xFF) || (p[strip_size - 1] != 0xD9)) {
+    jpeg_destroy_compress(&jpeg_info);
+    return(1);
+  }
+  scan=p + *header_size;
+  *scan_size=strip_size - 2 - *header_size;
+
+  if (symbol_counts != NULL) {
+    if (countJpegSymbols(&jpeg_info, scan, *scan_size, symbol_counts) != 0) {
+      jpeg_destroy_compress(&jpeg_info);
+      return(1);
+    }
+  }
+  jpeg_destroy_compress(&jpeg_info);
 
   //
-  // compress and output jpeg
+  // renumber RSTn markers (n = restart interval number mod 8) for the lines' position in the image.
+  // 0xFF in entropy-coded data is always followed by a stuffed 0x00 or a marker
   //
-  jpeg_write_scanlines(&jpeg_info, bsr_state->row_pointers, bsr_state->current_image_res_y);
+  first_interval=first_line / mcu_lines;
+  if ((first_interval & 7) != 0) {
+    pos=0;
+    while (pos < *scan_size) {
+      p=(unsigned char *)memchr(scan + pos, 0xFF, *scan_size - pos);
+      if (p == NULL) {
+        break;
+      }
+      pos=(size_t)(p - scan) + 1;
+      if ((pos < *scan_size) && ((scan[pos] & 0xF8) == 0xD0)) {
+        scan[pos]=(unsigned char)(0xD0 | (((scan[pos] & 7) + first_interval) & 7));
+      }
+    }
+  }
+
+  //
+  // replace EOI with restart marker ending the last interval of these lines
+  //
+  if (end_line < output_res_y) {
+    scan[*scan_size]=0xFF;
+    scan[*scan_size + 1]=(unsigned char)(0xD0 | (((end_line / mcu_lines) - 1) & 7));
+    *scan_size+=2;
+  }
+
+  return(0);
+}
+
+//
+// all threads: encode this thread's strip of MCU rows into *strip_buf with encodeJpegRows(). If count_symbols is set
+// Huffman symbols are counted into this thread's jpeg_strips entry
+//
+int encodeJpegStrip(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int mcu_lines, int count_symbols, unsigned char huff_bits[4][17], unsigned char huff_vals[4][256], unsigned char **strip_buf, size_t *header_size) {
+  int output_res_y;
+  int lines_per_thread;
+  int first_line;
+  int end_line;
+  size_t scan_size;
+  jpeg_strip_t *strip;
+
+  output_res_y=bsr_state->current_image_res_y;
+  lines_per_thread=(int)ceil(((double)output_res_y / (double)(bsr_state->num_worker_threads + 1)));
+  lines_per_thread=((lines_per_thread + mcu_lines - 1) / mcu_lines) * mcu_lines;
+  first_line=bsr_state->perthread->my_thread_id * lines_per_thread;
+  end_line=first_line + lines_per_thread;
+  if (end_line > output_res_y) {
+    end_line=output_res_y;
+  }
+
+  strip=&bsr_state->jpeg_strips[bsr_state->perthread->my_thread_id];
+  strip->compressed_size=0;
+  if (count_symbols == 1) {
+    memset(strip->symbol_counts, 0, sizeof(strip->symbol_counts));
+    strip->symbols_counted=0;
+  }
+  *header_size=0;
+  if (first_line >= end_line) {
+    if (count_symbols == 1) {
+      strip->symbols_counted=1;
+    }
+    return(0);
+  }
+
+  if (encodeJpegRows(bsr_config, bsr_state->current_image_res_x, output_res_y, mcu_lines, first_line, end_line, &bsr_state->row_pointers[first_line],\
+                     ((count_symbols == 1) ? strip->symbol_counts : NULL), huff_bits, huff_vals, strip_buf, header_size, &scan_size) != 0) {
+    strip->compressed_size=SIZE_MAX;
+    return(0);
+  }
+  if (count_symbols == 1) {
+    strip->symbols_counted=1;
+  }
+  strip->compressed_size=scan_size;
+
+  return(0);
+}
+
+//
+// main thread: write JPEG from the first strip's header and entropy-coded strips stored in place in image_output_buf.
+// Strips are written from there with writeOutputVector(), which passes them to a pipe by reference in CGI mode. The
+// header is freed by the caller so it is always copied
+//
+int outputJpegStrips(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int mcu_lines, unsigned char *header, size_t header_size, FILE *output_file) {
+  int output_res_y;
+  int lines_per_thread;
+  int first_line;
+  int thread_id;
+  int fd;
+  unsigned char eoi[2]={0xFF, 0xD9};
+  struct iovec iov;
+
+  output_res_y=bsr_state->current_image_res_y;
+  lines_per_thread=(int)ceil(((double)output_res_y / (double)(bsr_state->num_worker_threads + 1)));
+  lines_per_thread=((lines_per_thread + mcu_lines - 1) / mcu_lines) * mcu_lines;
+
+  fflush(output_file);
+  fd=fileno(output_file);
+  iov.iov_base=header;
+  iov.iov_len=header_size;
+  if (writeOutputVector(fd, &iov, 1, NULL) != 0) {
+    return(1);
+  }
+  for (thread_id=0; thread_id <= bsr_state->num_worker_threads; thread_id++) {
+    first_line=thread_id * lines_per_thread;
+    if (first_line >= output_res_y) {
+      break;
+    }
+    iov.iov_base=bsr_state->row_pointers[first_line];
+    iov.iov_len=bsr_state->jpeg_strips[thread_id].compressed_size;
+    if (writeOutputVector(fd, &iov, 1, &bsr_state->splice_buf) != 0) {
+      return(1);
+    }
+  }
+  iov.iov_base=eoi;
+  iov.iov_len=2;
+
+  return(writeOutputVector(fd, &iov, 1, NULL));
+}
+
+#endif // BSR_USE_JPEG
+
+//
+// all threads: encode one band of a streamed image from its ring slot in image_output_buf into its slot in
+// stream_out_buf with standard Huffman tables. The first band also includes the JPEG header
+//
+int encodeJpegStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band) {
+#ifdef BSR_USE_JPEG
+  int output_res_x;
+  int output_res_y;
+  int mcu_lines;
+  int first_line;
+  int end_line;
+  int slot;
+  int i;
+  unsigned char *strip_buf=NULL;
+  unsigned char *rows_p;
+  unsigned char *output_p;
+  size_t header_size;
+  size_t scan_size;
+  size_t output_size;
+  JSAMPROW *rows;
+  stream_slot_t *stream_slot;
+
+  output_res_x=bsr_state->current_image_res_x;
+  output_res_y=bsr_state->current_image_res_y;
+  mcu_lines=getJpegMCULines(bsr_config, bsr_state);
+  first_line=band * bsr_state->stream_band_lines;
+  end_line=first_line + bsr_state->stream_band_lines;
+  if (end_line > output_res_y) {
+    end_line=output_res_y;
+  }
+  slot=band % bsr_state->stream_num_slots;
+  stream_slot=&bsr_state->stream_slots[slot];
+  stream_slot->output_size=SIZE_MAX;
+
+  rows=(JSAMPROW *)malloc((size_t)(end_line - first_line) * sizeof(JSAMPROW));
+  if (rows == NULL) {
+    return(0);
+  }
+  rows_p=bsr_state->image_output_buf + ((size_t)slot * bsr_state->stream_slot_size) + ((size_t)bsr_state->stream_prefix_lines * (size_t)output_res_x * 3);
+  for (i=0; i < (end_line - first_line); i++) {
+    rows[i]=rows_p + ((size_t)i * (size_t)output_res_x * 3);
+  }
+
+  if (encodeJpegRows(bsr_config, output_res_x, output_res_y, mcu_lines, first_line, end_line, rows, NULL, NULL, NULL, &strip_buf, &header_size, &scan_size) == 0) {
+    // only the first band's header is written
+    if (band == 0) {
+      output_size=header_size + scan_size;
+      output_p=strip_buf;
+    } else {
+      output_size=scan_size;
+      output_p=strip_buf + header_size;
+    }
+    if (output_size <= bsr_state->stream_out_slot_size) {
+      memcpy(bsr_state->stream_out_buf + ((size_t)slot * bsr_state->stream_out_slot_size), output_p, output_size);
+      stream_slot->output_size=output_size;
+    }
+  }
+  free(rows);
+  free(strip_buf);
+#endif // BSR_USE_JPEG
+
+  return(0);
+}
+
+//
+// all threads: write one deep zoom tile as a complete JPEG file with libjpeg
+//
+int outputJpegTile(bsr_config_t *bsr_config, FILE *output_file, unsigned char *pixels, int width, int height) {
+#ifdef BSR_USE_JPEG
+  struct jpeg_compress_struct jpeg_info;
+  struct jpeg_error_mgr jpeg_err;
+  JSAMPROW row_pointer;
+
+  jpeg_info.err=jpeg_std_error(&jpeg_err);
+  jpeg_create_compress(&jpeg_info);
+  jpeg_stdio_dest(&jpeg_info, output_file);
+  initJpegCompress(bsr_config, &jpeg_info, width, height);
+  jpeg_start_compress(&jpeg_info, 1);
+  writeJpegColorProfile(bsr_config, &jpeg_info);
+  while (jpeg_info.next_scanline < jpeg_info.image_height) {
+    row_pointer=pixels + ((size_t)jpeg_info.next_scanline * (size_t)width * 3);
+    jpeg_write_scanlines(&jpeg_info, &row_pointer, 1);
+  }
   jpeg_finish_compress(&jpeg_info);
+  jpeg_destroy_compress(&jpeg_info);
+#endif // BSR_USE_JPEG
+
+  return(0);
+}
+
+int outputJpeg(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+
+#ifdef BSR_USE_JPEG
+
+  FILE *output_file=NULL;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  int i;
+  int j;
+  int thread_id;
+  int row_bytes;
+  int mcu_lines=0;
+  int lines_per_thread;
+  int first_line;
+  int end_line;
+  int strips_fit=1;
+  int result;
+  unsigned char *strip_buf=NULL;
+  size_t header_size=0;
+  uint64_t symbol_counts[256];
+  unsigned char huff_bits[4][17];
+  unsigned char huff_vals[4][256];
+
+  //
+  // main thread: display status update if not in CGI mode
+  //
+  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Writing %s...", bsr_config->output_file_name);
+    fflush(stdout);
+  }
+
+  if (bsr_config->jpeg_encoding > 0) {
+    //
+    // worker threads:  wait for main thread to say go
+    // main thread: tell worker threads to go
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
+    } else {
+      // main thread
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: encode this thread's strip with standard Huffman tables, counting symbols if optimizing
+    //
+    mcu_lines=getJpegMCULines(bsr_config, bsr_state);
+    if (bsr_config->jpeg_encoding == 2) {
+      encodeJpegStrip(bsr_config, bsr_state, mcu_lines, 1, NULL, NULL, &strip_buf, &header_size);
+    } else {
+      encodeJpegStrip(bsr_config, bsr_state, mcu_lines, 0, NULL, NULL, &strip_buf, &header_size);
+    }
+
+    if (bsr_config->jpeg_encoding == 2) {
+      //
+      // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+      // main thread: wait until all other threads are done and then signal that they can continue to next step.
+      //
+      if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+        bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+        waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_ENTROPY_BEGIN);
+      } else {
+        waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+        // ready to continue, set all worker thread status to continue
+        for (i=1; i <= bsr_state->num_worker_threads; i++) {
+          bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_ENTROPY_BEGIN;
+        }
+      } // end if not main thread
+
+      //
+      // all threads: build the same optimized Huffman tables from symbol counts of all strips and encode strip again
+      //
+      for (i=0; i < 4; i++) {
+        for (j=0; j < 256; j++) {
+          symbol_counts[j]=0;
+          for (thread_id=0; thread_id <= bsr_state->num_worker_threads; thread_id++) {
+            symbol_counts[j]+=bsr_state->jpeg_strips[thread_id].symbol_counts[i][j];
+          }
+        }
+        memset(huff_vals[i], 0, 256);
+        if (buildJpegHuffmanTable(symbol_counts, huff_bits[i], huff_vals[i]) != 0) {
+          strips_fit=0;
+        }
+      }
+      // compressed_size may already be overwritten by threads encoding their second pass
+      for (thread_id=0; thread_id <= bsr_state->num_worker_threads; thread_id++) {
+        if (bsr_state->jpeg_strips[thread_id].symbols_counted != 1) {
+          strips_fit=0;
+        }
+      }
+      free(strip_buf);
+      strip_buf=NULL;
+      header_size=0;
+      if (strips_fit == 1) {
+        encodeJpegStrip(bsr_config, bsr_state, mcu_lines, 0, huff_bits, huff_vals, &strip_buf, &header_size);
+      }
+
+      //
+      // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+      // main thread: wait until all other threads are done and then signal that they can continue to next step.
+      //
+      if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+        bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_ENTROPY_COMPLETE;
+        waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_BEGIN);
+      } else {
+        waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_ENTROPY_COMPLETE);
+        // ready to continue, set all worker thread status to continue
+        for (i=1; i <= bsr_state->num_worker_threads; i++) {
+          bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_BEGIN;
+        }
+      } // end if not main thread
+    } else {
+      //
+      // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+      // main thread: wait until all other threads are done and then signal that they can continue to next step.
+      //
+      if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+        bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+        waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_BEGIN);
+      } else {
+        waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+        // ready to continue, set all worker thread status to continue
+        for (i=1; i <= bsr_state->num_worker_threads; i++) {
+          bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_BEGIN;
+        }
+      } // end if not main thread
+    } // end if jpeg_encoding == 2
+
+    //
+    // all threads: once no thread reads pixels any more, copy entropy-coded strips over their own rows in
+    // image_output_buf. If any strip is larger than its rows the pixels are kept for libjpeg instead
+    //
+    row_bytes=3 * bsr_state->current_image_res_x;
+    lines_per_thread=(int)ceil(((double)bsr_state->current_image_res_y / (double)(bsr_state->num_worker_threads + 1)));
+    lines_per_thread=((lines_per_thread + mcu_lines - 1) / mcu_lines) * mcu_lines;
+    for (thread_id=0; thread_id <= bsr_state->num_worker_threads; thread_id++) {
+      first_line=thread_id * lines_per_thread;
+      end_line=first_line + lines_per_thread;
+      if (end_line > bsr_state->current_image_res_y) {
+        end_line=bsr_state->current_image_res_y;
+      }
+      if ((first_line < end_line) && (bsr_state->jpeg_strips[thread_id].compressed_size > ((size_t)(end_line - first_line) * (size_t)row_bytes))) {
+        strips_fit=0;
+      }
+    }
+    first_line=bsr_state->perthread->my_thread_id * lines_per_thread;
+    if ((strips_fit == 1) && (first_line < bsr_state->current_image_res_y)) {
+      memcpy(bsr_state->row_pointers[first_line], strip_buf + header_size, bsr_state->jpeg_strips[bsr_state->perthread->my_thread_id].compressed_size);
+    }
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done, write file and then signal that they can continue.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_OUTPUT_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_CONTINUE);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_COMPLETE);
+    }
+  } // end if jpeg_encoding
 
   //
-  // display status message and close output file if not CGI mode
+  // main thread: output JPEG image to file or stdout
   //
-  if (bsr_config->cgi_mode != 1) {
-    if (bsr_config->print_status == 1) {
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if (bsr_config->cgi_mode != 1) {
+      output_file=fopen(bsr_config->output_file_name, "wb");
+      if (output_file == NULL) {
+        printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+        fflush(stdout);
+        exit(1);
+      }
+    } else {
+      output_file=stdout;
+    }
+
+    if ((bsr_config->jpeg_encoding > 0) && (strips_fit == 1)) {
+      result=outputJpegStrips(bsr_config, bsr_state, mcu_lines, strip_buf, header_size, output_file);
+    } else {
+      result=outputJpegLibjpeg(bsr_config, bsr_state, output_file);
+    }
+    if (result != 0) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not write %s\n", bsr_config->output_file_name);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    if (bsr_config->cgi_mode != 1) {
+      fclose(output_file);
+    }
+
+    // ready to continue, set all worker thread status to continue
+    if (bsr_config->jpeg_encoding > 0) {
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_CONTINUE;
+      }
+    }
+
+    //
+    // display status message if not CGI mode
+    //
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
       clock_gettime(CLOCK_REALTIME, &endtime);
       elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
       printf(" (%.3fs)\n", elapsed_time);
       fflush(stdout);
     }
+  } // end if main thread
 
-    // close output file
-    fclose(output_file);
+  if (strip_buf != NULL) {
+    free(strip_buf);
   }
 
-  // clean up libjpeg
-  jpeg_destroy_compress(&jpeg_info);
-
 #endif // BSR_USE_JPEG
 
   return(0);
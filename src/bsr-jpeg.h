@@ -39,6 +39,13 @@
 #ifndef BSR_JPEG_H
 #define BSR_JPEG_H
 
+int outputJpegLibjpeg(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file);
+int getJpegMCULines(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int buildJpegHuffmanTable(uint64_t *symbol_counts, unsigned char *bits, unsigned char *huffval);
+int encodeJpegStrip(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int mcu_lines, int count_symbols, unsigned char huff_bits[4][17], unsigned char huff_vals[4][256], unsigned char **strip_buf, size_t *header_size);
+int encodeJpegStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band);
+int outputJpegStrips(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int mcu_lines, unsigned char *header, size_t header_size, FILE *output_file);
+int outputJpegTile(bsr_config_t *bsr_config, FILE *output_file, unsigned char *pixels, int width, int height);
 int outputJpeg(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_JPEG_H
@@ -0,0 +1,387 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <errno.h>
+#include "bsr-numa.h"
+
+//
+// NUMA support uses the raw mbind() system call and sysfs so bsrender does not depend on libnuma
+//
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+int parseCPUList(char *cpu_list, cpu_set_t *cpus, int *ids, int max_ids) {
+  char *list_p;
+  char *end_p;
+  long first;
+  long last;
+  long i;
+  int count=0;
+
+  //
+  // parse a sysfs cpu or node list such as "0-15,32-47" into a cpu_set_t and/or an array of ids
+  // returns number of entries found
+  //
+  list_p=cpu_list;
+  while (*list_p != 0) {
+    if ((*list_p < '0') || (*list_p > '9')) {
+      list_p++;
+      continue;
+    }
+    first=strtol(list_p, &end_p, 10);
+    last=first;
+    list_p=end_p;
+    if (*list_p == '-') {
+      list_p++;
+      last=strtol(list_p, &end_p, 10);
+      list_p=end_p;
+    }
+    for (i=first; i <= last; i++) {
+      if ((cpus != NULL) && (i < CPU_SETSIZE)) {
+        CPU_SET(i, cpus);
+      }
+      if ((ids != NULL) && (count < max_ids)) {
+        ids[count]=(int)i;
+      }
+      count++;
+    }
+  }
+
+  return(count);
+}
+
+int readSysfsList(char *file_name, char *list, int list_size) {
+  FILE *sysfs_file;
+  char *list_p;
+
+  list[0]=0;
+  sysfs_file=fopen(file_name, "r");
+  if (sysfs_file == NULL) {
+    return(0);
+  }
+  list_p=fgets(list, list_size, sysfs_file);
+  fclose(sysfs_file);
+  if (list_p == NULL) {
+    list[0]=0;
+    return(0);
+  }
+
+  return(1);
+}
+
+int initNUMA(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  char list[4096];
+  char file_name[256];
+  int node_count;
+  int i;
+
+  //
+  // discover online NUMA nodes and the cpus belonging to each one
+  // numa_nodes is left at 0 (disabled) if NUMA mode is off or this is a single-node host
+  //
+  bsr_state->numa_nodes=0;
+  if (bsr_config->numa_mode == 0) {
+    return(0);
+  }
+
+  readSysfsList("/sys/devices/system/node/online", list, 4096);
+  node_count=parseCPUList(list, NULL, bsr_state->numa_node_id, BSR_MAX_NUMA_NODES);
+  if (node_count > BSR_MAX_NUMA_NODES) {
+    node_count=BSR_MAX_NUMA_NODES;
+  }
+  if (node_count < 2) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: NUMA mode requested but only one NUMA node found, NUMA mode disabled\n");
+      fflush(stdout);
+    }
+    return(0);
+  }
+
+  for (i=0; i < node_count; i++) {
+    // node ids index the fixed size node mask in bindNUMAMemory(), sparse ids (GPU or CXL memory nodes) may not fit
+    if ((bsr_state->numa_node_id[i] < 0) || (bsr_state->numa_node_id[i] >= BSR_MAX_NUMA_NODES)) {
+      if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+        printf("Warning: NUMA node %d is above the supported maximum id of %d, NUMA mode disabled\n", bsr_state->numa_node_id[i], (BSR_MAX_NUMA_NODES - 1));
+        fflush(stdout);
+      }
+      return(0);
+    }
+    CPU_ZERO(&bsr_state->numa_cpus[i]);
+    snprintf(file_name, 256, "/sys/devices/system/node/node%d/cpulist", bsr_state->numa_node_id[i]);
+    readSysfsList(file_name, list, 4096);
+    if (parseCPUList(list, &bsr_state->numa_cpus[i], NULL, 0) == 0) {
+      // memory-only nodes cannot run threads
+      if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+        printf("Warning: NUMA node %d has no cpus, NUMA mode disabled\n", bsr_state->numa_node_id[i]);
+        fflush(stdout);
+      }
+      return(0);
+    }
+  }
+  bsr_state->numa_nodes=node_count;
+
+  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    if (bsr_config->numa_mode == 1) {
+      printf("NUMA mode: %d nodes, threads pinned to nodes, image buffers interleaved\n", bsr_state->numa_nodes);
+    } else {
+      printf("NUMA mode: %d nodes, threads pinned to nodes, image buffers partitioned by thread row band\n", bsr_state->numa_nodes);
+    }
+    fflush(stdout);
+  }
+
+  return(0);
+}
+
+int getNUMANodeIndex(bsr_state_t *bsr_state, int thread_id) {
+  //
+  // threads are assigned to nodes in contiguous groups so that adjacent row bands in post processing,
+  // and adjacent slices of each input file in processStars(), belong to the same node
+  //
+  if (bsr_state->numa_nodes < 2) {
+    return(0);
+  }
+
+  return((thread_id * bsr_state->numa_nodes) / (bsr_state->num_worker_threads + 1));
+}
+
+int bindNUMAMemory(bsr_state_t *bsr_state, void *addr, size_t len, int policy, int node_index) {
+  unsigned long node_mask[BSR_MAX_NUMA_NODES / (8 * sizeof(unsigned long)) + 1];
+  int node_id;
+  int i;
+
+  //
+  // set memory policy for an address range before it is first touched
+  // MPOL_INTERLEAVE spreads pages over all nodes in use, other policies use node_index only
+  //
+  memset(node_mask, 0, sizeof(node_mask));
+  if (policy == MPOL_INTERLEAVE) {
+    for (i=0; i < bsr_state->numa_nodes; i++) {
+      node_id=bsr_state->numa_node_id[i];
+      node_mask[node_id / (8 * sizeof(unsigned long))]|=(1UL << (node_id % (8 * sizeof(unsigned long))));
+    }
+  } else {
+    node_id=bsr_state->numa_node_id[node_index];
+    node_mask[node_id / (8 * sizeof(unsigned long))]|=(1UL << (node_id % (8 * sizeof(unsigned long))));
+  }
+
+  return((int)syscall(SYS_mbind, addr, len, policy, node_mask, (unsigned long)(sizeof(node_mask) * 8), 0));
+}
+
+int placeImageBufferNUMA(bsr_config_t *bsr_config, bsr_state_t *bsr_state, void *buffer, size_t buffer_size, size_t row_size, int rows, char *buffer_name) {
+  int lines_per_thread;
+  int thread_id;
+  int node_index;
+  int next_node_index;
+  size_t alignment;
+  size_t range_start;
+  size_t range_end;
+  int result=0;
+
+  if ((bsr_state->numa_nodes < 2) || (buffer == NULL)) {
+    return(0);
+  }
+
+  //
+  // numa_mode 1: interleave pages over all nodes
+  // numa_mode 2: prefer the node of the thread that owns each row band in post processing
+  //
+  if (bsr_config->numa_mode == 1) {
+    result=bindNUMAMemory(bsr_state, buffer, buffer_size, MPOL_INTERLEAVE, 0);
+  } else {
+    //
+    // band boundaries between nodes are rounded down to the largest page size we might be using
+    //
+    if (bsr_config->huge_pages == 3) {
+      alignment=(size_t)1073741824;
+    } else {
+      alignment=(size_t)2097152;
+    }
+    lines_per_thread=(int)ceil(((double)rows / (double)(bsr_state->num_worker_threads + 1)));
+    range_start=0;
+    node_index=getNUMANodeIndex(bsr_state, 0);
+    for (thread_id=1; thread_id <= (bsr_state->num_worker_threads + 1); thread_id++) {
+      if (thread_id <= bsr_state->num_worker_threads) {
+        next_node_index=getNUMANodeIndex(bsr_state, thread_id);
+        if (next_node_index == node_index) {
+          continue;
+        }
+        range_end=(((size_t)thread_id * (size_t)lines_per_thread * row_size) / alignment) * alignment;
+        if (range_end > buffer_size) {
+          range_end=buffer_size;
+        }
+      } else {
+        next_node_index=node_index;
+        range_end=buffer_size;
+      }
+      if ((range_end > range_start) && (bindNUMAMemory(bsr_state, (char *)buffer + range_start, (range_end - range_start), MPOL_PREFERRED, node_index) != 0)) {
+        result=-1;
+      }
+      if (range_end > range_start) {
+        range_start=range_end;
+      }
+      node_index=next_node_index;
+    }
+  }
+
+  if ((result != 0) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    printf("Warning: could not set NUMA memory policy for %s, errno: %d\n", buffer_name, errno);
+    fflush(stdout);
+  }
+
+  return(0);
+}
+
+int replicateInputFilesNUMA(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  input_file_t *input_files[11];
+  input_file_t *input_file;
+  int mmap_protection;
+  int mmap_visibility;
+  size_t max_size;
+  size_t total_size=0;
+  char *replica;
+  int i;
+  int node_index;
+
+  //
+  // copy each data file that fits within numa_replicate_max_size into shared memory bound to each node
+  // so every worker reads its slice from local memory. This must be done before fork()
+  //
+  if ((bsr_state->numa_nodes < 2) || (bsr_config->numa_replicate_max_size <= 0)) {
+    return(0);
+  }
+  max_size=(size_t)bsr_config->numa_replicate_max_size * (size_t)1048576;
+
+  input_files[0]=&bsr_state->input_file_external;
+  input_files[1]=&bsr_state->input_file_pq100;
+  input_files[2]=&bsr_state->input_file_pq050;
+  input_files[3]=&bsr_state->input_file_pq030;
+  input_files[4]=&bsr_state->input_file_pq020;
+  input_files[5]=&bsr_state->input_file_pq010;
+  input_files[6]=&bsr_state->input_file_pq005;
+  input_files[7]=&bsr_state->input_file_pq003;
+  input_files[8]=&bsr_state->input_file_pq002;
+  input_files[9]=&bsr_state->input_file_pq001;
+  input_files[10]=&bsr_state->input_file_pq000;
+
+  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Replicating data files to %d NUMA nodes...", bsr_state->numa_nodes);
+    fflush(stdout);
+  }
+
+  mmap_protection=PROT_READ | PROT_WRITE;
+  mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+  for (i=0; i < 11; i++) {
+    input_file=input_files[i];
+    if ((input_file->buf == NULL) || (input_file->buf_size == 0) || (input_file->buf_size > max_size)) {
+      continue;
+    }
+    for (node_index=0; node_index < bsr_state->numa_nodes; node_index++) {
+      replica=mmap(NULL, input_file->buf_size, mmap_protection, mmap_visibility, -1, 0);
+      if (replica == MAP_FAILED) {
+        break;
+      }
+      if (bindNUMAMemory(bsr_state, replica, input_file->buf_size, MPOL_BIND, node_index) != 0) {
+        munmap(replica, input_file->buf_size);
+        break;
+      }
+      memcpy(replica, input_file->buf, input_file->buf_size);
+      input_file->node_buf[node_index]=replica;
+      total_size+=input_file->buf_size;
+    }
+    if (node_index < bsr_state->numa_nodes) {
+      // out of memory on a node (or mbind failed), remaining files are read from the shared mapping
+      if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+        printf(" warning: could not replicate to NUMA node %d, errno: %d...", bsr_state->numa_node_id[node_index], errno);
+        fflush(stdout);
+      }
+      break;
+    }
+  }
+
+  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &endtime);
+    elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+    printf(" %.1fMB (%.3fs)\n", ((double)total_size / 1048576.0), elapsed_time);
+    fflush(stdout);
+  }
+
+  return(0);
+}
+
+int pinThreadNUMA(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int node_index;
+
+  //
+  // called by every thread after fork(). Pins this thread to the cpus of its assigned node. Private memory
+  // first touched after this point (dedup buffers, copy-on-write pages) will then be allocated locally
+  //
+  bsr_state->perthread->numa_node=0;
+  if (bsr_state->numa_nodes < 2) {
+    return(0);
+  }
+  node_index=getNUMANodeIndex(bsr_state, bsr_state->perthread->my_thread_id);
+  bsr_state->perthread->numa_node=node_index;
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &bsr_state->numa_cpus[node_index]) != 0) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: thread %d could not be pinned to NUMA node %d, errno: %d\n", bsr_state->perthread->my_thread_id, bsr_state->numa_node_id[node_index], errno);
+      fflush(stdout);
+    }
+  }
+
+  return(0);
+}
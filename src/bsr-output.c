@@ -0,0 +1,283 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "bsr-output.h"
+
+//
+// Output of finished in-memory data (encoded strips, EXR chunks, encoder output buffers) to stdout in CGI mode.
+// Data written to a pipe through stdio is copied into the stdio buffer, then into the pipe in small writes. Here
+// large pieces are passed to a pipe by reference with vmsplice(), so the reader (httpd) copies them straight from
+// the image buffers. A socket gets the same pages through a private pipe and splice(). Files and anything else
+// get plain writev() calls
+//
+
+//
+// main thread: grow the pipe buffer of fd if it is a pipe, so large outputs move in fewer, larger steps. The size is
+// halved until the kernel accepts it, unprivileged processes are limited by /proc/sys/fs/pipe-max-size
+//
+int setOutputPipeSize(int fd) {
+  struct stat fd_stat;
+  int current_size;
+  int pipe_size;
+
+  if ((fstat(fd, &fd_stat) != 0) || (S_ISFIFO(fd_stat.st_mode) == 0)) {
+    return(0);
+  }
+  current_size=fcntl(fd, F_GETPIPE_SZ);
+  for (pipe_size=BSR_OUTPUT_PIPE_SIZE; pipe_size > current_size; pipe_size/=2) {
+    if (fcntl(fd, F_SETPIPE_SZ, pipe_size) >= 0) {
+      break;
+    }
+  }
+
+  return(0);
+}
+
+//
+// make room for at least size more bytes in a growable page-aligned output buffer. The buffer is mmaped and grown
+// with mremap(), which moves pages instead of copying them, so data stored earlier stays in the same pages and can
+// be spliced. Returns 1 if the buffer could not be grown
+//
+int reserveOutputBuf(output_buf_t *output_buf, size_t size) {
+  size_t capacity;
+  void *new_data;
+
+  if ((output_buf->size + size) <= output_buf->capacity) {
+    return(0);
+  }
+  capacity=output_buf->capacity;
+  if (capacity == 0) {
+    capacity=BSR_OUTPUT_BUF_SIZE;
+  }
+  while (capacity < (output_buf->size + size)) {
+    capacity*=2;
+  }
+  if (output_buf->data == NULL) {
+    new_data=mmap(NULL, capacity, (PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+  } else {
+    new_data=mremap(output_buf->data, output_buf->capacity, capacity, MREMAP_MAYMOVE);
+  }
+  if (new_data == MAP_FAILED) {
+    return(1);
+  }
+  output_buf->data=(unsigned char *)new_data;
+  output_buf->capacity=capacity;
+
+  return(0);
+}
+
+//
+// append size bytes of data to a growable output buffer. Returns 1 if the buffer could not be grown
+//
+int appendOutputBuf(output_buf_t *output_buf, const void *data, size_t size) {
+  if (reserveOutputBuf(output_buf, size) != 0) {
+    return(1);
+  }
+  if (size > 0) {
+    memcpy((output_buf->data + output_buf->size), data, size);
+    output_buf->size+=size;
+  }
+
+  return(0);
+}
+
+int freeOutputBuf(output_buf_t *output_buf) {
+  if (output_buf->data != NULL) {
+    munmap(output_buf->data, output_buf->capacity);
+  }
+  output_buf->data=NULL;
+  output_buf->size=0;
+  output_buf->capacity=0;
+
+  return(0);
+}
+
+//
+// copy what is left in a private pipe (non-blocking) to socket_fd, used if the socket does not accept splice()
+//
+static int copyPipe(int pipe_r, int socket_fd) {
+  unsigned char copy_buf[65536];
+  struct iovec iov;
+  ssize_t result;
+
+  while (1) {
+    result=read(pipe_r, copy_buf, sizeof(copy_buf));
+    if ((result < 0) && (errno == EINTR)) {
+      continue;
+    } else if ((result < 0) && (errno == EAGAIN)) {
+      return(0);
+    } else if (result <= 0) {
+      return(result < 0);
+    }
+    iov.iov_base=copy_buf;
+    iov.iov_len=(size_t)result;
+    if (writeVector(socket_fd, &iov, 1, -1) != 0) {
+      return(1);
+    }
+  }
+}
+
+//
+// pass all buffers in iov to pipe_w by reference with vmsplice(). If socket_fd is not negative pipe_w is a private
+// pipe that is emptied into socket_fd with splice() after each vmsplice(). Falls back to writev() if the kernel
+// refuses. iov is modified. Returns 1 on error
+//
+static int spliceVector(int pipe_w, int pipe_r, int socket_fd, struct iovec *iov, int iovcnt) {
+  ssize_t result;
+  ssize_t moved;
+  size_t written=0;
+  size_t remaining;
+  int out_fd;
+  int copy=0;
+
+  out_fd=(socket_fd >= 0) ? socket_fd : pipe_w;
+  while (1) {
+    // skip buffers that were spliced completely, then advance into a partially spliced one
+    while ((iovcnt > 0) && (written >= iov->iov_len)) {
+      written-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt <= 0) {
+      break;
+    }
+    iov->iov_base=(char *)iov->iov_base + written;
+    iov->iov_len-=written;
+    if (copy == 1) {
+      // kernel refused, the private pipe (if any) is empty, write the rest directly
+      return(writeVector(out_fd, iov, iovcnt, -1));
+    }
+
+    result=vmsplice(pipe_w, iov, (unsigned long)iovcnt, 0);
+    if (result < 0) {
+      if (errno != EINTR) {
+        copy=1;
+      }
+      written=0;
+      continue;
+    } else if (result == 0) {
+      return(1);
+    }
+    written=(size_t)result;
+
+    // empty the private pipe into the socket
+    remaining=(socket_fd >= 0) ? (size_t)result : 0;
+    while (remaining > 0) {
+      moved=splice(pipe_r, NULL, socket_fd, NULL, remaining, (SPLICE_F_MOVE | SPLICE_F_MORE));
+      if ((moved < 0) && (errno == EINTR)) {
+        continue;
+      } else if ((moved < 0) && (errno == EINVAL)) {
+        // socket does not accept splice(), copy out what is left in the pipe
+        fcntl(pipe_r, F_SETFL, O_NONBLOCK);
+        if (copyPipe(pipe_r, socket_fd) != 0) {
+          return(1);
+        }
+        copy=1;
+        break;
+      } else if (moved <= 0) {
+        return(1);
+      }
+      remaining-=(size_t)moved;
+    }
+  }
+
+  return(0);
+}
+
+//
+// main thread: write all buffers in iov to fd sequentially. If fd is a pipe or socket and splice_buf is not NULL,
+// buffers of at least BSR_SPLICE_MIN_SIZE bytes are passed by reference, so they must not change until the process
+// exits or they are unmapped (image buffers, growable output buffers). Smaller buffers (chunk headers, checksums)
+// are copied into splice_buf, which keeps them until exit. Without splice_buf, or for files, all buffers are written
+// with writev(). iov is modified. Returns 1 on error
+//
+int writeOutputVector(int fd, struct iovec *iov, int iovcnt, output_buf_t *splice_buf) {
+  struct stat fd_stat;
+  int pipe_fds[2];
+  size_t offset;
+  int result;
+  int i;
+
+  if ((splice_buf == NULL) || (fstat(fd, &fd_stat) != 0) || ((S_ISFIFO(fd_stat.st_mode) == 0) && (S_ISSOCK(fd_stat.st_mode) == 0))) {
+    return(writeVector(fd, iov, iovcnt, -1));
+  }
+
+  //
+  // keep copies of small buffers. All are appended before any pointer is taken since appending may move splice_buf
+  //
+  offset=splice_buf->size;
+  for (i=0; i < iovcnt; i++) {
+    if (iov[i].iov_len < BSR_SPLICE_MIN_SIZE) {
+      if (appendOutputBuf(splice_buf, iov[i].iov_base, iov[i].iov_len) != 0) {
+        return(writeVector(fd, iov, iovcnt, -1));
+      }
+    }
+  }
+  for (i=0; i < iovcnt; i++) {
+    if (iov[i].iov_len < BSR_SPLICE_MIN_SIZE) {
+      iov[i].iov_base=splice_buf->data + offset;
+      offset+=iov[i].iov_len;
+    }
+  }
+
+  if (S_ISFIFO(fd_stat.st_mode)) {
+    return(spliceVector(fd, -1, -1, iov, iovcnt));
+  }
+
+  //
+  // socket: splice through a private pipe
+  //
+  if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+    return(writeVector(fd, iov, iovcnt, -1));
+  }
+  setOutputPipeSize(pipe_fds[1]);
+  result=spliceVector(pipe_fds[1], pipe_fds[0], fd, iov, iovcnt);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  return(result);
+}
@@ -35,63 +35,59 @@
  * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
 #include "util.h"
 #include "cgi.h"
 #include "icc-profiles.h"
+#include "bsr-png.h"
+#include "bsr-output.h"
 
 #ifdef BSR_USE_PNG
 #define PNG_SETJMP_NOT_SUPPORTED
 #include <png.h>
+#include <zlib.h>
 #endif
 
-int outputPNG(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
-
 #ifdef BSR_USE_PNG
 
-  FILE *output_file=NULL;
+//
+// libpng write callback collecting the encoded file in a growable output buffer (CGI mode)
+//
+static void writePNGOutputBuf(png_structp png_ptr, png_bytep data, png_size_t size) {
+  if (appendOutputBuf((output_buf_t *)png_get_io_ptr(png_ptr), data, size) != 0) {
+    exit(1);
+  }
+}
+
+//
+// write PNG file with libpng from main thread. In CGI mode the file is encoded into a growable output buffer
+// first and passed to stdout by reference instead of through stdio
+//
+int outputPNGlibpng(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file) {
   png_structp png_ptr;
   png_infop info_ptr;
   unsigned char color_type=PNG_COLOR_TYPE_RGB;
   unsigned char bit_depth;
-  struct timespec starttime;
-  struct timespec endtime;
-  double elapsed_time;
-
-  //
-  // display status update if not in CGI mode
-  //
-  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
-    clock_gettime(CLOCK_REALTIME, &starttime);
-    printf("Writing %s...", bsr_config->output_file_name);
-    fflush(stdout);
-  }
+  output_buf_t png_output={NULL, 0, 0};
+  struct iovec iov;
+  int result=0;
 
-  //
-  // if not CGI mode, open output file
-  //
-  if (bsr_config->cgi_mode != 1) {
-    output_file=fopen(bsr_config->output_file_name, "wb");
-    if (output_file == NULL) {
-      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
-      fflush(stdout);
-      exit(1);
-    }
-  }
-  
   //
   // initialize PNG ptr and info_ptr
   //
   png_ptr=png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   info_ptr=png_create_info_struct(png_ptr);
   if (bsr_config->cgi_mode == 1) {
-    png_init_io(png_ptr, stdout);
+    png_set_write_fn(png_ptr, &png_output, writePNGOutputBuf, NULL);
   } else {
     png_init_io(png_ptr, output_file);
-  } 
+  }
   if (bsr_config->bits_per_color == 16) {
     bit_depth=16;
   } else {
@@ -137,21 +133,793 @@ int outputPNG(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   png_write_info(png_ptr, info_ptr);
   png_write_image(png_ptr, bsr_state->row_pointers);
   png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  if (bsr_config->cgi_mode == 1) {
+    fflush(output_file);
+    iov.iov_base=png_output.data;
+    iov.iov_len=png_output.size;
+    result=writeOutputVector(fileno(output_file), &iov, 1, &bsr_state->splice_buf);
+    freeOutputBuf(&png_output);
+  }
+
+  return(result);
+}
+
+//
+// write one PNG chunk: length, type, data, CRC-32 of type and data
+//
+int outputPNGChunk(FILE *output_file, char *chunk_type, unsigned char *data, uint32_t data_size) {
+  unsigned char chunk_buf[8];
+  uint32_t crc;
+
+  storeU32BE(chunk_buf, data_size);
+  memcpy((chunk_buf + 4), chunk_type, 4);
+  crc=(uint32_t)crc32(0L, (const Bytef *)(chunk_buf + 4), 4);
+  if (data_size > 0) {
+    crc=(uint32_t)crc32(crc, (const Bytef *)data, data_size);
+  }
+  fwrite(chunk_buf, 8, 1, output_file);
+  if (data_size > 0) {
+    fwrite(data, data_size, 1, output_file);
+  }
+  storeU32BE(chunk_buf, crc);
+  fwrite(chunk_buf, 4, 1, output_file);
+
+  return(0);
+}
+
+//
+// write PNG signature, IHDR and color profile chunks (gAMA or iCCP), matching what libpng writes for the same settings
+//
+int outputPNGHeader(bsr_config_t *bsr_config, FILE *output_file, int width, int height) {
+  const unsigned char png_signature[8]={137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned char header[13];
+  unsigned char *header_p;
+  char *profile_name="sRGB";
+  const unsigned char *profile=sRGB_v4_icc;
+  unsigned int profile_len=sRGB_v4_icc_len;
+  unsigned char *iccp_buf;
+  uLongf iccp_compressed_size;
+  size_t profile_name_len;
+  uint32_t gamma=0;
+
+  fwrite(png_signature, 8, 1, output_file);
+
+  // IHDR: width, height, bit depth, color type RGB, deflate compression, adaptive filtering, no interlace
+  header_p=header;
+  header_p+=storeU32BE(header_p, (uint32_t)width);
+  header_p+=storeU32BE(header_p, (uint32_t)height);
+  if (bsr_config->bits_per_color == 16) {
+    header_p+=storeU8(header_p, 16);
+  } else {
+    header_p+=storeU8(header_p, 8);
+  }
+  header_p+=storeU8(header_p, 2);
+  header_p+=storeU8(header_p, 0);
+  header_p+=storeU8(header_p, 0);
+  header_p+=storeU8(header_p, 0);
+  outputPNGChunk(output_file, "IHDR", header, 13);
 
   //
-  // display status message and close output file if not CGI mode
+  // color profile
+  //
+  if (bsr_config->color_profile == 0) {
+    // no ICC profile and linear gamma
+    gamma=100000;
+  } else if (bsr_config->color_profile == 2) {
+    // Display-P3
+    profile_name="Display-P3";
+    profile=DisplayP3Compat_v4_icc;
+    profile_len=DisplayP3Compat_v4_icc_len;
+  } else if (bsr_config->color_profile == 3) {
+    // Rec. 2020
+    profile_name="Rec 2020";
+    profile=Rec2020Compat_v4_icc;
+    profile_len=Rec2020Compat_v4_icc_len;
+  } else if (bsr_config->color_profile == 4) {
+    // Rec. 601 NTSC
+    profile_name="Rec 601 NTSC";
+    profile=Rec601NTSC_v4_icc;
+    profile_len=Rec601NTSC_v4_icc_len;
+  } else if (bsr_config->color_profile == 5) {
+    // Rec. 601 PAL
+    profile_name="Re 601 PAL";
+    profile=Rec601PAL_v4_icc;
+    profile_len=Rec601PAL_v4_icc_len;
+  } else if (bsr_config->color_profile == 6) {
+    // Rec. 709
+    profile_name="Rec 709";
+    profile=Rec709_v4_icc;
+    profile_len=Rec709_v4_icc_len;
+  } else if (bsr_config->color_profile == 7) {
+    // no ICC profile and flat 2.0 gamma
+    gamma=50000;
+  } else if (bsr_config->color_profile == 8) {
+    // Rec. 2100 PQ
+    profile_name="Rec 2100 PQ";
+    profile=Rec2100PQ_v4_icc;
+    profile_len=Rec2100PQ_v4_icc_len;
+  }
+
+  if (gamma != 0) {
+    storeU32BE(header, gamma);
+    outputPNGChunk(output_file, "gAMA", header, 4);
+  } else {
+    // iCCP: profile name, null separator, compression method 0, zlib compressed profile
+    profile_name_len=strlen(profile_name);
+    iccp_compressed_size=compressBound((uLong)profile_len);
+    iccp_buf=(unsigned char *)malloc(profile_name_len + 2 + (size_t)iccp_compressed_size);
+    if (iccp_buf == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for PNG iCCP chunk\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    memcpy(iccp_buf, profile_name, (profile_name_len + 1));
+    iccp_buf[profile_name_len + 1]=0;
+    compress2((Bytef *)(iccp_buf + profile_name_len + 2), &iccp_compressed_size, (const Bytef *)profile, (uLong)profile_len, Z_BEST_COMPRESSION);
+    outputPNGChunk(output_file, "iCCP", iccp_buf, (uint32_t)(profile_name_len + 2 + iccp_compressed_size));
+    free(iccp_buf);
+  }
+
+  return(0);
+}
+
+//
+// Paeth predictor from the PNG specification
+//
+static inline int paethPredictor(int a, int b, int c) {
+  int p;
+  int pa;
+  int pb;
+  int pc;
+
+  p=a + b - c;
+  pa=abs(p - a);
+  pb=abs(p - b);
+  pc=abs(p - c);
+  if ((pa <= pb) && (pa <= pc)) {
+    return(a);
+  } else if (pb <= pc) {
+    return(b);
+  }
+  return(c);
+}
+
+//
+// filter one row with all five PNG filter types into candidates and return the one with the smallest sum of
+// absolute (signed) values, the same heuristic libpng uses. Each candidate is a filter type byte followed by the row
+//
+unsigned char *filterPNGRow(unsigned char *row, unsigned char *prev_row, int row_bytes, int bytes_per_pixel, unsigned char *candidates) {
+  unsigned char *none_p;
+  unsigned char *sub_p;
+  unsigned char *up_p;
+  unsigned char *avg_p;
+  unsigned char *paeth_p;
+  unsigned char *best_p;
+  int a;
+  int b;
+  int c;
+  int x;
+  int i;
+  uint64_t sum_none=0;
+  uint64_t sum_sub=0;
+  uint64_t sum_up=0;
+  uint64_t sum_avg=0;
+  uint64_t sum_paeth=0;
+  uint64_t best_sum;
+
+  none_p=candidates;
+  sub_p=none_p + row_bytes + 1;
+  up_p=sub_p + row_bytes + 1;
+  avg_p=up_p + row_bytes + 1;
+  paeth_p=avg_p + row_bytes + 1;
+  none_p[0]=0;
+  sub_p[0]=1;
+  up_p[0]=2;
+  avg_p[0]=3;
+  paeth_p[0]=4;
+  none_p++;
+  sub_p++;
+  up_p++;
+  avg_p++;
+  paeth_p++;
+
+  // first pixel has no left neighbor
+  for (i=0; i < bytes_per_pixel; i++) {
+    x=row[i];
+    b=prev_row[i];
+    none_p[i]=(unsigned char)x;
+    sub_p[i]=(unsigned char)x;
+    up_p[i]=(unsigned char)(x - b);
+    avg_p[i]=(unsigned char)(x - (b >> 1));
+    paeth_p[i]=(unsigned char)(x - b);
+  }
+  for (i=bytes_per_pixel; i < row_bytes; i++) {
+    x=row[i];
+    a=row[i - bytes_per_pixel];
+    b=prev_row[i];
+    c=prev_row[i - bytes_per_pixel];
+    none_p[i]=(unsigned char)x;
+    sub_p[i]=(unsigned char)(x - a);
+    up_p[i]=(unsigned char)(x - b);
+    avg_p[i]=(unsigned char)(x - ((a + b) >> 1));
+    paeth_p[i]=(unsigned char)(x - paethPredictor(a, b, c));
+  }
+  for (i=0; i < row_bytes; i++) {
+    sum_none+=abs((int)(signed char)none_p[i]);
+    sum_sub+=abs((int)(signed char)sub_p[i]);
+    sum_up+=abs((int)(signed char)up_p[i]);
+    sum_avg+=abs((int)(signed char)avg_p[i]);
+    sum_paeth+=abs((int)(signed char)paeth_p[i]);
+  }
+
+  best_p=none_p;
+  best_sum=sum_none;
+  if (sum_sub < best_sum) {
+    best_p=sub_p;
+    best_sum=sum_sub;
+  }
+  if (sum_up < best_sum) {
+    best_p=up_p;
+    best_sum=sum_up;
+  }
+  if (sum_avg < best_sum) {
+    best_p=avg_p;
+    best_sum=sum_avg;
+  }
+  if (sum_paeth < best_sum) {
+    best_p=paeth_p;
+  }
+
+  // include filter type byte
+  return(best_p - 1);
+}
+
+//
+// filter and deflate rows first_line to end_line into compressed_buf as a raw deflate segment ending on a byte
+// boundary (sync flush, or finish if end_line is the last row of the image) so segments concatenate into one zlib
+// stream. Row y is at rows_p + (y - first_line) * row_bytes, the prefix_lines rows before first_line must also be
+// there (at least one if first_line is not 0). Segments after the first are primed with the last BSR_PNG_DICTIONARY_SIZE
+// filtered bytes of the prefix rows, recomputed here from the unfiltered rows, so back references can cross segment
+// boundaries. work_buf holds five candidate rows, a zero row and the dictionary
+//
+static int deflatePNGRows(unsigned char *rows_p, int row_bytes, int bytes_per_pixel, int first_line, int end_line, int output_res_y, int prefix_lines, int level, unsigned char *work_buf, unsigned char *compressed_buf, size_t compressed_buf_size, png_strip_t *strip) {
+  int dictionary_lines;
+  size_t dictionary_size;
+  int output_y;
+  int flush;
+  int z_return;
+  unsigned char *candidates;
+  unsigned char *zero_row;
+  unsigned char *dictionary;
+  unsigned char *row_p;
+  unsigned char *filtered_p;
+  unsigned char *prev_row_p;
+  size_t header_size=0;
+  z_stream z;
+
+  strip->compressed_size=0;
+  strip->filtered_size=0;
+  strip->adler=(uint32_t)adler32(0L, Z_NULL, 0);
+  strip->crc=(uint32_t)crc32(0L, (const Bytef *)"IDAT", 4);
+  if (first_line >= end_line) {
+    return(0);
+  }
+
+  //
+  // scratch buffers: five candidate rows, a zero row above the image, dictionary
+  //
+  candidates=work_buf;
+  zero_row=candidates + (5 * (size_t)(row_bytes + 1));
+  dictionary=zero_row + row_bytes + 1;
+  memset(zero_row, 0, (size_t)(row_bytes + 1));
+
+  memset(&z, 0, sizeof(z_stream));
+  if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+    strip->compressed_size=SIZE_MAX;
+    return(0);
+  }
+
+  //
+  // first segment starts with zlib header (deflate, 32K window, no preset dictionary, check bits for level)
+  //
+  if (first_line == 0) {
+    compressed_buf[0]=0x78;
+    if (level == 1) {
+      compressed_buf[1]=0x01;
+    } else {
+      compressed_buf[1]=0x9c;
+    }
+    header_size=2;
+  } else {
+    //
+    // prime deflate window with filtered tail of prefix rows
+    //
+    dictionary_lines=(BSR_PNG_DICTIONARY_SIZE + row_bytes) / (row_bytes + 1);
+    if (first_line > prefix_lines) {
+      // rows must be filtered exactly as they were in the previous segment, which needs the row above each of them
+      prefix_lines--;
+    }
+    if (dictionary_lines > prefix_lines) {
+      dictionary_lines=prefix_lines;
+    }
+    filtered_p=dictionary;
+    for (output_y=(first_line - dictionary_lines); output_y < first_line; output_y++) {
+      row_p=rows_p - ((ptrdiff_t)(first_line - output_y) * (ptrdiff_t)row_bytes);
+      if (output_y == 0) {
+        prev_row_p=zero_row;
+      } else {
+        prev_row_p=row_p - row_bytes;
+      }
+      memcpy(filtered_p, filterPNGRow(row_p, prev_row_p, row_bytes, bytes_per_pixel, candidates), (size_t)(row_bytes + 1));
+      filtered_p+=(row_bytes + 1);
+    }
+    dictionary_size=(size_t)dictionary_lines * (size_t)(row_bytes + 1);
+    if (dictionary_size > BSR_PNG_DICTIONARY_SIZE) {
+      deflateSetDictionary(&z, (const Bytef *)(dictionary + (dictionary_size - BSR_PNG_DICTIONARY_SIZE)), BSR_PNG_DICTIONARY_SIZE);
+    } else if (dictionary_size > 0) {
+      deflateSetDictionary(&z, (const Bytef *)dictionary, (uInt)dictionary_size);
+    }
+  }
+
   //
-  if (bsr_config->cgi_mode != 1) {
-    if (bsr_config->print_status == 1) {
+  // filter and compress rows
+  //
+  z.next_out=(Bytef *)(compressed_buf + header_size);
+  z.avail_out=(uInt)(compressed_buf_size - header_size);
+  z_return=Z_OK;
+  row_p=rows_p;
+  for (output_y=first_line; output_y < end_line; output_y++) {
+    if (output_y == 0) {
+      prev_row_p=zero_row;
+    } else {
+      prev_row_p=row_p - row_bytes;
+    }
+    filtered_p=filterPNGRow(row_p, prev_row_p, row_bytes, bytes_per_pixel, candidates);
+    row_p+=row_bytes;
+    strip->adler=(uint32_t)adler32(strip->adler, (const Bytef *)filtered_p, (uInt)(row_bytes + 1));
+    if (output_y < (end_line - 1)) {
+      flush=Z_NO_FLUSH;
+    } else if (end_line == output_res_y) {
+      flush=Z_FINISH;
+    } else {
+      flush=Z_SYNC_FLUSH;
+    }
+    z.next_in=(Bytef *)filtered_p;
+    z.avail_in=(uInt)(row_bytes + 1);
+    z_return=deflate(&z, flush);
+    if ((z.avail_in != 0) || (z.avail_out == 0) || (z_return == Z_STREAM_ERROR)) {
+      // out of space, image is not compressible enough to store in place
+      break;
+    }
+  }
+  if ((output_y < end_line) || ((end_line == output_res_y) && (z_return != Z_STREAM_END))) {
+    strip->compressed_size=SIZE_MAX;
+  } else {
+    strip->compressed_size=header_size + (size_t)z.total_out;
+    strip->filtered_size=(size_t)(end_line - first_line) * (size_t)(row_bytes + 1);
+    strip->crc=(uint32_t)crc32(strip->crc, (const Bytef *)compressed_buf, (uInt)strip->compressed_size);
+  }
+  deflateEnd(&z);
+
+  return(0);
+}
+
+//
+// all threads: filter and deflate this thread's strip of rows into compression_buf2. Strips after the first are
+// primed with the filtered tail of the previous strip so the strips compress almost as well as one stream
+//
+int compressPNGStrip(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level) {
+  int output_res_y;
+  int bytes_per_pixel;
+  int lines_per_thread;
+  int first_line;
+  int end_line;
+
+  output_res_y=bsr_state->current_image_res_y;
+  if (bsr_config->bits_per_color == 16) {
+    bytes_per_pixel=6;
+  } else {
+    bytes_per_pixel=3;
+  }
+  lines_per_thread=(int)ceil(((double)output_res_y / (double)(bsr_state->num_worker_threads + 1)));
+  first_line=bsr_state->perthread->my_thread_id * lines_per_thread;
+  end_line=first_line + lines_per_thread;
+  if (end_line > output_res_y) {
+    end_line=output_res_y;
+  }
+  if (first_line >= end_line) {
+    first_line=end_line;
+  }
+
+  // rows in image_output_buf are contiguous, all rows above the strip are available for the dictionary
+  deflatePNGRows(bsr_state->image_output_buf + ((size_t)first_line * (size_t)bytes_per_pixel * (size_t)bsr_state->current_image_res_x),\
+                 (bytes_per_pixel * bsr_state->current_image_res_x), bytes_per_pixel, first_line, end_line, output_res_y, first_line, level,\
+                 bsr_state->compression_buf1, bsr_state->compression_buf2, bsr_state->compression_buf_size, &bsr_state->png_strips[bsr_state->perthread->my_thread_id]);
+
+  return(0);
+}
+
+//
+// main thread: write PNG from compressed strips stored in place in image_output_buf. Strips are written from
+// there with writeOutputVector(), which passes them to a pipe by reference in CGI mode
+//
+int outputPNGStrips(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file) {
+  int output_res_y;
+  int lines_per_thread;
+  int last_thread_id;
+  int thread_id;
+  unsigned char chunk_buf[8];
+  unsigned char adler_buf[4];
+  unsigned char crc_buf[4];
+  struct iovec iov[4];
+  int iovcnt;
+  unsigned char *strip_p;
+  size_t strip_remaining;
+  size_t chunk_size;
+  uint32_t adler;
+  uint32_t crc;
+  png_strip_t *strip;
+
+  output_res_y=bsr_state->current_image_res_y;
+  lines_per_thread=(int)ceil(((double)output_res_y / (double)(bsr_state->num_worker_threads + 1)));
+  last_thread_id=(output_res_y - 1) / lines_per_thread;
+
+  outputPNGHeader(bsr_config, output_file, bsr_state->current_image_res_x, output_res_y);
+  fflush(output_file);
+
+  //
+  // one IDAT chunk per strip using the CRC computed by the thread that compressed it, the combined Adler-32 of all
+  // strips is appended to the last one. Strips larger than BSR_PNG_MAX_IDAT are split and checksummed here
+  //
+  adler=(uint32_t)adler32(0L, Z_NULL, 0);
+  for (thread_id=0; thread_id <= last_thread_id; thread_id++) {
+    strip=&bsr_state->png_strips[thread_id];
+    adler=(uint32_t)adler32_combine(adler, strip->adler, (z_off_t)strip->filtered_size);
+  }
+  storeU32BE(adler_buf, adler);
+  for (thread_id=0; thread_id <= last_thread_id; thread_id++) {
+    strip=&bsr_state->png_strips[thread_id];
+    strip_p=bsr_state->row_pointers[thread_id * lines_per_thread];
+    strip_remaining=strip->compressed_size;
+    if (thread_id == last_thread_id) {
+      strip_remaining+=4;
+    }
+    if (strip_remaining <= BSR_PNG_MAX_IDAT) {
+      crc=strip->crc;
+      if (thread_id == last_thread_id) {
+        crc=(uint32_t)crc32_combine(crc, (uint32_t)crc32(0L, (const Bytef *)adler_buf, 4), 4);
+      }
+      storeU32BE(chunk_buf, (uint32_t)strip_remaining);
+      memcpy((chunk_buf + 4), "IDAT", 4);
+      storeU32BE(crc_buf, crc);
+      iov[0].iov_base=chunk_buf;
+      iov[0].iov_len=8;
+      iov[1].iov_base=strip_p;
+      iov[1].iov_len=strip->compressed_size;
+      iovcnt=2;
+      if (thread_id == last_thread_id) {
+        iov[2].iov_base=adler_buf;
+        iov[2].iov_len=4;
+        iovcnt=3;
+      }
+      iov[iovcnt].iov_base=crc_buf;
+      iov[iovcnt].iov_len=4;
+      iovcnt++;
+      if (writeOutputVector(fileno(output_file), iov, iovcnt, &bsr_state->splice_buf) != 0) {
+        return(1);
+      }
+    } else {
+      strip_remaining=strip->compressed_size;
+      while (strip_remaining > 0) {
+        chunk_size=strip_remaining;
+        if (chunk_size > BSR_PNG_MAX_IDAT) {
+          chunk_size=BSR_PNG_MAX_IDAT;
+        }
+        outputPNGChunk(output_file, "IDAT", strip_p, (uint32_t)chunk_size);
+        strip_p+=chunk_size;
+        strip_remaining-=chunk_size;
+      }
+      if (thread_id == last_thread_id) {
+        outputPNGChunk(output_file, "IDAT", adler_buf, 4);
+      }
+      fflush(output_file);
+    }
+  }
+  outputPNGChunk(output_file, "IEND", NULL, 0);
+
+  return(0);
+}
+
+#endif // BSR_USE_PNG
+
+//
+// all threads: filter and deflate one band of a streamed image from its ring slot in image_output_buf into its slot
+// in stream_out_buf, the stream_prefix_lines rows before the band are in the ring slot too
+//
+int compressPNGStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band) {
+#ifdef BSR_USE_PNG
+  int output_res_y;
+  int bytes_per_pixel;
+  int row_bytes;
+  int first_line;
+  int end_line;
+  int prefix_lines;
+  int slot;
+  int level;
+  png_strip_t strip;
+  stream_slot_t *stream_slot;
+
+  output_res_y=bsr_state->current_image_res_y;
+  if (bsr_config->bits_per_color == 16) {
+    bytes_per_pixel=6;
+  } else {
+    bytes_per_pixel=3;
+  }
+  row_bytes=bytes_per_pixel * bsr_state->current_image_res_x;
+  if (bsr_config->png_compression == 1) {
+    level=1;
+  } else {
+    level=6;
+  }
+  first_line=band * bsr_state->stream_band_lines;
+  end_line=first_line + bsr_state->stream_band_lines;
+  if (end_line > output_res_y) {
+    end_line=output_res_y;
+  }
+  prefix_lines=bsr_state->stream_prefix_lines;
+  if (prefix_lines > first_line) {
+    prefix_lines=first_line;
+  }
+  slot=band % bsr_state->stream_num_slots;
+  stream_slot=&bsr_state->stream_slots[slot];
+
+  deflatePNGRows(bsr_state->image_output_buf + ((size_t)slot * bsr_state->stream_slot_size) + ((size_t)bsr_state->stream_prefix_lines * (size_t)row_bytes),\
+                 row_bytes, bytes_per_pixel, first_line, end_line, output_res_y, prefix_lines, level, bsr_state->compression_buf1,\
+                 bsr_state->stream_out_buf + ((size_t)slot * bsr_state->stream_out_slot_size), bsr_state->stream_out_slot_size, &strip);
+  stream_slot->output_size=strip.compressed_size;
+  stream_slot->filtered_size=strip.filtered_size;
+  stream_slot->adler=strip.adler;
+  stream_slot->crc=strip.crc;
+#endif // BSR_USE_PNG
+
+  return(0);
+}
+
+//
+// all threads: write one deep zoom tile as a complete PNG file. Rows are filtered and deflated one at a time and
+// written in IDAT chunks of BSR_PNG_TILE_IDAT bytes. work_buf holds five candidate rows, a zero row and one chunk
+//
+int outputPNGTile(bsr_config_t *bsr_config, FILE *output_file, unsigned char *pixels, int width, int height, unsigned char *work_buf) {
+#ifdef BSR_USE_PNG
+  int bytes_per_pixel;
+  int row_bytes;
+  int level;
+  int y;
+  int flush;
+  int z_return;
+  unsigned char *candidates;
+  unsigned char *zero_row;
+  unsigned char *chunk_p;
+  unsigned char *row_p;
+  unsigned char *prev_row_p;
+  unsigned char *filtered_p;
+  z_stream z;
+
+  if (bsr_config->bits_per_color == 16) {
+    bytes_per_pixel=6;
+  } else {
+    bytes_per_pixel=3;
+  }
+  row_bytes=bytes_per_pixel * width;
+  candidates=work_buf;
+  zero_row=candidates + (5 * (size_t)(row_bytes + 1));
+  chunk_p=zero_row + row_bytes + 1;
+  memset(zero_row, 0, (size_t)(row_bytes + 1));
+  if (bsr_config->png_compression == 1) {
+    level=1;
+  } else {
+    level=6;
+  }
+
+  memset(&z, 0, sizeof(z_stream));
+  if (deflateInit2(&z, level, Z_DEFLATED, 15, 8, Z_FILTERED) != Z_OK) {
+    return(1);
+  }
+  outputPNGHeader(bsr_config, output_file, width, height);
+  z.next_out=(Bytef *)chunk_p;
+  z.avail_out=BSR_PNG_TILE_IDAT;
+  z_return=Z_OK;
+  prev_row_p=zero_row;
+  for (y=0; y < height; y++) {
+    row_p=pixels + ((size_t)y * (size_t)row_bytes);
+    filtered_p=filterPNGRow(row_p, prev_row_p, row_bytes, bytes_per_pixel, candidates);
+    prev_row_p=row_p;
+    if (y < (height - 1)) {
+      flush=Z_NO_FLUSH;
+    } else {
+      flush=Z_FINISH;
+    }
+    z.next_in=(Bytef *)filtered_p;
+    z.avail_in=(uInt)(row_bytes + 1);
+    do {
+      z_return=deflate(&z, flush);
+      if (z.avail_out == 0) {
+        outputPNGChunk(output_file, "IDAT", chunk_p, BSR_PNG_TILE_IDAT);
+        z.next_out=(Bytef *)chunk_p;
+        z.avail_out=BSR_PNG_TILE_IDAT;
+      }
+    } while ((z_return == Z_OK) && ((z.avail_in != 0) || (flush == Z_FINISH)));
+    if ((z_return != Z_OK) && (z_return != Z_STREAM_END)) {
+      deflateEnd(&z);
+      return(1);
+    }
+  }
+  if (z.avail_out != BSR_PNG_TILE_IDAT) {
+    outputPNGChunk(output_file, "IDAT", chunk_p, (uint32_t)(BSR_PNG_TILE_IDAT - z.avail_out));
+  }
+  deflateEnd(&z);
+  outputPNGChunk(output_file, "IEND", NULL, 0);
+#endif // BSR_USE_PNG
+
+  return(0);
+}
+
+int outputPNG(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+
+#ifdef BSR_USE_PNG
+
+  FILE *output_file=NULL;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  int i;
+  int thread_id;
+  int row_bytes;
+  int lines_per_thread;
+  int first_line;
+  int end_line;
+  int strips_fit=1;
+  int level;
+  int result;
+
+  //
+  // main thread: display status update if not in CGI mode
+  //
+  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Writing %s...", bsr_config->output_file_name);
+    fflush(stdout);
+  }
+
+  if (bsr_config->png_compression > 0) {
+    //
+    // worker threads:  wait for main thread to say go
+    // main thread: tell worker threads to go
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
+    } else {
+      // main thread
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: filter and compress this thread's strip
+    //
+    if (bsr_config->png_compression == 1) {
+      level=1;
+    } else {
+      level=6;
+    }
+    compressPNGStrip(bsr_config, bsr_state, level);
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done and then signal that they can continue to next step.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_BEGIN);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+      // ready to continue, set all worker thread status to continue
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_BEGIN;
+      }
+    } // end if not main thread
+
+    //
+    // all threads: once no thread reads unfiltered rows any more, copy compressed strips over their own rows in
+    // image_output_buf. If any strip is larger than its rows the unfiltered image is kept for libpng instead
+    //
+    if (bsr_config->bits_per_color == 16) {
+      row_bytes=6 * bsr_state->current_image_res_x;
+    } else {
+      row_bytes=3 * bsr_state->current_image_res_x;
+    }
+    lines_per_thread=(int)ceil(((double)bsr_state->current_image_res_y / (double)(bsr_state->num_worker_threads + 1)));
+    for (thread_id=0; thread_id <= bsr_state->num_worker_threads; thread_id++) {
+      first_line=thread_id * lines_per_thread;
+      end_line=first_line + lines_per_thread;
+      if (end_line > bsr_state->current_image_res_y) {
+        end_line=bsr_state->current_image_res_y;
+      }
+      if ((first_line < end_line) && (bsr_state->png_strips[thread_id].compressed_size > ((size_t)(end_line - first_line) * (size_t)row_bytes))) {
+        strips_fit=0;
+      }
+    }
+    first_line=bsr_state->perthread->my_thread_id * lines_per_thread;
+    if ((strips_fit == 1) && (first_line < bsr_state->current_image_res_y)) {
+      memcpy(bsr_state->row_pointers[first_line], bsr_state->compression_buf2, bsr_state->png_strips[bsr_state->perthread->my_thread_id].compressed_size);
+    }
+
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done, write file and then signal that they can continue.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_OUTPUT_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_CONTINUE);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_COMPLETE);
+    }
+  } // end if png_compression
+
+  //
+  // main thread: output PNG image to file or stdout
+  //
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if (bsr_config->cgi_mode != 1) {
+      output_file=fopen(bsr_config->output_file_name, "wb");
+      if (output_file == NULL) {
+        printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+        fflush(stdout);
+        exit(1);
+      }
+    } else {
+      output_file=stdout;
+    }
+
+    if ((bsr_config->png_compression > 0) && (strips_fit == 1)) {
+      result=outputPNGStrips(bsr_config, bsr_state, output_file);
+    } else {
+      result=outputPNGlibpng(bsr_config, bsr_state, output_file);
+    }
+    if (result != 0) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not write %s\n", bsr_config->output_file_name);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    if (bsr_config->cgi_mode != 1) {
+      fclose(output_file);
+    }
+
+    // ready to continue, set all worker thread status to continue
+    if (bsr_config->png_compression > 0) {
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_CONTINUE;
+      }
+    }
+
+    //
+    // display status message if not CGI mode
+    //
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
       clock_gettime(CLOCK_REALTIME, &endtime);
       elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
       printf(" (%.3fs)\n", elapsed_time);
       fflush(stdout);
     }
-
-    // close output file
-    fclose(output_file);
-  }
+  } // end if main thread
 
 #endif // BSR_USE_PNG
 
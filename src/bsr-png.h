@@ -39,6 +39,14 @@
 #ifndef BSR_PNG_H
 #define BSR_PNG_H
 
+int outputPNGlibpng(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file);
+int outputPNGChunk(FILE *output_file, char *chunk_type, unsigned char *data, uint32_t data_size);
+int outputPNGHeader(bsr_config_t *bsr_config, FILE *output_file, int width, int height);
+unsigned char *filterPNGRow(unsigned char *row, unsigned char *prev_row, int row_bytes, int bytes_per_pixel, unsigned char *candidates);
+int compressPNGStrip(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level);
+int compressPNGStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band);
+int outputPNGStrips(bsr_config_t *bsr_config, bsr_state_t *bsr_state, FILE *output_file);
+int outputPNGTile(bsr_config_t *bsr_config, FILE *output_file, unsigned char *pixels, int width, int height, unsigned char *work_buf);
 int outputPNG(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_PNG_H
@@ -0,0 +1,393 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "bsr-png.h"
+#include "bsr-exr.h"
+#include "bsr-jpeg.h"
+#include "bsr-stream.h"
+#include "band-schedule.h"
+#include "bsr-output.h"
+
+#ifdef BSR_USE_PNG
+#include <zlib.h>
+#endif
+
+//
+// set up bands and ring slots for writing the image while it is converted (stream_output). PNG with the
+// multi-threaded encoder, JPG with standard Huffman tables and scanline EXR are streamed. Compressed EXR needs the
+// size of every chunk for the offset table before the first chunk, so it is only streamed to a regular file (or a new
+// one) where the offset table is written last, not to stdout in CGI mode or to a pipe or terminal. Each band is at least BSR_STREAM_BAND_SIZE bytes of converted pixels and a whole number of
+// JPEG MCU rows or EXR chunks. image_output_buf holds a ring of two bands per thread instead of the whole image and
+// stream_out_buf the encoded bands until the main thread has written them
+//
+int setStreamLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_res_x, int output_res_y) {
+  int bytes_per_pixel;
+  int row_bytes;
+  int lines_per_unit=1;
+  int band_lines;
+  int streamable=0;
+  int seekable=0;
+  struct stat file_stat;
+  size_t band_size;
+  size_t filtered_size;
+
+  bsr_state->stream_num_bands=0;
+  bsr_state->stream_band_lines=0;
+  bsr_state->stream_prefix_lines=0;
+  bsr_state->stream_num_slots=0;
+  bsr_state->stream_slot_size=0;
+  bsr_state->stream_out_slot_size=0;
+  bsr_state->stream_out_buf_size=0;
+  bsr_state->stream_slots_size=0;
+  if (bsr_config->stream_output == 0) {
+    return(0);
+  }
+
+  if ((bsr_config->deep_zoom == 0) && (bsr_config->image_format == 0) && (bsr_config->png_compression > 0)) {
+#ifdef BSR_USE_PNG
+    streamable=1;
+#endif
+  } else if ((bsr_config->deep_zoom == 0) && (bsr_config->image_format == 2) && (bsr_config->jpeg_encoding == 1)) {
+#ifdef BSR_USE_JPEG
+    streamable=1;
+    lines_per_unit=getJpegMCULines(bsr_config, bsr_state);
+#endif
+  } else if ((bsr_config->image_format == 1) && (bsr_state->exr_num_levels == 0)) {
+    if ((bsr_config->cgi_mode != 1) && ((stat(bsr_config->output_file_name, &file_stat) != 0) || S_ISREG(file_stat.st_mode))) {
+      seekable=1;
+    }
+    if (((bsr_config->exr_compression != 2) && (bsr_config->exr_compression != 3)) || (seekable == 1)) {
+      streamable=1;
+      lines_per_unit=getEXRLinesPerBlock(bsr_config);
+    }
+  }
+  if (streamable == 0) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: stream_output requires PNG with png_compression=1 or 2, JPG with jpeg_encoding=1 or scanline EXR (compressed EXR only to a regular file), writing image after conversion\n");
+      fflush(stdout);
+    }
+    return(0);
+  }
+
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  } else if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12) || (bsr_config->bits_per_color == 16)) {
+    bytes_per_pixel=6;
+  } else {
+    bytes_per_pixel=3;
+  }
+  row_bytes=bytes_per_pixel * output_res_x;
+  band_lines=(int)((BSR_STREAM_BAND_SIZE + (size_t)row_bytes - 1) / (size_t)row_bytes);
+  if (band_lines < BSR_BAND_LINES) {
+    band_lines=BSR_BAND_LINES;
+  }
+  band_lines=((band_lines + lines_per_unit - 1) / lines_per_unit) * lines_per_unit;
+  bsr_state->stream_band_lines=band_lines;
+  bsr_state->stream_num_bands=(output_res_y + band_lines - 1) / band_lines;
+  bsr_state->stream_num_slots=2 * (bsr_state->num_worker_threads + 1);
+  if (bsr_state->stream_num_slots > bsr_state->stream_num_bands) {
+    bsr_state->stream_num_slots=bsr_state->stream_num_bands;
+  }
+
+  //
+  // PNG bands also convert the rows before them again: enough to prime the deflate window plus the row above those
+  // so they are filtered exactly as in the band before
+  //
+  band_size=(size_t)band_lines * (size_t)row_bytes;
+  if (bsr_config->image_format == 0) {
+    bsr_state->stream_prefix_lines=((BSR_PNG_DICTIONARY_SIZE + row_bytes) / (row_bytes + 1)) + 1;
+    filtered_size=(size_t)band_lines * (size_t)(row_bytes + 1);
+    // zlib compressBound() plus room for the zlib header and sync flush marker
+    bsr_state->stream_out_slot_size=filtered_size + (filtered_size >> 12) + (filtered_size >> 14) + (filtered_size >> 25) + 77;
+  } else if (bsr_config->image_format == 2) {
+    // entropy-coded data with byte stuffing is at most a little over 3 times the RGB pixels, first band also has the header
+    bsr_state->stream_out_slot_size=(4 * band_size) + 65536;
+  } else {
+    // one chunk header per line at most, compressed chunks are never larger than uncompressed
+    bsr_state->stream_out_slot_size=band_size + ((size_t)band_lines * 8);
+  }
+  bsr_state->stream_slot_size=(size_t)(bsr_state->stream_prefix_lines + band_lines) * (size_t)row_bytes;
+  bsr_state->output_buffer_size=(size_t)bsr_state->stream_num_slots * bsr_state->stream_slot_size;
+  bsr_state->stream_out_buf_size=(size_t)bsr_state->stream_num_slots * bsr_state->stream_out_slot_size;
+  bsr_state->stream_slots_size=(size_t)bsr_state->stream_num_slots * sizeof(stream_slot_t);
+
+  return(0);
+}
+
+//
+// main thread: open the output file (or stdout in CGI mode) and write everything that comes before the first band:
+// PNG signature and header, EXR header and offset table. The offset table of compressed EXR is written by
+// closeStreamOutput(), space is left for it here. JPEG headers are part of the first band
+//
+int openStreamOutput(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int lines_per_block;
+  int offset_table_records;
+  uint64_t chunk_start;
+
+  if (bsr_config->cgi_mode != 1) {
+    bsr_state->stream_file=fopen(bsr_config->output_file_name, "wb");
+    if (bsr_state->stream_file == NULL) {
+      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+      fflush(stdout);
+      exit(1);
+    }
+  } else {
+    bsr_state->stream_file=stdout;
+  }
+  __atomic_store_n(&bsr_state->stream_bands_written, 0, __ATOMIC_RELEASE);
+
+  if (bsr_config->image_format == 0) {
+#ifdef BSR_USE_PNG
+    outputPNGHeader(bsr_config, bsr_state->stream_file, bsr_state->current_image_res_x, bsr_state->current_image_res_y);
+    bsr_state->stream_adler=(uint32_t)adler32(0L, Z_NULL, 0);
+#endif
+  } else if (bsr_config->image_format == 1) {
+    lines_per_block=getEXRLinesPerBlock(bsr_config);
+    offset_table_records=(bsr_state->current_image_res_y + lines_per_block - 1) / lines_per_block;
+    bsr_state->exr_header_size=outputEXRHeader(bsr_config, bsr_state, bsr_state->stream_file);
+    chunk_start=(uint64_t)bsr_state->exr_header_size + ((uint64_t)offset_table_records * 8ul);
+    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+      if (fseek(bsr_state->stream_file, (long)chunk_start, SEEK_SET) != 0) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not seek in %s\n", bsr_config->output_file_name);
+          fflush(stdout);
+        }
+        exit(1);
+      }
+    } else {
+      fflush(bsr_state->stream_file);
+      if (outputEXROffsetTable(bsr_config, bsr_state, fileno(bsr_state->stream_file), -1, lines_per_block, 0, bsr_state->current_image_res_y, chunk_start) != 0) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not write %s\n", bsr_config->output_file_name);
+          fflush(stdout);
+        }
+        exit(1);
+      }
+    }
+  }
+  fflush(bsr_state->stream_file);
+
+  return(0);
+}
+
+//
+// all threads: wait until the ring slot of band is free, that is the band stream_num_slots before it has been
+// written. The main thread writes bands while it waits
+//
+int waitForStreamSlot(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band) {
+  int loop_count=0;
+
+  if (band < bsr_state->stream_num_slots) {
+    return(0);
+  }
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    writeStreamBands(bsr_config, bsr_state, (band - bsr_state->stream_num_slots), 1);
+  } else {
+    while (__atomic_load_n(&bsr_state->stream_bands_written, __ATOMIC_ACQUIRE) <= (band - bsr_state->stream_num_slots)) {
+      // periodically check for exceptions
+      loop_count++;
+      if ((loop_count % 10000) == 0) {
+        checkExceptions(bsr_state);
+        loop_count=1;
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// all threads: encode the converted rows of band into its slot in stream_out_buf
+//
+int encodeStreamBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int band) {
+  if (bsr_config->image_format == 0) {
+    compressPNGStreamBand(bsr_config, bsr_state, band);
+  } else if (bsr_config->image_format == 1) {
+    encodeEXRStreamBand(bsr_config, bsr_state, band);
+  } else if (bsr_config->image_format == 2) {
+    encodeJpegStreamBand(bsr_config, bsr_state, band);
+  }
+
+  return(0);
+}
+
+//
+// main thread: write encoded bands in order up to last_band and flush them to the client. If wait is 0 only
+// bands that are already done are written, otherwise it waits for each band
+//
+int writeStreamBands(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int last_band, int wait) {
+  int band;
+  stream_slot_t *stream_slot;
+  unsigned char *output_p;
+  struct iovec iov[3];
+  int result=0;
+#ifdef BSR_USE_PNG
+  unsigned char chunk_buf[8];
+  unsigned char crc_buf[4];
+  size_t output_remaining;
+  size_t chunk_size;
+#endif
+
+  if (last_band >= bsr_state->stream_num_bands) {
+    last_band=bsr_state->stream_num_bands - 1;
+  }
+  for (band=bsr_state->stream_bands_written; band <= last_band; band++) {
+    if (wait == 1) {
+      waitForBands(bsr_state, 0, band, band);
+    } else if (isBandDone(bsr_state, 0, band) == 0) {
+      break;
+    }
+    stream_slot=&bsr_state->stream_slots[band % bsr_state->stream_num_slots];
+    output_p=bsr_state->stream_out_buf + ((size_t)(band % bsr_state->stream_num_slots) * bsr_state->stream_out_slot_size);
+    if (stream_slot->output_size == SIZE_MAX) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not encode rows %d to %d of %s\n", (band * bsr_state->stream_band_lines), (((band + 1) * bsr_state->stream_band_lines) - 1), bsr_config->output_file_name);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    //
+    // bands are written with one writev() each, the ring slot is reused so it is never passed by reference
+    //
+    fflush(bsr_state->stream_file);
+    if (bsr_config->image_format == 0) {
+#ifdef BSR_USE_PNG
+      //
+      // one IDAT chunk per band using the CRC computed by the thread that compressed it, bands larger than
+      // BSR_PNG_MAX_IDAT are split and checksummed here
+      //
+      bsr_state->stream_adler=(uint32_t)adler32_combine(bsr_state->stream_adler, stream_slot->adler, (z_off_t)stream_slot->filtered_size);
+      if (stream_slot->output_size <= BSR_PNG_MAX_IDAT) {
+        storeU32BE(chunk_buf, (uint32_t)stream_slot->output_size);
+        memcpy((chunk_buf + 4), "IDAT", 4);
+        storeU32BE(crc_buf, stream_slot->crc);
+        iov[0].iov_base=chunk_buf;
+        iov[0].iov_len=8;
+        iov[1].iov_base=output_p;
+        iov[1].iov_len=stream_slot->output_size;
+        iov[2].iov_base=crc_buf;
+        iov[2].iov_len=4;
+        result=writeOutputVector(fileno(bsr_state->stream_file), iov, 3, NULL);
+      } else {
+        output_remaining=stream_slot->output_size;
+        while (output_remaining > 0) {
+          chunk_size=output_remaining;
+          if (chunk_size > BSR_PNG_MAX_IDAT) {
+            chunk_size=BSR_PNG_MAX_IDAT;
+          }
+          outputPNGChunk(bsr_state->stream_file, "IDAT", output_p, (uint32_t)chunk_size);
+          output_p+=chunk_size;
+          output_remaining-=chunk_size;
+        }
+      }
+#endif
+    } else {
+      // JPEG entropy-coded data or EXR chunks
+      iov[0].iov_base=output_p;
+      iov[0].iov_len=stream_slot->output_size;
+      result=writeOutputVector(fileno(bsr_state->stream_file), iov, 1, NULL);
+    }
+    fflush(bsr_state->stream_file);
+    if (result != 0) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not write %s\n", bsr_config->output_file_name);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    // ring slot can be reused
+    __atomic_store_n(&bsr_state->stream_bands_written, (band + 1), __ATOMIC_RELEASE);
+  }
+
+  return(0);
+}
+
+//
+// main thread: write the remaining bands and whatever comes after the last one: PNG Adler-32 and IEND, JPEG EOI
+// or the compressed EXR offset table, then close the output file
+//
+int closeStreamOutput(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int lines_per_block;
+  int offset_table_records;
+  unsigned char eoi[2]={0xFF, 0xD9};
+#ifdef BSR_USE_PNG
+  unsigned char adler_buf[4];
+#endif
+
+  writeStreamBands(bsr_config, bsr_state, (bsr_state->stream_num_bands - 1), 1);
+
+  if (bsr_config->image_format == 0) {
+#ifdef BSR_USE_PNG
+    storeU32BE(adler_buf, bsr_state->stream_adler);
+    outputPNGChunk(bsr_state->stream_file, "IDAT", adler_buf, 4);
+    outputPNGChunk(bsr_state->stream_file, "IEND", NULL, 0);
+#endif
+  } else if (bsr_config->image_format == 1) {
+    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+      fflush(bsr_state->stream_file);
+      lines_per_block=getEXRLinesPerBlock(bsr_config);
+      offset_table_records=(bsr_state->current_image_res_y + lines_per_block - 1) / lines_per_block;
+      if (outputEXROffsetTable(bsr_config, bsr_state, fileno(bsr_state->stream_file), (int64_t)bsr_state->exr_header_size, lines_per_block, 0,\
+                               bsr_state->current_image_res_y, ((uint64_t)bsr_state->exr_header_size + ((uint64_t)offset_table_records * 8ul))) != 0) {
+        printf("Error: could not write %s\n", bsr_config->output_file_name);
+        fflush(stdout);
+        exit(1);
+      }
+    }
+  } else if (bsr_config->image_format == 2) {
+    fwrite(eoi, 2, 1, bsr_state->stream_file);
+  }
+  fflush(bsr_state->stream_file);
+
+  if (bsr_config->cgi_mode != 1) {
+    fclose(bsr_state->stream_file);
+  }
+  bsr_state->stream_file=NULL;
+
+  return(0);
+}
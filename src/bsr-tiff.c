@@ -0,0 +1,783 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "util.h"
+#include "icc-profiles.h"
+#include "bsr-tiff.h"
+#include "band-schedule.h"
+
+#ifdef BSR_USE_TIFF
+#include <zlib.h>
+
+//
+// BigTIFF field types and tags used by this writer
+//
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_UNDEFINED 7
+#define TIFF_LONG8 16
+#define TIFF_IFD8 18
+
+#define TIFF_TAG_NEW_SUBFILE_TYPE 254
+#define TIFF_TAG_IMAGE_WIDTH 256
+#define TIFF_TAG_IMAGE_LENGTH 257
+#define TIFF_TAG_BITS_PER_SAMPLE 258
+#define TIFF_TAG_COMPRESSION 259
+#define TIFF_TAG_PHOTOMETRIC 262
+#define TIFF_TAG_SAMPLES_PER_PIXEL 277
+#define TIFF_TAG_PLANAR_CONFIGURATION 284
+#define TIFF_TAG_PREDICTOR 317
+#define TIFF_TAG_TILE_WIDTH 322
+#define TIFF_TAG_TILE_LENGTH 323
+#define TIFF_TAG_TILE_OFFSETS 324
+#define TIFF_TAG_TILE_BYTE_COUNTS 325
+#define TIFF_TAG_SUB_IFDS 330
+#define TIFF_TAG_SAMPLE_FORMAT 339
+#define TIFF_TAG_ICC_PROFILE 34675
+
+#define TIFF_MAX_ENTRIES 16
+#endif // BSR_USE_TIFF
+
+//
+// set up pyramid levels and tiles for TIFF images. Each pyramid level is half the size of the one before it
+// (rounded down, at least 1 pixel) until the whole level fits in one tile. Levels after the first are stored in
+// tiff_pyramid_buf with the same interleaved RGB line layout as image_output_buf
+//
+int setTIFFLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int output_res_x, int output_res_y) {
+  int level;
+  int bytes_per_pixel;
+  tile_level_t *tiff_level;
+
+  bsr_state->tiff_num_levels=0;
+  bsr_state->tiff_num_tiles=0;
+  bsr_state->tiff_num_tile_rows=0;
+  bsr_state->tiff_num_bands=0;
+  bsr_state->tiff_pyramid_buf_size=0;
+  if (bsr_config->image_format != 5) {
+    return(0);
+  }
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  } else if (bsr_config->bits_per_color == 16) {
+    bytes_per_pixel=6;
+  } else {
+    bytes_per_pixel=3;
+  }
+
+  for (level=0; level < BSR_MAX_TILE_LEVELS; level++) {
+    tiff_level=&bsr_state->tiff_levels[level];
+    if (level == 0) {
+      tiff_level->width=output_res_x;
+      tiff_level->height=output_res_y;
+    } else {
+      // stop when the previous level fits in one tile
+      if ((bsr_config->tiff_pyramid == 0) || ((bsr_state->tiff_levels[level - 1].width <= bsr_config->tiff_tile_size) && (bsr_state->tiff_levels[level - 1].height <= bsr_config->tiff_tile_size))) {
+        break;
+      }
+      tiff_level->width=bsr_state->tiff_levels[level - 1].width >> 1;
+      if (tiff_level->width < 1) {
+        tiff_level->width=1;
+      }
+      tiff_level->height=bsr_state->tiff_levels[level - 1].height >> 1;
+      if (tiff_level->height < 1) {
+        tiff_level->height=1;
+      }
+    }
+    tiff_level->tiles_x=(tiff_level->width + bsr_config->tiff_tile_size - 1) / bsr_config->tiff_tile_size;
+    tiff_level->tiles_y=(tiff_level->height + bsr_config->tiff_tile_size - 1) / bsr_config->tiff_tile_size;
+    tiff_level->first_tile=bsr_state->tiff_num_tiles;
+    tiff_level->first_tile_row=bsr_state->tiff_num_tile_rows;
+    bsr_state->tiff_num_tiles+=(tiff_level->tiles_x * tiff_level->tiles_y);
+    bsr_state->tiff_num_tile_rows+=tiff_level->tiles_y;
+    if (level == 0) {
+      tiff_level->first_band=0;
+      tiff_level->num_bands=0;
+      tiff_level->buf_offset=0;
+    } else {
+      tiff_level->first_band=bsr_state->tiff_num_bands;
+      tiff_level->num_bands=(tiff_level->height + BSR_BAND_LINES - 1) / BSR_BAND_LINES;
+      tiff_level->buf_offset=bsr_state->tiff_pyramid_buf_size;
+      bsr_state->tiff_num_bands+=tiff_level->num_bands;
+      bsr_state->tiff_pyramid_buf_size+=((size_t)bytes_per_pixel * (size_t)tiff_level->width * (size_t)tiff_level->height);
+    }
+    bsr_state->tiff_num_levels++;
+  }
+
+  return(0);
+}
+
+#ifdef BSR_USE_TIFF
+//
+// pixels of a TIFF pyramid level
+//
+static unsigned char *getTIFFLevelBuf(bsr_state_t *bsr_state, int level) {
+  if (level == 0) {
+    return(bsr_state->image_output_buf);
+  }
+
+  return(bsr_state->tiff_pyramid_buf + bsr_state->tiff_levels[level].buf_offset);
+}
+
+//
+// reduce one band of lines of the previous level into this level, each sample is the average of 2x2 samples.
+// A previous level that is an odd number of pixels wide or high loses its last column or row. Integer samples
+// are averaged as stored (after the transfer function), which is what viewers expect from a pyramid
+//
+static int reduceTIFFBand(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int level, int band) {
+  tile_level_t *tiff_level;
+  tile_level_t *src_level;
+  int bytes_per_color;
+  size_t row_bytes;
+  size_t src_row_bytes;
+  int y;
+  int x;
+  int src_x0;
+  int src_x1;
+  int src_y1;
+  int channel;
+  unsigned char *dest_p;
+  unsigned char *src_row0_p;
+  unsigned char *src_row1_p;
+  unsigned char *src_p[4];
+  uint32_t sum;
+
+  tiff_level=&bsr_state->tiff_levels[level];
+  src_level=&bsr_state->tiff_levels[level - 1];
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_color=4;
+  } else if (bsr_config->bits_per_color == 16) {
+    bytes_per_color=2;
+  } else {
+    bytes_per_color=1;
+  }
+  row_bytes=3 * (size_t)bytes_per_color * (size_t)tiff_level->width;
+  src_row_bytes=3 * (size_t)bytes_per_color * (size_t)src_level->width;
+
+  for (y=band * BSR_BAND_LINES; ((y < ((band + 1) * BSR_BAND_LINES)) && (y < tiff_level->height)); y++) {
+    src_y1=(2 * y) + 1;
+    if (src_y1 >= src_level->height) {
+      src_y1=src_level->height - 1;
+    }
+    dest_p=getTIFFLevelBuf(bsr_state, level) + ((size_t)y * row_bytes);
+    src_row0_p=getTIFFLevelBuf(bsr_state, level - 1) + ((size_t)(2 * y) * src_row_bytes);
+    src_row1_p=getTIFFLevelBuf(bsr_state, level - 1) + ((size_t)src_y1 * src_row_bytes);
+    for (x=0; x < tiff_level->width; x++) {
+      src_x0=2 * x;
+      src_x1=src_x0 + 1;
+      if (src_x1 >= src_level->width) {
+        src_x1=src_level->width - 1;
+      }
+      for (channel=0; channel < 3; channel++) {
+        src_p[0]=src_row0_p + ((size_t)((src_x0 * 3) + channel) * (size_t)bytes_per_color);
+        src_p[1]=src_row0_p + ((size_t)((src_x1 * 3) + channel) * (size_t)bytes_per_color);
+        src_p[2]=src_row1_p + ((size_t)((src_x0 * 3) + channel) * (size_t)bytes_per_color);
+        src_p[3]=src_row1_p + ((size_t)((src_x1 * 3) + channel) * (size_t)bytes_per_color);
+        if (bytes_per_color == 4) {
+          // 32-bit float, big-endian
+          dest_p+=storeFloatBE(dest_p, 0.25f * (loadFloatBE(src_p[0]) + loadFloatBE(src_p[1]) + loadFloatBE(src_p[2]) + loadFloatBE(src_p[3])));
+        } else if (bytes_per_color == 2) {
+          // 16-bit unsigned integer, big-endian
+          sum=(uint32_t)loadU16BE(src_p[0]) + (uint32_t)loadU16BE(src_p[1]) + (uint32_t)loadU16BE(src_p[2]) + (uint32_t)loadU16BE(src_p[3]);
+          dest_p+=storeU16BE(dest_p, (uint16_t)((sum + 2) >> 2));
+        } else {
+          // 8-bit unsigned integer
+          sum=(uint32_t)*src_p[0] + (uint32_t)*src_p[1] + (uint32_t)*src_p[2] + (uint32_t)*src_p[3];
+          dest_p+=storeU8(dest_p, (unsigned char)((sum + 2) >> 2));
+        }
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// apply the TIFF predictor to each line of a tile in place. Integer samples use horizontal differencing (predictor 2),
+// floating-point samples use the floating-point predictor (3): the bytes of each line are split into planes, most
+// significant byte first, then every byte is replaced by its difference to the same byte of the previous pixel.
+// line_buf holds one line for the byte planes
+//
+static int predictTIFFTile(bsr_config_t *bsr_config, unsigned char *tile, unsigned char *line_buf) {
+  int line_samples;
+  size_t line_bytes;
+  int line;
+  int i;
+  int byte;
+  unsigned char *line_p;
+
+  line_samples=3 * bsr_config->tiff_tile_size;
+  for (line=0; line < bsr_config->tiff_tile_size; line++) {
+    if (bsr_config->bits_per_color == 32) {
+      line_bytes=(size_t)line_samples * 4;
+      line_p=tile + ((size_t)line * line_bytes);
+      for (i=0; i < line_samples; i++) {
+        for (byte=0; byte < 4; byte++) {
+          line_buf[((size_t)byte * (size_t)line_samples) + (size_t)i]=line_p[((size_t)i * 4) + (size_t)byte];
+        }
+      }
+      for (i=(int)line_bytes - 1; i >= 3; i--) {
+        line_p[i]=(unsigned char)(line_buf[i] - line_buf[i - 3]);
+      }
+      line_p[2]=line_buf[2];
+      line_p[1]=line_buf[1];
+      line_p[0]=line_buf[0];
+    } else if (bsr_config->bits_per_color == 16) {
+      line_p=tile + ((size_t)line * (size_t)line_samples * 2);
+      for (i=line_samples - 1; i >= 3; i--) {
+        storeU16BE(line_p + ((size_t)i * 2), (uint16_t)(loadU16BE(line_p + ((size_t)i * 2)) - loadU16BE(line_p + ((size_t)(i - 3) * 2))));
+      }
+    } else {
+      line_p=tile + ((size_t)line * (size_t)line_samples);
+      for (i=line_samples - 1; i >= 3; i--) {
+        line_p[i]=(unsigned char)(line_p[i] - line_p[i - 3]);
+      }
+    }
+  }
+
+  return(0);
+}
+
+//
+// encode one row of tiles of a level. Each tile is copied from the level buffer into compression_buf1 (padded with
+// zeros past the right and bottom edges of the image, TIFF tiles are always full size), optionally compressed into
+// compression_buf2 and written at the end of the file. Rows of tiles are written in the order threads finish them,
+// tiff_tile_table records where each tile went
+//
+static int encodeTIFFTileRow(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd, int level, int tile_y) {
+  tile_level_t *tiff_level;
+  int bytes_per_pixel;
+  size_t row_bytes;
+  size_t tile_row_bytes;
+  size_t tile_bytes;
+  size_t copy_bytes;
+  int tile_x;
+  int tile;
+  int first_x;
+  int tile_width;
+  int tile_height;
+  int y;
+  unsigned char *src_p;
+  unsigned char *tile_data;
+  uLongf compressed_size;
+  uint64_t data_size;
+  uint64_t file_offset;
+  struct iovec iov;
+
+  tiff_level=&bsr_state->tiff_levels[level];
+  if (bsr_config->bits_per_color == 32) {
+    bytes_per_pixel=12;
+  } else if (bsr_config->bits_per_color == 16) {
+    bytes_per_pixel=6;
+  } else {
+    bytes_per_pixel=3;
+  }
+  row_bytes=(size_t)bytes_per_pixel * (size_t)tiff_level->width;
+  tile_row_bytes=(size_t)bytes_per_pixel * (size_t)bsr_config->tiff_tile_size;
+  tile_bytes=tile_row_bytes * (size_t)bsr_config->tiff_tile_size;
+  tile_height=tiff_level->height - (tile_y * bsr_config->tiff_tile_size);
+  if (tile_height > bsr_config->tiff_tile_size) {
+    tile_height=bsr_config->tiff_tile_size;
+  }
+
+  for (tile_x=0; tile_x < tiff_level->tiles_x; tile_x++) {
+    tile=tiff_level->first_tile + (tile_y * tiff_level->tiles_x) + tile_x;
+    first_x=tile_x * bsr_config->tiff_tile_size;
+    tile_width=tiff_level->width - first_x;
+    if (tile_width > bsr_config->tiff_tile_size) {
+      tile_width=bsr_config->tiff_tile_size;
+    }
+
+    //
+    // copy tile from level buffer
+    //
+    copy_bytes=(size_t)tile_width * (size_t)bytes_per_pixel;
+    src_p=getTIFFLevelBuf(bsr_state, level) + ((size_t)tile_y * (size_t)bsr_config->tiff_tile_size * row_bytes) + ((size_t)first_x * (size_t)bytes_per_pixel);
+    for (y=0; y < tile_height; y++) {
+      memcpy(bsr_state->compression_buf1 + ((size_t)y * tile_row_bytes), src_p, copy_bytes);
+      if (copy_bytes < tile_row_bytes) {
+        memset(bsr_state->compression_buf1 + ((size_t)y * tile_row_bytes) + copy_bytes, 0, (tile_row_bytes - copy_bytes));
+      }
+      src_p+=row_bytes;
+    }
+    if (tile_height < bsr_config->tiff_tile_size) {
+      memset(bsr_state->compression_buf1 + ((size_t)tile_height * tile_row_bytes), 0, ((size_t)(bsr_config->tiff_tile_size - tile_height) * tile_row_bytes));
+    }
+
+    //
+    // optionally compress
+    //
+    if (bsr_config->tiff_compression == 1) {
+      predictTIFFTile(bsr_config, bsr_state->compression_buf1, bsr_state->compression_buf2);
+      compressed_size=compressBound((uLong)tile_bytes);
+      if (compress2((Bytef *)bsr_state->compression_buf2, &compressed_size, (const Bytef *)bsr_state->compression_buf1, (uLong)tile_bytes, 6) != Z_OK) {
+        printf("Error: deflate compression failed for TIFF level: %d, tile_x: %d, tile_y: %d\n", level, tile_x, tile_y);
+        fflush(stdout);
+        exit(1);
+      }
+      tile_data=bsr_state->compression_buf2;
+      data_size=(uint64_t)compressed_size;
+    } else {
+      tile_data=bsr_state->compression_buf1;
+      data_size=(uint64_t)tile_bytes;
+    }
+
+    //
+    // claim space at the end of the file and write tile
+    //
+    file_offset=__atomic_fetch_add(&bsr_state->tiff_file_offset, data_size, __ATOMIC_ACQ_REL);
+    iov.iov_base=tile_data;
+    iov.iov_len=(size_t)data_size;
+    if (writeVector(fd, &iov, 1, (int64_t)file_offset) != 0) {
+      printf("Error: could not write %s\n", bsr_config->output_file_name);
+      fflush(stdout);
+      exit(1);
+    }
+    bsr_state->tiff_tile_table[(2 * tile)]=file_offset;
+    bsr_state->tiff_tile_table[(2 * tile) + 1]=data_size;
+  }
+
+  return(0);
+}
+
+//
+// all threads: build pyramid levels and encode all rows of tiles. Tasks are claimed from the band scheduler:
+// first the pyramid bands of each level in order, each waiting only for the bands of the previous level it reads,
+// then the rows of tiles in level order, each waiting only for the bands of its own level it reads
+//
+static int encodeTIFFTiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd) {
+  int task;
+  int num_tasks;
+  int level;
+  int band;
+  int src_band;
+  int row;
+  int tile_y;
+  int first_y;
+  int last_y;
+  tile_level_t *tiff_level;
+
+  num_tasks=bsr_state->tiff_num_bands + bsr_state->tiff_num_tile_rows;
+  for (task=claimBandTask(bsr_state); task < num_tasks; task=claimBandTask(bsr_state)) {
+    if (task < bsr_state->tiff_num_bands) {
+      //
+      // pyramid band
+      //
+      level=bsr_state->tiff_num_levels - 1;
+      while (bsr_state->tiff_levels[level].first_band > task) {
+        level--;
+      }
+      tiff_level=&bsr_state->tiff_levels[level];
+      band=task - tiff_level->first_band;
+      if (level > 1) {
+        // wait for the lines of the previous level this band reads
+        first_y=2 * band * BSR_BAND_LINES;
+        last_y=(2 * (((band + 1) * BSR_BAND_LINES) - 1)) + 1;
+        if (last_y >= bsr_state->tiff_levels[level - 1].height) {
+          last_y=bsr_state->tiff_levels[level - 1].height - 1;
+        }
+        src_band=bsr_state->tiff_levels[level - 1].first_band;
+        waitForLevelBands(bsr_state, src_band + (first_y / BSR_BAND_LINES), src_band + (last_y / BSR_BAND_LINES));
+      }
+      reduceTIFFBand(bsr_config, bsr_state, level, band);
+      setLevelBandDone(bsr_state, task);
+    } else {
+      //
+      // row of tiles
+      //
+      row=task - bsr_state->tiff_num_bands;
+      level=bsr_state->tiff_num_levels - 1;
+      while (bsr_state->tiff_levels[level].first_tile_row > row) {
+        level--;
+      }
+      tiff_level=&bsr_state->tiff_levels[level];
+      tile_y=row - tiff_level->first_tile_row;
+      if (level > 0) {
+        // wait for the lines of this level the row of tiles reads
+        first_y=tile_y * bsr_config->tiff_tile_size;
+        last_y=first_y + bsr_config->tiff_tile_size - 1;
+        if (last_y >= tiff_level->height) {
+          last_y=tiff_level->height - 1;
+        }
+        waitForLevelBands(bsr_state, tiff_level->first_band + (first_y / BSR_BAND_LINES), tiff_level->first_band + (last_y / BSR_BAND_LINES));
+      }
+      encodeTIFFTileRow(bsr_config, bsr_state, fd, level, tile_y);
+    }
+  }
+
+  return(0);
+}
+
+//
+// store a BigTIFF IFD entry with a single value or an offset to the values. Values are stored left justified
+// in the 8 byte value field
+//
+static int storeTIFFEntry(unsigned char *dest, int tag, int type, uint64_t count, uint64_t value) {
+  unsigned char *dest_p;
+
+  dest_p=dest;
+  dest_p+=storeU16BE(dest_p, (uint16_t)tag);
+  dest_p+=storeU16BE(dest_p, (uint16_t)type);
+  dest_p+=storeU64BE(dest_p, count);
+  memset(dest_p, 0, 8);
+  if ((count == 1) && (type == TIFF_SHORT)) {
+    storeU16BE(dest_p, (uint16_t)value);
+  } else if ((count == 1) && (type == TIFF_LONG)) {
+    storeU32BE(dest_p, (uint32_t)value);
+  } else {
+    // LONG8 and IFD8 single values or offset to values
+    storeU64BE(dest_p, value);
+  }
+
+  return(20);
+}
+
+//
+// store a BigTIFF IFD entry with three SHORT values (one per sample)
+//
+static int storeTIFFEntry3(unsigned char *dest, int tag, int value) {
+  unsigned char *dest_p;
+
+  dest_p=dest;
+  dest_p+=storeU16BE(dest_p, (uint16_t)tag);
+  dest_p+=storeU16BE(dest_p, (uint16_t)TIFF_SHORT);
+  dest_p+=storeU64BE(dest_p, 3);
+  dest_p+=storeU16BE(dest_p, (uint16_t)value);
+  dest_p+=storeU16BE(dest_p, (uint16_t)value);
+  dest_p+=storeU16BE(dest_p, (uint16_t)value);
+  storeU16BE(dest_p, 0);
+
+  return(20);
+}
+
+//
+// main thread: write IFDs for all levels at the end of the file, followed by tile offsets, tile byte counts, the
+// list of pyramid IFDs and the ICC profile. The full resolution image is the first IFD and pyramid levels are
+// reduced resolution sub-IFDs of it. Returns the offset of the first IFD
+//
+static uint64_t outputTIFFDirectories(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int fd) {
+  const unsigned char *profile=NULL;
+  unsigned int profile_len=0;
+  unsigned char *directory_buf;
+  unsigned char *directory_p;
+  unsigned char *entry_p;
+  size_t directory_size;
+  uint64_t directory_offset;
+  uint64_t ifd_offset[BSR_MAX_TILE_LEVELS];
+  uint64_t tile_offsets_offset[BSR_MAX_TILE_LEVELS];
+  uint64_t tile_byte_counts_offset[BSR_MAX_TILE_LEVELS];
+  uint64_t sub_ifds_offset=0;
+  uint64_t profile_offset=0;
+  uint64_t offset;
+  int num_entries[BSR_MAX_TILE_LEVELS];
+  int level;
+  int num_tiles;
+  int tile;
+  tile_level_t *tiff_level;
+  struct iovec iov;
+
+  //
+  // color profile, linear and flat 2.0 gamma have no ICC profile. Floating-point samples are linear like EXR
+  //
+  if (bsr_config->image_number_format == 1) {
+    profile=NULL;
+  } else if (bsr_config->color_profile == 1) {
+    profile=sRGB_v4_icc;
+    profile_len=sRGB_v4_icc_len;
+  } else if (bsr_config->color_profile == 2) {
+    profile=DisplayP3Compat_v4_icc;
+    profile_len=DisplayP3Compat_v4_icc_len;
+  } else if (bsr_config->color_profile == 3) {
+    profile=Rec2020Compat_v4_icc;
+    profile_len=Rec2020Compat_v4_icc_len;
+  } else if (bsr_config->color_profile == 4) {
+    profile=Rec601NTSC_v4_icc;
+    profile_len=Rec601NTSC_v4_icc_len;
+  } else if (bsr_config->color_profile == 5) {
+    profile=Rec601PAL_v4_icc;
+    profile_len=Rec601PAL_v4_icc_len;
+  } else if (bsr_config->color_profile == 6) {
+    profile=Rec709_v4_icc;
+    profile_len=Rec709_v4_icc_len;
+  } else if (bsr_config->color_profile == 8) {
+    profile=Rec2100PQ_v4_icc;
+    profile_len=Rec2100PQ_v4_icc_len;
+  }
+
+  //
+  // layout: IFDs, then arrays that do not fit in an entry. IFDs start on an 8 byte boundary
+  //
+  directory_offset=(bsr_state->tiff_file_offset + 7) & ~(uint64_t)7;
+  offset=directory_offset;
+  for (level=0; level < bsr_state->tiff_num_levels; level++) {
+    num_entries[level]=13;
+    if (bsr_config->tiff_compression == 1) {
+      num_entries[level]++; // predictor
+    }
+    if (level == 0) {
+      if (bsr_state->tiff_num_levels > 1) {
+        num_entries[level]++; // sub-IFDs
+      }
+      if (profile != NULL) {
+        num_entries[level]++; // ICC profile
+      }
+    }
+    ifd_offset[level]=offset;
+    offset+=(16 + (20 * (uint64_t)num_entries[level]));
+  }
+  for (level=0; level < bsr_state->tiff_num_levels; level++) {
+    num_tiles=bsr_state->tiff_levels[level].tiles_x * bsr_state->tiff_levels[level].tiles_y;
+    if (num_tiles > 1) {
+      tile_offsets_offset[level]=offset;
+      offset+=(8 * (uint64_t)num_tiles);
+      tile_byte_counts_offset[level]=offset;
+      offset+=(8 * (uint64_t)num_tiles);
+    } else {
+      tile_offsets_offset[level]=0;
+      tile_byte_counts_offset[level]=0;
+    }
+  }
+  if (bsr_state->tiff_num_levels > 2) {
+    sub_ifds_offset=offset;
+    offset+=(8 * (uint64_t)(bsr_state->tiff_num_levels - 1));
+  }
+  if (profile != NULL) {
+    profile_offset=offset;
+    offset+=(uint64_t)profile_len;
+  }
+  directory_size=(size_t)(offset - directory_offset);
+  directory_buf=(unsigned char *)malloc(directory_size);
+  if (directory_buf == NULL) {
+    printf("Error: could not allocate memory for TIFF directories\n");
+    fflush(stdout);
+    exit(1);
+  }
+
+  //
+  // IFDs, entries are in ascending tag order
+  //
+  for (level=0; level < bsr_state->tiff_num_levels; level++) {
+    tiff_level=&bsr_state->tiff_levels[level];
+    num_tiles=tiff_level->tiles_x * tiff_level->tiles_y;
+    directory_p=directory_buf + (ifd_offset[level] - directory_offset);
+    directory_p+=storeU64BE(directory_p, (uint64_t)num_entries[level]);
+    entry_p=directory_p;
+    if (level == 0) {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_NEW_SUBFILE_TYPE, TIFF_LONG, 1, 0);
+    } else {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_NEW_SUBFILE_TYPE, TIFF_LONG, 1, 1); // reduced resolution image
+    }
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_IMAGE_WIDTH, TIFF_LONG, 1, (uint64_t)tiff_level->width);
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_IMAGE_LENGTH, TIFF_LONG, 1, (uint64_t)tiff_level->height);
+    entry_p+=storeTIFFEntry3(entry_p, TIFF_TAG_BITS_PER_SAMPLE, bsr_config->bits_per_color);
+    if (bsr_config->tiff_compression == 1) {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_COMPRESSION, TIFF_SHORT, 1, 8);   // Adobe deflate
+    } else {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_COMPRESSION, TIFF_SHORT, 1, 1);   // uncompressed
+    }
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_PHOTOMETRIC, TIFF_SHORT, 1, 2);     // RGB
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_SAMPLES_PER_PIXEL, TIFF_SHORT, 1, 3);
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_PLANAR_CONFIGURATION, TIFF_SHORT, 1, 1); // interleaved RGB
+    if (bsr_config->tiff_compression == 1) {
+      if (bsr_config->image_number_format == 1) {
+        entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_PREDICTOR, TIFF_SHORT, 1, 3);   // floating-point
+      } else {
+        entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_PREDICTOR, TIFF_SHORT, 1, 2);   // horizontal differencing
+      }
+    }
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_TILE_WIDTH, TIFF_LONG, 1, (uint64_t)bsr_config->tiff_tile_size);
+    entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_TILE_LENGTH, TIFF_LONG, 1, (uint64_t)bsr_config->tiff_tile_size);
+    if (num_tiles > 1) {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_TILE_OFFSETS, TIFF_LONG8, (uint64_t)num_tiles, tile_offsets_offset[level]);
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_TILE_BYTE_COUNTS, TIFF_LONG8, (uint64_t)num_tiles, tile_byte_counts_offset[level]);
+      for (tile=0; tile < num_tiles; tile++) {
+        storeU64BE(directory_buf + (tile_offsets_offset[level] - directory_offset) + ((size_t)tile * 8), bsr_state->tiff_tile_table[2 * (tiff_level->first_tile + tile)]);
+        storeU64BE(directory_buf + (tile_byte_counts_offset[level] - directory_offset) + ((size_t)tile * 8), bsr_state->tiff_tile_table[(2 * (tiff_level->first_tile + tile)) + 1]);
+      }
+    } else {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_TILE_OFFSETS, TIFF_LONG8, 1, bsr_state->tiff_tile_table[2 * tiff_level->first_tile]);
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_TILE_BYTE_COUNTS, TIFF_LONG8, 1, bsr_state->tiff_tile_table[(2 * tiff_level->first_tile) + 1]);
+    }
+    if ((level == 0) && (bsr_state->tiff_num_levels > 2)) {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_SUB_IFDS, TIFF_IFD8, (uint64_t)(bsr_state->tiff_num_levels - 1), sub_ifds_offset);
+      for (tile=1; tile < bsr_state->tiff_num_levels; tile++) {
+        storeU64BE(directory_buf + (sub_ifds_offset - directory_offset) + ((size_t)(tile - 1) * 8), ifd_offset[tile]);
+      }
+    } else if ((level == 0) && (bsr_state->tiff_num_levels == 2)) {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_SUB_IFDS, TIFF_IFD8, 1, ifd_offset[1]);
+    }
+    if (bsr_config->image_number_format == 1) {
+      entry_p+=storeTIFFEntry3(entry_p, TIFF_TAG_SAMPLE_FORMAT, 3);              // IEEE floating-point
+    } else {
+      entry_p+=storeTIFFEntry3(entry_p, TIFF_TAG_SAMPLE_FORMAT, 1);              // unsigned integer
+    }
+    if ((level == 0) && (profile != NULL)) {
+      entry_p+=storeTIFFEntry(entry_p, TIFF_TAG_ICC_PROFILE, TIFF_UNDEFINED, (uint64_t)profile_len, profile_offset);
+      memcpy(directory_buf + (profile_offset - directory_offset), profile, profile_len);
+    }
+    // no next IFD, pyramid levels are sub-IFDs
+    storeU64BE(entry_p, 0);
+  }
+
+  //
+  // write directories
+  //
+  iov.iov_base=directory_buf;
+  iov.iov_len=directory_size;
+  if (writeVector(fd, &iov, 1, (int64_t)directory_offset) != 0) {
+    printf("Error: could not write %s\n", bsr_config->output_file_name);
+    fflush(stdout);
+    exit(1);
+  }
+  free(directory_buf);
+
+  return(directory_offset);
+}
+#endif // BSR_USE_TIFF
+
+int outputTIFF(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+#ifdef BSR_USE_TIFF
+  FILE *output_file=NULL;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  int i;
+  int fd;
+  unsigned char header[16];
+  unsigned char *header_p;
+  uint64_t directory_offset;
+  struct iovec iov;
+
+  //
+  // main thread: display status update, create output file and reserve space for the header
+  //
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &starttime);
+      printf("Writing %s...", bsr_config->output_file_name);
+      fflush(stdout);
+    }
+    output_file=fopen(bsr_config->output_file_name, "wb");
+    if (output_file == NULL) {
+      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+      fflush(stdout);
+      exit(1);
+    }
+    bsr_state->tiff_file_offset=16;
+    initBandSchedule(bsr_state);
+  }
+
+  //
+  // worker threads:  wait for main thread to say go
+  // main thread: tell worker threads to go
+  //
+  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+    waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_BEGIN);
+  } else {
+    // main thread
+    for (i=1; i <= bsr_state->num_worker_threads; i++) {
+      bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_COMPRESS_BEGIN;
+    }
+  } // end if not main thread
+
+  //
+  // all threads: build pyramid levels, compress tiles and write them to the file
+  //
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    fd=fileno(output_file);
+  } else {
+    fd=open(bsr_config->output_file_name, O_WRONLY);
+    if (fd == -1) {
+      printf("Error: could not open %s for writing\n", bsr_config->output_file_name);
+      fflush(stdout);
+      exit(1);
+    }
+  }
+  encodeTIFFTiles(bsr_config, bsr_state, fd);
+
+  //
+  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+  // main thread: wait until all other threads are done, write directories and header, then signal that they can continue
+  //
+  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+    close(fd);
+    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_IMAGE_COMPRESS_COMPLETE;
+    waitForMainThread(bsr_state, THREAD_STATUS_IMAGE_OUTPUT_CONTINUE);
+  } else {
+    waitForWorkerThreads(bsr_state, THREAD_STATUS_IMAGE_COMPRESS_COMPLETE);
+    directory_offset=outputTIFFDirectories(bsr_config, bsr_state, fd);
+
+    // BigTIFF header: big-endian byte order, version 43, 8 byte offsets, first IFD offset
+    header_p=header;
+    header_p+=storeU8(header_p, 'M');
+    header_p+=storeU8(header_p, 'M');
+    header_p+=storeU16BE(header_p, 43);
+    header_p+=storeU16BE(header_p, 8);
+    header_p+=storeU16BE(header_p, 0);
+    storeU64BE(header_p, directory_offset);
+    iov.iov_base=header;
+    iov.iov_len=16;
+    if (writeVector(fd, &iov, 1, 0) != 0) {
+      printf("Error: could not write %s\n", bsr_config->output_file_name);
+      fflush(stdout);
+      exit(1);
+    }
+    fclose(output_file);
+
+    // ready to continue, set all worker thread status to continue
+    for (i=1; i <= bsr_state->num_worker_threads; i++) {
+      bsr_state->status_array[i].status=THREAD_STATUS_IMAGE_OUTPUT_CONTINUE;
+    }
+
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &endtime);
+      elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+      printf(" (%.3fs)\n", elapsed_time);
+      fflush(stdout);
+    }
+  } // end if not main thread
+#endif // BSR_USE_TIFF
+
+  return(0);
+}
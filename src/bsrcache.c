@@ -0,0 +1,682 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+//
+// dataset residency manager
+// This program loads bsrender data files into a shared memory cache (hugetlbfs or tmpfs) that bsrender attaches to
+// with the data_cache_directory option, warms the page cache in parallel, and reports residency
+//
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include "util.h"
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define BSRCACHE_MAX_FILES 11
+#define BSRCACHE_COPY_ALIGNMENT 2097152 // worker slices are aligned to 2MB so they never share a huge page
+
+void printUsage() {
+  printf("bsrcache version %s\n", BSR_VERSION);
+  printf("\n\
+NAME\n\
+     bsrcache -- manage residency of bsrender data files in memory\n\
+\n\
+SYNOPSIS\n\
+     bsrcache [-d DIR] [-c DIR] [-p NUM] [-t NUM] [-w] [-l] [-r] [-u] [-h]\n\
+ \n\
+OPTIONS:\n\
+\n\
+     -d DIR\n\
+          Path to galaxy-* data files (default: galaxydata)\n\
+\n\
+     -c DIR\n\
+          Cache directory, should be on hugetlbfs or tmpfs (default: /dev/hugepages/bsrender)\n\
+          Set data_cache_directory in bsrender.cfg to the same path to use the cache\n\
+\n\
+     -p NUM\n\
+          Only process data files needed for this Gaia_min_parallax_quality (default: 0, all files)\n\
+\n\
+     -t NUM\n\
+          Number of parallel processes used to copy or warm each file (default: number of online cpus)\n\
+\n\
+     -w\n\
+          Warm the page cache only with madvise(MADV_WILLNEED) and MAP_POPULATE, do not copy to cache directory\n\
+\n\
+     -l\n\
+          Lock the cached files (or data files with -w) in memory with mlock() and stay resident until interrupted\n\
+\n\
+     -r\n\
+          Report page cache residency of data files and status of cached copies, then exit\n\
+\n\
+     -u\n\
+          Remove cached copies from cache directory, then exit\n\
+\n\
+     -h\n\
+          Show help\n\
+\n\
+DESCRIPTON\n\
+ bsrcache loads bsrender data files once into a huge page backed shared memory cache so bsrender does not need to fault\n\
+ through the data files at 4K granularity after a reboot or memory pressure. Cached copies are validated by bsrender\n\
+ against the size and modification time of the data files and ignored if stale.\n\
+ \n");
+}
+
+int setDefaults(bsrcache_config_t *bsrcache_config) {
+  long online_cpus;
+
+  strncpy(bsrcache_config->data_file_directory, "galaxydata", 255);
+  bsrcache_config->data_file_directory[255]=0;
+  strncpy(bsrcache_config->data_cache_directory, "/dev/hugepages/bsrender", 255);
+  bsrcache_config->data_cache_directory[255]=0;
+  bsrcache_config->Gaia_min_parallax_quality=0;
+  online_cpus=sysconf(_SC_NPROCESSORS_ONLN);
+  if (online_cpus < 1) {
+    online_cpus=1;
+  }
+  bsrcache_config->num_processes=(int)online_cpus;
+  bsrcache_config->warm_only=0;
+  bsrcache_config->lock=0;
+  bsrcache_config->report=0;
+  bsrcache_config->remove=0;
+
+  return(0);
+}
+
+int getOptionValue(char *option_value, int argc, char **argv, int *i) {
+  char *option_start;
+
+  option_value[0]=0;
+  if (argv[*i][2] != 0) {
+    // option concatenated onto switch
+    option_start=argv[*i];
+    strncpy(option_value, (option_start + (size_t)2), 255);
+    option_value[255]=0;
+  } else if ((argc > (*i + 1)) && (argv[*i + 1][0] != '-')) {
+    // option is probably next argv
+    option_start=argv[*i + 1];
+    strncpy(option_value, option_start, 255);
+    option_value[255]=0;
+    *i+=1;
+  } // end if no space
+
+  return(0);
+}
+
+int processCmdArgs(bsrcache_config_t *bsrcache_config, int argc, char **argv) {
+  int i;
+  char option_value[256];
+
+  if (argc == 1) {
+    return(0);
+  } else {
+    for (i=1; i <= (argc - 1); i++) {
+      if (argv[i][1] == 'd') {
+        // data file directory
+        getOptionValue(option_value, argc, argv, &i);
+        strncpy(bsrcache_config->data_file_directory, option_value, 255);
+        bsrcache_config->data_file_directory[255]=0;
+      } else if (argv[i][1] == 'c') {
+        // cache directory
+        getOptionValue(option_value, argc, argv, &i);
+        strncpy(bsrcache_config->data_cache_directory, option_value, 255);
+        bsrcache_config->data_cache_directory[255]=0;
+      } else if (argv[i][1] == 'p') {
+        // minimum parallax quality
+        getOptionValue(option_value, argc, argv, &i);
+        bsrcache_config->Gaia_min_parallax_quality=atoi(option_value);
+      } else if (argv[i][1] == 't') {
+        // number of parallel processes
+        getOptionValue(option_value, argc, argv, &i);
+        bsrcache_config->num_processes=atoi(option_value);
+        if (bsrcache_config->num_processes < 1) {
+          bsrcache_config->num_processes=1;
+        }
+      } else if (argv[i][1] == 'w') {
+        // warm page cache only
+        bsrcache_config->warm_only=1;
+      } else if (argv[i][1] == 'l') {
+        // lock in memory and stay resident
+        bsrcache_config->lock=1;
+      } else if (argv[i][1] == 'r') {
+        // report residency
+        bsrcache_config->report=1;
+      } else if (argv[i][1] == 'u') {
+        // remove cached files
+        bsrcache_config->remove=1;
+      } else if (argv[i][1] == 'h') {
+        // print help
+        printUsage();
+        exit(0);
+      } // end which option
+    } // end for argc
+  } // end if any options
+  return(0);
+}
+
+int getDataFileNames(bsrcache_config_t *bsrcache_config, char file_names[BSRCACHE_MAX_FILES][256]) {
+  int file_count;
+  int i;
+  char *suffix;
+  // same parallax quality levels and order as openInputFiles() in bsrender
+  const int pq_levels[10]={100, 50, 30, 20, 10, 5, 3, 2, 1, 0};
+  const int pq_thresholds[10]={101, 100, 50, 30, 20, 10, 5, 3, 2, 1};
+
+  if (littleEndianTest() == 1) {
+    suffix=BSR_LE_SUFFIX;
+  } else {
+    suffix=BSR_BE_SUFFIX;
+  }
+
+  file_count=0;
+  sprintf(file_names[file_count], "%s-%s.%s", BSR_EXTERNAL_PREFIX, suffix, BSR_EXTENSION);
+  file_count++;
+  for (i=0; i < 10; i++) {
+    if (bsrcache_config->Gaia_min_parallax_quality < pq_thresholds[i]) {
+      sprintf(file_names[file_count], "%s-pq%03d-%s.%s", BSR_GDR3_PREFIX, pq_levels[i], suffix, BSR_EXTENSION);
+      file_count++;
+    }
+  }
+
+  return(file_count);
+}
+
+size_t getPageSize(char *directory_path) {
+  struct statfs fs;
+
+  //
+  // hugetlbfs reports the huge page size as the filesystem block size
+  //
+  if ((statfs(directory_path, &fs) == 0) && ((unsigned long)fs.f_type == (unsigned long)HUGETLBFS_MAGIC)) {
+    return((size_t)fs.f_bsize);
+  }
+
+  return((size_t)sysconf(_SC_PAGESIZE));
+}
+
+double getResidency(char *buf, size_t buf_size) {
+  unsigned char *residency_vector;
+  size_t page_size;
+  size_t page_count;
+  size_t resident_pages;
+  size_t i;
+
+  if ((buf == NULL) || (buf_size == 0)) {
+    return(0.0);
+  }
+  page_size=(size_t)sysconf(_SC_PAGESIZE);
+  page_count=(buf_size + page_size - 1) / page_size;
+  residency_vector=(unsigned char *)malloc(page_count);
+  if (residency_vector == NULL) {
+    return(0.0);
+  }
+  if (mincore(buf, buf_size, residency_vector) != 0) {
+    free(residency_vector);
+    return(0.0);
+  }
+  resident_pages=0;
+  for (i=0; i < page_count; i++) {
+    resident_pages+=(residency_vector[i] & 1);
+  }
+  free(residency_vector);
+
+  return((double)resident_pages * 100.0 / (double)page_count);
+}
+
+int waitForChildren(int num_children) {
+  int i;
+  int status;
+  int failed=0;
+
+  for (i=0; i < num_children; i++) {
+    if ((wait(&status) < 0) || (WIFEXITED(status) == 0) || (WEXITSTATUS(status) != 0)) {
+      failed=1;
+    }
+  }
+
+  return(failed);
+}
+
+int processFileParallel(bsrcache_config_t *bsrcache_config, char *src_buf, char *dest_buf, size_t file_size, int src_fd) {
+  int i;
+  int num_children;
+  size_t slice_size;
+  size_t slice_start;
+  size_t slice_end;
+  pid_t pid;
+  char *slice_buf;
+  int mmap_protection;
+  int mmap_visibility;
+
+  //
+  // split file into 2MB aligned slices, one per process. If dest_buf is NULL, just pull the slice
+  // into page cache, otherwise copy it into the cache file mapping
+  //
+  slice_size=(file_size + (size_t)bsrcache_config->num_processes - 1) / (size_t)bsrcache_config->num_processes;
+  slice_size=((slice_size + BSRCACHE_COPY_ALIGNMENT - 1) / BSRCACHE_COPY_ALIGNMENT) * BSRCACHE_COPY_ALIGNMENT;
+  num_children=0;
+  for (i=0; i < bsrcache_config->num_processes; i++) {
+    slice_start=(size_t)i * slice_size;
+    if (slice_start >= file_size) {
+      break;
+    }
+    slice_end=slice_start + slice_size;
+    if (slice_end > file_size) {
+      slice_end=file_size;
+    }
+    pid=fork();
+    if (pid < 0) {
+      printf("Error: fork() failed, errno: %d\n", errno);
+      fflush(stdout);
+      exit(1);
+    } else if (pid == 0) {
+      if (dest_buf == NULL) {
+        // warm page cache: map this slice with MAP_POPULATE and ask for readahead
+        mmap_protection=PROT_READ;
+        mmap_visibility=MAP_SHARED | MAP_POPULATE;
+        slice_buf=mmap(NULL, (slice_end - slice_start), mmap_protection, mmap_visibility, src_fd, (off_t)slice_start);
+        if (slice_buf == MAP_FAILED) {
+          exit(1);
+        }
+        madvise(slice_buf, (slice_end - slice_start), MADV_WILLNEED);
+        munmap(slice_buf, (slice_end - slice_start));
+      } else {
+        madvise((src_buf + slice_start), (slice_end - slice_start), MADV_WILLNEED);
+        memcpy((dest_buf + slice_start), (src_buf + slice_start), (slice_end - slice_start));
+      }
+      exit(0);
+    }
+    num_children++;
+  }
+
+  return(waitForChildren(num_children));
+}
+
+int cacheFile(bsrcache_config_t *bsrcache_config, char *file_name, uint64_t *total_bytes) {
+  char file_path[4096];
+  char cache_path[4096];
+  int src_fd;
+  int cache_fd;
+  struct stat src_sb;
+  struct stat cache_sb;
+  struct timespec file_times[2];
+  char *src_buf;
+  char *cache_buf;
+  size_t page_size;
+  size_t cache_size;
+  int mmap_protection;
+  int mmap_visibility;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+
+  snprintf(file_path, 4096, "%s/%s", bsrcache_config->data_file_directory, file_name);
+  snprintf(cache_path, 4096, "%s/%s", bsrcache_config->data_cache_directory, file_name);
+  src_fd=open(file_path, O_RDONLY);
+  if (src_fd < 0) {
+    printf("Warning: could not open %s, skipping\n", file_path);
+    fflush(stdout);
+    return(0);
+  }
+  fstat(src_fd, &src_sb);
+  if (src_sb.st_size == 0) {
+    close(src_fd);
+    return(0);
+  }
+
+  //
+  // skip files that are already cached and current
+  //
+  if ((stat(cache_path, &cache_sb) == 0) && (cache_sb.st_size >= src_sb.st_size)\
+       && (cache_sb.st_mtim.tv_sec == src_sb.st_mtim.tv_sec) && (cache_sb.st_mtim.tv_nsec == src_sb.st_mtim.tv_nsec)) {
+    printf("%s is already cached\n", file_name);
+    fflush(stdout);
+    close(src_fd);
+    return(0);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &starttime);
+  printf("Caching %s (%.3f GB)...", file_name, ((double)src_sb.st_size / 1.0E9));
+  fflush(stdout);
+
+  //
+  // create cache file. On hugetlbfs the size must be a multiple of the huge page size
+  //
+  unlink(cache_path);
+  cache_fd=open(cache_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (cache_fd < 0) {
+    printf("\nError: could not create %s, errno: %d\n", cache_path, errno);
+    fflush(stdout);
+    exit(1);
+  }
+  page_size=getPageSize(bsrcache_config->data_cache_directory);
+  cache_size=(((size_t)src_sb.st_size + page_size - 1) / page_size) * page_size;
+  if (ftruncate(cache_fd, (off_t)cache_size) != 0) {
+    printf("\nError: could not resize %s to %lu bytes, errno: %d (are enough huge pages reserved?)\n", cache_path, (unsigned long)cache_size, errno);
+    fflush(stdout);
+    unlink(cache_path);
+    exit(1);
+  }
+
+  mmap_protection=PROT_READ;
+  mmap_visibility=MAP_SHARED;
+  src_buf=mmap(NULL, src_sb.st_size, mmap_protection, mmap_visibility, src_fd, 0);
+  mmap_protection=PROT_READ | PROT_WRITE;
+  cache_buf=mmap(NULL, cache_size, mmap_protection, mmap_visibility, cache_fd, 0);
+  if ((src_buf == MAP_FAILED) || (cache_buf == MAP_FAILED)) {
+    printf("\nError: could not mmap %s or %s, errno: %d\n", file_path, cache_path, errno);
+    fflush(stdout);
+    unlink(cache_path);
+    exit(1);
+  }
+
+  //
+  // copy in parallel, then stamp cache file with data file modification time so bsrender can validate it
+  //
+  if (processFileParallel(bsrcache_config, src_buf, cache_buf, (size_t)src_sb.st_size, src_fd) != 0) {
+    printf("\nError: copy to %s failed (are enough huge pages reserved?)\n", cache_path);
+    fflush(stdout);
+    unlink(cache_path);
+    exit(1);
+  }
+  munmap(src_buf, src_sb.st_size);
+  munmap(cache_buf, cache_size);
+  file_times[0]=src_sb.st_atim;
+  file_times[1]=src_sb.st_mtim;
+  futimens(cache_fd, file_times);
+  close(cache_fd);
+  close(src_fd);
+  *total_bytes+=(uint64_t)src_sb.st_size;
+
+  clock_gettime(CLOCK_REALTIME, &endtime);
+  elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+  printf(" (%.3fs, %.3f GB/s)\n", elapsed_time, ((double)src_sb.st_size / 1.0E9 / elapsed_time));
+  fflush(stdout);
+
+  return(0);
+}
+
+int warmFile(bsrcache_config_t *bsrcache_config, char *file_name, uint64_t *total_bytes) {
+  char file_path[4096];
+  int src_fd;
+  struct stat src_sb;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+
+  snprintf(file_path, 4096, "%s/%s", bsrcache_config->data_file_directory, file_name);
+  src_fd=open(file_path, O_RDONLY);
+  if (src_fd < 0) {
+    printf("Warning: could not open %s, skipping\n", file_path);
+    fflush(stdout);
+    return(0);
+  }
+  fstat(src_fd, &src_sb);
+  if (src_sb.st_size == 0) {
+    close(src_fd);
+    return(0);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &starttime);
+  printf("Warming %s (%.3f GB)...", file_name, ((double)src_sb.st_size / 1.0E9));
+  fflush(stdout);
+  if (processFileParallel(bsrcache_config, NULL, NULL, (size_t)src_sb.st_size, src_fd) != 0) {
+    printf("\nWarning: could not warm all of %s\n", file_path);
+    fflush(stdout);
+  }
+  close(src_fd);
+  *total_bytes+=(uint64_t)src_sb.st_size;
+
+  clock_gettime(CLOCK_REALTIME, &endtime);
+  elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+  printf(" (%.3fs, %.3f GB/s)\n", elapsed_time, ((double)src_sb.st_size / 1.0E9 / elapsed_time));
+  fflush(stdout);
+
+  return(0);
+}
+
+int reportFile(bsrcache_config_t *bsrcache_config, char *file_name) {
+  char file_path[4096];
+  char cache_path[4096];
+  int fd;
+  struct stat src_sb;
+  struct stat cache_sb;
+  char *buf;
+  double src_residency=0.0;
+  double cache_residency=0.0;
+  int cache_status; // 0 = not cached, 1 = stale, 2 = current
+
+  snprintf(file_path, 4096, "%s/%s", bsrcache_config->data_file_directory, file_name);
+  snprintf(cache_path, 4096, "%s/%s", bsrcache_config->data_cache_directory, file_name);
+
+  fd=open(file_path, O_RDONLY);
+  if (fd < 0) {
+    printf("%-32s   not found\n", file_name);
+    return(0);
+  }
+  fstat(fd, &src_sb);
+  if (src_sb.st_size > 0) {
+    buf=mmap(NULL, src_sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf != MAP_FAILED) {
+      src_residency=getResidency(buf, src_sb.st_size);
+      munmap(buf, src_sb.st_size);
+    }
+  }
+  close(fd);
+
+  cache_status=0;
+  fd=open(cache_path, O_RDONLY);
+  if (fd >= 0) {
+    fstat(fd, &cache_sb);
+    if ((cache_sb.st_size >= src_sb.st_size) && (cache_sb.st_mtim.tv_sec == src_sb.st_mtim.tv_sec) && (cache_sb.st_mtim.tv_nsec == src_sb.st_mtim.tv_nsec)) {
+      cache_status=2;
+    } else {
+      cache_status=1;
+    }
+    if (cache_sb.st_size > 0) {
+      buf=mmap(NULL, cache_sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (buf != MAP_FAILED) {
+        cache_residency=getResidency(buf, cache_sb.st_size);
+        munmap(buf, cache_sb.st_size);
+      }
+    }
+    close(fd);
+  }
+
+  if (cache_status == 2) {
+    printf("%-32s %9.3f GB  page cache %5.1f%%  cached %5.1f%% resident\n", file_name, ((double)src_sb.st_size / 1.0E9), src_residency, cache_residency);
+  } else if (cache_status == 1) {
+    printf("%-32s %9.3f GB  page cache %5.1f%%  cached copy is stale\n", file_name, ((double)src_sb.st_size / 1.0E9), src_residency);
+  } else {
+    printf("%-32s %9.3f GB  page cache %5.1f%%  not cached\n", file_name, ((double)src_sb.st_size / 1.0E9), src_residency);
+  }
+  fflush(stdout);
+
+  return(0);
+}
+
+int removeCacheFile(bsrcache_config_t *bsrcache_config, char *file_name) {
+  char cache_path[4096];
+
+  snprintf(cache_path, 4096, "%s/%s", bsrcache_config->data_cache_directory, file_name);
+  if (unlink(cache_path) == 0) {
+    printf("Removed %s\n", cache_path);
+    fflush(stdout);
+  }
+
+  return(0);
+}
+
+int lockFile(char *directory, char *file_name) {
+  char file_path[4096];
+  int fd;
+  struct stat sb;
+  char *buf;
+
+  //
+  // map and lock file, mapping is intentionally kept until the process exits
+  //
+  snprintf(file_path, 4096, "%s/%s", directory, file_name);
+  fd=open(file_path, O_RDONLY);
+  if (fd < 0) {
+    return(0);
+  }
+  fstat(fd, &sb);
+  if (sb.st_size == 0) {
+    close(fd);
+    return(0);
+  }
+  buf=mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (buf == MAP_FAILED) {
+    printf("Warning: could not mmap %s for locking, errno: %d\n", file_path, errno);
+    fflush(stdout);
+    close(fd);
+    return(0);
+  }
+  if (mlock(buf, sb.st_size) != 0) {
+    printf("Warning: could not lock %s, errno: %d (check ulimit -l)\n", file_path, errno);
+    fflush(stdout);
+  } else {
+    printf("Locked %s (%.3f GB)\n", file_path, ((double)sb.st_size / 1.0E9));
+    fflush(stdout);
+  }
+  close(fd);
+
+  return(0);
+}
+
+int main(int argc, char **argv) {
+  bsrcache_config_t bsrcache_config;
+  char file_names[BSRCACHE_MAX_FILES][256];
+  int file_count;
+  int i;
+  uint64_t total_bytes=0;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+
+  //
+  // set default options and process command line options
+  //
+  setDefaults(&bsrcache_config);
+  processCmdArgs(&bsrcache_config, argc, argv);
+  printf("bsrcache version %s\n", BSR_VERSION);
+  file_count=getDataFileNames(&bsrcache_config, file_names);
+
+  //
+  // report residency
+  //
+  if (bsrcache_config.report == 1) {
+    printf("Data file directory: %s\n", bsrcache_config.data_file_directory);
+    printf("Cache directory: %s (page size %lu bytes)\n", bsrcache_config.data_cache_directory, (unsigned long)getPageSize(bsrcache_config.data_cache_directory));
+    for (i=0; i < file_count; i++) {
+      reportFile(&bsrcache_config, file_names[i]);
+    }
+    exit(0);
+  }
+
+  //
+  // remove cached files
+  //
+  if (bsrcache_config.remove == 1) {
+    for (i=0; i < file_count; i++) {
+      removeCacheFile(&bsrcache_config, file_names[i]);
+    }
+    exit(0);
+  }
+
+  //
+  // warm page cache or load files into cache directory
+  //
+  clock_gettime(CLOCK_REALTIME, &starttime);
+  if (bsrcache_config.warm_only == 1) {
+    printf("Warming page cache with %d processes\n", bsrcache_config.num_processes);
+    fflush(stdout);
+    for (i=0; i < file_count; i++) {
+      warmFile(&bsrcache_config, file_names[i], &total_bytes);
+    }
+  } else {
+    mkdir(bsrcache_config.data_cache_directory, 0755);
+    printf("Loading data files into %s with %d processes\n", bsrcache_config.data_cache_directory, bsrcache_config.num_processes);
+    if (getPageSize(bsrcache_config.data_cache_directory) == (size_t)sysconf(_SC_PAGESIZE)) {
+      printf("Warning: %s is not on hugetlbfs, cached files will use normal pages\n", bsrcache_config.data_cache_directory);
+    }
+    fflush(stdout);
+    for (i=0; i < file_count; i++) {
+      cacheFile(&bsrcache_config, file_names[i], &total_bytes);
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &endtime);
+  elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+  if (total_bytes > 0) {
+    printf("Total: %.3f GB in %.3fs (%.3f GB/s)\n", ((double)total_bytes / 1.0E9), elapsed_time, ((double)total_bytes / 1.0E9 / elapsed_time));
+    fflush(stdout);
+  }
+
+  //
+  // optionally lock files in memory and stay resident
+  //
+  if (bsrcache_config.lock == 1) {
+    for (i=0; i < file_count; i++) {
+      if (bsrcache_config.warm_only == 1) {
+        lockFile(bsrcache_config.data_file_directory, file_names[i]);
+      } else {
+        lockFile(bsrcache_config.data_cache_directory, file_names[i]);
+      }
+    }
+    printf("Holding locked files in memory until interrupted\n");
+    fflush(stdout);
+    while (1) {
+      pause();
+    }
+  }
+
+  return(0);
+}
@@ -0,0 +1,505 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+//
+// data file compressor
+// This program converts bsrender data files to and from the block compressed format, which bsrender detects
+// automatically. Each worker thread in bsrender decompresses only its own blocks
+//
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "bsr-compress.h"
+
+#define BSRCOMPRESS_MAX_FILES 11
+
+void printUsage() {
+  printf("bsrcompress version %s\n", BSR_VERSION);
+  printf("\n\
+NAME\n\
+     bsrcompress -- convert bsrender data files to or from block compressed format\n\
+\n\
+SYNOPSIS\n\
+     bsrcompress [-d DIR] [-o DIR] [-p NUM] [-z NUM] [-b NUM] [-x] [-v] [-h]\n\
+ \n\
+OPTIONS:\n\
+\n\
+     -d DIR\n\
+          Path to galaxy-* data files to convert (default: galaxydata)\n\
+\n\
+     -o DIR\n\
+          Output directory for converted files, must be different from -d (default: galaxydata-compressed)\n\
+          Set data_file_directory in bsrender.cfg to this path to use the converted files\n\
+\n\
+     -p NUM\n\
+          Only process data files needed for this Gaia_min_parallax_quality (default: 0, all files)\n\
+\n\
+     -z NUM\n\
+          zlib compression level 1-9 (default: 6)\n\
+\n\
+     -b NUM\n\
+          Star records per compressed block (default: %d)\n\
+\n\
+     -x\n\
+          Decompress block compressed files back to uncompressed data files\n\
+\n\
+     -v\n\
+          After compressing, verify each file and compare single thread decode throughput with raw scanning\n\
+\n\
+     -h\n\
+          Show help\n\
+\n\
+DESCRIPTON\n\
+ bsrcompress stores star records in independently zlib compressed blocks after a byte shuffle that groups\n\
+ each byte position of the 33 byte star records together. A block table at the end of the file lets each bsrender\n\
+ worker thread decompress only its own blocks. Compressed files keep the same file names as uncompressed files\n\
+ \n", BSR_BLOCK_RECORDS);
+}
+
+int setDefaults(bsrcompress_config_t *bsrcompress_config) {
+  strncpy(bsrcompress_config->data_file_directory, "galaxydata", 255);
+  bsrcompress_config->data_file_directory[255]=0;
+  strncpy(bsrcompress_config->output_directory, "galaxydata-compressed", 255);
+  bsrcompress_config->output_directory[255]=0;
+  bsrcompress_config->Gaia_min_parallax_quality=0;
+  bsrcompress_config->compression_level=6;
+  bsrcompress_config->block_records=BSR_BLOCK_RECORDS;
+  bsrcompress_config->decompress=0;
+  bsrcompress_config->verify=0;
+
+  return(0);
+}
+
+int getOptionValue(char *option_value, int argc, char **argv, int *i) {
+  char *option_start;
+
+  option_value[0]=0;
+  if (argv[*i][2] != 0) {
+    // option concatenated onto switch
+    option_start=argv[*i];
+    strncpy(option_value, (option_start + (size_t)2), 255);
+    option_value[255]=0;
+  } else if ((argc > (*i + 1)) && (argv[*i + 1][0] != '-')) {
+    // option is probably next argv
+    option_start=argv[*i + 1];
+    strncpy(option_value, option_start, 255);
+    option_value[255]=0;
+    *i+=1;
+  } // end if no space
+
+  return(0);
+}
+
+int processCmdArgs(bsrcompress_config_t *bsrcompress_config, int argc, char **argv) {
+  int i;
+  char option_value[256];
+
+  if (argc == 1) {
+    return(0);
+  } else {
+    for (i=1; i <= (argc - 1); i++) {
+      if (argv[i][1] == 'd') {
+        // data file directory
+        getOptionValue(option_value, argc, argv, &i);
+        strncpy(bsrcompress_config->data_file_directory, option_value, 255);
+        bsrcompress_config->data_file_directory[255]=0;
+      } else if (argv[i][1] == 'o') {
+        // output directory
+        getOptionValue(option_value, argc, argv, &i);
+        strncpy(bsrcompress_config->output_directory, option_value, 255);
+        bsrcompress_config->output_directory[255]=0;
+      } else if (argv[i][1] == 'p') {
+        // minimum parallax quality
+        getOptionValue(option_value, argc, argv, &i);
+        bsrcompress_config->Gaia_min_parallax_quality=atoi(option_value);
+      } else if (argv[i][1] == 'z') {
+        // zlib compression level
+        getOptionValue(option_value, argc, argv, &i);
+        bsrcompress_config->compression_level=atoi(option_value);
+        if (bsrcompress_config->compression_level < 1) {
+          bsrcompress_config->compression_level=1;
+        } else if (bsrcompress_config->compression_level > 9) {
+          bsrcompress_config->compression_level=9;
+        }
+      } else if (argv[i][1] == 'b') {
+        // star records per block
+        getOptionValue(option_value, argc, argv, &i);
+        bsrcompress_config->block_records=atoi(option_value);
+        if (bsrcompress_config->block_records < 1024) {
+          bsrcompress_config->block_records=1024;
+        } else if (bsrcompress_config->block_records > 16777216) {
+          bsrcompress_config->block_records=16777216;
+        }
+      } else if (argv[i][1] == 'x') {
+        // decompress
+        bsrcompress_config->decompress=1;
+      } else if (argv[i][1] == 'v') {
+        // verify and benchmark
+        bsrcompress_config->verify=1;
+      } else if (argv[i][1] == 'h') {
+        // print help
+        printUsage();
+        exit(0);
+      } // end which option
+    } // end for argc
+  } // end if any options
+  return(0);
+}
+
+int getDataFileNames(bsrcompress_config_t *bsrcompress_config, char file_names[BSRCOMPRESS_MAX_FILES][256]) {
+  int file_count;
+  int i;
+  char *suffix;
+  // same parallax quality levels and order as openInputFiles() in bsrender
+  const int pq_levels[10]={100, 50, 30, 20, 10, 5, 3, 2, 1, 0};
+  const int pq_thresholds[10]={101, 100, 50, 30, 20, 10, 5, 3, 2, 1};
+
+  if (littleEndianTest() == 1) {
+    suffix=BSR_LE_SUFFIX;
+  } else {
+    suffix=BSR_BE_SUFFIX;
+  }
+
+  file_count=0;
+  sprintf(file_names[file_count], "%s-%s.%s", BSR_EXTERNAL_PREFIX, suffix, BSR_EXTENSION);
+  file_count++;
+  for (i=0; i < 10; i++) {
+    if (bsrcompress_config->Gaia_min_parallax_quality < pq_thresholds[i]) {
+      sprintf(file_names[file_count], "%s-pq%03d-%s.%s", BSR_GDR3_PREFIX, pq_levels[i], suffix, BSR_EXTENSION);
+      file_count++;
+    }
+  }
+
+  return(file_count);
+}
+
+double getElapsedTime(struct timespec *starttime) {
+  struct timespec endtime;
+
+  clock_gettime(CLOCK_REALTIME, &endtime);
+  return(((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime->tv_sec - 1500000000) + ((double)starttime->tv_nsec) / 1.0E9));
+}
+
+char *mapFile(char *file_path, size_t *file_size) {
+  int fd;
+  struct stat sb;
+  char *buf;
+
+  //
+  // mmap an entire file read-only, returns NULL on failure
+  //
+  fd=open(file_path, O_RDONLY);
+  if (fd < 0) {
+    return(NULL);
+  }
+  fstat(fd, &sb);
+  *file_size=(size_t)sb.st_size;
+  if (sb.st_size < BSR_FILE_HEADER_SIZE) {
+    close(fd);
+    return(NULL);
+  }
+  buf=(char *)mmap(NULL, *file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    return(NULL);
+  }
+  madvise(buf, *file_size, MADV_SEQUENTIAL);
+
+  return(buf);
+}
+
+int verifyFile(char *compressed_path, char *raw_buf, size_t raw_size) {
+  char *compressed_buf;
+  size_t compressed_size;
+  bsr_block_t *blocks;
+  uint64_t block_count;
+  uint64_t total_records;
+  uint64_t i;
+  uint64_t record_offset;
+  uint32_t max_block_records=0;
+  unsigned char *shuffle_buf;
+  unsigned char *record_buf;
+  uint64_t *raw_p;
+  uint64_t raw_words;
+  uint64_t checksum=0;
+  struct timespec starttime;
+  double decode_time=0.0;
+  double scan_time;
+  int fd;
+
+  //
+  // decompress every block and compare with the uncompressed data file
+  //
+  compressed_buf=mapFile(compressed_path, &compressed_size);
+  fd=open(compressed_path, O_RDONLY);
+  if ((compressed_buf == NULL) || (fd < 0) || (loadBlockTable(fd, compressed_buf, compressed_size, &blocks, &block_count, &total_records) != 0)) {
+    printf("  verify failed: could not load block table\n");
+    return(-1);
+  }
+  close(fd);
+  if ((BSR_FILE_HEADER_SIZE + (total_records * BSR_STAR_RECORD_SIZE)) != raw_size) {
+    printf("  verify failed: record count mismatch\n");
+    return(-1);
+  }
+  for (i=0; i < block_count; i++) {
+    if (blocks[i].record_count > max_block_records) {
+      max_block_records=blocks[i].record_count;
+    }
+  }
+  shuffle_buf=(unsigned char *)malloc((size_t)max_block_records * BSR_STAR_RECORD_SIZE + 1);
+  record_buf=(unsigned char *)malloc((size_t)max_block_records * BSR_STAR_RECORD_SIZE + 1);
+  if ((shuffle_buf == NULL) || (record_buf == NULL)) {
+    printf("Error: could not allocate memory for verify buffers\n");
+    exit(1);
+  }
+
+  record_offset=BSR_FILE_HEADER_SIZE;
+  for (i=0; i < block_count; i++) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    if (decodeBlock((unsigned char *)compressed_buf + blocks[i].offset, blocks[i].compressed_size, blocks[i].record_count, shuffle_buf, record_buf) != 0) {
+      printf("  verify failed: block %lu is corrupt\n", (unsigned long)i);
+      return(-1);
+    }
+    decode_time+=getElapsedTime(&starttime);
+    if (memcmp(record_buf, raw_buf + record_offset, (size_t)blocks[i].record_count * BSR_STAR_RECORD_SIZE) != 0) {
+      printf("  verify failed: block %lu does not match data file\n", (unsigned long)i);
+      return(-1);
+    }
+    record_offset+=(uint64_t)blocks[i].record_count * BSR_STAR_RECORD_SIZE;
+  }
+
+  //
+  // raw scanning reference: read every byte of the (now cached) uncompressed mapping once
+  //
+  clock_gettime(CLOCK_REALTIME, &starttime);
+  raw_p=(uint64_t *)raw_buf;
+  raw_words=(uint64_t)raw_size / 8;
+  for (i=0; i < raw_words; i++) {
+    checksum+=raw_p[i];
+  }
+  scan_time=getElapsedTime(&starttime);
+  if ((decode_time > 0.0) && (scan_time > 0.0)) {
+    printf("  verified, decode: %.1fMB/s per thread, raw scan: %.1fMB/s (checksum %016lx)\n", ((double)raw_size / 1048576.0 / decode_time), ((double)raw_size / 1048576.0 / scan_time), (unsigned long)checksum);
+  } else {
+    printf("  verified\n");
+  }
+  fflush(stdout);
+
+  free(shuffle_buf);
+  free(record_buf);
+  free(blocks);
+  munmap(compressed_buf, compressed_size);
+
+  return(0);
+}
+
+int convertFile(bsrcompress_config_t *bsrcompress_config, char *file_name, uint64_t *total_input_bytes, uint64_t *total_output_bytes) {
+  char input_path[4096];
+  char output_path[4096];
+  char *input_buf;
+  size_t input_size;
+  FILE *output_file;
+  char file_header[BSR_FILE_HEADER_SIZE];
+  char *new_magic;
+  bsr_block_writer_t writer;
+  bsr_block_t *blocks;
+  uint64_t block_count;
+  uint64_t total_records;
+  uint64_t i;
+  uint32_t max_block_records=0;
+  unsigned char *shuffle_buf;
+  unsigned char *record_buf;
+  unsigned char *record_p;
+  struct stat output_sb;
+  struct timespec starttime;
+  int fd;
+
+  snprintf(input_path, 4096, "%s/%s", bsrcompress_config->data_file_directory, file_name);
+  snprintf(output_path, 4096, "%s/%s", bsrcompress_config->output_directory, file_name);
+  input_buf=mapFile(input_path, &input_size);
+  if (input_buf == NULL) {
+    printf("%s: could not open, skipping\n", input_path);
+    fflush(stdout);
+    return(0);
+  }
+
+  //
+  // select file identifier for output file, compressed and uncompressed files keep the byte order of the input file
+  //
+  if (bsrcompress_config->decompress == 0) {
+    if (strncmp(input_buf, BSR_MAGIC_NUMBER_LE, 11) == 0) {
+      new_magic=BSR_MAGIC_NUMBER_ZL;
+    } else if (strncmp(input_buf, BSR_MAGIC_NUMBER_BE, 11) == 0) {
+      new_magic=BSR_MAGIC_NUMBER_ZB;
+    } else {
+      printf("%s: not an uncompressed bsrender data file, skipping\n", input_path);
+      fflush(stdout);
+      munmap(input_buf, input_size);
+      return(0);
+    }
+  } else {
+    if (strncmp(input_buf, BSR_MAGIC_NUMBER_ZL, 11) == 0) {
+      new_magic=BSR_MAGIC_NUMBER_LE;
+    } else if (strncmp(input_buf, BSR_MAGIC_NUMBER_ZB, 11) == 0) {
+      new_magic=BSR_MAGIC_NUMBER_BE;
+    } else {
+      printf("%s: not a block compressed bsrender data file, skipping\n", input_path);
+      fflush(stdout);
+      munmap(input_buf, input_size);
+      return(0);
+    }
+  }
+  memcpy(file_header, input_buf, BSR_FILE_HEADER_SIZE);
+  memcpy(file_header, new_magic, 11);
+
+  output_file=fopen(output_path, "wb");
+  if (output_file == NULL) {
+    printf("Error: could not open %s for writing\n", output_path);
+    fflush(stdout);
+    exit(1);
+  }
+  printf("%s...", output_path);
+  fflush(stdout);
+  clock_gettime(CLOCK_REALTIME, &starttime);
+  fwrite(file_header, BSR_FILE_HEADER_SIZE, 1, output_file);
+
+  if (bsrcompress_config->decompress == 0) {
+    //
+    // compress star records
+    //
+    openBlockWriter(&writer, output_file, 1, bsrcompress_config->compression_level, (uint32_t)bsrcompress_config->block_records);
+    record_p=(unsigned char *)input_buf + BSR_FILE_HEADER_SIZE;
+    total_records=(uint64_t)(input_size - BSR_FILE_HEADER_SIZE) / BSR_STAR_RECORD_SIZE;
+    for (i=0; i < total_records; i++) {
+      writeStarRecord(&writer, record_p);
+      record_p+=BSR_STAR_RECORD_SIZE;
+    }
+    closeBlockWriter(&writer);
+  } else {
+    //
+    // decompress each block in order
+    //
+    fd=open(input_path, O_RDONLY);
+    if ((fd < 0) || (loadBlockTable(fd, input_buf, input_size, &blocks, &block_count, &total_records) != 0)) {
+      printf("Error: %s has a missing or corrupt block table\n", input_path);
+      fflush(stdout);
+      exit(1);
+    }
+    close(fd);
+    for (i=0; i < block_count; i++) {
+      if (blocks[i].record_count > max_block_records) {
+        max_block_records=blocks[i].record_count;
+      }
+    }
+    shuffle_buf=(unsigned char *)malloc((size_t)max_block_records * BSR_STAR_RECORD_SIZE + 1);
+    record_buf=(unsigned char *)malloc((size_t)max_block_records * BSR_STAR_RECORD_SIZE + 1);
+    if ((shuffle_buf == NULL) || (record_buf == NULL)) {
+      printf("Error: could not allocate memory for decompression buffers\n");
+      exit(1);
+    }
+    for (i=0; i < block_count; i++) {
+      if (decodeBlock((unsigned char *)input_buf + blocks[i].offset, blocks[i].compressed_size, blocks[i].record_count, shuffle_buf, record_buf) != 0) {
+        printf("Error: %s block %lu is corrupt\n", input_path, (unsigned long)i);
+        fflush(stdout);
+        exit(1);
+      }
+      fwrite(record_buf, ((size_t)blocks[i].record_count * BSR_STAR_RECORD_SIZE), 1, output_file);
+    }
+    free(shuffle_buf);
+    free(record_buf);
+    free(blocks);
+  }
+  fclose(output_file);
+
+  stat(output_path, &output_sb);
+  printf(" %.1fMB -> %.1fMB (%.2f:1) (%.3fs)\n", ((double)input_size / 1048576.0), ((double)output_sb.st_size / 1048576.0), ((double)input_size / (double)output_sb.st_size), getElapsedTime(&starttime));
+  fflush(stdout);
+  *total_input_bytes+=(uint64_t)input_size;
+  *total_output_bytes+=(uint64_t)output_sb.st_size;
+
+  if ((bsrcompress_config->verify == 1) && (bsrcompress_config->decompress == 0)) {
+    verifyFile(output_path, input_buf, input_size);
+  }
+  munmap(input_buf, input_size);
+
+  return(0);
+}
+
+int main(int argc, char **argv) {
+  bsrcompress_config_t bsrcompress_config;
+  char file_names[BSRCOMPRESS_MAX_FILES][256];
+  int file_count;
+  int i;
+  uint64_t total_input_bytes=0;
+  uint64_t total_output_bytes=0;
+  struct timespec starttime;
+
+  //
+  // set default options and process command line options
+  //
+  setDefaults(&bsrcompress_config);
+  processCmdArgs(&bsrcompress_config, argc, argv);
+  printf("bsrcompress version %s\n", BSR_VERSION);
+  if (strcmp(bsrcompress_config.data_file_directory, bsrcompress_config.output_directory) == 0) {
+    printf("Error: output directory must be different from data file directory\n");
+    exit(1);
+  }
+  file_count=getDataFileNames(&bsrcompress_config, file_names);
+  mkdir(bsrcompress_config.output_directory, 0755);
+
+  //
+  // convert each data file
+  //
+  clock_gettime(CLOCK_REALTIME, &starttime);
+  for (i=0; i < file_count; i++) {
+    convertFile(&bsrcompress_config, file_names[i], &total_input_bytes, &total_output_bytes);
+  }
+  if (total_output_bytes > 0) {
+    printf("Total: %.1fMB -> %.1fMB (%.2f:1) (%.3fs)\n", ((double)total_input_bytes / 1048576.0), ((double)total_output_bytes / 1048576.0), ((double)total_input_bytes / (double)total_output_bytes), getElapsedTime(&starttime));
+  }
+
+  return(0);
+}
@@ -54,6 +54,8 @@
 #include "bsr-jpeg.h"
 #include "bsr-avif.h"
 #include "bsr-heif.h"
+#include "bsr-tiff.h"
+#include "bsr-deepzoom.h"
 #include "init-state.h"
 #include "cgi.h"
 #include "post-process.h"
@@ -62,23 +64,32 @@
 #include "file.h"
 #include "sequence-pixels.h"
 #include "diffraction.h"
+#include "bsr-numa.h"
+#include "bsr-output.h"
 
 int main(int argc, char **argv) {
   bsr_config_t bsr_config;
+  bsr_config_t unvalidated_config;
+  bsr_config_t *extra_configs;
   bsr_state_t *bsr_state;
+  bsr_config_t *output_configs[BSR_MAX_EXTRA_OUTPUTS + 1];
+  bsr_state_t *output_states[BSR_MAX_EXTRA_OUTPUTS + 1];
+  bsr_config_t *output_config;
+  bsr_state_t *output_state;
+  int num_outputs;
+  int output;
+  int pass;
   bsr_thread_state_t perthread;
   struct timespec overall_starttime;
   struct timespec overall_endtime;
   struct timespec starttime;
   struct timespec endtime;
   double elapsed_time;
-  int all_workers_done;
   int i;
-  pixel_composition_t *image_composition_p;
-  int main_thread_buffer_index;
-  int buffer_is_empty;
-  int empty_passes;
-  thread_buffer_t *main_thread_buf_p;
+  uint64_t input_bytes;
+  uint64_t compressed_bytes;
+  uint64_t decoded_bytes;
+  double decode_time;
 
   //
   // initialize bsr_config to default values
@@ -120,15 +131,20 @@ int main(int argc, char **argv) {
   }
 
   //
-  // validate config parameters are sane
+  // validate config parameters are sane. Extra outputs start from the validated config, except for options
+  // whose defaults depend on the output format
   //
+  memcpy(&unvalidated_config, &bsr_config, sizeof(bsr_config_t));
   validateConfig(&bsr_config);
+  extra_configs=loadExtraOutputConfigs(&bsr_config, &unvalidated_config);
 
   //
   // if CGI mode, print CGI header (must be done after validate to translate output_format
   //
   if (bsr_config.cgi_mode == 1) {
     printCGIHeader(bsr_config);
+    fflush(stdout);
+    setOutputPipeSize(STDOUT_FILENO);
   }
 
   //
@@ -166,6 +182,12 @@ int main(int argc, char **argv) {
     fflush(stdout);
   }
 
+  //
+  // if NUMA mode is enabled, discover nodes and optionally replicate data files to each node
+  //
+  initNUMA(&bsr_config, bsr_state);
+  replicateInputFilesNUMA(&bsr_config, bsr_state);
+
   //
   // initialize RGB color lookup tables
   //
@@ -182,6 +204,11 @@ int main(int argc, char **argv) {
     fflush(stdout);
   }
 
+  //
+  // initialize transfer function lookup table used by sequencePixels() if the output format can use it
+  //
+  initTransferTable(&bsr_config, bsr_state);
+
   //
   // allocate memory and initialize various buffers that get attached to bsr_state
   //
@@ -193,6 +220,35 @@ int main(int argc, char **argv) {
   bsr_state->main_pid=getpid();
   bsr_state->main_pgid=getpgrp();
   bsr_state->httpd_pid=getppid();
+
+  //
+  // set up extra outputs and list all outputs in the order they are made from the post-processed image: resized
+  // outputs first, then full size outputs which draw overlays into it. All outputs but the last keep the image
+  //
+  num_outputs=0;
+  for (pass=0; pass < 2; pass++) {
+    for (output=-1; output < bsr_config.num_extra_outputs; output++) {
+      if (output < 0) {
+        output_config=&bsr_config;
+      } else {
+        output_config=&extra_configs[output];
+      }
+      if (((pass == 0) && (output_config->output_scaling_factor != 1.0)) || ((pass == 1) && (output_config->output_scaling_factor == 1.0))) {
+        if (output < 0) {
+          output_state=bsr_state;
+        } else {
+          output_state=allocateExtraOutputState(output_config, bsr_state);
+          initTransferTable(output_config, output_state);
+        }
+        output_configs[num_outputs]=output_config;
+        output_states[num_outputs]=output_state;
+        num_outputs++;
+      }
+    }
+  }
+  for (output=0; output < (num_outputs - 1); output++) {
+    output_states[output]->keep_source_image=1;
+  }
   if (bsr_state->num_worker_threads > 0) {
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
       bsr_state->perthread->my_pid=getpid();
@@ -209,6 +265,11 @@ int main(int argc, char **argv) {
     bsr_state->perthread->my_thread_id=0;
   }
 
+  //
+  // all threads: pin to assigned NUMA node if NUMA mode is enabled
+  //
+  pinThreadNUMA(&bsr_config, bsr_state);
+
 // 
 // begin thread specific processing.
 //
@@ -223,7 +284,13 @@ int main(int argc, char **argv) {
   //
   // all threads: initialize (clear) image composition buffer
   //
-  initImageCompositionBuffer(&bsr_config, bsr_state);
+  if (bsr_config.composition_precision == 16) {
+    initImageCompositionBuffer16(&bsr_config, bsr_state);
+  } else if (bsr_config.composition_precision == 64) {
+    initImageCompositionBuffer64(&bsr_config, bsr_state);
+  } else {
+    initImageCompositionBuffer(&bsr_config, bsr_state);
+  }
 
   //
   // main thread: display begin rendering status if not in CGI mode
@@ -303,44 +370,13 @@ int main(int argc, char **argv) {
     //
     // main thread: scan main thread buffer for pixels to integrate into image until all worker threads are done
     //
-    empty_passes=0;
-    while (empty_passes < 2) { // do second pass once empty
-      // check if any worker threads have died
-      checkExceptions(bsr_state);
-
-      // scan buffer for new pixel data
-      main_thread_buf_p=bsr_state->thread_buf;
-      buffer_is_empty=1;
-      for (main_thread_buffer_index=0; main_thread_buffer_index < bsr_state->thread_buffer_count; main_thread_buffer_index++) {
-        if ((main_thread_buf_p->status_left == 1) && (main_thread_buf_p->status_right == 1)) {
-          // buffer location has new pixel data, add to image composition buffer
-          if (buffer_is_empty == 1) {
-            buffer_is_empty=0; 
-          }
-          image_composition_p=bsr_state->image_composition_buf + main_thread_buf_p->image_offset;
-          image_composition_p->r+=main_thread_buf_p->r;
-          image_composition_p->g+=main_thread_buf_p->g;
-          image_composition_p->b+=main_thread_buf_p->b;
-          // set this buffer location to free
-          main_thread_buf_p->status_left=0;
-          main_thread_buf_p->status_right=0;
-        }
-        main_thread_buf_p++;
-      } // end for thread_buffer_index
-      // if buffer is completely empty, check if all threads are done
-      if (buffer_is_empty == 1) {
-        all_workers_done=1;
-        for (i=1; i <= bsr_state->num_worker_threads; i++) {
-          if (bsr_state->status_array[i].status < THREAD_STATUS_PROCESS_STARS_COMPLETE) {
-            all_workers_done=0;
-          }
-        }
-        if (all_workers_done == 1) {
-          // if main thread buffer is empty and all worker threads are done, increment empty_passes
-          empty_passes++;
-        }
-      } 
-    } // end while not done
+    if (bsr_config.composition_precision == 16) {
+      integratePixels16(&bsr_config, bsr_state);
+    } else if (bsr_config.composition_precision == 64) {
+      integratePixels64(&bsr_config, bsr_state);
+    } else {
+      integratePixels(&bsr_config, bsr_state);
+    }
 
     // main thread: tell worker threads it's ok to continue
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
@@ -352,6 +388,26 @@ int main(int argc, char **argv) {
       clock_gettime(CLOCK_REALTIME, &endtime);
       elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
       printf(" (%.3fs)\n", elapsed_time);
+      // streaming input backend: report sustained read bandwidth over entire rendering time
+      if (bsr_config.input_backend != 0) {
+        input_bytes=0;
+        for (i=1; i <= bsr_state->num_worker_threads; i++) {
+          input_bytes+=bsr_state->status_array[i].input_bytes;
+        }
+        printf("Read %.1fMB from data files (%.1fMB/s)\n", ((double)input_bytes / 1048576.0), ((double)input_bytes / 1048576.0 / elapsed_time));
+      }
+      // compressed data files: report compression ratio and decode throughput per worker thread
+      compressed_bytes=0;
+      decoded_bytes=0;
+      decode_time=0.0;
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        compressed_bytes+=bsr_state->status_array[i].compressed_bytes;
+        decoded_bytes+=bsr_state->status_array[i].decoded_bytes;
+        decode_time+=bsr_state->status_array[i].decode_time;
+      }
+      if ((compressed_bytes > 0) && (decode_time > 0.0)) {
+        printf("Decompressed %.1fMB to %.1fMB (%.2f:1), %.1fMB/s per worker thread\n", ((double)compressed_bytes / 1048576.0), ((double)decoded_bytes / 1048576.0), ((double)decoded_bytes / (double)compressed_bytes), ((double)decoded_bytes / 1048576.0 / decode_time));
+      }
       fflush(stdout);
     }
   } // end if main thread
@@ -359,34 +415,112 @@ int main(int argc, char **argv) {
   //
   // all threads: post processing
   //
-  postProcess(&bsr_config, bsr_state);
+  if (bsr_config.composition_precision == 16) {
+    postProcess16(&bsr_config, bsr_state);
+  } else if (bsr_config.composition_precision == 64) {
+    postProcess64(&bsr_config, bsr_state);
+  } else {
+    postProcess(&bsr_config, bsr_state);
+  }
 
   //
-  // all threads: convert image to byte sequence required by output image_format and store in image_output_buf.
-  // This is also where quantization happens for integer number formats
+  // all threads: make each output from the post-processed image
   //
-  sequencePixels(&bsr_config, bsr_state);  
+  for (output=0; output < num_outputs; output++) {
+    output_config=output_configs[output];
+    output_state=output_states[output];
+    if ((num_outputs > 1) && (output_state->perthread->my_pid == output_state->main_pid) && (output_config->cgi_mode != 1) && (output_config->print_status == 1)) {
+      printf("Output %d of %d: %s\n", (output + 1), num_outputs, output_config->output_file_name);
+      fflush(stdout);
+    }
 
-  //
-  // all threads: output image file
-  //
-  if ((bsr_config.image_format == 0) && (bsr_state->perthread->my_pid == bsr_state->main_pid)) { // PNG encoder not yet multi-threadded
-    outputPNG(&bsr_config, bsr_state);
-  } else if (bsr_config.image_format == 1) {
-    outputEXR(&bsr_config, bsr_state);
-  } else if ((bsr_config.image_format == 2) && (bsr_state->perthread->my_pid == bsr_state->main_pid)) { // JPG encoder not yet multi-threadded (but still very fast)
-    outputJpeg(&bsr_config, bsr_state);
-  } else if ((bsr_config.image_format == 3) && (bsr_state->perthread->my_pid == bsr_state->main_pid)) { // libavif is already multi-thredded internally so we invoke from main thread
-    outputAvif(&bsr_config, bsr_state);
-  } else if ((bsr_config.image_format == 4) && (bsr_state->perthread->my_pid == bsr_state->main_pid)) {
-    outputHeif(&bsr_config, bsr_state);
-  }
+    //
+    // all threads: resize to output resolution and draw overlays
+    //
+    if (bsr_config.composition_precision == 16) {
+      postProcessOutput16(output_config, output_state);
+    } else if (bsr_config.composition_precision == 64) {
+      postProcessOutput64(output_config, output_state);
+    } else {
+      postProcessOutput(output_config, output_state);
+    }
+
+    //
+    // all threads: convert image to byte sequence required by output image_format and store in image_output_buf.
+    // This is also where quantization happens for integer number formats
+    //
+    if (bsr_config.composition_precision == 16) {
+      sequencePixels16(output_config, output_state);
+    } else if (bsr_config.composition_precision == 64) {
+      sequencePixels64(output_config, output_state);
+    } else {
+      sequencePixels(output_config, output_state);
+    }
+
+    //
+    // main thread: the last floating-point image buffer is dead once it has been converted, unless a later
+    // output reads it
+    //
+    if (output_state->perthread->my_pid == output_state->main_pid) {
+      if (output_state->current_image_buf == output_state->image_resize_buf) {
+        releaseImageBuffer(output_state->image_resize_buf, output_state->resize_buffer_size);
+      } else if ((output_state->output_buffer_aliased == 0) && (output_state->keep_source_image == 0)) {
+        releaseImageBuffer(output_state->image_composition_buf, output_state->composition_buffer_size);
+      }
+    }
+
+    //
+    // all threads: output image file or deep zoom tiles. Streamed images have already been written while converted
+    //
+    if (output_state->stream_num_bands > 0) {
+      // nothing more to write
+    } else if (output_config->deep_zoom != 0) {
+      outputDeepZoom(output_config, output_state);
+    } else if (output_config->image_format == 0) {
+      outputPNG(output_config, output_state);
+    } else if (output_config->image_format == 1) {
+      outputEXR(output_config, output_state);
+    } else if (output_config->image_format == 2) {
+      outputJpeg(output_config, output_state);
+    } else if (output_config->image_format == 3) { // grid tiles are encoded by all threads, a single image by the main thread only
+      outputAvif(output_config, output_state);
+    } else if (output_config->image_format == 4) {
+      outputHeif(output_config, output_state);
+    } else if (output_config->image_format == 5) {
+      outputTIFF(output_config, output_state);
+    }
+
+    //
+    // worker threads: wait until the main thread rewinds our status to repeat resize, conversion and output
+    // main thread: wait until all worker threads are done with this output, release its buffers and rewind status
+    //
+    if (output < (num_outputs - 1)) {
+      if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+        bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_NEXT_OUTPUT_WAIT;
+        waitForMainThreadRewind(bsr_state, THREAD_STATUS_NEXT_OUTPUT_WAIT);
+      } else {
+        waitForWorkerThreads(bsr_state, THREAD_STATUS_NEXT_OUTPUT_WAIT);
+        releaseOutputBuffers(output_state);
+        for (i=1; i <= bsr_state->num_worker_threads; i++) {
+          bsr_state->status_array[i].status=THREAD_STATUS_GAUSSIAN_BLUR_CONTINUE;
+        }
+      }
+    }
+  } // end for output
 
   //
   // main thread: cleanup
   //
   if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
     // main thread: clean up memory allocations
+    for (output=0; output < num_outputs; output++) {
+      if (output_states[output] != bsr_state) {
+        freeExtraOutputState(output_states[output]);
+      }
+    }
+    if (extra_configs != NULL) {
+      free(extra_configs);
+    }
     freeMemory(bsr_state);
 
     // main thread: output total runtime
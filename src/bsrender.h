@@ -47,11 +47,43 @@
 #define BSR_USE_JPEG
 #define BSR_USE_PNG
 #define BSR_USE_EXR
+#define BSR_USE_TIFF
 #define BSR_USE_AVIF
 #define BSR_USE_HEIF
-#define BSR_32BIT_BUFFERS // use 32-bit floats in image composition, blur, and resize buffers. This reduces the size of these buffers by half which may
-                          // be useful for extremely large image resolutions at the expense of summation precision within these buffers. This does not
-                          // change the main thread, or dedup buffers which are relatively small and always double precision.
+
+//
+// Image composition, blur, and resize buffer precision is selected at run time (composition_precision option).
+// Source files that read or write these buffers are compiled once for each precision with BSR_COMPOSITION_BITS
+// set to 16, 32, or 64 (see Makefile). The 32-bit build keeps the plain function names, the 16 and 64-bit builds
+// add the precision to the name of each public function so all three link into bsrender
+//
+#ifndef BSR_COMPOSITION_BITS
+#define BSR_COMPOSITION_BITS 32
+#endif
+#define BSR_VARIANT_PASTE(name, bits) name ## bits
+#define BSR_VARIANT_NAME(name, bits) BSR_VARIANT_PASTE(name, bits)
+#if BSR_COMPOSITION_BITS != 32
+#define BSR_VARIANT(name) BSR_VARIANT_NAME(name, BSR_COMPOSITION_BITS)
+#define initImageCompositionBuffer BSR_VARIANT(initImageCompositionBuffer)
+#define integratePixels BSR_VARIANT(integratePixels)
+#define postProcessLine BSR_VARIANT(postProcessLine)
+#define postProcess BSR_VARIANT(postProcess)
+#define postProcessOutput BSR_VARIANT(postProcessOutput)
+#define initRecursiveGaussian BSR_VARIANT(initRecursiveGaussian)
+#define blurLinesRecursive BSR_VARIANT(blurLinesRecursive)
+#define useRecursiveGaussian BSR_VARIANT(useRecursiveGaussian)
+#define blurRingBands BSR_VARIANT(blurRingBands)
+#define GaussianBlur BSR_VARIANT(GaussianBlur)
+#define fastLog BSR_VARIANT(fastLog)
+#define fastExp BSR_VARIANT(fastExp)
+#define initLanczosTable BSR_VARIANT(initLanczosTable)
+#define resizeLanczos BSR_VARIANT(resizeLanczos)
+#define resizeArea BSR_VARIANT(resizeArea)
+#define drawCrossHairs BSR_VARIANT(drawCrossHairs)
+#define drawGridLines BSR_VARIANT(drawGridLines)
+#define initTransferTable BSR_VARIANT(initTransferTable)
+#define sequencePixels BSR_VARIANT(sequencePixels)
+#endif
 
 
 //
@@ -92,14 +124,60 @@
 #define BSR_FILE_HEADER_SIZE 256 // bytes, ascii including magic number
 #define BSR_MAGIC_NUMBER_LE "BSRENDER_LE" // file identifier for little-endian files, included in file header size
 #define BSR_MAGIC_NUMBER_BE "BSRENDER_BE" // file identifier for big-endian files, included in file header size
+#define BSR_MAGIC_NUMBER_ZL "BSRENDER_ZL" // file identifier for block compressed little-endian files
+#define BSR_MAGIC_NUMBER_ZB "BSRENDER_ZB" // file identifier for block compressed big-endian files
+#define BSR_BLOCK_TABLE_MAGIC "BSR_BTBL" // last 8 bytes of block compressed files
+#define BSR_BLOCK_ENTRY_SIZE 16 // bytes per block table entry: offset (8), compressed size (4), record count (4)
+#define BSR_BLOCK_TRAILER_SIZE 32 // bytes: table offset (8), block count (8), total records (8), BSR_BLOCK_TABLE_MAGIC (8)
+#define BSR_BLOCK_RECORDS 65536 // default number of star records per compressed block
 #define BSR_STAR_RECORD_SIZE 33  // bytes
-#define BSR_BLUR_RESCALE 16777216.0 // pixel values are divided by this number before Gaussian blur to help keep values between [0..1]
+#define BSR_BLUR_RESCALE 16777216.0 // pixel values are limited to [0..BSR_BLUR_RESCALE] before Gaussian blur
+#define BSR_BLUR_RECURSIVE_MIN_RADIUS 5.0 // Gaussian_blur_method=0 uses the recursive filter at and above this radius (measured crossover)
+#define BSR_BLUR_COLUMN_BLOCK 64 // columns filtered together in the vertical blur pass
+#define BSR_BAND_LINES 16 // rows per task in band scheduled passes (blur, Lanczos resize)
+#define BSR_PNG_DICTIONARY_SIZE 32768 // deflate window carried from the previous strip into each multi-threaded PNG strip
+#define BSR_PNG_MAX_IDAT 1073741824 // largest IDAT chunk written by the multi-threaded PNG encoder
+#define BSR_PNG_TILE_IDAT 65536 // IDAT chunk size of deep zoom PNG tiles
+#define BSR_STREAM_BAND_SIZE 262144 // smallest bytes of converted pixels in each band of a streamed image
+#define BSR_OUTPUT_PIPE_SIZE 1048576 // pipe buffer size requested for stdout in CGI mode (limited by /proc/sys/fs/pipe-max-size)
+#define BSR_SPLICE_MIN_SIZE 4096 // smallest piece of finished output passed to a pipe by reference, smaller pieces are copied
+#define BSR_OUTPUT_BUF_SIZE 1048576 // initial size of growable output buffers
+#define BSR_OUTPUT_WRITE_BATCH 1024 // buffers passed to one writev() call for grid tile rows (IOV_MAX is 1024 on Linux)
+#define BSR_EXR_WRITE_BATCH 512 // EXR chunks passed to one pwritev()/writev() call, two buffers each (IOV_MAX is 1024 on Linux)
+#define BSR_MAX_TILE_LEVELS 32 // most mipmap or pyramid levels in a tiled EXR, TIFF or deep zoom image (largest dimension below 2^31)
+#define BSR_DEEP_ZOOM_MAX_PATH 512 // longest deep zoom tile or manifest file name
+#define BSR_GRID_MIN_TILE_SIZE 64 // smallest AVIF/HEIF grid tile width and height
+#define BSR_GRID_MAX_TILES 255 // largest number of AVIF/HEIF grid columns or rows (16-bit item IDs for all tiles)
+#define BSR_GRID_MAX_PROPERTIES 16 // item properties copied from each AVIF/HEIF grid tile
+#define BSR_GRID_MAX_PROPERTY_SIZE 2048 // bytes of item properties copied from each AVIF/HEIF grid tile
+#define BSR_TRANSFER_CELL_BITS 10 // transfer function table index uses 2^10 cells per power of two of input value
+#define BSR_TRANSFER_OCTAVES 64 // transfer function table index covers inputs from 2^-64 to 1.0, smaller inputs are computed directly
+#define BSR_HALF_LIMIT 32768.0 // 16-bit image composition buffers hold values up to this many times camera_pixel_limit
+#define BSR_ACCUMULATION_TILE_PIXELS 64 // adjacent pixels in each double precision accumulation tile for 16-bit image composition buffers
+#define BSR_ACCUMULATION_TILES 4096 // number of accumulation tiles for 16-bit image composition buffers (direct mapped)
+#define BSR_MAX_NUMA_NODES 64 // maximum number of NUMA nodes used by numa_mode
+#define BSR_MAX_EXTRA_OUTPUTS 8 // extra_output images written from one composition besides output_file_name
+#define BSR_INPUT_STREAM_CHUNKS 4 // number of chunks in each worker thread's read ring when input_backend is streaming
+#define BSR_INPUT_STREAM_ALIGNMENT 4096 // file offset and length alignment for streaming reads, required for O_DIRECT
 #define BSR_RESIZE_LOG_OFFSET 1.0E-6 // pixel values are converted to log(BSR_LOG_OFFSET + pixel value) before Lanczos scaline to minimize clipping artifacts
 
 #define _GNU_SOURCE // needed for strcasestr in string.h
 #include <stdint.h> // needed for uint64_t
+#include <stdio.h> // needed for FILE
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h> // needed for struct iovec
+#include <sched.h> // needed for cpu_set_t
+#include <pthread.h>
+#if BSR_COMPOSITION_BITS == 16
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__clang__)
+#define BSR_USE_F16C
+#pragma GCC target("f16c") // half-float conversion instructions, 16-bit buffers are only used if the cpu supports them
+#include <immintrin.h>
+#else
+#include <string.h>
+#endif
+#endif
 
 //
 // For most things we detect endianness runtime with littleEndianTest(). For certain expensive
@@ -145,28 +223,26 @@ typedef enum {
   THREAD_STATUS_POST_PROCESS_BEGIN                = 40,
   THREAD_STATUS_POST_PROCESS_COMPLETE             = 41,
   THREAD_STATUS_POST_PROCESS_CONTINUE             = 42,
-  THREAD_STATUS_GAUSSIAN_BLUR_PREP_BEGIN          = 50,
-  THREAD_STATUS_GAUSSIAN_BLUR_PREP_COMPLETE       = 51,
-  THREAD_STATUS_GAUSSIAN_BLUR_HORIZONTAL_BEGIN    = 52,
-  THREAD_STATUS_GAUSSIAN_BLUR_HORIZONTAL_COMPLETE = 53,
-  THREAD_STATUS_GAUSSIAN_BLUR_VERTICAL_BEGIN      = 54,
-  THREAD_STATUS_GAUSSIAN_BLUR_VERTICAL_COMPLETE   = 55,
-  THREAD_STATUS_GAUSSIAN_BLUR_CONTINUE            = 56,
-  THREAD_STATUS_LANCZOS_PREP_BEGIN                = 60,
-  THREAD_STATUS_LANCZOS_PREP_COMPLETE             = 61,
-  THREAD_STATUS_LANCZOS_RESAMPLE_BEGIN            = 62,
-  THREAD_STATUS_LANCZOS_RESAMPLE_COMPLETE         = 63,
-  THREAD_STATUS_LANCZOS_POINTERS_BEGIN            = 64,
-  THREAD_STATUS_LANCZOS_POINTERS_COMPLETE         = 65,
-  THREAD_STATUS_LANCZOS_CONTINUE                  = 66,
+  THREAD_STATUS_GAUSSIAN_BLUR_BEGIN               = 50,
+  THREAD_STATUS_GAUSSIAN_BLUR_COMPLETE            = 51,
+  THREAD_STATUS_GAUSSIAN_BLUR_CONTINUE            = 52,
+  THREAD_STATUS_LANCZOS_BEGIN                     = 60,
+  THREAD_STATUS_LANCZOS_COMPLETE                  = 61,
+  THREAD_STATUS_LANCZOS_CONTINUE                  = 62,
+  THREAD_STATUS_AREA_RESIZE_BEGIN                 = 67,
+  THREAD_STATUS_AREA_RESIZE_COMPLETE              = 68,
+  THREAD_STATUS_AREA_RESIZE_CONTINUE              = 69,
   THREAD_STATUS_SEQUENCE_PIXELS_BEGIN             = 70,
   THREAD_STATUS_SEQUENCE_PIXELS_COMPLETE          = 71,
   THREAD_STATUS_SEQUENCE_PIXELS_CONTINUE          = 72,
   THREAD_STATUS_IMAGE_COMPRESS_BEGIN              = 80,
   THREAD_STATUS_IMAGE_COMPRESS_COMPLETE           = 81,
-  THREAD_STATUS_IMAGE_OUTPUT_BEGIN                = 82,
-  THREAD_STATUS_IMAGE_OUTPUT_COMPLETE             = 83,
-  THREAD_STATUS_IMAGE_OUTPUT_CONTINUE             = 84,
+  THREAD_STATUS_IMAGE_ENTROPY_BEGIN               = 82,
+  THREAD_STATUS_IMAGE_ENTROPY_COMPLETE            = 83,
+  THREAD_STATUS_IMAGE_OUTPUT_BEGIN                = 84,
+  THREAD_STATUS_IMAGE_OUTPUT_COMPLETE             = 85,
+  THREAD_STATUS_IMAGE_OUTPUT_CONTINUE             = 86,
+  THREAD_STATUS_NEXT_OUTPUT_WAIT                  = 90,
 } bsr_thread_status_t;
 
 typedef struct {
@@ -190,8 +266,64 @@ typedef struct {
 typedef struct {
   pid_t pid;
   int status;
+  uint64_t input_bytes; // bytes read by streaming input backend
+  uint64_t compressed_bytes; // bytes of compressed blocks processed from compressed data files
+  uint64_t decoded_bytes; // star record bytes decompressed from compressed data files
+  double decode_time; // seconds spent decompressing
+  double pass_time; // seconds spent in the timed part of the current band scheduled pass
 } bsr_status_t;
 
+typedef struct {
+  uint64_t next_task; // next task index in band scheduled passes, claimed with atomic add
+  int generation;     // incremented for each scheduled pass, band_done entries equal to generation are done
+} bsr_band_schedule_t;
+
+typedef struct {
+  size_t compressed_size; // deflate bytes for this strip (including zlib header for the first strip), SIZE_MAX if it did not fit
+  size_t filtered_size;   // filtered row bytes compressed, for combining Adler-32 checksums
+  uint32_t adler;         // Adler-32 of filtered rows in this strip
+  uint32_t crc;           // CRC-32 of IDAT chunk type and compressed bytes of this strip
+} png_strip_t;
+
+typedef struct {
+  size_t compressed_size;         // entropy-coded bytes for this strip including trailing restart marker, SIZE_MAX on error
+  uint64_t symbol_counts[4][256]; // Huffman symbol counts for this strip: DC table 0, DC table 1, AC table 0, AC table 1
+  int symbols_counted;            // 1 if symbol_counts covers the whole strip
+} jpeg_strip_t;
+
+typedef struct {
+  size_t output_size; // encoded bytes of this band in stream_out_buf, SIZE_MAX if encoding failed
+  size_t filtered_size; // PNG: filtered row bytes compressed, for combining Adler-32 checksums
+  uint32_t adler;     // PNG: Adler-32 of filtered rows in this band
+  uint32_t crc;       // PNG: CRC-32 of IDAT chunk type and compressed bytes of this band
+} stream_slot_t;
+
+typedef struct {
+  unsigned char *data; // page-aligned, mmaped, moved by mremap() as it grows
+  size_t size;         // bytes used
+  size_t capacity;     // bytes mapped
+} output_buf_t;
+
+typedef struct {
+  int width;          // level resolution, level 0 is the full image
+  int height;
+  int tiles_x;        // tiles per row of tiles
+  int tiles_y;        // rows of tiles
+  int first_tile;     // index of first tile of this level in file order (offset table)
+  int first_tile_row; // index of first row of tiles of this level in file order
+  int first_band;     // index of first band of reduction tasks, levels > 0 only
+  int num_bands;
+  size_t buf_offset;  // offset of level pixels in exr_mip_buf, tiff_pyramid_buf or deep_zoom_buf, levels > 0 only
+} tile_level_t;
+
+typedef struct {
+  size_t data_size;                                   // coded bytes for this tile, SIZE_MAX if encoding failed
+  size_t properties_size;                             // bytes of property boxes in properties
+  int num_properties;                                 // item properties of this tile except ispe (codec configuration, colr, pixi)
+  unsigned char essential[BSR_GRID_MAX_PROPERTIES];   // 1 if property is essential
+  unsigned char properties[BSR_GRID_MAX_PROPERTY_SIZE]; // property boxes copied from the tile's single image file
+} grid_tile_t;
+
 typedef struct {
   int status_left;
   uint64_t image_offset;
@@ -213,17 +345,67 @@ typedef struct {
 } dedup_index_t;
 
 typedef struct {
-#ifdef BSR_32BIT_BUFFERS
-  float r;
-  float g;
-  float b;
-#else
+  uint16_t bits;                 // IEEE half-float
+} bsr_half_t;
+
+typedef struct {
+#if BSR_COMPOSITION_BITS == 16
+  bsr_half_t r;
+  bsr_half_t g;
+  bsr_half_t b;
+#elif BSR_COMPOSITION_BITS == 64
   double r;
   double g;
   double b;
+#else
+  float r;
+  float g;
+  float b;
 #endif
 } pixel_composition_t;
 
+//
+// read and write one color of a pixel_composition_t. 16-bit buffers are converted with F16C instructions (or _Float16
+// on other architectures) and limited to the largest finite half-float
+//
+#if BSR_COMPOSITION_BITS == 16
+static inline float getHalfPixel(bsr_half_t component) {
+#ifdef BSR_USE_F16C
+  return(_cvtsh_ss(component.bits));
+#else
+  _Float16 value;
+
+  memcpy(&value, &component.bits, sizeof(value));
+  return((float)value);
+#endif
+}
+
+static inline bsr_half_t setHalfPixel(double value) {
+  bsr_half_t component;
+#ifndef BSR_USE_F16C
+  _Float16 half_value;
+#endif
+
+  if (value > 65504.0) {
+    value=65504.0;
+  } else if (value < -65504.0) {
+    value=-65504.0;
+  }
+#ifdef BSR_USE_F16C
+  component.bits=_cvtss_sh((float)value, 0);
+#else
+  half_value=(_Float16)value;
+  memcpy(&component.bits, &half_value, sizeof(component.bits));
+#endif
+  return(component);
+}
+#define BSR_GET_PIXEL(component) getHalfPixel(component)
+#define BSR_SET_PIXEL(value) setHalfPixel(value)
+#else
+#define BSR_GET_PIXEL(component) (component)
+#define BSR_SET_PIXEL(value) (value)
+#endif
+
 typedef struct {
   //
   // these are not globally mmapped so they can be set differently by each thread after fork()
@@ -233,15 +415,68 @@ typedef struct {
   int my_thread_id;
   pid_t my_pid;
   int dedup_count;
+  int numa_node; // index of NUMA node this thread is pinned to, 0 if NUMA mode is disabled
 } bsr_thread_state_t;
 
+typedef struct {
+  uint64_t offset;          // file offset of compressed block
+  uint32_t compressed_size; // bytes
+  uint32_t record_count;    // star records in this block
+} bsr_block_t;
+
 typedef struct {
   int fd;
   struct stat sb;
   char *buf; // pointer to large input file, globally mmapped
-  size_t buf_size;
+  size_t buf_size; // size of star data, same as data file size
+  size_t map_size; // size of mapping, may be larger if attached to a cached copy on hugetlbfs
+  char *node_buf[BSR_MAX_NUMA_NODES]; // optional per NUMA node copies of buf, globally mmapped
+  int stream_fd; // file descriptor for streaming input backend, may be opened with O_DIRECT
+  int compressed; // 1 = block compressed data file
+  bsr_block_t *blocks; // block table for compressed data files, malloc'ed before fork()
+  uint64_t block_count;
+  uint64_t total_records;
+  uint32_t max_block_records;
+  uint32_t max_compressed_size;
 } input_file_t;
 
+typedef struct {
+  //
+  // ring of chunks filled by a reader thread for the streaming input backend, each worker thread has its own.
+  // chunk n is in slot (n % BSR_INPUT_STREAM_CHUNKS), a slot is free when chunks_filled - chunks_consumed < BSR_INPUT_STREAM_CHUNKS
+  //
+  pthread_t reader_thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;
+  char *chunk_buf;  // BSR_INPUT_STREAM_CHUNKS * chunk_size bytes, page aligned for O_DIRECT
+  size_t chunk_buf_size;
+  size_t chunk_size;
+  size_t chunk_bytes[BSR_INPUT_STREAM_CHUNKS];
+  uint64_t chunk_offset[BSR_INPUT_STREAM_CHUNKS];
+  uint64_t start_offset; // aligned down to BSR_INPUT_STREAM_ALIGNMENT
+  uint64_t end_offset;   // aligned up to BSR_INPUT_STREAM_ALIGNMENT
+  uint64_t file_size;
+  uint64_t chunks_filled;
+  uint64_t chunks_consumed;
+  int reader_done;
+  int stop;
+  int error;
+  uint64_t *input_bytes; // this thread's entry in status_array
+} input_stream_t;
+
+typedef struct {
+  int num_codes;                 // number of output codes, 0 if the table is not used for this output format
+  uint16_t zero_code;            // output code for an input of exactly 0.0
+  double code_scale;             // maximum integer output code
+  int half_output;               // 1 if output codes are half float bit patterns
+  double linear_limit;           // inputs at or below this use the linear segment of the transfer function, -1.0 if none
+  double linear_slope;
+  int linear_inclusive;          // 1 if linear_limit itself is in the linear segment
+  double *threshold;             // threshold[k] is the smallest input that encodes to output code k or higher
+  uint16_t *cell_code;           // output code at the start of each index cell, used to narrow the threshold search
+} bsr_transfer_table_t;
+
 typedef struct {
   //
   // bsr_state is globally mmapped so all of these variables will be the sync'ed between threads
@@ -253,8 +488,20 @@ typedef struct {
   unsigned char *image_output_buf;            // updated by all threads, globally mmaped
   unsigned char **row_pointers;               // updated by all threads, globally mmaped
   int *compressed_sizes;                      // updated by all threads, globally mmaped
+  uint64_t *exr_section_sizes;                // updated by all threads, globally mmaped
+  png_strip_t *png_strips;                    // updated by all threads, globally mmaped
+  jpeg_strip_t *jpeg_strips;                  // updated by all threads, globally mmaped
+  grid_tile_t *grid_tiles;                    // updated by all threads, globally mmaped
+  unsigned char *exr_mip_buf;                 // updated by all threads, globally mmaped
+  unsigned char *tiff_pyramid_buf;            // updated by all threads, globally mmaped
+  uint64_t *tiff_tile_table;                  // updated by all threads, globally mmaped
+  unsigned char *deep_zoom_buf;               // updated by all threads, globally mmaped
+  float *deep_zoom_linear_buf;                // updated by all threads, globally mmaped
+  unsigned char *stream_out_buf;              // updated by all threads, globally mmaped
+  stream_slot_t *stream_slots;                // updated by all threads, globally mmaped
   pixel_composition_t *image_blur_buf;        // updated by all threads, globally mmaped
   pixel_composition_t *image_resize_buf;      // updated by all threads, globally mmaped
+  pixel_composition_t *image_resize_scratch_buf; // updated by all threads, globally mmaped
   dedup_buffer_t *dedup_buf;        // thread-specific buffer, malloc'ed so each thread get's it's own local buffer when fork()'ed
   dedup_index_t *dedup_index;       // thread-specific buffer, malloc'ed so each thread get's it's own local buffer when fork()'ed
   unsigned char *compression_buf1;  // thread-specific buffer, malloc'ed so each thread get's it's own local buffer when fork()'ed
@@ -273,10 +520,54 @@ typedef struct {
   int dedup_index_mode;
   int resize_res_x;
   int resize_res_y;
+  int resize_area_factor;        // integer reduction factor if area resize is used, 0 for Lanczos resize
+  int blur_ring_bands;           // band slots in the blur buffer for the direct kernel, 0 if the recursive filter blurs in place
+  int output_buffer_aliased;     // 1 if the output buffer reuses the composition buffer after resize
+  int composition_buffer_dirty;  // 1 if the composition buffer has been written since it was mapped, 0 while it is still zero-filled
+  size_t composition_pixel_size; // bytes per pixel in image composition, blur, and resize buffers for composition_precision
+  double composition_scale;      // linear intensity of one unit in the image composition buffer (camera_pixel_limit for 16-bit buffers)
+  int post_process_stage;        // pass that applies camera gamma and pre-limit: 0 = own pass, 1 = Gaussian blur, 2 = resize, 3 = sequencePixels
+  int keep_source_image;         // 1 if a later extra output reads the post-processed image, so its buffer is not released
   pixel_composition_t *current_image_buf; // just a pointer to one of the real image buffers which are all globally mmapped
   int current_image_res_x;
   int current_image_res_y;
+  int grid_num_tiles;            // number of tiles in AVIF/HEIF grid image, 0 if encoded as a single image
+  int grid_tile_width;
+  int grid_tile_height;
+  int grid_columns;
+  int grid_rows;
+  int exr_header_size;           // bytes in EXR header, set by main thread before workers write their sections
+  int exr_sequential;            // 1 if the EXR file is not a regular file (pipe, terminal) and main thread writes it in order
+  int exr_num_levels;            // tiled EXR levels, 0 for scanline EXR images
+  int exr_num_tiles;             // tiled EXR tiles in all levels
+  int exr_num_tile_rows;         // tiled EXR rows of tiles in all levels
+  int exr_num_bands;             // tiled EXR mipmap reduction tasks in all levels
+  tile_level_t exr_levels[BSR_MAX_TILE_LEVELS];
+  uint64_t tiff_file_offset;     // end of TIFF data written so far, advanced atomically by each thread as it writes
+  int tiff_num_levels;           // TIFF pyramid levels including the full resolution image
+  int tiff_num_tiles;            // TIFF tiles in all levels
+  int tiff_num_tile_rows;        // TIFF rows of tiles in all levels
+  int tiff_num_bands;            // TIFF pyramid reduction tasks in all levels
+  tile_level_t tiff_levels[BSR_MAX_TILE_LEVELS];
+  int deep_zoom_num_levels;      // deep zoom pyramid levels including the full resolution image, 0 if not enabled
+  int deep_zoom_num_tiles;       // deep zoom tiles in all levels
+  int deep_zoom_num_bands;       // deep zoom pyramid reduction tasks in all levels
+  int deep_zoom_black_tiles;     // deep zoom tiles not written because they are black, counted atomically
+  tile_level_t deep_zoom_levels[BSR_MAX_TILE_LEVELS];
+  int stream_num_bands;          // bands of rows in a streamed image, 0 if the image is written after conversion
+  int stream_band_lines;         // rows per streamed band
+  int stream_prefix_lines;       // rows before each band converted again for PNG filtering and the deflate window
+  int stream_num_slots;          // bands held in image_output_buf (ring) and stream_out_buf at the same time
+  int stream_bands_written;      // bands written by the main thread so far, updated atomically
+  size_t stream_slot_size;       // bytes of converted rows per slot in image_output_buf, including prefix rows
+  size_t stream_out_slot_size;   // bytes of encoded data per slot in stream_out_buf
+  FILE *stream_file;             // main thread only: output file or stdout
+  uint32_t stream_adler;         // main thread only: PNG Adler-32 of all bands written
+  output_buf_t splice_buf;       // main thread only: small pieces of spliced output, kept until exit
   int num_worker_threads;
+  int numa_nodes;                // number of NUMA nodes in use, 0 if NUMA mode is disabled
+  int numa_node_id[BSR_MAX_NUMA_NODES];
+  cpu_set_t numa_cpus[BSR_MAX_NUMA_NODES];
   pid_t main_pid;
   pid_t main_pgid;
   pid_t httpd_pid;
@@ -284,6 +575,10 @@ typedef struct {
   int per_thread_buffers;
   int thread_buffer_count;
   bsr_status_t *status_array;    // updated by all threads, globally mmaped
+  bsr_band_schedule_t *band_schedule; // shared task queue for band scheduled passes, globally mmapped
+  int *band_done;                // per stage band completion flags, globally mmapped
+  int band_schedule_max_bands;
+  bsr_transfer_table_t transfer_table; // transfer function and quantization lookup table, malloc'ed before fork() and read only after
   double rgb_red[32768];
   double rgb_green[32768];
   double rgb_blue[32768];
@@ -306,10 +601,23 @@ typedef struct {
   size_t output_buffer_size;
   size_t row_pointers_size;
   size_t compressed_sizes_size;
+  size_t exr_section_sizes_size;
+  size_t exr_mip_buf_size;
+  size_t tiff_pyramid_buf_size;
+  size_t tiff_tile_table_size;
+  size_t deep_zoom_buf_size;
+  size_t deep_zoom_linear_buf_size;
+  size_t stream_out_buf_size;
+  size_t stream_slots_size;
+  size_t png_strips_size;
+  size_t jpeg_strips_size;
+  size_t grid_tiles_size;
   size_t blur_buffer_size;
   size_t resize_buffer_size;
+  size_t resize_scratch_buffer_size;
   size_t thread_buffer_size;
   size_t status_array_size;
+  size_t band_schedule_size;
   size_t dedup_buffer_size;
   size_t dedup_index_size;
   size_t compression_buf_size;
@@ -324,18 +632,72 @@ typedef struct {
   int enable_maximum_distance;
   double maximum_distance;
   int output_little_endian;
+  int compress_output;
 } mkg_config_t;
 
+typedef struct {
+  //
+  // writes star records to a data file, optionally as independently compressed blocks
+  // star records in each block are byte shuffled (byte n of every record stored together) before zlib compression
+  //
+  FILE *output_file;
+  int compress;                 // 0 = write star records directly
+  int compression_level;        // zlib compression level
+  uint32_t block_records;       // maximum star records per block
+  uint32_t record_count;        // star records in current block
+  unsigned char *record_buf;
+  unsigned char *shuffle_buf;
+  unsigned char *compressed_buf;
+  size_t compressed_buf_size;
+  bsr_block_t *blocks;
+  uint64_t block_count;
+  uint64_t blocks_allocated;
+  uint64_t offset;              // file offset of next block
+  uint64_t total_records;
+  uint64_t compressed_bytes;
+} bsr_block_writer_t;
+
+typedef struct {
+  char data_file_directory[256];
+  char data_cache_directory[256];
+  int Gaia_min_parallax_quality;
+  int num_processes;
+  int warm_only;
+  int lock;
+  int report;
+  int remove;
+} bsrcache_config_t;
+
+typedef struct {
+  char data_file_directory[256];
+  char output_directory[256];
+  int Gaia_min_parallax_quality;
+  int compression_level;
+  int block_records;
+  int decompress;
+  int verify;
+} bsrcompress_config_t;
+
 typedef struct {
   char bsrender_cfg_version[256];
   char *QUERY_STRING_p;
   char config_file_name[256];
   char data_file_directory[256];
+  char data_cache_directory[256];
   char output_file_name[256];
+  char extra_output[BSR_MAX_EXTRA_OUTPUTS][256];
+  int num_extra_outputs;
   int print_status;
   int num_threads;
   int per_thread_buffer;
   int per_thread_buffer_Airy;
+  int huge_pages;
+  int numa_mode;
+  int numa_replicate_max_size;
+  int max_memory;
+  int composition_precision;
+  int input_backend;
+  int input_chunk_size;
   int cgi_mode;
   int cgi_max_res_x;
   int cgi_max_res_y;
@@ -345,6 +707,7 @@ typedef struct {
   int cgi_max_Airy_disk_max_extent;
   int cgi_max_Airy_disk_min_extent;
   int cgi_allow_anti_alias;
+  int cgi_min_encoder_speed;
   int Gaia_db_enable;
   int Gaia_min_parallax_quality;
   int external_db_enable;
@@ -388,14 +751,28 @@ typedef struct {
   double skyglow_per_pixel_mag;
   int pre_limit_intensity;
   double Gaussian_blur_radius;
+  int Gaussian_blur_method;
   double output_scaling_factor;
   int Lanczos_order;
+  int resize_method;
   int draw_crosshairs;
   int draw_grid_lines;
   int output_format;
   int color_profile;
   int exr_compression;
+  int exr_tile_size;
+  int exr_mipmap;
+  int tiff_compression;
+  int tiff_tile_size;
+  int tiff_pyramid;
+  int deep_zoom;
+  int deep_zoom_tile_size;
+  int stream_output;
+  int png_compression;
+  int jpeg_encoding;
   int compression_quality;
+  int encoder_speed;
+  int grid_tile_size;
   int image_format;
   int hdr_neutral_white_ref;
   int bits_per_color;
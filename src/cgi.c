@@ -157,6 +157,9 @@ int enforceCGILimits(bsr_config_t *bsr_config) {
   if (bsr_config->cgi_allow_anti_alias == 0) {
     bsr_config->anti_alias_enable=0;
   }
+  if ((bsr_config->cgi_min_encoder_speed > 0) && (bsr_config->encoder_speed < bsr_config->cgi_min_encoder_speed)) {
+    bsr_config->encoder_speed=bsr_config->cgi_min_encoder_speed;
+  }
 
   return(0);
 }
@@ -44,10 +44,79 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include "bsr-compress.h"
+
+int openCachedInputFile(bsr_config_t *bsr_config, char *file_path, input_file_t *input_file) {
+  char cache_path[1024];
+  char *file_name_p;
+  int cache_fd;
+  struct stat cache_sb;
+  char *cache_buf;
+  int mmap_protection;
+  int mmap_visibility;
+
+  //
+  // look for a copy of this data file in data_cache_directory created by bsrcache
+  // the cached copy is only used if it is at least as large as the data file and has the same modification time
+  // returns 1 if the cached copy was attached, 0 if the data file should be used instead
+  //
+  file_name_p=strrchr(file_path, '/');
+  if (file_name_p != NULL) {
+    file_name_p++;
+  } else {
+    file_name_p=file_path;
+  }
+  snprintf(cache_path, 1024, "%s/%s", bsr_config->data_cache_directory, file_name_p);
+  cache_fd=open(cache_path, O_RDONLY);
+  if (cache_fd < 0) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: no cached copy of %s in %s, using data file\n", file_name_p, bsr_config->data_cache_directory);
+      fflush(stdout);
+    }
+    return(0);
+  }
+  fstat(cache_fd, &cache_sb);
+  if ((cache_sb.st_size < input_file->sb.st_size)\
+       || (cache_sb.st_mtim.tv_sec != input_file->sb.st_mtim.tv_sec)\
+       || (cache_sb.st_mtim.tv_nsec != input_file->sb.st_mtim.tv_nsec)) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: cached copy of %s is stale or incomplete, using data file. Run bsrcache to update\n", file_name_p);
+      fflush(stdout);
+    }
+    close(cache_fd);
+    return(0);
+  }
+
+  //
+  // map the entire cache file. On hugetlbfs the file size is rounded up to the huge page size
+  //
+  mmap_protection=PROT_READ;
+  mmap_visibility=MAP_SHARED;
+  cache_buf=mmap(NULL, cache_sb.st_size, mmap_protection, mmap_visibility, cache_fd, 0);
+  if (cache_buf == MAP_FAILED) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: could not mmap cached copy of %s, errno: %d, using data file\n", file_name_p, errno);
+      fflush(stdout);
+    }
+    close(cache_fd);
+    return(0);
+  }
+
+  // data file is no longer needed
+  close(input_file->fd);
+  input_file->fd=cache_fd;
+  input_file->buf=cache_buf;
+  input_file->map_size=cache_sb.st_size;
+
+  return(1);
+}
 
 int openInputFile(bsr_config_t *bsr_config, char *file_path, input_file_t *input_file, int little_endian) {
   int mmap_protection;
   int mmap_visibility;
+  char header[256];
+  char *header_p;
+  uint64_t i;
 
   input_file->fd=open(file_path, O_RDONLY);
   if (input_file->fd < 0) {
@@ -59,6 +128,9 @@ int openInputFile(bsr_config_t *bsr_config, char *file_path, input_file_t *input
   }
 
   fstat(input_file->fd, &input_file->sb);
+  input_file->buf_size=input_file->sb.st_size;
+  input_file->map_size=input_file->sb.st_size;
+  input_file->stream_fd=input_file->fd;
   if (input_file->sb.st_size == 0) {
     // mmap will not map zero length files but we don't want that to abort the entire program
     // processStars() will not try to read anything from this file so input_file->buf is irrelevant
@@ -66,29 +138,68 @@ int openInputFile(bsr_config_t *bsr_config, char *file_path, input_file_t *input
     return(0);
   }
 
-  mmap_protection=PROT_READ;
-  mmap_visibility=MAP_SHARED;
-  input_file->buf=mmap(NULL, input_file->sb.st_size, mmap_protection, mmap_visibility, input_file->fd, 0);
-  if (input_file->buf == MAP_FAILED) {
-    if (bsr_config->cgi_mode != 1) {
-      printf("Error: could not mmap file %s, errno: %d\n", file_path, errno);
-      fflush(stdout);
+  if (bsr_config->input_backend != 0) {
+    //
+    // streaming input backend: worker threads read the file with pread(), only the header is read here
+    //
+    input_file->buf=NULL;
+    input_file->map_size=0;
+    if (bsr_config->input_backend == 2) {
+      input_file->stream_fd=open(file_path, O_RDONLY | O_DIRECT);
+      if (input_file->stream_fd < 0) {
+        if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+          printf("Warning: could not open %s with O_DIRECT, errno: %d, using page cache\n", file_path, errno);
+          fflush(stdout);
+        }
+        input_file->stream_fd=input_file->fd;
+      }
     }
-    exit(1);
+    posix_fadvise(input_file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    memset(header, 0, 256);
+    if (pread(input_file->fd, header, 256, 0) != 256) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not read header of %s\n", file_path);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    header_p=header;
+  } else {
+    //
+    // attach to cached copy if data_cache_directory is set, otherwise mmap data file
+    //
+    if ((bsr_config->data_cache_directory[0] == 0) || (openCachedInputFile(bsr_config, file_path, input_file) == 0)) {
+      mmap_protection=PROT_READ;
+      mmap_visibility=MAP_SHARED;
+      input_file->buf=mmap(NULL, input_file->sb.st_size, mmap_protection, mmap_visibility, input_file->fd, 0);
+      if (input_file->buf == MAP_FAILED) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not mmap file %s, errno: %d\n", file_path, errno);
+          fflush(stdout);
+        }
+        exit(1);
+      }
+    }
+    header_p=input_file->buf;
   }
 
   //
   // verify file has correct endianness signature for this platform
   //
+  input_file->compressed=0;
   if (little_endian == 1) {
-    if (strncmp(input_file->buf, BSR_MAGIC_NUMBER_LE, 11) != 0) {
+    if (strncmp(header_p, BSR_MAGIC_NUMBER_ZL, 11) == 0) {
+      input_file->compressed=1;
+    } else if (strncmp(header_p, BSR_MAGIC_NUMBER_LE, 11) != 0) {
       if (bsr_config->cgi_mode != 1) {
         printf("Error: input file %s is not a bsrender data file or is not in little endian format as this platform requires\n", file_path);
       }
       exit(1);
     }
   } else {
-    if (strncmp(input_file->buf, BSR_MAGIC_NUMBER_BE, 11) != 0) {
+    if (strncmp(header_p, BSR_MAGIC_NUMBER_ZB, 11) == 0) {
+      input_file->compressed=1;
+    } else if (strncmp(header_p, BSR_MAGIC_NUMBER_BE, 11) != 0) {
       if (bsr_config->cgi_mode != 1) {
         printf("Error: input file %s is not a bsrender data files or is not in big endian format as this platform requires\n", file_path);
       }
@@ -96,12 +207,34 @@ int openInputFile(bsr_config_t *bsr_config, char *file_path, input_file_t *input
     }
   }
 
+  //
+  // block compressed data file: load block table, worker threads decompress their own blocks
+  //
+  if (input_file->compressed == 1) {
+    if (loadBlockTable(input_file->fd, input_file->buf, input_file->buf_size, &input_file->blocks, &input_file->block_count, &input_file->total_records) != 0) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: compressed input file %s has a missing or corrupt block table\n", file_path);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    input_file->max_block_records=0;
+    input_file->max_compressed_size=0;
+    for (i=0; i < input_file->block_count; i++) {
+      if (input_file->blocks[i].record_count > input_file->max_block_records) {
+        input_file->max_block_records=input_file->blocks[i].record_count;
+      }
+      if (input_file->blocks[i].compressed_size > input_file->max_compressed_size) {
+        input_file->max_compressed_size=input_file->blocks[i].compressed_size;
+      }
+    }
+  }
+
   return(0);
 }
 
 int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   char file_path[1024];
-  input_file_t input_file;
   int little_endian;
 
   //
@@ -118,10 +251,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     } else {
       sprintf(file_path, "%s/%s-%s.%s", bsr_config->data_file_directory, BSR_EXTERNAL_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
     }
-    openInputFile(bsr_config, file_path, &input_file, little_endian);
-    bsr_state->input_file_external.buf=input_file.buf;
-    bsr_state->input_file_external.fd=input_file.fd;
-    bsr_state->input_file_external.buf_size=input_file.sb.st_size;
+    openInputFile(bsr_config, file_path, &bsr_state->input_file_external, little_endian);
   } // end if enable_external_db
   if (bsr_config->Gaia_db_enable == 1) {
     if (little_endian == 1) {
@@ -129,20 +259,14 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     } else {
       sprintf(file_path, "%s/%s-pq100-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
     }
-    openInputFile(bsr_config, file_path, &input_file, little_endian);
-    bsr_state->input_file_pq100.buf=input_file.buf;
-    bsr_state->input_file_pq100.fd=input_file.fd;
-    bsr_state->input_file_pq100.buf_size=input_file.sb.st_size;
+    openInputFile(bsr_config, file_path, &bsr_state->input_file_pq100, little_endian);
     if (bsr_config->Gaia_min_parallax_quality < 100) {
       if (little_endian == 1) {
         sprintf(file_path, "%s/%s-pq050-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_LE_SUFFIX, BSR_EXTENSION);
       } else {
         sprintf(file_path, "%s/%s-pq050-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq050.buf=input_file.buf;
-      bsr_state->input_file_pq050.fd=input_file.fd;
-      bsr_state->input_file_pq050.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq050, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 50) {
       if (little_endian == 1) {
@@ -150,10 +274,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq030-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq030.buf=input_file.buf;
-      bsr_state->input_file_pq030.fd=input_file.fd;
-      bsr_state->input_file_pq030.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq030, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 30) {
       if (little_endian == 1) {
@@ -161,10 +282,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq020-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq020.buf=input_file.buf;
-      bsr_state->input_file_pq020.fd=input_file.fd;
-      bsr_state->input_file_pq020.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq020, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 20) {
       if (little_endian == 1) {
@@ -172,10 +290,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq010-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq010.buf=input_file.buf;
-      bsr_state->input_file_pq010.fd=input_file.fd;
-      bsr_state->input_file_pq010.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq010, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 10) {
       if (little_endian == 1) {
@@ -183,10 +298,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq005-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq005.buf=input_file.buf;
-      bsr_state->input_file_pq005.fd=input_file.fd;
-      bsr_state->input_file_pq005.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq005, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 05) {
       if (little_endian == 1) {
@@ -194,10 +306,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq003-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq003.buf=input_file.buf;
-      bsr_state->input_file_pq003.fd=input_file.fd;
-      bsr_state->input_file_pq003.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq003, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 03) {
       if (little_endian == 1) {
@@ -205,10 +314,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq002-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq002.buf=input_file.buf;
-      bsr_state->input_file_pq002.fd=input_file.fd;
-      bsr_state->input_file_pq002.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq002, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 02) {
       if (little_endian == 1) {
@@ -216,10 +322,7 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq001-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq001.buf=input_file.buf;
-      bsr_state->input_file_pq001.fd=input_file.fd;
-      bsr_state->input_file_pq001.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq001, little_endian);
     }
     if (bsr_config->Gaia_min_parallax_quality < 01) {
       if (little_endian == 1) {
@@ -227,60 +330,73 @@ int openInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
       } else {
         sprintf(file_path, "%s/%s-pq000-%s.%s", bsr_config->data_file_directory, BSR_GDR3_PREFIX, BSR_BE_SUFFIX, BSR_EXTENSION);
       }
-      openInputFile(bsr_config, file_path, &input_file, little_endian);
-      bsr_state->input_file_pq000.buf=input_file.buf;
-      bsr_state->input_file_pq000.fd=input_file.fd;
-      bsr_state->input_file_pq000.buf_size=input_file.sb.st_size;
+      openInputFile(bsr_config, file_path, &bsr_state->input_file_pq000, little_endian);
     }
   } // end if enable Gaia_db
 
   return(0);
 }
 
+int closeInputFile(input_file_t *input_file) {
+  int i;
+
+  //
+  // unmap any per NUMA node copies, then the data file (or cached copy) itself
+  //
+  for (i=0; i < BSR_MAX_NUMA_NODES; i++) {
+    if (input_file->node_buf[i] != NULL) {
+      munmap(input_file->node_buf[i], input_file->buf_size);
+      input_file->node_buf[i]=NULL;
+    }
+  }
+  if (input_file->buf != NULL) {
+    munmap(input_file->buf, input_file->map_size);
+  }
+  if (input_file->blocks != NULL) {
+    free(input_file->blocks);
+    input_file->blocks=NULL;
+  }
+  if (input_file->stream_fd != input_file->fd) {
+    close(input_file->stream_fd);
+  }
+  close(input_file->fd);
+
+  return(0);
+}
+
 int closeInputFiles(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
 
   if (bsr_config->external_db_enable == 1) {
-    munmap(bsr_state->input_file_external.buf, bsr_state->input_file_external.buf_size);
-    close(bsr_state->input_file_external.fd);
+    closeInputFile(&bsr_state->input_file_external);
   } // end if external_db_enable
   if (bsr_config->Gaia_db_enable == 1) {
-    munmap(bsr_state->input_file_pq100.buf, bsr_state->input_file_pq100.buf_size);
-    close(bsr_state->input_file_pq100.fd);
+    closeInputFile(&bsr_state->input_file_pq100);
     if (bsr_config->Gaia_min_parallax_quality < 100) {
-      munmap(bsr_state->input_file_pq050.buf, bsr_state->input_file_pq050.buf_size);
-      close(bsr_state->input_file_pq050.fd);
+      closeInputFile(&bsr_state->input_file_pq050);
     }
     if (bsr_config->Gaia_min_parallax_quality < 50) {
-      munmap(bsr_state->input_file_pq030.buf, bsr_state->input_file_pq030.buf_size);
-      close(bsr_state->input_file_pq030.fd);
+      closeInputFile(&bsr_state->input_file_pq030);
     }
     if (bsr_config->Gaia_min_parallax_quality < 30) {
-      munmap(bsr_state->input_file_pq020.buf, bsr_state->input_file_pq020.buf_size);
-      close(bsr_state->input_file_pq020.fd);
+      closeInputFile(&bsr_state->input_file_pq020);
     }
     if (bsr_config->Gaia_min_parallax_quality < 20) {
-      munmap(bsr_state->input_file_pq010.buf, bsr_state->input_file_pq010.buf_size);
-      close(bsr_state->input_file_pq010.fd);
+      closeInputFile(&bsr_state->input_file_pq010);
     }
     if (bsr_config->Gaia_min_parallax_quality < 10) {
-      munmap(bsr_state->input_file_pq005.buf, bsr_state->input_file_pq005.buf_size);
-      close(bsr_state->input_file_pq005.fd);
+      closeInputFile(&bsr_state->input_file_pq005);
     }
     if (bsr_config->Gaia_min_parallax_quality < 05) {
-      munmap(bsr_state->input_file_pq003.buf, bsr_state->input_file_pq003.buf_size);
-      close(bsr_state->input_file_pq003.fd);
+      closeInputFile(&bsr_state->input_file_pq003);
     }
     if (bsr_config->Gaia_min_parallax_quality < 03) {
-      munmap(bsr_state->input_file_pq002.buf, bsr_state->input_file_pq002.buf_size);
-      close(bsr_state->input_file_pq002.fd);
+      closeInputFile(&bsr_state->input_file_pq002);
     }
     if (bsr_config->Gaia_min_parallax_quality < 02) {
-      munmap(bsr_state->input_file_pq001.buf, bsr_state->input_file_pq001.buf_size);
-      close(bsr_state->input_file_pq001.fd);
+      closeInputFile(&bsr_state->input_file_pq001);
     }
     if (bsr_config->Gaia_min_parallax_quality < 01) {
-      munmap(bsr_state->input_file_pq000.buf, bsr_state->input_file_pq000.buf_size);
-      close(bsr_state->input_file_pq000.fd);
+      closeInputFile(&bsr_state->input_file_pq000);
     } 
   } // end if enable Gaia_db
 
@@ -38,6 +38,10 @@
 
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
 #include <math.h>
 #include <time.h>
 #include "util.h"
@@ -46,32 +50,147 @@
 #include "overlay.h"
 #include "Gaia-passbands.h"
 
+//
+// skyglow zones for the raster projections. Each zone is convex so it covers one span of pixels per row, the span
+// ends are estimated analytically and then settled with the same per pixel test the zone would use on every pixel
+//
+#define BSR_SKYGLOW_MAX_ZONES     3
+#define BSR_SKYGLOW_ZONE_RECTANGLE 0
+#define BSR_SKYGLOW_ZONE_CIRCLE   1
+#define BSR_SKYGLOW_ZONE_ELLIPSE  2
+#define BSR_FILL_CHUNK_PIXELS     1024
+
+typedef struct {
+  int shape;
+  double x_offset;       // added to pixel x distance from image center
+  double extent_x;       // half width for rectangles, squared semi-axis for circles and ellipses
+  double extent_y;       // half height for rectangles, squared semi-axis for circles and ellipses
+  double min_x_distance; // side limits on pixel x distance for partial zones
+  double max_x_distance;
+} skyglow_zone_t;
+
+static int pixelInSkyglowZone(bsr_state_t *bsr_state, skyglow_zone_t *zone, int x, int y) {
+  double pixel_x_distance;
+  double pixel_y_distance;
+
+  pixel_y_distance=(double)y - bsr_state->camera_half_res_y + 0.5;
+  pixel_x_distance=(double)x - bsr_state->camera_half_res_x + zone->x_offset + 0.5;
+  if ((pixel_x_distance < zone->min_x_distance) || (pixel_x_distance > zone->max_x_distance)) {
+    return(0);
+  }
+  if (zone->shape == BSR_SKYGLOW_ZONE_RECTANGLE) {
+    return((fabs(pixel_x_distance) <= zone->extent_x) && (fabs(pixel_y_distance) <= zone->extent_y));
+  } else if (zone->shape == BSR_SKYGLOW_ZONE_CIRCLE) {
+    return((((pixel_x_distance * pixel_x_distance) + (pixel_y_distance * pixel_y_distance)) / zone->extent_x) <= 1.0);
+  }
+  return(((pixel_x_distance * pixel_x_distance / zone->extent_x) + (pixel_y_distance * pixel_y_distance / zone->extent_y)) <= 1.0);
+}
+
+//
+// find first and last pixel of a zone in image row y, returns 0 if the row does not intersect the zone
+//
+static int skyglowZoneSpan(bsr_state_t *bsr_state, skyglow_zone_t *zone, int y, int *span_start, int *span_end) {
+  double pixel_y_distance;
+  double center_x;
+  double half_width;
+  double left;
+  double right;
+  int last_x;
+  int start;
+  int end;
+
+  last_x=bsr_state->current_image_res_x - 1;
+  pixel_y_distance=(double)y - bsr_state->camera_half_res_y + 0.5;
+  if (zone->shape == BSR_SKYGLOW_ZONE_RECTANGLE) {
+    if (fabs(pixel_y_distance) > zone->extent_y) {
+      return(0);
+    }
+    half_width=zone->extent_x;
+  } else if (zone->shape == BSR_SKYGLOW_ZONE_CIRCLE) {
+    half_width=sqrt(fmax((zone->extent_x - (pixel_y_distance * pixel_y_distance)), 0.0));
+  } else {
+    half_width=sqrt(fmax((1.0 - (pixel_y_distance * pixel_y_distance / zone->extent_y)), 0.0) * zone->extent_x);
+  }
+
+  //
+  // analytic estimate, clipped to side limits and image
+  //
+  center_x=bsr_state->camera_half_res_x - zone->x_offset - 0.5;
+  left=fmax((center_x - half_width), (center_x + zone->min_x_distance));
+  right=fmin((center_x + half_width), (center_x + zone->max_x_distance));
+  left=fmin(fmax(left, 0.0), (double)last_x);
+  right=fmin(fmax(right, 0.0), (double)last_x);
+  start=(int)floor(left);
+  end=(int)ceil(right);
+
+  //
+  // settle span ends with per pixel test, rounding can move them by a pixel either way
+  //
+  while ((start <= end) && (pixelInSkyglowZone(bsr_state, zone, start, y) == 0)) {
+    start++;
+  }
+  while ((end >= start) && (pixelInSkyglowZone(bsr_state, zone, end, y) == 0)) {
+    end--;
+  }
+  if (start > end) {
+    return(0);
+  }
+  while ((start > 0) && (pixelInSkyglowZone(bsr_state, zone, (start - 1), y) == 1)) {
+    start--;
+  }
+  while ((end < last_x) && (pixelInSkyglowZone(bsr_state, zone, (end + 1), y) == 1)) {
+    end++;
+  }
+  *span_start=start;
+  *span_end=end;
+
+  return(1);
+}
+
+//
+// fill pixels with one value, copying the filled part forward in chunks so stores are wide for any pixel size
+//
+static void fillPixels(pixel_composition_t *pixel_p, pixel_composition_t value, uint64_t count) {
+  uint64_t filled;
+  uint64_t chunk;
+
+  if (count == 0) {
+    return;
+  }
+  pixel_p[0]=value;
+  filled=1;
+  while (filled < count) {
+    chunk=filled;
+    if (chunk > BSR_FILL_CHUNK_PIXELS) {
+      chunk=BSR_FILL_CHUNK_PIXELS;
+    }
+    if (chunk > (count - filled)) {
+      chunk=count - filled;
+    }
+    memcpy((pixel_p + filled), pixel_p, (chunk * sizeof(pixel_composition_t)));
+    filled+=chunk;
+  }
+}
+
 int initImageCompositionBuffer(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   struct timespec starttime;
   struct timespec endtime;
   double elapsed_time;
-  uint64_t image_offset;
-  int current_image_x;
   int current_image_y;
-  pixel_composition_t *current_image_p;
   int current_image_res_x;
   int current_image_res_y;
   int lines_per_thread;
+  int first_line;
+  int end_line;
   int i;
   int skyglow_temp;
   double skyglow_intensity;
-  double skyglow_red=0.0;
-  double skyglow_green=0.0;
-  double skyglow_blue=0.0;
-  int pixel_has_skyglow=0;
-  double pixel_x_distance;
-  double pixel_y_distance;
+  pixel_composition_t skyglow_pixel;
+  skyglow_zone_t skyglow_zone[BSR_SKYGLOW_MAX_ZONES];
+  int skyglow_zones=0;
+  int span_start;
+  int span_end;
   const double pi_over_2=0.5 * M_PI;
-  double semimajor2=0.0;
-  double semiminor2=0.0;
-  double elipse;
-  double circle_r2=0.0;
-  double circle;
   double aesthetic_edge=0.4999999; // for rectangular edges, this instead of 0.5 eliminates an extra skyglow pixel on "even" pixel raster sizes without being too small for reasonable arbitrary raster sizes
 
   //
@@ -108,108 +227,76 @@ int initImageCompositionBuffer(bsr_config_t *bsr_config, bsr_state_t *bsr_state)
   }
 
   //
-  // all threads: set skyglow variables enabled
+  // all threads: set skyglow pixel value and zones for the selected raster projection if enabled
   //
+  memset(&skyglow_pixel, 0, sizeof(pixel_composition_t));
   if (bsr_config->skyglow_enable == 1) {
     // skyglow rgb values
     // note: rgb lookup table values are adjusted for Gaia Gband transmissivity, so we must uncorrect for that with Gaia_Gband_scalar
     skyglow_temp=(int)(bsr_config->skyglow_temp + 0.5);
     skyglow_intensity=Gaia_Gband_scalar * pow(100.0, (-bsr_config->skyglow_per_pixel_mag / 5.0));
-    skyglow_red=skyglow_intensity * bsr_state->rgb_red[skyglow_temp];
-    skyglow_green=skyglow_intensity * bsr_state->rgb_green[skyglow_temp];
-    skyglow_blue=skyglow_intensity * bsr_state->rgb_blue[skyglow_temp];
-    // set shortcut variables we don't need to calculate for each pixel
-    circle_r2=((pi_over_2 * bsr_state->pixels_per_radian) + 0.5) * ((pi_over_2 * bsr_state->pixels_per_radian) + 0.5);
-    semimajor2=((M_PI * bsr_state->pixels_per_radian) + 0.5) * ((M_PI * bsr_state->pixels_per_radian) + 0.5);
-    semiminor2=((pi_over_2 * bsr_state->pixels_per_radian) + 0.5) * ((pi_over_2 * bsr_state->pixels_per_radian) + 0.5);
-  }
-
-  //
-  // all threads: initialize image composition buffer
-  //
-  current_image_x=0;
-  current_image_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  current_image_p=bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)current_image_y);
-  for (image_offset=0; ((image_offset < ((uint64_t)bsr_state->current_image_res_x * (uint64_t)lines_per_thread)) && (current_image_y < current_image_res_y)); image_offset++) {
-    //
-    // check if pixel is inside a valid rendering area for the selected raster projection
-    //
-    if (bsr_config->skyglow_enable == 1) {
-      if (bsr_config->camera_projection == 0) { // equirectangular (lat/lon)
-        pixel_has_skyglow=0;
-        pixel_y_distance=fabs((double)current_image_y - bsr_state->camera_half_res_y + 0.5);
-        pixel_x_distance=fabs((double)current_image_x - bsr_state->camera_half_res_x + 0.5);
-        if ((pixel_x_distance <= ((M_PI * bsr_state->pixels_per_radian) + aesthetic_edge)) && (pixel_y_distance <= ((pi_over_2 * bsr_state->pixels_per_radian) + aesthetic_edge))) {
-           pixel_has_skyglow=1;
-        }
-      } else if ((bsr_config->camera_projection == 1) && (bsr_config->spherical_orientation == 0)) { // forward centered spherical
-        pixel_has_skyglow=0;
-        pixel_y_distance=(double)current_image_y - bsr_state->camera_half_res_y + 0.5;
-        // center zone
-        pixel_x_distance=(double)current_image_x - bsr_state->camera_half_res_x + 0.5;
-        circle=((pixel_x_distance * pixel_x_distance) + (pixel_y_distance * pixel_y_distance)) / circle_r2;
-        if (circle <= 1.0) {
-          pixel_has_skyglow=1;
-        }
-        // left zone
-        pixel_x_distance=(double)current_image_x - bsr_state->camera_half_res_x + (M_PI * bsr_state->pixels_per_radian) + 0.5;
-        circle=((pixel_x_distance * pixel_x_distance) + (pixel_y_distance * pixel_y_distance)) / circle_r2;
-        if ((circle <= 1.0) && (pixel_x_distance >= -aesthetic_edge)) {
-          pixel_has_skyglow=1;
-        }
-        // right zone
-        pixel_x_distance=(double)current_image_x - bsr_state->camera_half_res_x - (M_PI * bsr_state->pixels_per_radian) + 0.5;
-        circle=((pixel_x_distance * pixel_x_distance) + (pixel_y_distance * pixel_y_distance)) / circle_r2;
-        if ((circle <= 1.0) && (pixel_x_distance <= aesthetic_edge)) {
-          pixel_has_skyglow=1;
-        }
-      } else if ((bsr_config->camera_projection == 1) && (bsr_config->spherical_orientation == 1)) { // side-by-side spherical
-        pixel_has_skyglow=0;
-        pixel_y_distance=(double)current_image_y - bsr_state->camera_half_res_y + 0.5;
-        // left zone
-        pixel_x_distance=(double)current_image_x - bsr_state->camera_half_res_x + (pi_over_2 * bsr_state->pixels_per_radian) + 0.5;
-        circle=((pixel_x_distance * pixel_x_distance) + (pixel_y_distance * pixel_y_distance)) / circle_r2;
-        if (circle <= 1.0) {
-          pixel_has_skyglow=1;
-        }
-        // right zone
-        pixel_x_distance=(double)current_image_x - bsr_state->camera_half_res_x - (pi_over_2 * bsr_state->pixels_per_radian) + 0.5;
-        circle=((pixel_x_distance * pixel_x_distance) + (pixel_y_distance * pixel_y_distance)) / circle_r2;
-        if (circle <= 1.0) {
-          pixel_has_skyglow=1;
-        }
-      } else if ((bsr_config->camera_projection == 2) || (bsr_config->camera_projection == 3)) { // Hammer or Mollewide ellipse
-        pixel_has_skyglow=0;
-        pixel_y_distance=(double)current_image_y - bsr_state->camera_half_res_y + 0.5;
-        pixel_x_distance=(double)current_image_x - bsr_state->camera_half_res_x + 0.5;
-        elipse=(pixel_x_distance * pixel_x_distance / semimajor2) + (pixel_y_distance * pixel_y_distance / semiminor2);
-        if (elipse <= 1.0) {
-          pixel_has_skyglow=1;
-        }
-      } else {
-        pixel_has_skyglow=1;
-      } // end if inside valid rendering area
-    } // end if skyglow enabled
-
-    //
-    // all threads: set pixel rgb background value (skyglow or 0.0)
-    //
-    if (pixel_has_skyglow == 1) {
-      current_image_p->r=skyglow_red;
-      current_image_p->g=skyglow_green;
-      current_image_p->b=skyglow_blue;
-    } else {
-      current_image_p->r=0.0;
-      current_image_p->g=0.0;
-      current_image_p->b=0.0;
+    // convert to image composition buffer units
+    skyglow_pixel.r=BSR_SET_PIXEL(skyglow_intensity * bsr_state->rgb_red[skyglow_temp] / bsr_state->composition_scale);
+    skyglow_pixel.g=BSR_SET_PIXEL(skyglow_intensity * bsr_state->rgb_green[skyglow_temp] / bsr_state->composition_scale);
+    skyglow_pixel.b=BSR_SET_PIXEL(skyglow_intensity * bsr_state->rgb_blue[skyglow_temp] / bsr_state->composition_scale);
+    for (i=0; i < BSR_SKYGLOW_MAX_ZONES; i++) {
+      skyglow_zone[i].shape=BSR_SKYGLOW_ZONE_CIRCLE;
+      skyglow_zone[i].x_offset=0.0;
+      skyglow_zone[i].extent_x=((pi_over_2 * bsr_state->pixels_per_radian) + 0.5) * ((pi_over_2 * bsr_state->pixels_per_radian) + 0.5);
+      skyglow_zone[i].extent_y=skyglow_zone[i].extent_x;
+      skyglow_zone[i].min_x_distance=-DBL_MAX;
+      skyglow_zone[i].max_x_distance=DBL_MAX;
     }
-    current_image_x++;
-    if (current_image_x == bsr_state->current_image_res_x) {
-      current_image_x=0;
-      current_image_y++;
+    if (bsr_config->camera_projection == 0) { // equirectangular (lat/lon)
+      skyglow_zones=1;
+      skyglow_zone[0].shape=BSR_SKYGLOW_ZONE_RECTANGLE;
+      skyglow_zone[0].extent_x=(M_PI * bsr_state->pixels_per_radian) + aesthetic_edge;
+      skyglow_zone[0].extent_y=(pi_over_2 * bsr_state->pixels_per_radian) + aesthetic_edge;
+    } else if ((bsr_config->camera_projection == 1) && (bsr_config->spherical_orientation == 0)) { // forward centered spherical
+      // center, left and right zones
+      skyglow_zones=3;
+      skyglow_zone[1].x_offset=M_PI * bsr_state->pixels_per_radian;
+      skyglow_zone[1].min_x_distance=-aesthetic_edge;
+      skyglow_zone[2].x_offset=-M_PI * bsr_state->pixels_per_radian;
+      skyglow_zone[2].max_x_distance=aesthetic_edge;
+    } else if ((bsr_config->camera_projection == 1) && (bsr_config->spherical_orientation == 1)) { // side-by-side spherical
+      // left and right zones
+      skyglow_zones=2;
+      skyglow_zone[0].x_offset=pi_over_2 * bsr_state->pixels_per_radian;
+      skyglow_zone[1].x_offset=-pi_over_2 * bsr_state->pixels_per_radian;
+    } else if ((bsr_config->camera_projection == 2) || (bsr_config->camera_projection == 3)) { // Hammer or Mollewide ellipse
+      skyglow_zones=1;
+      skyglow_zone[0].shape=BSR_SKYGLOW_ZONE_ELLIPSE;
+      skyglow_zone[0].extent_x=((M_PI * bsr_state->pixels_per_radian) + 0.5) * ((M_PI * bsr_state->pixels_per_radian) + 0.5);
+      skyglow_zone[0].extent_y=((pi_over_2 * bsr_state->pixels_per_radian) + 0.5) * ((pi_over_2 * bsr_state->pixels_per_radian) + 0.5);
+    } else { // whole image
+      skyglow_zones=1;
+      skyglow_zone[0].shape=BSR_SKYGLOW_ZONE_RECTANGLE;
+      skyglow_zone[0].extent_x=(double)current_image_res_x;
+      skyglow_zone[0].extent_y=(double)current_image_res_y;
     }
-    current_image_p++;
-  } // end for i
+  }
+
+  //
+  // all threads: initialize this thread's lines of the image composition buffer
+  // a freshly mapped buffer is already zero-filled so only skyglow spans are written, a buffer that has been
+  // used before is cleared first
+  //
+  first_line=bsr_state->perthread->my_thread_id * lines_per_thread;
+  end_line=first_line + lines_per_thread;
+  if (end_line > current_image_res_y) {
+    end_line=current_image_res_y;
+  }
+  if ((bsr_state->composition_buffer_dirty == 1) && (first_line < end_line)) {
+    memset((bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)first_line)), 0, ((size_t)current_image_res_x * (size_t)(end_line - first_line) * sizeof(pixel_composition_t)));
+  }
+  for (current_image_y=first_line; current_image_y < end_line; current_image_y++) {
+    for (i=0; i < skyglow_zones; i++) {
+      if (skyglowZoneSpan(bsr_state, &skyglow_zone[i], current_image_y, &span_start, &span_end) == 1) {
+        fillPixels((bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)current_image_y) + span_start), skyglow_pixel, (uint64_t)(span_end - span_start + 1));
+      }
+    }
+  }
 
   //
   // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
@@ -222,6 +309,8 @@ int initImageCompositionBuffer(bsr_config_t *bsr_config, bsr_state_t *bsr_state)
   } else {
     // main thread
     waitForWorkerThreads(bsr_state, THREAD_STATUS_INIT_IMAGECOMP_COMPLETE);
+    // bsr_state is shared, so only mark the buffer dirty once every thread has checked it
+    bsr_state->composition_buffer_dirty=1;
     // ready to continue, set all worker thread status to continue
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
       bsr_state->status_array[i].status=THREAD_STATUS_INIT_IMAGECOMP_CONTINUE;
@@ -240,3 +329,142 @@ int initImageCompositionBuffer(bsr_config_t *bsr_config, bsr_state_t *bsr_state)
 
   return(0);
 }
+
+#if BSR_COMPOSITION_BITS == 16
+//
+// add accumulation tile to 16-bit image composition buffer, limited to BSR_HALF_LIMIT
+//
+static void flushAccumulationTile(bsr_state_t *bsr_state, uint64_t tile, double *tile_sum) {
+  pixel_composition_t *image_composition_p;
+  uint64_t image_offset;
+  uint64_t image_size;
+  int i;
+
+  image_size=(uint64_t)bsr_state->current_image_res_x * (uint64_t)bsr_state->current_image_res_y;
+  image_offset=tile * BSR_ACCUMULATION_TILE_PIXELS;
+  image_composition_p=bsr_state->image_composition_buf + image_offset;
+  for (i=0; ((i < BSR_ACCUMULATION_TILE_PIXELS) && ((image_offset + i) < image_size)); i++) {
+    image_composition_p->r=BSR_SET_PIXEL(fmin(((double)BSR_GET_PIXEL(image_composition_p->r) + tile_sum[0]), BSR_HALF_LIMIT));
+    image_composition_p->g=BSR_SET_PIXEL(fmin(((double)BSR_GET_PIXEL(image_composition_p->g) + tile_sum[1]), BSR_HALF_LIMIT));
+    image_composition_p->b=BSR_SET_PIXEL(fmin(((double)BSR_GET_PIXEL(image_composition_p->b) + tile_sum[2]), BSR_HALF_LIMIT));
+    tile_sum[0]=0.0;
+    tile_sum[1]=0.0;
+    tile_sum[2]=0.0;
+    tile_sum+=3;
+    image_composition_p++;
+  }
+}
+#endif
+
+//
+// main thread: scan main thread buffer for pixels to integrate into image until all worker threads are done
+//
+int integratePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int i;
+  int all_workers_done;
+  int main_thread_buffer_index;
+  int buffer_is_empty;
+  int empty_passes;
+  thread_buffer_t *main_thread_buf_p;
+#if BSR_COMPOSITION_BITS == 16
+  double *tile_sum;
+  double *tile_sum_p;
+  uint64_t *tile_tag;
+  uint64_t tile;
+  int tile_slot;
+  double inv_composition_scale;
+#else
+  pixel_composition_t *image_composition_p;
+#endif
+
+#if BSR_COMPOSITION_BITS == 16
+  //
+  // 16-bit buffers would lose faint stars added to bright pixels, so pixels are summed in double precision
+  // accumulation tiles (a direct mapped cache of BSR_ACCUMULATION_TILE_PIXELS adjacent pixels) and each tile is
+  // added to the image composition buffer when it is evicted, rounding once per tile instead of once per star
+  //
+  tile_sum=(double *)calloc((size_t)BSR_ACCUMULATION_TILES * BSR_ACCUMULATION_TILE_PIXELS * 3, sizeof(double));
+  tile_tag=(uint64_t *)malloc((size_t)BSR_ACCUMULATION_TILES * sizeof(uint64_t));
+  if ((tile_sum == NULL) || (tile_tag == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for accumulation tiles\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+  for (tile_slot=0; tile_slot < BSR_ACCUMULATION_TILES; tile_slot++) {
+    tile_tag[tile_slot]=UINT64_MAX;
+  }
+  inv_composition_scale=1.0 / bsr_state->composition_scale;
+#endif
+
+  empty_passes=0;
+  while (empty_passes < 2) { // do second pass once empty
+    // check if any worker threads have died
+    checkExceptions(bsr_state);
+
+    // scan buffer for new pixel data
+    main_thread_buf_p=bsr_state->thread_buf;
+    buffer_is_empty=1;
+    for (main_thread_buffer_index=0; main_thread_buffer_index < bsr_state->thread_buffer_count; main_thread_buffer_index++) {
+      if ((main_thread_buf_p->status_left == 1) && (main_thread_buf_p->status_right == 1)) {
+        // buffer location has new pixel data, add to image composition buffer
+        if (buffer_is_empty == 1) {
+          buffer_is_empty=0; 
+        }
+#if BSR_COMPOSITION_BITS == 16
+        tile=main_thread_buf_p->image_offset / BSR_ACCUMULATION_TILE_PIXELS;
+        tile_slot=(int)(tile % BSR_ACCUMULATION_TILES);
+        tile_sum_p=tile_sum + ((uint64_t)tile_slot * BSR_ACCUMULATION_TILE_PIXELS * 3);
+        if (tile_tag[tile_slot] != tile) {
+          if (tile_tag[tile_slot] != UINT64_MAX) {
+            flushAccumulationTile(bsr_state, tile_tag[tile_slot], tile_sum_p);
+          }
+          tile_tag[tile_slot]=tile;
+        }
+        tile_sum_p+=(main_thread_buf_p->image_offset % BSR_ACCUMULATION_TILE_PIXELS) * 3;
+        tile_sum_p[0]+=main_thread_buf_p->r * inv_composition_scale;
+        tile_sum_p[1]+=main_thread_buf_p->g * inv_composition_scale;
+        tile_sum_p[2]+=main_thread_buf_p->b * inv_composition_scale;
+#else
+        image_composition_p=bsr_state->image_composition_buf + main_thread_buf_p->image_offset;
+        image_composition_p->r+=main_thread_buf_p->r;
+        image_composition_p->g+=main_thread_buf_p->g;
+        image_composition_p->b+=main_thread_buf_p->b;
+#endif
+        // set this buffer location to free
+        main_thread_buf_p->status_left=0;
+        main_thread_buf_p->status_right=0;
+      }
+      main_thread_buf_p++;
+    } // end for thread_buffer_index
+    // if buffer is completely empty, check if all threads are done
+    if (buffer_is_empty == 1) {
+      all_workers_done=1;
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        if (bsr_state->status_array[i].status < THREAD_STATUS_PROCESS_STARS_COMPLETE) {
+          all_workers_done=0;
+        }
+      }
+      if (all_workers_done == 1) {
+        // if main thread buffer is empty and all worker threads are done, increment empty_passes
+        empty_passes++;
+      }
+    } 
+  } // end while not done
+
+#if BSR_COMPOSITION_BITS == 16
+  //
+  // add remaining accumulation tiles to image composition buffer
+  //
+  for (tile_slot=0; tile_slot < BSR_ACCUMULATION_TILES; tile_slot++) {
+    if (tile_tag[tile_slot] != UINT64_MAX) {
+      flushAccumulationTile(bsr_state, tile_tag[tile_slot], (tile_sum + ((uint64_t)tile_slot * BSR_ACCUMULATION_TILE_PIXELS * 3)));
+    }
+  }
+  free(tile_sum);
+  free(tile_tag);
+#endif
+
+  return(0);
+}
@@ -40,5 +40,10 @@
 #define BSR_IMAGE_COMPOSITION_H
 
 int initImageCompositionBuffer(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int integratePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int initImageCompositionBuffer16(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int integratePixels16(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int initImageCompositionBuffer64(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int integratePixels64(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_IMAGE_COMPOSITION_H
@@ -81,6 +81,7 @@ bsr_state_t *initState(bsr_config_t *bsr_config) {
     }
     return(NULL);
   }
+  bsr_state->bsr_state_size=bsr_state_size;
 
   //
   // calculate number of worker threads to be forked
@@ -97,6 +98,21 @@ bsr_state_t *initState(bsr_config_t *bsr_config) {
   bsr_state->camera_half_res_x=(double)bsr_config->camera_res_x / 2.0;
   bsr_state->camera_half_res_y=(double)bsr_config->camera_res_y / 2.0;
   bsr_state->camera_pixel_limit=pow(100.0, (-bsr_config->camera_pixel_limit_mag / 5.0));
+
+  //
+  // image composition buffer element size and units. 16-bit buffers store intensity relative to camera_pixel_limit
+  // so faint stars are not lost below the smallest half-float value and bright stars do not overflow
+  //
+  if (bsr_config->composition_precision == 16) {
+    bsr_state->composition_pixel_size=3 * sizeof(uint16_t);
+    bsr_state->composition_scale=bsr_state->camera_pixel_limit;
+  } else if (bsr_config->composition_precision == 64) {
+    bsr_state->composition_pixel_size=3 * sizeof(double);
+    bsr_state->composition_scale=1.0;
+  } else {
+    bsr_state->composition_pixel_size=3 * sizeof(float);
+    bsr_state->composition_scale=1.0;
+  }
   bsr_state->render_distance_min2=bsr_config->render_distance_min * bsr_config->render_distance_min;
   bsr_state->render_distance_max2=bsr_config->render_distance_max * bsr_config->render_distance_max;
   bsr_state->linear_star_intensity_min=pow(100.0, (-bsr_config->star_intensity_min / 5.0));
@@ -122,6 +138,24 @@ bsr_state_t *initState(bsr_config_t *bsr_config) {
     bsr_state->per_thread_buffers = bsr_config->per_thread_buffer;
   }
 
+  //
+  // select the first pass that reads every pixel after image composition. Normalization, camera gamma
+  // and pre-limit are applied there on the fly instead of in their own read/write pass over the image.
+  // Overlays are drawn after resize so they need the separate pass if nothing else comes before them.
+  // Extra outputs resize and convert the same image, so it is normalized once by blur or its own pass
+  //
+  if (bsr_config->Gaussian_blur_radius > 0.0) {
+    bsr_state->post_process_stage=1;
+  } else if (bsr_config->num_extra_outputs > 0) {
+    bsr_state->post_process_stage=0;
+  } else if (bsr_config->output_scaling_factor != 1.0) {
+    bsr_state->post_process_stage=2;
+  } else if ((bsr_config->draw_crosshairs != 1) && (bsr_config->draw_grid_lines != 1)) {
+    bsr_state->post_process_stage=3;
+  } else {
+    bsr_state->post_process_stage=0;
+  }
+
   //
   // optionally transform spherical icrs to euclidian icrs if x,y,z are zero
   //
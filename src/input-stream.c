@@ -0,0 +1,211 @@
+//
+// Billion Star 3D Rendering Engine
+// Kevin M. Loch
+//
+// 3D rendering engine for the ESA Gaia DR3 star dataset
+
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (c) 2021, Kevin Loch
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include "input-stream.h"
+
+void *inputStreamReader(void *arg) {
+  input_stream_t *stream=(input_stream_t *)arg;
+  uint64_t offset;
+  uint64_t chunk_index=0;
+  size_t request_size;
+  size_t bytes_read;
+  ssize_t result;
+  int slot;
+
+  //
+  // reader thread: fill each free slot of the ring with the next aligned chunk of this worker's slice of the file
+  // so the worker can process one chunk while the next ones are in flight
+  //
+  offset=stream->start_offset;
+  while (offset < stream->end_offset) {
+    // wait for a free slot
+    pthread_mutex_lock(&stream->lock);
+    while (((stream->chunks_filled - stream->chunks_consumed) >= BSR_INPUT_STREAM_CHUNKS) && (stream->stop == 0)) {
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    if (stream->stop == 1) {
+      break;
+    }
+
+    // read chunk, short reads are retried until end of file. With O_DIRECT the request size stays aligned and the
+    // final read of the file returns a partial block
+    slot=(int)(chunk_index % BSR_INPUT_STREAM_CHUNKS);
+    request_size=stream->chunk_size;
+    if ((stream->end_offset - offset) < request_size) {
+      request_size=(size_t)(stream->end_offset - offset);
+    }
+    bytes_read=0;
+    while ((bytes_read < request_size) && ((offset + bytes_read) < stream->file_size)) {
+      result=pread(stream->fd, stream->chunk_buf + ((size_t)slot * stream->chunk_size) + bytes_read, (request_size - bytes_read), (off_t)(offset + bytes_read));
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        stream->error=errno;
+        break;
+      } else if (result == 0) {
+        break; // end of file
+      }
+      bytes_read+=(size_t)result;
+    }
+    *stream->input_bytes+=bytes_read;
+
+    // hand chunk to worker thread
+    pthread_mutex_lock(&stream->lock);
+    stream->chunk_bytes[slot]=bytes_read;
+    stream->chunk_offset[slot]=offset;
+    if ((stream->error == 0) && (bytes_read > 0)) {
+      stream->chunks_filled++;
+    }
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+    if ((stream->error != 0) || (bytes_read < request_size)) {
+      // error or end of file
+      break;
+    }
+    offset+=request_size;
+    chunk_index++;
+  }
+
+  pthread_mutex_lock(&stream->lock);
+  stream->reader_done=1;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+
+  return(NULL);
+}
+
+int startInputStream(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t *input_file, input_stream_t *stream, uint64_t start_byte, uint64_t end_byte) {
+  int mmap_protection;
+  int mmap_visibility;
+
+  //
+  // start reader thread for bytes [start_byte, end_byte) of input_file. Offsets are widened to BSR_INPUT_STREAM_ALIGNMENT
+  // so the same reads work with O_DIRECT, the caller skips the extra bytes at the beginning of the first chunk
+  //
+  memset(stream, 0, sizeof(input_stream_t));
+  stream->fd=input_file->stream_fd;
+  stream->file_size=(uint64_t)input_file->buf_size;
+  stream->chunk_size=(size_t)bsr_config->input_chunk_size * (size_t)1048576;
+  stream->start_offset=(start_byte / BSR_INPUT_STREAM_ALIGNMENT) * BSR_INPUT_STREAM_ALIGNMENT;
+  stream->end_offset=((end_byte + BSR_INPUT_STREAM_ALIGNMENT - 1) / BSR_INPUT_STREAM_ALIGNMENT) * BSR_INPUT_STREAM_ALIGNMENT;
+  stream->input_bytes=&bsr_state->status_array[bsr_state->perthread->my_thread_id].input_bytes;
+
+  // page aligned private buffer for all chunks in the ring
+  mmap_protection=PROT_READ | PROT_WRITE;
+  mmap_visibility=MAP_PRIVATE | MAP_ANONYMOUS;
+  stream->chunk_buf_size=(size_t)BSR_INPUT_STREAM_CHUNKS * stream->chunk_size;
+  stream->chunk_buf=(char *)mmap(NULL, stream->chunk_buf_size, mmap_protection, mmap_visibility, -1, 0);
+  if (stream->chunk_buf == MAP_FAILED) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate input stream buffer\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->cond, NULL);
+  if (pthread_create(&stream->reader_thread, NULL, inputStreamReader, stream) != 0) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not create input stream reader thread\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  return(0);
+}
+
+char *getInputStreamChunk(input_stream_t *stream, size_t *chunk_bytes, uint64_t *chunk_offset) {
+  char *chunk=NULL;
+  int slot;
+
+  //
+  // wait for the next chunk from the reader thread. Returns NULL at end of stream or on read error (stream->error)
+  //
+  pthread_mutex_lock(&stream->lock);
+  while ((stream->chunks_filled == stream->chunks_consumed) && (stream->reader_done == 0)) {
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  }
+  if (stream->chunks_filled > stream->chunks_consumed) {
+    slot=(int)(stream->chunks_consumed % BSR_INPUT_STREAM_CHUNKS);
+    chunk=stream->chunk_buf + ((size_t)slot * stream->chunk_size);
+    *chunk_bytes=stream->chunk_bytes[slot];
+    *chunk_offset=stream->chunk_offset[slot];
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  return(chunk);
+}
+
+int releaseInputStreamChunk(input_stream_t *stream) {
+  //
+  // return the oldest chunk's slot to the reader thread
+  //
+  pthread_mutex_lock(&stream->lock);
+  stream->chunks_consumed++;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+
+  return(0);
+}
+
+int stopInputStream(input_stream_t *stream) {
+  //
+  // stop reader thread (which may still be reading ahead) and free ring buffer
+  //
+  pthread_mutex_lock(&stream->lock);
+  stream->stop=1;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+  pthread_join(stream->reader_thread, NULL);
+  pthread_mutex_destroy(&stream->lock);
+  pthread_cond_destroy(&stream->cond);
+  munmap(stream->chunk_buf, stream->chunk_buf_size);
+
+  return(0);
+}
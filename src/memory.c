@@ -39,19 +39,110 @@
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <sys/mman.h>
 #include <time.h>
+#include "bsr-numa.h"
+#include "Gaussian-blur.h"
+#include "bsr-grid.h"
+#include "bsr-output.h"
+#include "bsr-exr.h"
+#include "bsr-tiff.h"
+#include "bsr-deepzoom.h"
+#include "bsr-stream.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+//
+// free buffers sized for one output image, shared by freeMemory() and the states of extra outputs
+//
+int freeOutputMemory(bsr_state_t *bsr_state) {
+  if (bsr_state->image_resize_buf != NULL) {
+    munmap(bsr_state->image_resize_buf, bsr_state->resize_buffer_size);
+  }
+  if (bsr_state->image_resize_scratch_buf != NULL) {
+    munmap(bsr_state->image_resize_scratch_buf, bsr_state->resize_scratch_buffer_size);
+  }
+  if (bsr_state->band_schedule != NULL) {
+    munmap(bsr_state->band_schedule, bsr_state->band_schedule_size);
+  }
+  if ((bsr_state->image_output_buf != NULL) && (bsr_state->output_buffer_aliased == 0)) {
+    munmap(bsr_state->image_output_buf, bsr_state->output_buffer_size);
+  }
+  if (bsr_state->row_pointers != NULL) {
+    munmap(bsr_state->row_pointers, bsr_state->row_pointers_size);
+  }
+  if (bsr_state->compressed_sizes != NULL) {
+    munmap(bsr_state->compressed_sizes, bsr_state->compressed_sizes_size);
+  }
+  if (bsr_state->exr_section_sizes != NULL) {
+    munmap(bsr_state->exr_section_sizes, bsr_state->exr_section_sizes_size);
+  }
+  if (bsr_state->exr_mip_buf != NULL) {
+    munmap(bsr_state->exr_mip_buf, bsr_state->exr_mip_buf_size);
+  }
+  if (bsr_state->tiff_pyramid_buf != NULL) {
+    munmap(bsr_state->tiff_pyramid_buf, bsr_state->tiff_pyramid_buf_size);
+  }
+  if (bsr_state->tiff_tile_table != NULL) {
+    munmap(bsr_state->tiff_tile_table, bsr_state->tiff_tile_table_size);
+  }
+  if (bsr_state->deep_zoom_buf != NULL) {
+    munmap(bsr_state->deep_zoom_buf, bsr_state->deep_zoom_buf_size);
+  }
+  if (bsr_state->deep_zoom_linear_buf != NULL) {
+    munmap(bsr_state->deep_zoom_linear_buf, bsr_state->deep_zoom_linear_buf_size);
+  }
+  if (bsr_state->stream_out_buf != NULL) {
+    munmap(bsr_state->stream_out_buf, bsr_state->stream_out_buf_size);
+  }
+  if (bsr_state->stream_slots != NULL) {
+    munmap(bsr_state->stream_slots, bsr_state->stream_slots_size);
+  }
+  if (bsr_state->png_strips != NULL) {
+    munmap(bsr_state->png_strips, bsr_state->png_strips_size);
+  }
+  if (bsr_state->jpeg_strips != NULL) {
+    munmap(bsr_state->jpeg_strips, bsr_state->jpeg_strips_size);
+  }
+  if (bsr_state->grid_tiles != NULL) {
+    munmap(bsr_state->grid_tiles, bsr_state->grid_tiles_size);
+  }
+  if (bsr_state->compression_buf1 != NULL) {
+    free(bsr_state->compression_buf1);
+  }
+  if (bsr_state->compression_buf2 != NULL) {
+    free(bsr_state->compression_buf2);
+  }
+  if (bsr_state->transfer_table.threshold != NULL) {
+    free(bsr_state->transfer_table.threshold);
+  }
+  if (bsr_state->transfer_table.cell_code != NULL) {
+    free(bsr_state->transfer_table.cell_code);
+  }
+  if (bsr_state->splice_buf.data != NULL) {
+    freeOutputBuf(&bsr_state->splice_buf);
+  }
+  return(0);
+}
 
 int freeMemory(bsr_state_t *bsr_state) {
+  freeOutputMemory(bsr_state);
   if (bsr_state->image_composition_buf != NULL) {
     munmap(bsr_state->image_composition_buf, bsr_state->composition_buffer_size);
   }
   if (bsr_state->image_blur_buf != NULL) {
     munmap(bsr_state->image_blur_buf, bsr_state->blur_buffer_size);
   }
-  if (bsr_state->image_resize_buf != NULL) {
-    munmap(bsr_state->image_resize_buf, bsr_state->resize_buffer_size);
-  }
   if (bsr_state->thread_buf != NULL) {
     munmap(bsr_state->thread_buf, bsr_state->thread_buffer_size);
   }
@@ -73,25 +164,747 @@ int freeMemory(bsr_state_t *bsr_state) {
   if (bsr_state->dedup_index != NULL) {
     free(bsr_state->dedup_index);
   }
-  if (bsr_state->image_output_buf != NULL) {
-    munmap(bsr_state->image_output_buf, bsr_state->output_buffer_size);
+  // must be freed last
+  if (bsr_state != NULL) {
+    munmap(bsr_state, bsr_state->bsr_state_size);
   }
-  if (bsr_state->row_pointers != NULL) {
-    munmap(bsr_state->row_pointers, bsr_state->row_pointers_size);
+  return(0);
+}
+
+int transparentHugePagesShmem() {
+  FILE *shmem_enabled_file;
+  char shmem_enabled[256];
+  char *shmem_enabled_p;
+
+  //
+  // transparent huge pages are controlled separately for shared memory. If the kernel has them
+  // set to [never] or [deny] then madvise(MADV_HUGEPAGE) on our shared buffers will have no effect
+  //
+  shmem_enabled_file=fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+  if (shmem_enabled_file == NULL) {
+    return(0);
   }
-  if (bsr_state->compressed_sizes != NULL) {
-    munmap(bsr_state->compressed_sizes, bsr_state->compressed_sizes_size);
+  shmem_enabled_p=fgets(shmem_enabled, 256, shmem_enabled_file);
+  fclose(shmem_enabled_file);
+  if ((shmem_enabled_p == NULL) || (strstr(shmem_enabled, "[never]") != NULL) || (strstr(shmem_enabled, "[deny]") != NULL)) {
+    return(0);
   }
-  if (bsr_state->compression_buf1 != NULL) {
-    free(bsr_state->compression_buf1);
+
+  return(1);
+}
+
+void *allocateImageBuffer(bsr_config_t *bsr_config, size_t *buffer_size, char *buffer_name) {
+  void *buffer=MAP_FAILED;
+  int mmap_protection;
+  int mmap_visibility;
+  int huge_pages;
+  size_t huge_page_size;
+  size_t rounded_size;
+
+  //
+  // allocate shared memory for large image buffers, optionally backed by huge pages
+  // huge_pages: 0 = normal pages, 1 = transparent huge pages, 2 = 2MB huge pages, 3 = 1GB huge pages
+  // if the requested huge page size is not available we fall back 1GB -> 2MB -> transparent -> normal pages
+  // buffer_size is rounded up to a multiple of the page size actually used so munmap() in freeMemory() matches
+  //
+  mmap_protection=PROT_READ | PROT_WRITE;
+  huge_pages=bsr_config->huge_pages;
+
+#ifdef MAP_HUGETLB
+  while ((buffer == MAP_FAILED) && (huge_pages >= 2)) {
+    if (huge_pages == 3) {
+      huge_page_size=(size_t)1073741824;
+      mmap_visibility=MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB;
+    } else {
+      huge_page_size=(size_t)2097152;
+      mmap_visibility=MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB;
+    }
+    rounded_size=((*buffer_size + huge_page_size - 1) / huge_page_size) * huge_page_size;
+    buffer=mmap(NULL, rounded_size, mmap_protection, mmap_visibility, -1, 0);
+    if (buffer != MAP_FAILED) {
+      *buffer_size=rounded_size;
+    } else {
+      if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+        if (huge_pages == 3) {
+          printf("Warning: 1GB huge pages not available for %s, trying 2MB huge pages\n", buffer_name);
+        } else {
+          printf("Warning: 2MB huge pages not available for %s, trying transparent huge pages\n", buffer_name);
+        }
+        fflush(stdout);
+      }
+      huge_pages--;
+    }
   }
-  if (bsr_state->compression_buf2 != NULL) {
-    free(bsr_state->compression_buf2);
+#else
+  if (huge_pages >= 2) {
+    if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: not compiled with MAP_HUGETLB support for %s, trying transparent huge pages\n", buffer_name);
+      fflush(stdout);
+    }
+    huge_pages=1;
   }
-  // must be freed last
-  if (bsr_state != NULL) {
-    munmap(bsr_state, bsr_state->bsr_state_size);
+#endif
+
+  if (buffer == MAP_FAILED) {
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    buffer=mmap(NULL, *buffer_size, mmap_protection, mmap_visibility, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if ((buffer != MAP_FAILED) && (huge_pages == 1)) {
+      if ((madvise(buffer, *buffer_size, MADV_HUGEPAGE) != 0) || (transparentHugePagesShmem() == 0)) {
+        if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+          printf("Warning: transparent huge pages not available for %s (see /sys/kernel/mm/transparent_hugepage/shmem_enabled), using normal pages\n", buffer_name);
+          fflush(stdout);
+        }
+      }
+    }
+#else
+    if ((buffer != MAP_FAILED) && (huge_pages == 1) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      printf("Warning: not compiled with MADV_HUGEPAGE support for %s, using normal pages\n", buffer_name);
+      fflush(stdout);
+    }
+#endif
+  }
+
+  return(buffer);
+}
+
+int releaseImageBuffer(void *buffer, size_t buffer_size) {
+  //
+  // return the pages of a shared image buffer that is no longer needed. MADV_DONTNEED would only drop this
+  // process's mapping of the shared pages, MADV_REMOVE frees them for all threads. The buffer stays mapped
+  // and reads as zero if it is written again (for example when the output buffer reuses it)
+  //
+  if ((buffer == NULL) || (buffer_size == 0)) {
+    return(0);
+  }
+#ifdef MADV_REMOVE
+  madvise(buffer, buffer_size, MADV_REMOVE);
+#endif
+
+  return(0);
+}
+
+int planMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  double composition_size;
+  double blur_size=0.0;
+  double resize_size=0.0;
+  double resize_scratch_size=0.0;
+  double output_size;
+  double fixed_size;
+  double dedup_index_count;
+  double stage_size;
+  double peak_size;
+  double unplanned_size;
+  int num_threads;
+
+  //
+  // Buffer lifetimes: the composition buffer lives until the last pass that reads it (resize, or pixel conversion
+  // without resize), the blur ring only during blur, the resize scratch buffer only during Lanczos resize, the resize
+  // buffer from resize through pixel conversion and the output buffer from pixel conversion on. Dead buffers are
+  // released with releaseImageBuffer() so the peak is the largest stage instead of the sum of all buffers.
+  // With resize, the output buffer reuses the composition buffer if it fits. Extra outputs all read the composition
+  // buffer, so it lives until the last one is converted and is never reused. Their own buffers are not counted here
+  //
+  num_threads=bsr_state->num_worker_threads + 1;
+  composition_size=(double)bsr_config->camera_res_x * (double)bsr_config->camera_res_y * (double)bsr_state->composition_pixel_size;
+  if (bsr_config->Gaussian_blur_radius > 0.0) {
+    if (bsr_state->blur_ring_bands > 0) {
+      blur_size=(double)bsr_state->blur_ring_bands * (double)BSR_BAND_LINES * (double)bsr_config->camera_res_x * (double)bsr_state->composition_pixel_size;
+    } else {
+      // recursive filter copies one block of columns per thread
+      blur_size=(double)num_threads * (double)BSR_BLUR_COLUMN_BLOCK * (double)bsr_config->camera_res_y * (double)bsr_state->composition_pixel_size;
+    }
+  }
+  if (bsr_config->output_scaling_factor != 1.0) {
+    resize_size=(double)bsr_state->resize_res_x * (double)bsr_state->resize_res_y * (double)bsr_state->composition_pixel_size;
+    if (bsr_state->resize_area_factor == 0) {
+      resize_scratch_size=(double)bsr_state->resize_res_x * (double)bsr_config->camera_res_y * (double)bsr_state->composition_pixel_size;
+    }
+  }
+  output_size=(double)bsr_state->output_buffer_size + (double)bsr_state->exr_mip_buf_size + (double)bsr_state->tiff_pyramid_buf_size + (double)bsr_state->deep_zoom_buf_size + (double)bsr_state->deep_zoom_linear_buf_size\
+            + (double)bsr_state->stream_out_buf_size;
+  bsr_state->output_buffer_aliased=0;
+  if ((bsr_config->output_scaling_factor != 1.0) && (output_size <= composition_size) && (bsr_config->num_extra_outputs == 0)) {
+    bsr_state->output_buffer_aliased=1;
+  }
+
+  // buffers that live for the whole run: star buffers, dedup buffer and index for each thread and Airy disk maps
+  if (((double)bsr_config->camera_res_x * (double)bsr_config->camera_res_y) <= 16777216.0) {
+    dedup_index_count=(double)bsr_config->camera_res_x * (double)bsr_config->camera_res_y;
+  } else {
+    dedup_index_count=(double)0xffffff;
+  }
+  fixed_size=((double)bsr_state->num_worker_threads * (double)bsr_state->per_thread_buffers * (double)sizeof(thread_buffer_t))\
+            + ((double)num_threads * (((double)bsr_state->per_thread_buffers * (double)sizeof(dedup_buffer_t)) + (dedup_index_count * (double)sizeof(dedup_index_t))))\
+            + (3.0 * (double)bsr_state->Airymap_size);
+
+  //
+  // peak over stages: render, blur, resize, pixel conversion and output
+  //
+  peak_size=composition_size + blur_size;
+  stage_size=composition_size + resize_size + resize_scratch_size;
+  if (stage_size > peak_size) {
+    peak_size=stage_size;
+  }
+  if ((bsr_config->output_scaling_factor != 1.0) && (bsr_config->num_extra_outputs == 0)) {
+    stage_size=resize_size + output_size;
+  } else if (bsr_config->output_scaling_factor != 1.0) {
+    stage_size=composition_size + resize_size + output_size;
+  } else {
+    stage_size=composition_size + output_size;
+  }
+  if (stage_size > peak_size) {
+    peak_size=stage_size;
+  }
+  peak_size+=fixed_size;
+  unplanned_size=composition_size + resize_size + resize_scratch_size + output_size + fixed_size;
+  if (bsr_config->Gaussian_blur_radius > 0.0) {
+    unplanned_size+=composition_size;
+  }
+
+  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    printf("Planned peak memory for image, star and dedup buffers: %.1fMB (%.1fMB without buffer reuse)\n", (peak_size / 1048576.0), (unplanned_size / 1048576.0));
+    fflush(stdout);
+  }
+
+  //
+  // reject jobs that would need more than max_memory before anything is allocated
+  //
+  if ((bsr_config->max_memory > 0) && (peak_size > ((double)bsr_config->max_memory * 1048576.0))) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: planned peak memory of %.1fMB exceeds max_memory=%dMB\n", (peak_size / 1048576.0), bsr_config->max_memory);
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  return(0);
+}
+
+//
+// resize and output resolutions and the layout of tiled, pyramid and streamed output for one output image
+//
+int setOutputLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int output_res_x;
+  int output_res_y;
+  int area_factor;
+
+  //
+  // resize and output resolutions
+  //
+  if (bsr_config->output_scaling_factor != 1.0) {
+    bsr_state->resize_res_x=(int)(((double)bsr_config->camera_res_x * bsr_config->output_scaling_factor) + 0.5);
+    bsr_state->resize_res_y=(int)(((double)bsr_config->camera_res_y * bsr_config->output_scaling_factor) + 0.5);
+
+    //
+    // area resize is used if selected and output_scaling_factor is 1/N for integer N
+    //
+    bsr_state->resize_area_factor=0;
+    if (bsr_config->resize_method == 1) {
+      area_factor=(int)((1.0 / bsr_config->output_scaling_factor) + 0.5);
+      if ((area_factor >= 2) && (fabs((1.0 / bsr_config->output_scaling_factor) - (double)area_factor) < 1.0E-6)) {
+        bsr_state->resize_area_factor=area_factor;
+      } else if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+        printf("Warning: resize_method=1 requires output_scaling_factor to be 1/N for integer N, using Lanczos resize\n");
+        fflush(stdout);
+      }
+    }
+    output_res_x=bsr_state->resize_res_x;
+    output_res_y=bsr_state->resize_res_y;
+  } else {
+    output_res_x=bsr_config->camera_res_x;
+    output_res_y=bsr_config->camera_res_y;
+  }
+  if (bsr_config->bits_per_color == 32) {
+    bsr_state->output_buffer_size=(size_t)output_res_x * (size_t)output_res_y * (size_t)12 * sizeof(unsigned char);
+  } else if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12) || (bsr_config->bits_per_color == 16)) {
+    bsr_state->output_buffer_size=(size_t)output_res_x * (size_t)output_res_y * (size_t)6 * sizeof(unsigned char);
+  } else { // default 8 bits per color
+    bsr_state->output_buffer_size=(size_t)output_res_x * (size_t)output_res_y * (size_t)3 * sizeof(unsigned char);
+  }
+  setEXRLayout(bsr_config, bsr_state, output_res_x, output_res_y);
+  setTIFFLayout(bsr_config, bsr_state, output_res_x, output_res_y);
+  setDeepZoomLayout(bsr_config, bsr_state, output_res_x, output_res_y);
+  setStreamLayout(bsr_config, bsr_state, output_res_x, output_res_y);
+
+  return(0);
+}
+
+//
+// allocate the resize buffers, band scheduler and output buffers of one output image. setOutputLayout() and
+// planMemory() must have been called for this state, and the composition buffer allocated if it may be reused
+//
+int allocateOutputMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  int mmap_protection;
+  int mmap_visibility;
+  int output_res_x;
+  int output_res_y;
+  int lines_per_block=0;
+  int pixel_data_size=0;
+  int png_row_bytes;
+  int lines_per_thread;
+  size_t png_filtered_size;
+
+  if (bsr_config->output_scaling_factor != 1.0) {
+    output_res_x=bsr_state->resize_res_x;
+    output_res_y=bsr_state->resize_res_y;
+  } else {
+    output_res_x=bsr_config->camera_res_x;
+    output_res_y=bsr_config->camera_res_y;
+  }
+
+  //
+  // allocate shared memory for image resize buffer if needed
+  //
+  if (bsr_config->output_scaling_factor != 1.0) {
+    bsr_state->resize_buffer_size=(size_t)bsr_state->resize_res_x * (size_t)bsr_state->resize_res_y * bsr_state->composition_pixel_size;
+    bsr_state->image_resize_buf=(pixel_composition_t *)allocateImageBuffer(bsr_config, &bsr_state->resize_buffer_size, "image resize buffer");
+    if (bsr_state->image_resize_buf == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for image resize buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    placeImageBufferNUMA(bsr_config, bsr_state, bsr_state->image_resize_buf, bsr_state->resize_buffer_size, ((size_t)bsr_state->resize_res_x * bsr_state->composition_pixel_size), bsr_state->resize_res_y, "image resize buffer");
+
+    // scratch buffer for horizontal Lanczos resize pass, full source height at output width
+    if (bsr_state->resize_area_factor == 0) {
+      bsr_state->resize_scratch_buffer_size=(size_t)bsr_state->resize_res_x * (size_t)bsr_config->camera_res_y * bsr_state->composition_pixel_size;
+      bsr_state->image_resize_scratch_buf=(pixel_composition_t *)allocateImageBuffer(bsr_config, &bsr_state->resize_scratch_buffer_size, "image resize scratch buffer");
+      if (bsr_state->image_resize_scratch_buf == MAP_FAILED) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate shared memory for image resize scratch buffer\n");
+          fflush(stdout);
+        }
+        exit(1);
+      }
+      placeImageBufferNUMA(bsr_config, bsr_state, bsr_state->image_resize_scratch_buf, bsr_state->resize_scratch_buffer_size, ((size_t)bsr_state->resize_res_x * bsr_state->composition_pixel_size), bsr_config->camera_res_y, "image resize scratch buffer");
+    }
+  }
+
+  //
+  // allocate shared memory for band scheduler queue and completion flags (two stages)
+  //
+  mmap_protection=PROT_READ | PROT_WRITE;
+  mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+  bsr_state->band_schedule_max_bands=(int)ceil((double)bsr_config->camera_res_y / (double)BSR_BAND_LINES);
+  if ((bsr_config->output_scaling_factor != 1.0) && ((int)ceil((double)bsr_state->resize_res_y / (double)BSR_BAND_LINES) > bsr_state->band_schedule_max_bands)) {
+    bsr_state->band_schedule_max_bands=(int)ceil((double)bsr_state->resize_res_y / (double)BSR_BAND_LINES);
+  }
+  if ((int)ceil((double)bsr_config->camera_res_x / (double)BSR_BLUR_COLUMN_BLOCK) > bsr_state->band_schedule_max_bands) {
+    bsr_state->band_schedule_max_bands=(int)ceil((double)bsr_config->camera_res_x / (double)BSR_BLUR_COLUMN_BLOCK);
+  }
+  // tiled EXR mipmap bands of all levels use the flags of both stages
+  if (((bsr_state->exr_num_bands + 1) / 2) > bsr_state->band_schedule_max_bands) {
+    bsr_state->band_schedule_max_bands=(bsr_state->exr_num_bands + 1) / 2;
+  }
+  // TIFF pyramid bands of all levels also use the flags of both stages
+  if (((bsr_state->tiff_num_bands + 1) / 2) > bsr_state->band_schedule_max_bands) {
+    bsr_state->band_schedule_max_bands=(bsr_state->tiff_num_bands + 1) / 2;
+  }
+  // deep zoom pyramid bands of all levels also use the flags of both stages
+  if (((bsr_state->deep_zoom_num_bands + 1) / 2) > bsr_state->band_schedule_max_bands) {
+    bsr_state->band_schedule_max_bands=(bsr_state->deep_zoom_num_bands + 1) / 2;
+  }
+  if (bsr_state->stream_num_bands > bsr_state->band_schedule_max_bands) {
+    bsr_state->band_schedule_max_bands=bsr_state->stream_num_bands;
+  }
+  bsr_state->band_schedule_size=sizeof(bsr_band_schedule_t) + ((size_t)bsr_state->band_schedule_max_bands * 2 * sizeof(int));
+  bsr_state->band_schedule=(bsr_band_schedule_t *)mmap(NULL, bsr_state->band_schedule_size, mmap_protection, mmap_visibility, -1, 0);
+  if (bsr_state->band_schedule == MAP_FAILED) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate shared memory for band scheduler\n");
+    }
+    exit(1);
+  }
+  bsr_state->band_done=(int *)(bsr_state->band_schedule + 1);
+
+  //
+  // allocate shared memory for image output buffer, or reuse the composition buffer which is dead after resize
+  //
+  if (bsr_state->output_buffer_aliased == 1) {
+    bsr_state->image_output_buf=(unsigned char *)bsr_state->image_composition_buf;
+  } else {
+    bsr_state->image_output_buf=(unsigned char *)allocateImageBuffer(bsr_config, &bsr_state->output_buffer_size, "image output buffer");
+  }
+  if (bsr_state->image_output_buf == MAP_FAILED) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate shared memory for image output buffer\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  //
+  // allocate shared memory for row_pointers used in various ways by different image output encoders
+  //
+  mmap_protection=PROT_READ | PROT_WRITE;
+  mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+  bsr_state->row_pointers_size=(size_t)output_res_y * sizeof(unsigned char *);
+  bsr_state->row_pointers=(unsigned char **)mmap(NULL, bsr_state->row_pointers_size, mmap_protection, mmap_visibility, -1, 0);
+  if (bsr_state->row_pointers == MAP_FAILED) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate shared memory for row_pointers\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  //
+  // allocate shared memory for EXR section sizes, one section per thread
+  //
+  if (bsr_config->image_format == 1) {
+    mmap_protection=PROT_READ | PROT_WRITE;
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    bsr_state->exr_section_sizes_size=(size_t)(bsr_state->num_worker_threads + 1) * sizeof(uint64_t);
+    bsr_state->exr_section_sizes=(uint64_t *)mmap(NULL, bsr_state->exr_section_sizes_size, mmap_protection, mmap_visibility, -1, 0);
+    if (bsr_state->exr_section_sizes == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for exr_section_sizes array\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+  }
+
+  //
+  // allocate shared memory for tiled EXR mipmap levels after the first
+  //
+  if (bsr_state->exr_mip_buf_size > 0) {
+    bsr_state->exr_mip_buf=(unsigned char *)allocateImageBuffer(bsr_config, &bsr_state->exr_mip_buf_size, "EXR mipmap buffer");
+    if (bsr_state->exr_mip_buf == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for EXR mipmap buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+  }
+
+  //
+  // allocate shared memory for TIFF pyramid levels after the first
+  //
+  if (bsr_state->tiff_pyramid_buf_size > 0) {
+    bsr_state->tiff_pyramid_buf=(unsigned char *)allocateImageBuffer(bsr_config, &bsr_state->tiff_pyramid_buf_size, "TIFF pyramid buffer");
+    if (bsr_state->tiff_pyramid_buf == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for TIFF pyramid buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+  }
+
+  //
+  // allocate shared memory for deep zoom levels after the first, encoded and linear
+  //
+  if (bsr_state->deep_zoom_buf_size > 0) {
+    bsr_state->deep_zoom_buf=(unsigned char *)allocateImageBuffer(bsr_config, &bsr_state->deep_zoom_buf_size, "deep zoom buffer");
+    if (bsr_state->deep_zoom_buf == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for deep zoom buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    bsr_state->deep_zoom_linear_buf=(float *)allocateImageBuffer(bsr_config, &bsr_state->deep_zoom_linear_buf_size, "deep zoom linear buffer");
+    if (bsr_state->deep_zoom_linear_buf == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for deep zoom linear buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+  }
+
+  //
+  // allocate memory for image compression buffers if required
+  //
+  if ((bsr_config->image_format == 1) && (bsr_state->exr_num_levels > 0)) {
+    if (bsr_config->bits_per_color == 32) {
+      pixel_data_size=12;
+    } else {
+      pixel_data_size=6;
+    }
+    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+      // allocate shared memory for compressed_sizes table, one entry per tile
+      mmap_protection=PROT_READ | PROT_WRITE;
+      mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+      bsr_state->compressed_sizes_size=(size_t)bsr_state->exr_num_tiles * sizeof(int);
+      bsr_state->compressed_sizes=(int *)mmap(NULL, bsr_state->compressed_sizes_size, mmap_protection, mmap_visibility, -1, 0);
+      if (bsr_state->compressed_sizes == MAP_FAILED) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate shared memory for compressed_sizes array\n");
+          fflush(stdout);
+        }
+        exit(1);
+      }
+    }
+
+    // allocate non-shared memory for compression_buf1: one row of tiles of the first level
+    bsr_state->compression_buf_size=(size_t)pixel_data_size * (size_t)bsr_config->exr_tile_size * (size_t)output_res_x;
+    bsr_state->compression_buf1=(unsigned char *)malloc(bsr_state->compression_buf_size);
+    if (bsr_state->compression_buf1 == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for compression buffer 1\n");
+      }
+      exit(1);
+    }
+    // allocate non-shared memory for compression_buf2: re-ordered and compressed data for one tile
+    if ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3)) {
+      bsr_state->compression_buf2=(unsigned char *)malloc(2 * (size_t)pixel_data_size * (size_t)bsr_config->exr_tile_size * (size_t)bsr_config->exr_tile_size);
+      if (bsr_state->compression_buf2 == NULL) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate memory for compression buffer 2\n");
+        }
+        exit(1);
+      }
+    }
+  } else if ((bsr_config->image_format == 1) && ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3))) {
+    // allocate shared memory for compressed_sizes table
+    mmap_protection=PROT_READ | PROT_WRITE;
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    bsr_state->compressed_sizes_size=(size_t)output_res_y * sizeof(int);
+    bsr_state->compressed_sizes=(int *)mmap(NULL, bsr_state->compressed_sizes_size, mmap_protection, mmap_visibility, -1, 0);
+    if (bsr_state->compressed_sizes == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for compressed_sizes array\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    // allocate non-shared memory for compression_buf1 and 2
+    if (bsr_config->exr_compression == 2) {
+      // deflate, 1 line per block
+      lines_per_block=1;
+    } else if (bsr_config->exr_compression == 3) {
+      // deflate, 16 line per block
+      lines_per_block=16;
+    }
+    if (bsr_config->bits_per_color == 16) {
+      pixel_data_size=6 * output_res_x * lines_per_block;
+    } else if (bsr_config->bits_per_color == 32) {
+      pixel_data_size=12 * output_res_x * lines_per_block;
+    }
+    // allocate non-shared memory for compression_buf1
+    bsr_state->compression_buf_size=(size_t)pixel_data_size * sizeof(unsigned char);
+    bsr_state->compression_buf1=(unsigned char *)malloc(bsr_state->compression_buf_size);
+    if (bsr_state->compression_buf1 == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for compression buffer 1\n");
+      }
+      exit(1);
+    }
+    // allocate non-shared memory for compression_buf2
+    bsr_state->compression_buf2=(unsigned char *)malloc(bsr_state->compression_buf_size);
+    if (bsr_state->compression_buf2== NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for compression buffer 2\n");
+      }
+      exit(1);
+    }
+  } // end if exr_compression
+
+  //
+  // allocate memory for multi-threaded PNG compression
+  //
+  if ((bsr_config->image_format == 0) && (bsr_config->png_compression > 0) && (bsr_config->deep_zoom == 0)) {
+    // allocate shared memory for png_strips table, one strip per thread. Streamed images use stream_slots instead
+    if (bsr_state->stream_num_bands == 0) {
+      mmap_protection=PROT_READ | PROT_WRITE;
+      mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+      bsr_state->png_strips_size=(size_t)(bsr_state->num_worker_threads + 1) * sizeof(png_strip_t);
+      bsr_state->png_strips=(png_strip_t *)mmap(NULL, bsr_state->png_strips_size, mmap_protection, mmap_visibility, -1, 0);
+      if (bsr_state->png_strips == MAP_FAILED) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate shared memory for png_strips array\n");
+          fflush(stdout);
+        }
+        exit(1);
+      }
+    }
+
+    if (bsr_config->bits_per_color == 16) {
+      png_row_bytes=6 * output_res_x;
+    } else {
+      png_row_bytes=3 * output_res_x;
+    }
+    lines_per_thread=(int)ceil(((double)output_res_y / (double)(bsr_state->num_worker_threads + 1)));
+    png_filtered_size=(size_t)lines_per_thread * (size_t)(png_row_bytes + 1);
+
+    // allocate non-shared memory for compression_buf1: five candidate filtered rows, a zero row and the preset dictionary
+    bsr_state->compression_buf1=(unsigned char *)malloc((7 * (size_t)(png_row_bytes + 1)) + BSR_PNG_DICTIONARY_SIZE);
+    if (bsr_state->compression_buf1 == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for compression buffer 1\n");
+      }
+      exit(1);
+    }
+    // allocate non-shared memory for compression_buf2: deflate output for one strip, zlib compressBound() plus room for
+    // the zlib header and sync flush marker. Pages are only touched as compressed data is written. Streamed bands are
+    // compressed into stream_out_buf instead
+    if (bsr_state->stream_num_bands == 0) {
+      bsr_state->compression_buf_size=png_filtered_size + (png_filtered_size >> 12) + (png_filtered_size >> 14) + (png_filtered_size >> 25) + 77;
+      bsr_state->compression_buf2=(unsigned char *)malloc(bsr_state->compression_buf_size);
+      if (bsr_state->compression_buf2 == NULL) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate memory for compression buffer 2\n");
+        }
+        exit(1);
+      }
+    }
+  } // end if png_compression
+
+  //
+  // allocate memory for multi-threaded JPEG encoding
+  //
+  if ((bsr_config->image_format == 2) && (bsr_config->jpeg_encoding > 0) && (bsr_config->deep_zoom == 0) && (bsr_state->stream_num_bands == 0)) {
+    // allocate shared memory for jpeg_strips table, one strip per thread
+    mmap_protection=PROT_READ | PROT_WRITE;
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    bsr_state->jpeg_strips_size=(size_t)(bsr_state->num_worker_threads + 1) * sizeof(jpeg_strip_t);
+    bsr_state->jpeg_strips=(jpeg_strip_t *)mmap(NULL, bsr_state->jpeg_strips_size, mmap_protection, mmap_visibility, -1, 0);
+    if (bsr_state->jpeg_strips == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for jpeg_strips array\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+  } // end if jpeg_encoding
+
+  //
+  // allocate memory for streamed output: encoded bands waiting to be written and their sizes and checksums
+  //
+  if (bsr_state->stream_num_bands > 0) {
+    bsr_state->stream_out_buf=(unsigned char *)allocateImageBuffer(bsr_config, &bsr_state->stream_out_buf_size, "stream output buffer");
+    if (bsr_state->stream_out_buf == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for stream output buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    mmap_protection=PROT_READ | PROT_WRITE;
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    bsr_state->stream_slots=(stream_slot_t *)mmap(NULL, bsr_state->stream_slots_size, mmap_protection, mmap_visibility, -1, 0);
+    if (bsr_state->stream_slots == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for stream_slots array\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
   }
+
+  //
+  // allocate memory for AVIF/HEIF grid images
+  //
+  setGridLayout(bsr_config, bsr_state, output_res_x, output_res_y);
+  if (bsr_state->grid_num_tiles > 0) {
+    // allocate shared memory for grid_tiles table
+    mmap_protection=PROT_READ | PROT_WRITE;
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    bsr_state->grid_tiles_size=(size_t)bsr_state->grid_num_tiles * sizeof(grid_tile_t);
+    bsr_state->grid_tiles=(grid_tile_t *)mmap(NULL, bsr_state->grid_tiles_size, mmap_protection, mmap_visibility, -1, 0);
+    if (bsr_state->grid_tiles == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for grid_tiles array\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    if (bsr_config->image_format == 3) {
+      // allocate non-shared memory for compression_buf1: RGB pixels of one tile in the last grid column or row
+      if (bsr_config->bits_per_color == 8) {
+        bsr_state->compression_buf_size=(size_t)bsr_state->grid_tile_width * (size_t)bsr_state->grid_tile_height * 3;
+      } else {
+        bsr_state->compression_buf_size=(size_t)bsr_state->grid_tile_width * (size_t)bsr_state->grid_tile_height * 6;
+      }
+      bsr_state->compression_buf1=(unsigned char *)malloc(bsr_state->compression_buf_size);
+      if (bsr_state->compression_buf1 == NULL) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate memory for compression buffer 1\n");
+        }
+        exit(1);
+      }
+    }
+  } // end if grid_num_tiles
+
+  if (bsr_config->image_format == 5) {
+    if (bsr_config->bits_per_color == 32) {
+      pixel_data_size=12;
+    } else if (bsr_config->bits_per_color == 16) {
+      pixel_data_size=6;
+    } else {
+      pixel_data_size=3;
+    }
+
+    // allocate shared memory for tiff_tile_table, file offset and byte count of each tile
+    mmap_protection=PROT_READ | PROT_WRITE;
+    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
+    bsr_state->tiff_tile_table_size=(size_t)bsr_state->tiff_num_tiles * 2 * sizeof(uint64_t);
+    bsr_state->tiff_tile_table=(uint64_t *)mmap(NULL, bsr_state->tiff_tile_table_size, mmap_protection, mmap_visibility, -1, 0);
+    if (bsr_state->tiff_tile_table == MAP_FAILED) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate shared memory for tiff_tile_table array\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+
+    // allocate non-shared memory for compression_buf1: pixels of one tile
+    bsr_state->compression_buf_size=(size_t)pixel_data_size * (size_t)bsr_config->tiff_tile_size * (size_t)bsr_config->tiff_tile_size;
+    bsr_state->compression_buf1=(unsigned char *)malloc(bsr_state->compression_buf_size);
+    if (bsr_state->compression_buf1 == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for compression buffer 1\n");
+      }
+      exit(1);
+    }
+    // allocate non-shared memory for compression_buf2: deflate output for one tile, zlib compressBound()
+    if (bsr_config->tiff_compression == 1) {
+      bsr_state->compression_buf2=(unsigned char *)malloc(bsr_state->compression_buf_size + (bsr_state->compression_buf_size >> 12) + (bsr_state->compression_buf_size >> 14) + (bsr_state->compression_buf_size >> 25) + 13);
+      if (bsr_state->compression_buf2 == NULL) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate memory for compression buffer 2\n");
+        }
+        exit(1);
+      }
+    }
+  } // end if image_format
+
+  if (bsr_config->deep_zoom != 0) {
+    if (bsr_config->bits_per_color == 8) {
+      pixel_data_size=3;
+    } else {
+      pixel_data_size=6;
+    }
+
+    // allocate non-shared memory for compression_buf1: pixels of one tile
+    bsr_state->compression_buf_size=(size_t)pixel_data_size * (size_t)bsr_config->deep_zoom_tile_size * (size_t)bsr_config->deep_zoom_tile_size;
+    bsr_state->compression_buf1=(unsigned char *)malloc(bsr_state->compression_buf_size);
+    if (bsr_state->compression_buf1 == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for compression buffer 1\n");
+      }
+      exit(1);
+    }
+    // allocate non-shared memory for compression_buf2: five candidate filtered rows, a zero row and one IDAT chunk
+    if (bsr_config->image_format == 0) {
+      bsr_state->compression_buf2=(unsigned char *)malloc((6 * (size_t)((pixel_data_size * bsr_config->deep_zoom_tile_size) + 1)) + BSR_PNG_TILE_IDAT);
+      if (bsr_state->compression_buf2 == NULL) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: could not allocate memory for compression buffer 2\n");
+        }
+        exit(1);
+      }
+    }
+  } // end if deep_zoom
+
   return(0);
 }
 
@@ -107,10 +920,6 @@ int allocateMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   dedup_index_t *dedup_index_p;
   int i;
   thread_buffer_t *main_thread_buf_p;
-  int output_res_x;
-  int output_res_y;
-  int lines_per_block=0;
-  int pixel_data_size=0;
 
   //
   // allocate shared memory for Airy disk maps if Airy disk mode enabled
@@ -125,31 +934,40 @@ int allocateMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     bsr_state->Airymap_blue=(double *)mmap(NULL, bsr_state->Airymap_size, mmap_protection, mmap_visibility, -1, 0);
   }
 
+  //
+  // resize and output resolutions and output layout
+  //
+  setOutputLayout(bsr_config, bsr_state);
+  bsr_state->blur_ring_bands=blurRingBands(bsr_config, bsr_state, bsr_config->camera_res_y);
+
+  //
+  // plan buffer reuse, report peak memory and check max_memory
+  //
+  planMemory(bsr_config, bsr_state);
+
   //
   // allocate shared memory for image composition buffer (floating-point rgb)
   //
-  mmap_protection=PROT_READ | PROT_WRITE;
-  mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
-  bsr_state->composition_buffer_size=(size_t)bsr_config->camera_res_x * (size_t)bsr_config->camera_res_y * sizeof(pixel_composition_t);
-  bsr_state->image_composition_buf=(pixel_composition_t *)mmap(NULL, bsr_state->composition_buffer_size, mmap_protection, mmap_visibility, -1, 0);
+  bsr_state->composition_buffer_size=(size_t)bsr_config->camera_res_x * (size_t)bsr_config->camera_res_y * bsr_state->composition_pixel_size;
+  bsr_state->image_composition_buf=(pixel_composition_t *)allocateImageBuffer(bsr_config, &bsr_state->composition_buffer_size, "image composition buffer");
   if (bsr_state->image_composition_buf == MAP_FAILED) {
     if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
       printf("Error: could not allocate shared memory for image composition buffer\n");
     }
     exit(1);
   }
+  placeImageBufferNUMA(bsr_config, bsr_state, bsr_state->image_composition_buf, bsr_state->composition_buffer_size, ((size_t)bsr_config->camera_res_x * bsr_state->composition_pixel_size), bsr_config->camera_res_y, "image composition buffer");
+  bsr_state->composition_buffer_dirty=0; // fresh anonymous mappings are zero-filled
   bsr_state->current_image_buf=bsr_state->image_composition_buf;
   bsr_state->current_image_res_x=bsr_config->camera_res_x;
   bsr_state->current_image_res_y=bsr_config->camera_res_y;
 
   //
-  // allocate shared memory for image blur buffer if needed
+  // allocate shared memory for image blur ring if needed (direct kernel only, the recursive filter works in place)
   //
-  if (bsr_config->Gaussian_blur_radius > 0.0) {
-    mmap_protection=PROT_READ | PROT_WRITE;
-    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
-    bsr_state->blur_buffer_size=(size_t)bsr_config->camera_res_x * (size_t)bsr_config->camera_res_y * sizeof(pixel_composition_t);
-    bsr_state->image_blur_buf=(pixel_composition_t *)mmap(NULL, bsr_state->blur_buffer_size, mmap_protection, mmap_visibility, -1, 0);
+  if ((bsr_config->Gaussian_blur_radius > 0.0) && (bsr_state->blur_ring_bands > 0)) {
+    bsr_state->blur_buffer_size=(size_t)bsr_state->blur_ring_bands * (size_t)BSR_BAND_LINES * (size_t)bsr_config->camera_res_x * bsr_state->composition_pixel_size;
+    bsr_state->image_blur_buf=(pixel_composition_t *)allocateImageBuffer(bsr_config, &bsr_state->blur_buffer_size, "image blur buffer");
     if (bsr_state->image_blur_buf == MAP_FAILED) {
       if (bsr_config->cgi_mode != 1) {
         printf("Error: could not allocate shared memory for image blur buffer\n");
@@ -159,25 +977,6 @@ int allocateMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     }
   }
 
-  //
-  // allocate shared memory for image resize buffer if needed
-  //
-  if (bsr_config->output_scaling_factor != 1.0) {
-    bsr_state->resize_res_x=(int)(((double)bsr_config->camera_res_x * bsr_config->output_scaling_factor) + 0.5);
-    bsr_state->resize_res_y=(int)(((double)bsr_config->camera_res_y * bsr_config->output_scaling_factor) + 0.5);
-    mmap_protection=PROT_READ | PROT_WRITE;
-    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
-    bsr_state->resize_buffer_size=(size_t)bsr_state->resize_res_x * (size_t)bsr_state->resize_res_y * sizeof(pixel_composition_t);
-    bsr_state->image_resize_buf=(pixel_composition_t *)mmap(NULL, bsr_state->resize_buffer_size, mmap_protection, mmap_visibility, -1, 0);
-    if (bsr_state->image_resize_buf == MAP_FAILED) {
-      if (bsr_config->cgi_mode != 1) {
-        printf("Error: could not allocate shared memory for image resize buffer\n");
-        fflush(stdout);
-      }
-      exit(1);
-    }
-  }
-
   //
   // allocate non-shared memory for dedup buffer and initialize
   //
@@ -248,6 +1047,8 @@ int allocateMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   if (bsr_state->per_thread_buffers < 1) {
     bsr_state->per_thread_buffers=1;
   }
+  mmap_protection=PROT_READ | PROT_WRITE;
+  mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
   bsr_state->thread_buffer_count=bsr_state->num_worker_threads * bsr_state->per_thread_buffers;
   bsr_state->thread_buffer_size=(size_t)bsr_state->thread_buffer_count * sizeof(thread_buffer_t);
   bsr_state->thread_buf=(thread_buffer_t *)mmap(NULL, bsr_state->thread_buffer_size, mmap_protection, mmap_visibility, -1, 0);
@@ -281,96 +1082,110 @@ int allocateMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   }
 
   //
-  // allocate shared memory for image output buffer
+  // allocate buffers for resize, band scheduled passes and output
   //
-  if (bsr_config->output_scaling_factor != 1.0) {
-    output_res_x=bsr_state->resize_res_x;
-    output_res_y=bsr_state->resize_res_y;
-  } else {
-    output_res_x=bsr_config->camera_res_x;
-    output_res_y=bsr_config->camera_res_y;
+  allocateOutputMemory(bsr_config, bsr_state);
+
+  return(0);
+}
+
+//
+// return the pages of an output's resize and output buffers once it has been written, so the next output
+// does not add to peak memory. The buffers stay mapped and are freed by freeOutputMemory()
+//
+int releaseOutputBuffers(bsr_state_t *bsr_state) {
+  releaseImageBuffer(bsr_state->image_resize_buf, bsr_state->resize_buffer_size);
+  if (bsr_state->output_buffer_aliased == 0) {
+    releaseImageBuffer(bsr_state->image_output_buf, bsr_state->output_buffer_size);
   }
+  releaseImageBuffer(bsr_state->exr_mip_buf, bsr_state->exr_mip_buf_size);
+  releaseImageBuffer(bsr_state->tiff_pyramid_buf, bsr_state->tiff_pyramid_buf_size);
+  releaseImageBuffer(bsr_state->deep_zoom_buf, bsr_state->deep_zoom_buf_size);
+  releaseImageBuffer(bsr_state->deep_zoom_linear_buf, bsr_state->deep_zoom_linear_buf_size);
+  releaseImageBuffer(bsr_state->stream_out_buf, bsr_state->stream_out_buf_size);
+
+  return(0);
+}
+
+//
+// allocate the state of an extra output. It is a copy of the main state after allocateMemory(), sharing the
+// composition buffer, thread buffers and status array, with its own output layout, transfer table and output
+// buffers. Must be called after main_pid is set and before worker threads are forked
+//
+bsr_state_t *allocateExtraOutputState(bsr_config_t *bsr_config, bsr_state_t *main_state) {
+  bsr_state_t *bsr_state;
+  int mmap_protection;
+  int mmap_visibility;
+
   mmap_protection=PROT_READ | PROT_WRITE;
   mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
-  if (bsr_config->bits_per_color == 32) {
-    bsr_state->output_buffer_size=(size_t)output_res_x * (size_t)output_res_y * (size_t)12 * sizeof(unsigned char);
-  } else if ((bsr_config->bits_per_color == 10) || (bsr_config->bits_per_color == 12) || (bsr_config->bits_per_color == 16)) {
-    bsr_state->output_buffer_size=(size_t)output_res_x * (size_t)output_res_y * (size_t)6 * sizeof(unsigned char);
-  } else { // default 8 bits per color
-    bsr_state->output_buffer_size=(size_t)output_res_x * (size_t)output_res_y * (size_t)3 * sizeof(unsigned char);
-  }
-  bsr_state->image_output_buf=(unsigned char *)mmap(NULL, bsr_state->output_buffer_size, mmap_protection, mmap_visibility, -1, 0);
-  if (bsr_state->image_output_buf == MAP_FAILED) {
+  bsr_state=(bsr_state_t *)mmap(NULL, sizeof(bsr_state_t), mmap_protection, mmap_visibility, -1, 0);
+  if (bsr_state == MAP_FAILED) {
     if (bsr_config->cgi_mode != 1) {
-      printf("Error: could not allocate shared memory for image output buffer\n");
+      printf("Error: could not allocate shared memory for extra output state\n");
       fflush(stdout);
     }
     exit(1);
   }
+  memcpy(bsr_state, main_state, sizeof(bsr_state_t));
 
   //
-  // allocate shared memory for row_pointers used in various ways by different image output encoders
+  // forget the main output's buffers, they are set up again for this output below
   //
-  mmap_protection=PROT_READ | PROT_WRITE;
-  mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
-  bsr_state->row_pointers_size=(size_t)output_res_y * sizeof(unsigned char *);
-  bsr_state->row_pointers=(unsigned char **)mmap(NULL, bsr_state->row_pointers_size, mmap_protection, mmap_visibility, -1, 0);
-  if (bsr_state->row_pointers == MAP_FAILED) {
-    if (bsr_config->cgi_mode != 1) {
-      printf("Error: could not allocate shared memory for row_pointers\n");
-      fflush(stdout);
-    }
-    exit(1);
-  }
+  bsr_state->image_output_buf=NULL;
+  bsr_state->row_pointers=NULL;
+  bsr_state->compressed_sizes=NULL;
+  bsr_state->exr_section_sizes=NULL;
+  bsr_state->png_strips=NULL;
+  bsr_state->jpeg_strips=NULL;
+  bsr_state->grid_tiles=NULL;
+  bsr_state->exr_mip_buf=NULL;
+  bsr_state->tiff_pyramid_buf=NULL;
+  bsr_state->tiff_tile_table=NULL;
+  bsr_state->deep_zoom_buf=NULL;
+  bsr_state->deep_zoom_linear_buf=NULL;
+  bsr_state->stream_out_buf=NULL;
+  bsr_state->stream_slots=NULL;
+  bsr_state->image_resize_buf=NULL;
+  bsr_state->image_resize_scratch_buf=NULL;
+  bsr_state->compression_buf1=NULL;
+  bsr_state->compression_buf2=NULL;
+  bsr_state->band_schedule=NULL;
+  bsr_state->band_done=NULL;
+  bsr_state->stream_file=NULL;
+  memset(&bsr_state->splice_buf, 0, sizeof(output_buf_t));
+  memset(&bsr_state->transfer_table, 0, sizeof(bsr_transfer_table_t));
+  bsr_state->resize_res_x=0;
+  bsr_state->resize_res_y=0;
+  bsr_state->resize_area_factor=0;
+  bsr_state->output_buffer_aliased=0;
+  bsr_state->keep_source_image=0;
+  bsr_state->resize_buffer_size=0;
+  bsr_state->resize_scratch_buffer_size=0;
+  bsr_state->compressed_sizes_size=0;
+  bsr_state->exr_section_sizes_size=0;
+  bsr_state->tiff_tile_table_size=0;
+  bsr_state->png_strips_size=0;
+  bsr_state->jpeg_strips_size=0;
+  bsr_state->grid_tiles_size=0;
+  bsr_state->compression_buf_size=0;
 
   //
-  // allocate memory for image compression buffers if required
+  // this output's layout and buffers. The output buffer is never aliased to the composition buffer since other
+  // outputs still read it. The transfer table is built by the caller, as for the main state
   //
-  if ((bsr_config->image_format == 1) && ((bsr_config->exr_compression == 2) || (bsr_config->exr_compression == 3))) {
-    // allocate shared memory for compressed_sizes table
-    mmap_protection=PROT_READ | PROT_WRITE;
-    mmap_visibility=MAP_SHARED | MAP_ANONYMOUS;
-    bsr_state->compressed_sizes_size=(size_t)output_res_y * sizeof(int);
-    bsr_state->compressed_sizes=(int *)mmap(NULL, bsr_state->compressed_sizes_size, mmap_protection, mmap_visibility, -1, 0);
-    if (bsr_state->row_pointers == MAP_FAILED) {
-      if (bsr_config->cgi_mode != 1) {
-        printf("Error: could not allocate shared memory for compressed_sizes array\n");
-        fflush(stdout);
-      }
-      exit(1);
-    }
+  setOutputLayout(bsr_config, bsr_state);
+  allocateOutputMemory(bsr_config, bsr_state);
 
-    // allocate non-shared memory for compression_buf1 and 2
-    if (bsr_config->exr_compression == 2) {
-      // deflate, 1 line per block
-      lines_per_block=1;
-    } else if (bsr_config->exr_compression == 3) {
-      // deflate, 16 line per block
-      lines_per_block=16;
-    }
-    if (bsr_config->bits_per_color == 16) {
-      pixel_data_size=6 * output_res_x * lines_per_block;
-    } else if (bsr_config->bits_per_color == 32) {
-      pixel_data_size=12 * output_res_x * lines_per_block;
-    }
-    // allocate non-shared memory for compression_buf1
-    bsr_state->compression_buf_size=(size_t)pixel_data_size * sizeof(unsigned char);
-    bsr_state->compression_buf1=(unsigned char *)malloc(bsr_state->compression_buf_size);
-    if (bsr_state->compression_buf1 == NULL) {
-      if (bsr_config->cgi_mode != 1) {
-        printf("Error: could not allocate memory for compression buffer 1\n");
-      }
-      exit(1);
-    }
-    // allocate non-shared memory for compression_buf2
-    bsr_state->compression_buf2=(unsigned char *)malloc(bsr_state->compression_buf_size);
-    if (bsr_state->compression_buf2== NULL) {
-      if (bsr_config->cgi_mode != 1) {
-        printf("Error: could not allocate memory for compression buffer 2\n");
-      }
-      exit(1);
-    }
-  } // end if exr_compression
+  return(bsr_state);
+}
+
+//
+// free the buffers and state of an extra output, the buffers it shares with the main state are left alone
+//
+int freeExtraOutputState(bsr_state_t *bsr_state) {
+  freeOutputMemory(bsr_state);
+  munmap(bsr_state, bsr_state->bsr_state_size);
 
   return(0);
 }
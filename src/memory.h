@@ -40,6 +40,15 @@
 #define BSR_MEMORY_H
 
 int freeMemory(bsr_state_t *bsr_state);
+void *allocateImageBuffer(bsr_config_t *bsr_config, size_t *buffer_size, char *buffer_name);
+int releaseImageBuffer(void *buffer, size_t buffer_size);
+int planMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 int allocateMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int freeOutputMemory(bsr_state_t *bsr_state);
+int setOutputLayout(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int allocateOutputMemory(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int releaseOutputBuffers(bsr_state_t *bsr_state);
+bsr_state_t *allocateExtraOutputState(bsr_config_t *bsr_config, bsr_state_t *main_state);
+int freeExtraOutputState(bsr_state_t *bsr_state);
 
 #endif // BSR_MEMORY_H
@@ -48,6 +48,7 @@
 #include <string.h>
 #include <math.h>
 #include "util.h"
+#include "bsr-compress.h"
 
 void printUsage() {
   printf("mkexternal version %s\n", BSR_VERSION);
@@ -56,7 +57,7 @@ NAME\n\
      mkexternal -- create binary data file for use with bsrender\n\
 \n\
 SYNOPSIS\n\
-     mkexternal [-l] [-g] [-h]\n\
+     mkexternal [-l] [-g] [-z] [-h]\n\
  \n\
 OPTIONS:\n\
 \n\
@@ -65,6 +66,9 @@ OPTIONS:\n\
 \n\
      -g\n\
           Force output big-endian format (default is to match this platform)\n\
+\n\
+     -z\n\
+          Write block compressed data file (see bsrcompress)\n\
 \n\
      -h\n\
           Show help\n\
@@ -83,6 +87,7 @@ int setDefaults(mkg_config_t *mkg_config) {
   } else {
     mkg_config->output_little_endian=0;
   }
+  mkg_config->compress_output=0;
 
   return(0);
 }
@@ -100,6 +105,9 @@ int processCmdArgs(mkg_config_t *mkg_config, int argc, char **argv) {
       } else if (argv[i][1] == 'g') {
         // force output to big-endian
         mkg_config->output_little_endian=0;
+      } else if (argv[i][1] == 'z') {
+        // block compressed output
+        mkg_config->compress_output=1;
       } else if (argv[i][1] == 'h') {
         // print help
         printUsage();
@@ -132,7 +140,7 @@ int main(int argc, char **argv) {
   double icrs_y;
   double icrs_z;
   char star_record[BSR_STAR_RECORD_SIZE];
-  size_t star_record_size=(size_t)BSR_STAR_RECORD_SIZE;
+  bsr_block_writer_t output_writer;
   char file_header[BSR_FILE_HEADER_SIZE];
   size_t file_header_size;
   int little_endian;
@@ -216,9 +224,9 @@ int main(int argc, char **argv) {
   // write file header
   //
   if (mkg_config.output_little_endian == 1) {
-    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkexternal version: %s\n", BSR_MAGIC_NUMBER_LE, BSR_VERSION);
+    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkexternal version: %s\n", ((mkg_config.compress_output == 1) ? BSR_MAGIC_NUMBER_ZL : BSR_MAGIC_NUMBER_LE), BSR_VERSION);
   } else {
-    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkexternal version: %s\n", BSR_MAGIC_NUMBER_BE, BSR_VERSION);
+    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkexternal version: %s\n", ((mkg_config.compress_output == 1) ? BSR_MAGIC_NUMBER_ZB : BSR_MAGIC_NUMBER_BE), BSR_VERSION);
   } 
   // pad the rest of file_header with zeros
   file_header_size=strnlen(file_header, (BSR_FILE_HEADER_SIZE - 1));
@@ -228,6 +236,7 @@ int main(int argc, char **argv) {
   printf("Writing file headers\n");
   fflush(stdout);
   fwrite(file_header, BSR_FILE_HEADER_SIZE, 1, output_file);
+  openBlockWriter(&output_writer, output_file, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
 
   //
   // read and process each line of input file
@@ -606,7 +615,7 @@ int main(int argc, char **argv) {
       //
       // output star_record to output dat file
       //
-      fwrite(&star_record, star_record_size, 1, output_file);
+      writeStarRecord(&output_writer, (unsigned char *)star_record);
       output_count++;
 
     } // end ignore csv header lines
@@ -630,6 +639,7 @@ int main(int argc, char **argv) {
   // clean up
   //
   fclose(input_file);
+  closeBlockWriter(&output_writer);
   fclose(output_file);
   return(0);
 }
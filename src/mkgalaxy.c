@@ -55,6 +55,7 @@
 #include <time.h>
 #include "bandpass-ratio.h"
 #include "util.h"
+#include "bsr-compress.h"
 
 void printUsage() {
   printf("mkgalaxy version %s\n", BSR_VERSION);
@@ -63,7 +64,7 @@ NAME\n\
      mkgalaxy -- create binary data files for use with bsrender\n\
 \n\
 SYNOPSIS\n\
-     mkgalaxy [-b] [-w] [-d] [-p] [-c] [-n] [-m] [-l] [-g] [-h]\n\
+     mkgalaxy [-b] [-w] [-d] [-p] [-c] [-n] [-m] [-l] [-g] [-z] [-h]\n\
  \n\
 OPTIONS:\n\
      -b\n\
@@ -92,6 +93,9 @@ OPTIONS:\n\
 \n\
      -g\n\
           Force output big-endian format (default is to match this platform)\n\
+\n\
+     -z\n\
+          Write block compressed data files (see bsrcompress)\n\
 \n\
      -h\n\
           Show help\n\
@@ -116,6 +120,7 @@ int setDefaults(mkg_config_t *mkg_config) {
   } else {
     mkg_config->output_little_endian=0;
   }
+  mkg_config->compress_output=0;
 
   return(0);
 }
@@ -188,6 +193,9 @@ int processCmdArgs(mkg_config_t *mkg_config, int argc, char **argv) {
       } else if (argv[i][1] == 'g') {
         // force output to big-endian
         mkg_config->output_little_endian=0;
+      } else if (argv[i][1] == 'z') {
+        // block compressed output
+        mkg_config->compress_output=1;
       } else if (argv[i][1] == 'h') {
         // print help
         printUsage();
@@ -561,6 +569,16 @@ int main(int argc, char **argv) {
   FILE *output_file_pq030;
   FILE *output_file_pq050;
   FILE *output_file_pq100;
+  bsr_block_writer_t output_writer_pq000;
+  bsr_block_writer_t output_writer_pq001;
+  bsr_block_writer_t output_writer_pq002;
+  bsr_block_writer_t output_writer_pq003;
+  bsr_block_writer_t output_writer_pq005;
+  bsr_block_writer_t output_writer_pq010;
+  bsr_block_writer_t output_writer_pq020;
+  bsr_block_writer_t output_writer_pq030;
+  bsr_block_writer_t output_writer_pq050;
+  bsr_block_writer_t output_writer_pq100;
   char *input_line_p;
   char input_line[256];
   char *field_start;
@@ -619,7 +637,6 @@ int main(int argc, char **argv) {
   double icrs_y;
   double icrs_z;
   char star_record[BSR_STAR_RECORD_SIZE];
-  size_t star_record_size=(size_t)BSR_STAR_RECORD_SIZE;
   char file_header[BSR_FILE_HEADER_SIZE];
   size_t file_header_size;
   int little_endian;
@@ -854,9 +871,9 @@ int main(int argc, char **argv) {
   // write file headers
   //
   if (mkg_config.output_little_endian == 1) {
-    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkgalaxy version: %s, use_bandpass_ratios: %d, use_gspphot_distance: %d, calibrate_parallax: %d, enable_maximum_distance: %d, maximum_distance: %.1e\n", BSR_MAGIC_NUMBER_LE, BSR_VERSION, mkg_config.use_bandpass_ratios, mkg_config.use_gspphot_distance, mkg_config.calibrate_parallax, mkg_config.enable_maximum_distance, mkg_config.maximum_distance);
+    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkgalaxy version: %s, use_bandpass_ratios: %d, use_gspphot_distance: %d, calibrate_parallax: %d, enable_maximum_distance: %d, maximum_distance: %.1e\n", ((mkg_config.compress_output == 1) ? BSR_MAGIC_NUMBER_ZL : BSR_MAGIC_NUMBER_LE), BSR_VERSION, mkg_config.use_bandpass_ratios, mkg_config.use_gspphot_distance, mkg_config.calibrate_parallax, mkg_config.enable_maximum_distance, mkg_config.maximum_distance);
   } else {
-    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkgalaxy version: %s, use_bandpass_ratios: %d, use_gspphot_distance: %d, calibrate_parallax: %d, enable_maximum_distance: %d, maximum_distance: %.1e\n", BSR_MAGIC_NUMBER_BE, BSR_VERSION, mkg_config.use_bandpass_ratios, mkg_config.use_gspphot_distance, mkg_config.calibrate_parallax, mkg_config.enable_maximum_distance, mkg_config.maximum_distance);
+    snprintf(file_header, BSR_FILE_HEADER_SIZE, "%s, mkgalaxy version: %s, use_bandpass_ratios: %d, use_gspphot_distance: %d, calibrate_parallax: %d, enable_maximum_distance: %d, maximum_distance: %.1e\n", ((mkg_config.compress_output == 1) ? BSR_MAGIC_NUMBER_ZB : BSR_MAGIC_NUMBER_BE), BSR_VERSION, mkg_config.use_bandpass_ratios, mkg_config.use_gspphot_distance, mkg_config.calibrate_parallax, mkg_config.enable_maximum_distance, mkg_config.maximum_distance);
   } 
   // pad the rest of file_header with zeros
   file_header_size=strnlen(file_header, (BSR_FILE_HEADER_SIZE - 1));
@@ -875,6 +892,16 @@ int main(int argc, char **argv) {
   fwrite(file_header, BSR_FILE_HEADER_SIZE, 1, output_file_pq002);
   fwrite(file_header, BSR_FILE_HEADER_SIZE, 1, output_file_pq001);
   fwrite(file_header, BSR_FILE_HEADER_SIZE, 1, output_file_pq000);
+  openBlockWriter(&output_writer_pq100, output_file_pq100, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq050, output_file_pq050, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq030, output_file_pq030, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq020, output_file_pq020, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq010, output_file_pq010, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq005, output_file_pq005, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq003, output_file_pq003, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq002, output_file_pq002, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq001, output_file_pq001, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
+  openBlockWriter(&output_writer_pq000, output_file_pq000, mkg_config.compress_output, 6, BSR_BLOCK_RECORDS);
 
   //
   // read and process each line of input file
@@ -1632,43 +1659,43 @@ int main(int argc, char **argv) {
           // output star_record to correct output file
           //
           if (parallax_over_error >= 100.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq100);
+            writeStarRecord(&output_writer_pq100, (unsigned char *)star_record);
             pq100_count++;
             total_output_count++;
           } else if (parallax_over_error >= 50.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq050);
+            writeStarRecord(&output_writer_pq050, (unsigned char *)star_record);
             pq050_count++;
             total_output_count++;
           } else if (parallax_over_error >= 30.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq030);
+            writeStarRecord(&output_writer_pq030, (unsigned char *)star_record);
             pq030_count++;
             total_output_count++;
           } else if (parallax_over_error >= 20.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq020);
+            writeStarRecord(&output_writer_pq020, (unsigned char *)star_record);
             pq020_count++;
             total_output_count++;
           } else if (parallax_over_error >= 10.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq010);
+            writeStarRecord(&output_writer_pq010, (unsigned char *)star_record);
             pq010_count++;
             total_output_count++;
           } else if (parallax_over_error >= 5.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq005);
+            writeStarRecord(&output_writer_pq005, (unsigned char *)star_record);
             pq005_count++;
             total_output_count++;
           } else if (parallax_over_error >= 3.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq003);
+            writeStarRecord(&output_writer_pq003, (unsigned char *)star_record);
             pq003_count++;
             total_output_count++;
           } else if (parallax_over_error >= 2.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq002);
+            writeStarRecord(&output_writer_pq002, (unsigned char *)star_record);
             pq002_count++;
             total_output_count++;
           } else if (parallax_over_error >= 1.0) {
-            fwrite(star_record, star_record_size, 1, output_file_pq001);
+            writeStarRecord(&output_writer_pq001, (unsigned char *)star_record);
             pq001_count++;
             total_output_count++;
           } else {
-            fwrite(star_record, star_record_size, 1, output_file_pq000);
+            writeStarRecord(&output_writer_pq000, (unsigned char *)star_record);
             pq000_count++;
             total_output_count++;
           }
@@ -1820,6 +1847,16 @@ int main(int argc, char **argv) {
   // clean up
   //
   fclose(input_file);
+  closeBlockWriter(&output_writer_pq000);
+  closeBlockWriter(&output_writer_pq001);
+  closeBlockWriter(&output_writer_pq002);
+  closeBlockWriter(&output_writer_pq003);
+  closeBlockWriter(&output_writer_pq005);
+  closeBlockWriter(&output_writer_pq010);
+  closeBlockWriter(&output_writer_pq020);
+  closeBlockWriter(&output_writer_pq030);
+  closeBlockWriter(&output_writer_pq050);
+  closeBlockWriter(&output_writer_pq100);
   fclose(output_file_pq000);
   fclose(output_file_pq001);
   fclose(output_file_pq002);
@@ -38,38 +38,72 @@
 
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include "util.h"
 #include "Lanczos.h"
+#include "area-resize.h"
 #include "Gaussian-blur.h"
 #include "overlay.h"
+#include "memory.h"
+
+//
+// normalize one line of pixels to camera saturation reference level = 1.0, then optionally apply camera gamma
+// and pre-limit intensity. Output is r,g,b interleaved doubles. Called from whichever pass first reads the
+// composed image (post_process_stage) so the line is still in cache when that pass uses it
+//
+int postProcessLine(bsr_config_t *bsr_config, double inv_camera_pixel_limit, pixel_composition_t *source, double *dest, int num_pixels) {
+  int i;
+  double *dest_p;
+
+  // normalize pixel values to camera saturation reference level = 1.0
+  dest_p=dest;
+  for (i=0; i < num_pixels; i++) {
+    dest_p[0]=BSR_GET_PIXEL(source[i].r) * inv_camera_pixel_limit;
+    dest_p[1]=BSR_GET_PIXEL(source[i].g) * inv_camera_pixel_limit;
+    dest_p[2]=BSR_GET_PIXEL(source[i].b) * inv_camera_pixel_limit;
+    dest_p+=3;
+  }
+
+  // optionally apply camera gamma setting
+  if (bsr_config->camera_gamma != 1.0) { // this is expensive so only if not 1.0
+    for (i=0; i < (num_pixels * 3); i++) {
+      dest[i]=pow(dest[i], bsr_config->camera_gamma);
+    }
+  }
+
+  // optionally pre-limit intensity before blur/resize
+  if (bsr_config->pre_limit_intensity == 1) {
+    dest_p=dest;
+    for (i=0; i < num_pixels; i++) {
+      if (bsr_config->camera_pixel_limit_mode == 0) {
+        limitIntensity(bsr_config, &dest_p[0], &dest_p[1], &dest_p[2]);
+      } else if (bsr_config->camera_pixel_limit_mode == 1) {
+        limitIntensityPreserveColor(bsr_config, &dest_p[0], &dest_p[1], &dest_p[2]);
+      }
+      dest_p+=3;
+    }
+  }
+
+  return(0);
+}
 
 int postProcess(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   struct timespec starttime;
   struct timespec endtime;
   double elapsed_time;
-  uint64_t image_offset;
   int current_image_x;
   int current_image_y;
   pixel_composition_t *current_image_p;
   double inv_camera_pixel_limit;
-  double pixel_r;
-  double pixel_g;
-  double pixel_b;
+  double *post_process_line=NULL;
+  double *post_process_line_p;
   int current_image_res_x;
   int current_image_res_y;
   int lines_per_thread;
   int i;
-
-  //
-  // main thread: display status message if not in CGI mode
-  //
-  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
-    clock_gettime(CLOCK_REALTIME, &starttime);
-    printf("Applying camera gamma and intensity limit...");
-    fflush(stdout);
-  }
+  double saved_bytes;
 
   //
   // all threads: get current image resolution and lines per thread
@@ -80,87 +114,103 @@ int postProcess(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   if (lines_per_thread < 1) {
     lines_per_thread=1;
   }
-  inv_camera_pixel_limit = 1.0 / bsr_state->camera_pixel_limit;
+  inv_camera_pixel_limit = bsr_state->composition_scale / bsr_state->camera_pixel_limit;
 
   //
-  // worker threads:  wait for main thread to say go
-  // main thread: tell worker threads to go
+  // main thread: if camera gamma and intensity limit are applied by a later pass, report the memory
+  // traffic saved by not making a separate read/write pass over the image (plus the blur prep pass)
   //
-  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    waitForMainThread(bsr_state, THREAD_STATUS_POST_PROCESS_BEGIN);
-  } else {
-    // main thread
-    for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_POST_PROCESS_BEGIN;
+  if ((bsr_state->post_process_stage != 0) && (bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    saved_bytes=(double)current_image_res_x * (double)current_image_res_y * (double)sizeof(pixel_composition_t) * 2.0;
+    if (bsr_state->post_process_stage == 1) {
+      saved_bytes*=2.0;
+      printf("Camera gamma and intensity limit fused into Gaussian blur, %.1fMB less memory traffic\n", (saved_bytes / 1.0E6));
+    } else if (bsr_state->post_process_stage == 2) {
+      printf("Camera gamma and intensity limit fused into resize, %.1fMB less memory traffic\n", (saved_bytes / 1.0E6));
+    } else if (bsr_state->post_process_stage == 3) {
+      printf("Camera gamma and intensity limit fused into pixel conversion, %.1fMB less memory traffic\n", (saved_bytes / 1.0E6));
     }
-  } // end if not main thread
+    fflush(stdout);
+  }
 
   //
-  // all threads: normalize pixels to 1.0 reference, and apply cmaera_gamma
+  // all threads: normalize pixels to 1.0 reference, and apply camera gamma in a separate pass only if
+  // there is no blur, resize or output conversion pass that can do it
   //
-  current_image_x=0;
-  current_image_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  current_image_p=bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)current_image_y);
-  for (image_offset=0; ((image_offset < ((uint64_t)bsr_state->current_image_res_x * (uint64_t)lines_per_thread)) && (current_image_y < current_image_res_y)); image_offset++) {
-    // normalize pixel values to camera saturation reference level = 1.0
-    pixel_r=current_image_p->r * inv_camera_pixel_limit;
-    pixel_g=current_image_p->g * inv_camera_pixel_limit;
-    pixel_b=current_image_p->b * inv_camera_pixel_limit;
-
-    // optionally apply camera gamma setting
-    if (bsr_config->camera_gamma != 1.0) { // this is expensive so only if not 1.0
-      pixel_r=pow(pixel_r, bsr_config->camera_gamma);
-      pixel_g=pow(pixel_g, bsr_config->camera_gamma);
-      pixel_b=pow(pixel_b, bsr_config->camera_gamma);
+  if (bsr_state->post_process_stage == 0) {
+    //
+    // main thread: display status message if not in CGI mode
+    //
+    if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &starttime);
+      printf("Applying camera gamma and intensity limit...");
+      fflush(stdout);
     }
 
-    // optionally pre-limit intensity before blur/resize
-    if (bsr_config->pre_limit_intensity == 1) {
-      if (bsr_config->camera_pixel_limit_mode == 0) {
-        limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
-      } else if (bsr_config->camera_pixel_limit_mode == 1) {
-        limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+    //
+    // all threads: allocate one line buffer
+    //
+    post_process_line=(double *)malloc((size_t)current_image_res_x * 3 * sizeof(double));
+    if (post_process_line == NULL) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for post processing line buffer\n");
+        fflush(stdout);
       }
+      exit(1);
     }
 
-    // copy back to current image buf
-    current_image_p->r=pixel_r;
-    current_image_p->g=pixel_g;
-    current_image_p->b=pixel_b;
+    //
+    // worker threads:  wait for main thread to say go
+    // main thread: tell worker threads to go
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      waitForMainThread(bsr_state, THREAD_STATUS_POST_PROCESS_BEGIN);
+    } else {
+      // main thread
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_POST_PROCESS_BEGIN;
+      }
+    } // end if not main thread
 
-    // if end of this line, move to next line
-    current_image_x++;
-    if (current_image_x == bsr_state->current_image_res_x) {
-      current_image_x=0;
-      current_image_y++;
-    }
-    current_image_p++;
-  } // end for i
+    for (current_image_y=bsr_state->perthread->my_thread_id * lines_per_thread; ((current_image_y < ((bsr_state->perthread->my_thread_id + 1) * lines_per_thread)) && (current_image_y < current_image_res_y)); current_image_y++) {
+      current_image_p=bsr_state->current_image_buf + ((uint64_t)current_image_res_x * (uint64_t)current_image_y);
+      postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, post_process_line, current_image_res_x);
+      post_process_line_p=post_process_line;
+      for (current_image_x=0; current_image_x < current_image_res_x; current_image_x++) {
+        current_image_p->r=BSR_SET_PIXEL(post_process_line_p[0]);
+        current_image_p->g=BSR_SET_PIXEL(post_process_line_p[1]);
+        current_image_p->b=BSR_SET_PIXEL(post_process_line_p[2]);
+        post_process_line_p+=3;
+        current_image_p++;
+      }
+    } // end for current_image_y
 
-  //
-  // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
-  // main thread: wait until all other threads are done and then signal that they can continue to next step.
-  //
-  if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
-    bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_POST_PROCESS_COMPLETE;
-    waitForMainThread(bsr_state, THREAD_STATUS_POST_PROCESS_CONTINUE);
-  } else {
-    waitForWorkerThreads(bsr_state, THREAD_STATUS_POST_PROCESS_COMPLETE);
-    // ready to continue, set all worker thread status to continue
-    for (i=1; i <= bsr_state->num_worker_threads; i++) {
-      bsr_state->status_array[i].status=THREAD_STATUS_POST_PROCESS_CONTINUE;
-    }
-  } // end if not main thread
+    //
+    // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
+    // main thread: wait until all other threads are done and then signal that they can continue to next step.
+    //
+    if (bsr_state->perthread->my_pid != bsr_state->main_pid) {
+      bsr_state->status_array[bsr_state->perthread->my_thread_id].status=THREAD_STATUS_POST_PROCESS_COMPLETE;
+      waitForMainThread(bsr_state, THREAD_STATUS_POST_PROCESS_CONTINUE);
+    } else {
+      waitForWorkerThreads(bsr_state, THREAD_STATUS_POST_PROCESS_COMPLETE);
+      // ready to continue, set all worker thread status to continue
+      for (i=1; i <= bsr_state->num_worker_threads; i++) {
+        bsr_state->status_array[i].status=THREAD_STATUS_POST_PROCESS_CONTINUE;
+      }
+    } // end if not main thread
 
-  //
-  // main thread: output execution time if not in CGI mode
-  //
-  if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
-    clock_gettime(CLOCK_REALTIME, &endtime);
-    elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
-    printf(" (%.3fs)\n", elapsed_time);
-    fflush(stdout);
-  }
+    //
+    // main thread: output execution time if not in CGI mode
+    //
+    if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+      clock_gettime(CLOCK_REALTIME, &endtime);
+      elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+      printf(" (%.3fs)\n", elapsed_time);
+      fflush(stdout);
+    }
+    free(post_process_line);
+  } // end if post_process_stage
 
   //
   // all threads: optionally blur image
@@ -169,11 +219,34 @@ int postProcess(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     GaussianBlur(bsr_config, bsr_state); 
   }
 
+  return(0);
+}
+
+//
+// post processing that depends on the output image: resize to the output resolution and draw overlays.
+// Called once for each output with that output's config and state, after postProcess()
+//
+int postProcessOutput(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   //
   // all threads: optionally resize image
   //
   if (bsr_config->output_scaling_factor != 1.0) {
-    resizeLanczos(bsr_config, bsr_state);
+    if (bsr_state->resize_area_factor > 0) {
+      resizeArea(bsr_config, bsr_state);
+    } else {
+      resizeLanczos(bsr_config, bsr_state);
+    }
+
+    //
+    // main thread: composition and resize scratch buffers are dead after resize, unless another output
+    // still reads the composition buffer
+    //
+    if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+      if (bsr_state->keep_source_image == 0) {
+        releaseImageBuffer(bsr_state->image_composition_buf, bsr_state->composition_buffer_size);
+      }
+      releaseImageBuffer(bsr_state->image_resize_scratch_buf, bsr_state->resize_scratch_buffer_size);
+    }
   }
 
   //
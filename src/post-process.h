@@ -39,6 +39,12 @@
 #ifndef BSR_POST_PROCESS_H
 #define BSR_POST_PROCESS_H
 
+int postProcessLine(bsr_config_t *bsr_config, double inv_camera_pixel_limit, pixel_composition_t *source, double *dest, int num_pixels);
 int postProcess(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int postProcess16(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int postProcess64(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int postProcessOutput(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int postProcessOutput16(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int postProcessOutput64(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_POST_PROCESS_H
@@ -40,8 +40,12 @@
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 #include "util.h"
+#include "input-stream.h"
+#include "bsr-compress.h"
 
 //
 // note: all functions in this file should remain in this file for compiler optimization
@@ -359,11 +363,11 @@ int antiAliasPixel(bsr_config_t *bsr_config, bsr_state_t *bsr_state, double outp
   return(0);
 }
 
-int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t *input_file) {
+int processStarRecords(bsr_config_t *bsr_config, bsr_state_t *bsr_state, char *input_file_p, uint64_t record_count) {
   //
   // This function handles the most expensive operations in bsrender. It performs the following:
   //
-  // - reads stars from the supplied input file
+  // - reads record_count star records starting at input_file_p
   // - filters stars by distance from target or camera, and color temperature
   // - translates position relative to camera position
   // - rotates stars to center on target (and optional pan/tilt away from target)
@@ -373,12 +377,7 @@ int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t
   // - sends pixels to main thread for integration into the image composition buffer
   //
   int i;
-  uint64_t total_input_records;
-  uint64_t input_records_per_thread;
-  uint64_t input_record_abs;  // index of which star record we are at over the entire input file
-  uint64_t input_record_rel;  // index of which star record we are at relative to beginning of this thread's part of input file
-  char *input_file_p;          // pointer to an arbitrary byte in the input file
-  int my_thread_id;
+  uint64_t input_record_rel;  // index of which star record we are at relative to input_file_p
 //  uint64_t source_id;
   double star_icrs_x;
   double star_icrs_y;
@@ -426,7 +425,6 @@ int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t
   double r;
   double g;
   double b;
-  size_t star_record_size=(size_t)BSR_STAR_RECORD_SIZE;
   uint64_t *tmp64_p;
   uint32_t *tmp32_p;
   double star_distance_from_earth2;
@@ -436,27 +434,9 @@ int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t
   // init shortcut variables
   //
   Airymap_max_width=bsr_config->Airy_disk_max_extent + 1;
-  my_thread_id=bsr_state->perthread->my_thread_id;
-  total_input_records=(input_file->buf_size - 256) / star_record_size;
-  input_records_per_thread=(uint64_t)ceil(((double)total_input_records / (double)bsr_state->num_worker_threads));
-  if (input_records_per_thread < 1) {
-    input_records_per_thread=1;
-  }
-
-  //
-  // process each line of input file
-  // 
-  input_record_abs=(my_thread_id - 1) * input_records_per_thread; // set absolute input record index to beginning of this thread's section of input file
-  input_file_p=input_file->buf;
-
-  // skip 256-byte ascii header
-  input_file_p+=256;
-
-  // skip to beginning of this thread's section of input file
-  input_file_p+=((uint64_t)star_record_size * (uint64_t)input_record_abs);
 
   // process each star record
-  for (input_record_rel=0; ((input_record_rel < input_records_per_thread) && (input_record_abs < total_input_records)); input_record_rel++) {
+  for (input_record_rel=0; input_record_rel < record_count; input_record_rel++) {
     //
     // Binary data file details
     //
@@ -573,7 +553,7 @@ int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t
 #endif
 
 #ifdef DEBUG
-    printf("debug, thread_id: %d, source_id: %lu, star_icrs_x: %.4e, star_icrs_y: %.4e, star_icrs_z: %.4e, linear_1pc_intensity: %.4e, color_temperature: %d\n", my_thread_id, source_id, star_icrs_x, star_icrs_y, star_icrs_z, linear_1pc_intensity, color_temperature);
+    printf("debug, thread_id: %d, source_id: %lu, star_icrs_x: %.4e, star_icrs_y: %.4e, star_icrs_z: %.4e, linear_1pc_intensity: %.4e, color_temperature: %d\n", bsr_state->perthread->my_thread_id, source_id, star_icrs_x, star_icrs_y, star_icrs_z, linear_1pc_intensity, color_temperature);
     fflush(stdout);
 #endif
 
@@ -805,10 +785,242 @@ int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t
         } // end if Airy disk mode
       } // end if star is within image raster
     } // end if within distance ranges
-
-    input_record_abs++;
   } // end input loop
 
+  return(0);
+}
+
+int streamStarRecords(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t *input_file, uint64_t first_record, uint64_t record_count) {
+  input_stream_t stream;
+  char *chunk;
+  char *chunk_p;
+  size_t chunk_bytes;
+  size_t available;
+  uint64_t chunk_offset;
+  uint64_t start_byte;
+  uint64_t end_byte;
+  uint64_t records_remaining;
+  uint64_t records;
+  char partial_record[BSR_STAR_RECORD_SIZE]; // star record split between two chunks
+  size_t partial_bytes=0;
+  size_t copy_bytes;
+  size_t star_record_size=(size_t)BSR_STAR_RECORD_SIZE;
+
+  //
+  // streaming input backend: a reader thread fills a ring of chunks while this thread processes the previous ones
+  // chunk boundaries do not line up with star records so records split between chunks are reassembled in partial_record
+  //
+  start_byte=256 + (first_record * (uint64_t)star_record_size);
+  end_byte=start_byte + (record_count * (uint64_t)star_record_size);
+  startInputStream(bsr_config, bsr_state, input_file, &stream, start_byte, end_byte);
+  records_remaining=record_count;
+  while ((records_remaining > 0) && ((chunk=getInputStreamChunk(&stream, &chunk_bytes, &chunk_offset)) != NULL)) {
+    chunk_p=chunk;
+    available=chunk_bytes;
+
+    // skip over alignment bytes before this thread's section of input file
+    if (chunk_offset < start_byte) {
+      if ((start_byte - chunk_offset) >= (uint64_t)available) {
+        available=0;
+      } else {
+        chunk_p+=(start_byte - chunk_offset);
+        available-=(size_t)(start_byte - chunk_offset);
+      }
+    }
+
+    // finish star record split from previous chunk
+    if (partial_bytes > 0) {
+      copy_bytes=star_record_size - partial_bytes;
+      if (copy_bytes > available) {
+        copy_bytes=available;
+      }
+      memcpy(partial_record + partial_bytes, chunk_p, copy_bytes);
+      partial_bytes+=copy_bytes;
+      chunk_p+=copy_bytes;
+      available-=copy_bytes;
+      if (partial_bytes == star_record_size) {
+        processStarRecords(bsr_config, bsr_state, partial_record, 1);
+        records_remaining--;
+        partial_bytes=0;
+      }
+    }
+
+    // process whole star records in this chunk
+    records=(uint64_t)(available / star_record_size);
+    if (records > records_remaining) {
+      records=records_remaining;
+    }
+    processStarRecords(bsr_config, bsr_state, chunk_p, records);
+    records_remaining-=records;
+    chunk_p+=(records * (uint64_t)star_record_size);
+    available-=(size_t)(records * (uint64_t)star_record_size);
+
+    // save beginning of star record split with next chunk
+    if ((records_remaining > 0) && (available > 0)) {
+      memcpy(partial_record + partial_bytes, chunk_p, available);
+      partial_bytes+=available;
+    }
+    releaseInputStreamChunk(&stream);
+  } // end while chunks
+  stopInputStream(&stream);
+
+  if (stream.error != 0) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: read from input file failed, errno: %d\n", stream.error);
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  return(0);
+}
+
+int processCompressedStarRecords(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t *input_file) {
+  uint64_t blocks_per_thread;
+  uint64_t block_index;
+  uint64_t last_block;
+  bsr_block_t *block;
+  unsigned char *compressed_p;
+  unsigned char *compressed_buf=NULL;
+  unsigned char *shuffle_buf;
+  unsigned char *record_buf;
+  char *file_buf;
+  bsr_status_t *my_status;
+  struct timespec starttime;
+  struct timespec endtime;
+
+  //
+  // block compressed data file: each worker thread decompresses a contiguous range of blocks into private buffers
+  //
+  blocks_per_thread=(uint64_t)ceil(((double)input_file->block_count / (double)bsr_state->num_worker_threads));
+  block_index=(uint64_t)(bsr_state->perthread->my_thread_id - 1) * blocks_per_thread;
+  last_block=block_index + blocks_per_thread;
+  if (last_block > input_file->block_count) {
+    last_block=input_file->block_count;
+  }
+  if (block_index >= last_block) {
+    return(0);
+  }
+  my_status=&bsr_state->status_array[bsr_state->perthread->my_thread_id];
+
+  shuffle_buf=(unsigned char *)malloc((size_t)input_file->max_block_records * BSR_STAR_RECORD_SIZE);
+  record_buf=(unsigned char *)malloc((size_t)input_file->max_block_records * BSR_STAR_RECORD_SIZE);
+  if (input_file->buf == NULL) {
+    // streaming input backend, compressed blocks are read with pread()
+    compressed_buf=(unsigned char *)malloc((size_t)input_file->max_compressed_size);
+  }
+  if ((shuffle_buf == NULL) || (record_buf == NULL) || ((input_file->buf == NULL) && (compressed_buf == NULL))) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for block decompression\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+  if (input_file->node_buf[bsr_state->perthread->numa_node] != NULL) {
+    file_buf=input_file->node_buf[bsr_state->perthread->numa_node]; // local copy for this thread's NUMA node
+  } else {
+    file_buf=input_file->buf;
+  }
+
+  for (; block_index < last_block; block_index++) {
+    block=&input_file->blocks[block_index];
+    if (file_buf != NULL) {
+      compressed_p=(unsigned char *)file_buf + block->offset;
+    } else {
+      if (readFileBytes(input_file->fd, NULL, compressed_buf, block->compressed_size, block->offset) != 0) {
+        if (bsr_config->cgi_mode != 1) {
+          printf("Error: read from compressed input file failed\n");
+          fflush(stdout);
+        }
+        exit(1);
+      }
+      compressed_p=compressed_buf;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+    if (decodeBlock(compressed_p, block->compressed_size, block->record_count, shuffle_buf, record_buf) != 0) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: compressed input file block %lu is corrupt\n", (unsigned long)block_index);
+        fflush(stdout);
+      }
+      exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &endtime);
+    my_status->decode_time+=((double)(endtime.tv_sec - starttime.tv_sec) + ((double)(endtime.tv_nsec - starttime.tv_nsec) / 1.0E9));
+    my_status->decoded_bytes+=(uint64_t)block->record_count * BSR_STAR_RECORD_SIZE;
+    my_status->compressed_bytes+=(uint64_t)block->compressed_size;
+    if (file_buf == NULL) {
+      my_status->input_bytes+=(uint64_t)block->compressed_size;
+    }
+    processStarRecords(bsr_config, bsr_state, (char *)record_buf, block->record_count);
+  }
+
+  free(shuffle_buf);
+  free(record_buf);
+  if (compressed_buf != NULL) {
+    free(compressed_buf);
+  }
+
+  return(0);
+}
+
+int processStars(bsr_config_t *bsr_config, bsr_state_t *bsr_state, input_file_t *input_file) {
+  uint64_t total_input_records;
+  uint64_t input_records_per_thread;
+  uint64_t input_record_abs;  // index of first star record in this thread's section of input file
+  uint64_t record_count;
+  char *input_file_p;         // pointer to an arbitrary byte in the input file
+  int my_thread_id;
+  size_t star_record_size=(size_t)BSR_STAR_RECORD_SIZE;
+
+  //
+  // divide input file into equal sections for each worker thread
+  //
+  if (input_file->buf_size < (256 + star_record_size)) {
+    return(0);
+  }
+  if (input_file->compressed == 1) {
+    processCompressedStarRecords(bsr_config, bsr_state, input_file);
+    if (bsr_state->perthread->dedup_count > 0) {
+      sendDedupBufferToMainThread(bsr_state);
+    }
+    return(0);
+  }
+  my_thread_id=bsr_state->perthread->my_thread_id;
+  total_input_records=(input_file->buf_size - 256) / star_record_size;
+  input_records_per_thread=(uint64_t)ceil(((double)total_input_records / (double)bsr_state->num_worker_threads));
+  if (input_records_per_thread < 1) {
+    input_records_per_thread=1;
+  }
+  input_record_abs=(my_thread_id - 1) * input_records_per_thread; // set absolute input record index to beginning of this thread's section of input file
+  if (input_record_abs >= total_input_records) {
+    return(0);
+  }
+  record_count=input_records_per_thread;
+  if ((input_record_abs + record_count) > total_input_records) {
+    record_count=total_input_records - input_record_abs;
+  }
+
+  //
+  // process this thread's section of input file
+  //
+  if (bsr_config->input_backend != 0) {
+    streamStarRecords(bsr_config, bsr_state, input_file, input_record_abs, record_count);
+  } else {
+    if (input_file->node_buf[bsr_state->perthread->numa_node] != NULL) {
+      input_file_p=input_file->node_buf[bsr_state->perthread->numa_node]; // local copy for this thread's NUMA node
+    } else {
+      input_file_p=input_file->buf;
+    }
+
+    // skip 256-byte ascii header
+    input_file_p+=256;
+
+    // skip to beginning of this thread's section of input file
+    input_file_p+=((uint64_t)star_record_size * (uint64_t)input_record_abs);
+
+    processStarRecords(bsr_config, bsr_state, input_file_p, record_count);
+  }
+
   //
   // done with input file, check for any remaining pixels in dedup buffer and send to main thread
   //
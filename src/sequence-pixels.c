@@ -38,9 +38,741 @@
 
 #include "bsrender.h" // needs to be first to get GNU_SOURCE define for strcasestr
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include "util.h"
+#include "post-process.h"
+#include "band-schedule.h"
+#include "bsr-deepzoom.h"
+#include "bsr-stream.h"
+
+// Rec. 2100 PQ constants
+#define BSR_PQ_M1 0.1593017578125
+#define BSR_PQ_M2 78.84375
+#define BSR_PQ_C1 0.8359375
+#define BSR_PQ_C2 18.8515625
+#define BSR_PQ_C3 18.6875
+
+static double transferCurve(bsr_config_t *bsr_config, double pixel) {
+  const double one_over_2dot4=1.0 / 2.4;
+  double Ym1;
+
+  //
+  // non-linear segment of the transfer function, same expressions as the per pixel conversion in sequencePixels()
+  //
+  if ((bsr_config->color_profile == 1) || (bsr_config->color_profile == 2)) {
+    return(1.055 * pow(pixel, one_over_2dot4) - 0.055);
+  } else if (bsr_config->color_profile == 8) {
+    Ym1=pow(pixel, BSR_PQ_M1);
+    return(pow(((BSR_PQ_C1 + (BSR_PQ_C2 * Ym1)) / (1.0 + (BSR_PQ_C3 * Ym1))), BSR_PQ_M2));
+  }
+  return(1.09929682680944 * pow(pixel, 0.45) - 0.09929682680944);
+}
+
+static double inverseTransferCurve(bsr_config_t *bsr_config, double value) {
+  double Ep;
+  double numerator;
+
+  //
+  // approximate inverse of transferCurve(), only used as a starting point for the exact threshold search
+  //
+  if ((bsr_config->color_profile == 1) || (bsr_config->color_profile == 2)) {
+    return(pow(((value + 0.055) / 1.055), 2.4));
+  } else if (bsr_config->color_profile == 8) {
+    Ep=pow(value, (1.0 / BSR_PQ_M2));
+    numerator=Ep - BSR_PQ_C1;
+    if (numerator < 0.0) {
+      numerator=0.0;
+    }
+    return(pow((numerator / (BSR_PQ_C2 - (BSR_PQ_C3 * Ep))), (1.0 / BSR_PQ_M1)));
+  }
+  return(pow(((value + 0.09929682680944) / 1.09929682680944), (1.0 / 0.45)));
+}
+
+static inline uint16_t quantizeValue(bsr_transfer_table_t *table, double value) {
+  //
+  // encoded value [0..1] to output code, same rounding as the per pixel conversion in sequencePixels()
+  //
+  if (value < 0.0) {
+    value=0.0;
+  }
+  if (table->half_output == 1) {
+    return(floatToHalf((float)value));
+  }
+  return((uint16_t)((value * table->code_scale) + 0.5));
+}
+
+static double codeToValue(bsr_transfer_table_t *table, int code) {
+  //
+  // lower edge of an output code in encoded value space, only used as a search starting point
+  //
+  if (table->half_output == 1) {
+    if ((code >> 10) == 0) {
+      return(ldexp((double)(code & 0x3ff), -24));
+    }
+    return(ldexp((double)((code & 0x3ff) | 0x400), ((code >> 10) - 25)));
+  }
+  return(((double)code - 0.5) / table->code_scale);
+}
+
+static inline double bitsToDouble(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return(value);
+}
+
+static inline uint64_t doubleToBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return(bits);
+}
+
+static inline uint16_t curveCode(bsr_config_t *bsr_config, bsr_transfer_table_t *table, uint64_t bits) {
+  return(quantizeValue(table, transferCurve(bsr_config, bitsToDouble(bits))));
+}
+
+int initTransferTable(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  //
+  // Build a table that maps a limited linear pixel value [0..1] directly to its output code. For each code k
+  // the table stores the smallest input that encodes to k or higher, found by searching the bit patterns of
+  // doubles with the exact same transfer function and rounding as the per pixel path, so table lookups are
+  // bit-exact. An index of BSR_TRANSFER_CELL_BITS cells per power of two narrows each lookup to a few codes
+  //
+  bsr_transfer_table_t *table=&bsr_state->transfer_table;
+  struct timespec starttime;
+  struct timespec endtime;
+  double elapsed_time;
+  double estimate;
+  uint64_t one_bits;
+  uint64_t first_cell_bits;
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t mid;
+  uint64_t step;
+  int num_cells;
+  int first_code;
+  int code;
+  int k;
+  int i;
+
+  table->num_codes=0;
+
+  //
+  // only integer and AVIF half outputs with a limited, curve based transfer function use the table
+  //
+  if ((bsr_config->image_format == 1) || (bsr_config->color_profile == 7) || (bsr_config->color_profile < 1) || (bsr_config->color_profile > 8)\
+   || ((bsr_config->camera_pixel_limit_mode != 0) && (bsr_config->camera_pixel_limit_mode != 1))) {
+    return(0);
+  }
+  if ((bsr_config->bits_per_color != 8) && (bsr_config->bits_per_color != 10) && (bsr_config->bits_per_color != 12) && (bsr_config->bits_per_color != 16)) {
+    return(0);
+  }
+
+  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &starttime);
+    printf("Initializing transfer function table...");
+    fflush(stdout);
+  }
+
+  //
+  // output code scale, AVIF 16-bit is half float
+  //
+  table->half_output=0;
+  if (bsr_config->bits_per_color == 8) {
+    table->code_scale=255.0;
+  } else if (bsr_config->bits_per_color == 10) {
+    table->code_scale=1023.0;
+  } else if (bsr_config->bits_per_color == 12) {
+    table->code_scale=4095.0;
+  } else {
+    table->code_scale=65535.0;
+    if (bsr_config->image_format == 3) {
+      table->half_output=1;
+    }
+  }
+
+  //
+  // linear segment near black is evaluated directly
+  //
+  if ((bsr_config->color_profile == 1) || (bsr_config->color_profile == 2)) {
+    table->linear_limit=0.0031308;
+    table->linear_slope=12.92;
+    table->linear_inclusive=1;
+  } else if (bsr_config->color_profile == 8) {
+    table->linear_limit=-1.0;
+    table->linear_slope=0.0;
+    table->linear_inclusive=0;
+  } else {
+    table->linear_limit=0.018053968510807;
+    table->linear_slope=4.5;
+    table->linear_inclusive=0;
+  }
+
+  //
+  // allocate thresholds and index
+  //
+  one_bits=doubleToBits(1.0);
+  first_cell_bits=(uint64_t)(1023 - BSR_TRANSFER_OCTAVES) << 52;
+  num_cells=BSR_TRANSFER_OCTAVES << BSR_TRANSFER_CELL_BITS;
+  code=curveCode(bsr_config, table, one_bits) + 1;
+  table->threshold=(double *)malloc((size_t)code * sizeof(double));
+  table->cell_code=(uint16_t *)malloc((size_t)(num_cells + 2) * sizeof(uint16_t));
+  if ((table->threshold == NULL) || (table->cell_code == NULL)) {
+    // not fatal, sequencePixels() falls back to per pixel conversion
+    free(table->threshold);
+    free(table->cell_code);
+    table->threshold=NULL;
+    table->cell_code=NULL;
+    return(1);
+  }
+  table->num_codes=code;
+  table->zero_code=curveCode(bsr_config, table, 0);
+
+  //
+  // find thresholds: start from the analytic inverse, gallop to bracket the first input with code >= k, then bisect
+  //
+  first_code=table->zero_code;
+  for (k=0; k <= first_code; k++) {
+    table->threshold[k]=0.0;
+  }
+  for (k=(first_code + 1); k < table->num_codes; k++) {
+    estimate=inverseTransferCurve(bsr_config, codeToValue(table, k));
+    if (!(estimate > 0.0)) {
+      estimate=0.0;
+    } else if (estimate > 1.0) {
+      estimate=1.0;
+    }
+    step=1;
+    if (curveCode(bsr_config, table, doubleToBits(estimate)) >= k) {
+      hi=doubleToBits(estimate);
+      while (1) {
+        if (hi <= step) {
+          lo=0;
+          break;
+        }
+        if (curveCode(bsr_config, table, (hi - step)) < k) {
+          lo=hi - step;
+          break;
+        }
+        hi-=step;
+        step*=2;
+      }
+    } else {
+      lo=doubleToBits(estimate);
+      while (1) {
+        if ((one_bits - lo) <= step) {
+          hi=one_bits;
+          break;
+        }
+        if (curveCode(bsr_config, table, (lo + step)) >= k) {
+          hi=lo + step;
+          break;
+        }
+        lo+=step;
+        step*=2;
+      }
+    }
+    while ((hi - lo) > 1) {
+      mid=lo + ((hi - lo) / 2);
+      if (curveCode(bsr_config, table, mid) >= k) {
+        hi=mid;
+      } else {
+        lo=mid;
+      }
+    }
+    table->threshold[k]=bitsToDouble(hi);
+
+    // thresholds must be ordered for lookups to be valid
+    if (table->threshold[k] < table->threshold[k - 1]) {
+      free(table->threshold);
+      free(table->cell_code);
+      table->threshold=NULL;
+      table->cell_code=NULL;
+      table->num_codes=0;
+      return(1);
+    }
+  }
+
+  //
+  // index: code at the start of each cell
+  //
+  code=first_code;
+  for (i=0; i <= num_cells; i++) {
+    estimate=bitsToDouble(first_cell_bits + ((uint64_t)i << (52 - BSR_TRANSFER_CELL_BITS)));
+    while (((code + 1) < table->num_codes) && (table->threshold[code + 1] <= estimate)) {
+      code++;
+    }
+    table->cell_code[i]=code;
+  }
+  table->cell_code[num_cells + 1]=table->cell_code[num_cells];
+
+  if ((bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
+    clock_gettime(CLOCK_REALTIME, &endtime);
+    elapsed_time=((double)(endtime.tv_sec - 1500000000) + ((double)endtime.tv_nsec / 1.0E9)) - ((double)(starttime.tv_sec - 1500000000) + ((double)starttime.tv_nsec) / 1.0E9);
+    printf(" (%.3fs)\n", elapsed_time);
+    fflush(stdout);
+  }
+
+  return(0);
+}
+
+static inline uint16_t encodePixel(bsr_config_t *bsr_config, bsr_transfer_table_t *table, double pixel) {
+  uint64_t bits;
+  int cell;
+  int lo;
+  int hi;
+  int mid;
+
+  //
+  // limited linear pixel value [0..1] to output code
+  //
+  if ((pixel < table->linear_limit) || ((table->linear_inclusive == 1) && (pixel == table->linear_limit))) {
+    return(quantizeValue(table, (pixel * table->linear_slope)));
+  }
+  bits=doubleToBits(pixel);
+  if (bits < ((uint64_t)(1023 - BSR_TRANSFER_OCTAVES) << 52)) {
+    if (pixel == 0.0) {
+      return(table->zero_code);
+    }
+    return(curveCode(bsr_config, table, bits));
+  }
+  cell=(int)((bits >> (52 - BSR_TRANSFER_CELL_BITS)) - ((uint64_t)(1023 - BSR_TRANSFER_OCTAVES) << BSR_TRANSFER_CELL_BITS));
+  lo=table->cell_code[cell];
+  hi=table->cell_code[cell + 1];
+  while (lo < hi) {
+    mid=(lo + hi + 1) >> 1;
+    if (table->threshold[mid] <= pixel) {
+      lo=mid;
+    } else {
+      hi=mid - 1;
+    }
+  }
+  return((uint16_t)lo);
+}
+
+//
+// select output byte order for integer codes: 0 = 8-bit, 1 = 16-bit big-endian, 2 = 16-bit little-endian
+//
+static int getStoreMode(bsr_config_t *bsr_config) {
+  if (bsr_config->bits_per_color == 8) {
+    return(0);
+  } else if ((bsr_config->image_format == 0) || (bsr_config->image_format == 2) || (bsr_config->image_format == 5)) {
+    // PNG, JPG, TIFF are big-endian
+    return(1);
+  } else if (bsr_config->image_format == 3) {
+    // AVIF is system-endian
+#ifdef BSR_BIG_ENDIAN_COMPILE
+    return(1);
+#else
+    return(2);
+#endif
+  }
+
+  // HEIF is little-endian
+  return(2);
+}
+
+//
+// limited linear pixel value [0..1] to integer output code without the transfer function table, same expressions
+// as the per pixel conversion in sequencePixels()
+//
+static uint16_t encodePixelDirect(bsr_config_t *bsr_config, double pixel) {
+  double value;
+
+  if ((bsr_config->color_profile == 1) || (bsr_config->color_profile == 2)) {
+    if (pixel <= 0.0031308) {
+      value=pixel * 12.92;
+    } else {
+      value=transferCurve(bsr_config, pixel);
+    }
+  } else if ((bsr_config->color_profile >= 3) && (bsr_config->color_profile <= 6)) {
+    if (pixel < 0.018053968510807) {
+      value=pixel * 4.5;
+    } else {
+      value=transferCurve(bsr_config, pixel);
+    }
+  } else if (bsr_config->color_profile == 7) {
+    value=pow(pixel, 0.5);
+  } else if (bsr_config->color_profile == 8) {
+    value=transferCurve(bsr_config, pixel);
+  } else {
+    value=pixel;
+  }
+
+  if (bsr_config->bits_per_color == 8) {
+    return((uint16_t)((value * 255.0) + 0.5));
+  } else if (bsr_config->bits_per_color == 10) {
+    return((uint16_t)((value * 1023.0) + 0.5));
+  } else if (bsr_config->bits_per_color == 12) {
+    return((uint16_t)((value * 4095.0) + 0.5));
+  }
+  return((uint16_t)((value * 65535.0) + 0.5));
+}
+
+//
+// renormalize for PQ and limit intensity of one line of linear pixels in place
+//
+static int limitLine(bsr_config_t *bsr_config, double *sequence_line, int num_pixels) {
+  double hdr_normalization_factor;
+  double *pixel_p;
+  int x;
+  int i;
+
+  hdr_normalization_factor=(double)bsr_config->hdr_neutral_white_ref / 10000.0;
+  for (x=0; x < num_pixels; x++) {
+    pixel_p=sequence_line + (x * 3);
+    if (bsr_config->color_profile == 8) {
+      // renormalize to hdr_neutral_white_ref for PQ transform
+      for (i=0; i < 3; i++) {
+        pixel_p[i] *= hdr_normalization_factor;
+      }
+    }
+    if (bsr_config->camera_pixel_limit_mode == 0) {
+      // same as limitIntensity()
+      for (i=0; i < 3; i++) {
+        pixel_p[i]=(pixel_p[i] < 0.0) ? 0.0 : ((pixel_p[i] > 1.0) ? 1.0 : pixel_p[i]);
+      }
+    } else {
+      limitIntensityPreserveColor(bsr_config, &pixel_p[0], &pixel_p[1], &pixel_p[2]);
+    }
+  }
+
+  return(0);
+}
+
+//
+// encode one line of limited linear pixels with the transfer function table (or directly if there is no table)
+// and store codes in RGB RGB RGB order with the output byte order
+//
+static int encodeLine(bsr_config_t *bsr_config, bsr_transfer_table_t *table, double *sequence_line, uint16_t *codes, unsigned char *image_output_p, int num_pixels, int store_mode) {
+  int i;
+
+  if (table->num_codes > 0) {
+    for (i=0; i < (num_pixels * 3); i++) {
+      codes[i]=encodePixel(bsr_config, table, sequence_line[i]);
+    }
+  } else {
+    for (i=0; i < (num_pixels * 3); i++) {
+      codes[i]=encodePixelDirect(bsr_config, sequence_line[i]);
+    }
+  }
+
+  //
+  // store codes, channels are in RGB RGB RGB order
+  //
+  if (store_mode == 0) {
+    for (i=0; i < (num_pixels * 3); i++) {
+      image_output_p[i]=(unsigned char)codes[i];
+    }
+  } else if (store_mode == 1) {
+    for (i=0; i < (num_pixels * 3); i++) {
+      image_output_p[(i * 2)]=(unsigned char)(codes[i] >> 8);
+      image_output_p[(i * 2) + 1]=(unsigned char)(codes[i] & 0xff);
+    }
+  } else {
+    for (i=0; i < (num_pixels * 3); i++) {
+      image_output_p[(i * 2)]=(unsigned char)(codes[i] & 0xff);
+      image_output_p[(i * 2) + 1]=(unsigned char)(codes[i] >> 8);
+    }
+  }
+
+  return(0);
+}
+
+static int sequenceRows(bsr_config_t *bsr_config, bsr_state_t *bsr_state, int first_row, int last_row, unsigned char *output_p, double *sequence_line, void *code_line) {
+  //
+  // row based conversion used with the transfer function table, for EXR and for streamed output. The output format
+  // is selected once and each row is converted in a few simple loops instead of per pixel branching. Rows are stored
+  // from output_p, which is where first_row goes
+  //
+  bsr_transfer_table_t *table=&bsr_state->transfer_table;
+  pixel_composition_t *current_image_p;
+  unsigned char *image_output_p;
+  unsigned char *channel_p;
+  uint16_t *codes=(uint16_t *)code_line;
+  float *float_line=(float *)code_line;
+  double inv_camera_pixel_limit;
+  int output_res_x;
+  int output_y;
+  int bytes_per_pixel;
+  int bytes_per_color;
+  int store_mode;
+  int channel;
+  int x;
+  int i;
+
+  output_res_x=bsr_state->current_image_res_x;
+  inv_camera_pixel_limit=bsr_state->composition_scale / bsr_state->camera_pixel_limit;
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_color=1;
+  } else if (bsr_config->bits_per_color == 32) {
+    bytes_per_color=4;
+  } else {
+    bytes_per_color=2;
+  }
+  bytes_per_pixel=bytes_per_color * 3;
+
+  store_mode=getStoreMode(bsr_config);
+
+  for (output_y=first_row; output_y < last_row; output_y++) {
+    current_image_p=bsr_state->current_image_buf + ((uint64_t)output_res_x * (uint64_t)output_y);
+    image_output_p=output_p + ((uint64_t)output_res_x * (uint64_t)(output_y - first_row) * (uint64_t)bytes_per_pixel);
+    if ((bsr_config->image_format != 1) && (bsr_state->stream_num_bands == 0)) {
+      bsr_state->row_pointers[output_y]=image_output_p;
+    }
+
+    //
+    // get linear pixel values for this row
+    //
+    if (bsr_state->post_process_stage == 3) {
+      postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, sequence_line, output_res_x);
+    } else {
+      for (x=0; x < output_res_x; x++) {
+        sequence_line[(x * 3)]=BSR_GET_PIXEL(current_image_p[x].r);
+        sequence_line[(x * 3) + 1]=BSR_GET_PIXEL(current_image_p[x].g);
+        sequence_line[(x * 3) + 2]=BSR_GET_PIXEL(current_image_p[x].b);
+      }
+    }
+
+    if (bsr_config->image_format == 1) {
+      //
+      // EXR: channels are in BBB GGG RRR order and stored little-endian, no transfer function
+      //
+      for (channel=0; channel < 3; channel++) {
+        channel_p=image_output_p + ((uint64_t)channel * (uint64_t)bytes_per_color * (uint64_t)output_res_x);
+        if (bsr_config->image_number_format == 0) {
+          for (x=0; x < output_res_x; x++) {
+            storeU32LE(channel_p + (x * 4), (uint32_t)((sequence_line[(x * 3) + 2 - channel] * 4294967295.0) + 0.5));
+          }
+        } else {
+          for (x=0; x < output_res_x; x++) {
+            float_line[x]=(float)sequence_line[(x * 3) + 2 - channel];
+          }
+          if (bsr_config->bits_per_color == 16) {
+            storeHalfLineLE(channel_p, float_line, output_res_x);
+          } else {
+#ifdef BSR_LITTLE_ENDIAN_COMPILE
+            memcpy(channel_p, float_line, (size_t)output_res_x * sizeof(float));
+#else
+            for (x=0; x < output_res_x; x++) {
+              storeFloatLE(channel_p + (x * 4), float_line[x]);
+            }
+#endif
+          }
+        }
+      }
+      continue;
+    } else if ((bsr_config->image_format == 5) && (bsr_config->image_number_format == 1)) {
+      //
+      // TIFF floating-point: channels are in RGB RGB RGB order and stored big-endian, no transfer function
+      //
+      for (i=0; i < (output_res_x * 3); i++) {
+        storeFloatBE(image_output_p + (i * 4), (float)sequence_line[i]);
+      }
+      continue;
+    }
+
+    //
+    // limit intensity and encode with the transfer function table
+    //
+    limitLine(bsr_config, sequence_line, output_res_x);
+    encodeLine(bsr_config, table, sequence_line, codes, image_output_p, output_res_x, store_mode);
+  }
+
+  return(0);
+}
+
+//
+// all threads: build the reduced levels of a deep zoom pyramid. Each level is the 2x2 average of the one before
+// it in linear light (after the intensity limit, before the transfer function), rounded up so odd edge pixels
+// average with themselves. Level 1 is reduced from current_image_buf, later levels from the linear copy of the level before
+// kept in deep_zoom_linear_buf. Each level is also encoded into deep_zoom_buf in the same byte sequence as
+// image_output_buf. Bands are claimed from the band scheduler, a band waits only for the bands of the previous
+// level it reads
+//
+static int sequenceDeepZoomLevels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
+  bsr_transfer_table_t *table=&bsr_state->transfer_table;
+  tile_level_t *level_p;
+  tile_level_t *src_level_p;
+  pixel_composition_t *current_image_p;
+  double inv_camera_pixel_limit;
+  double *src_line[2];
+  double *dest_line;
+  uint16_t *codes;
+  float *linear_p;
+  unsigned char *output_p;
+  size_t line_bytes;
+  int store_mode;
+  int bytes_per_pixel;
+  int task;
+  int level;
+  int band;
+  int src_band;
+  int first_y;
+  int last_y;
+  int y;
+  int src_y[2];
+  int src_x0;
+  int src_x1;
+  int x;
+  int row;
+  int i;
+
+  if (bsr_state->deep_zoom_num_bands == 0) {
+    return(0);
+  }
+  inv_camera_pixel_limit=bsr_state->composition_scale / bsr_state->camera_pixel_limit;
+  store_mode=getStoreMode(bsr_config);
+  if (bsr_config->bits_per_color == 8) {
+    bytes_per_pixel=3;
+  } else {
+    bytes_per_pixel=6;
+  }
+
+  //
+  // line buffers: two source lines of the full resolution image, one reduced line and its codes
+  //
+  line_bytes=(size_t)bsr_state->deep_zoom_levels[0].width * 3 * sizeof(double);
+  src_line[0]=(double *)malloc(line_bytes);
+  src_line[1]=(double *)malloc(line_bytes);
+  dest_line=(double *)malloc(line_bytes);
+  codes=(uint16_t *)malloc((size_t)bsr_state->deep_zoom_levels[0].width * 3 * sizeof(uint16_t));
+  if ((src_line[0] == NULL) || (src_line[1] == NULL) || (dest_line == NULL) || (codes == NULL)) {
+    if (bsr_config->cgi_mode != 1) {
+      printf("Error: could not allocate memory for deep zoom line buffers\n");
+      fflush(stdout);
+    }
+    exit(1);
+  }
+
+  for (task=claimBandTask(bsr_state); task < bsr_state->deep_zoom_num_bands; task=claimBandTask(bsr_state)) {
+    level=bsr_state->deep_zoom_num_levels - 1;
+    while (bsr_state->deep_zoom_levels[level].first_band > task) {
+      level--;
+    }
+    level_p=&bsr_state->deep_zoom_levels[level];
+    src_level_p=&bsr_state->deep_zoom_levels[level - 1];
+    band=task - level_p->first_band;
+    first_y=band * BSR_BAND_LINES;
+    last_y=first_y + BSR_BAND_LINES - 1;
+    if (last_y >= level_p->height) {
+      last_y=level_p->height - 1;
+    }
+    if (level > 1) {
+      // wait for the lines of the previous level this band reads
+      src_band=src_level_p->first_band;
+      row=(2 * last_y) + 1;
+      if (row >= src_level_p->height) {
+        row=src_level_p->height - 1;
+      }
+      waitForLevelBands(bsr_state, src_band + ((2 * first_y) / BSR_BAND_LINES), src_band + (row / BSR_BAND_LINES));
+    }
+
+    for (y=first_y; y <= last_y; y++) {
+      //
+      // get the two linear source lines
+      //
+      src_y[0]=2 * y;
+      src_y[1]=src_y[0] + 1;
+      if (src_y[1] >= src_level_p->height) {
+        src_y[1]=src_level_p->height - 1;
+      }
+      for (row=0; row < 2; row++) {
+        if (level == 1) {
+          current_image_p=bsr_state->current_image_buf + ((uint64_t)src_level_p->width * (uint64_t)src_y[row]);
+          if (bsr_state->post_process_stage == 3) {
+            postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, src_line[row], src_level_p->width);
+          } else {
+            for (x=0; x < src_level_p->width; x++) {
+              src_line[row][(x * 3)]=BSR_GET_PIXEL(current_image_p[x].r);
+              src_line[row][(x * 3) + 1]=BSR_GET_PIXEL(current_image_p[x].g);
+              src_line[row][(x * 3) + 2]=BSR_GET_PIXEL(current_image_p[x].b);
+            }
+          }
+          limitLine(bsr_config, src_line[row], src_level_p->width);
+        } else {
+          linear_p=getDeepZoomLinearBuf(bsr_config, bsr_state, (level - 1)) + ((size_t)src_level_p->width * 3 * (size_t)src_y[row]);
+          for (i=0; i < (src_level_p->width * 3); i++) {
+            src_line[row][i]=(double)linear_p[i];
+          }
+        }
+      }
+
+      //
+      // reduce, keep linear copy for the next level and encode
+      //
+      for (x=0; x < level_p->width; x++) {
+        src_x0=2 * x;
+        src_x1=src_x0 + 1;
+        if (src_x1 >= src_level_p->width) {
+          src_x1=src_level_p->width - 1;
+        }
+        for (i=0; i < 3; i++) {
+          dest_line[(x * 3) + i]=0.25 * (src_line[0][(src_x0 * 3) + i] + src_line[0][(src_x1 * 3) + i] + src_line[1][(src_x0 * 3) + i] + src_line[1][(src_x1 * 3) + i]);
+        }
+      }
+      linear_p=getDeepZoomLinearBuf(bsr_config, bsr_state, level) + ((size_t)level_p->width * 3 * (size_t)y);
+      for (i=0; i < (level_p->width * 3); i++) {
+        linear_p[i]=(float)dest_line[i];
+      }
+      output_p=getDeepZoomLevelBuf(bsr_config, bsr_state, level) + ((size_t)level_p->width * (size_t)bytes_per_pixel * (size_t)y);
+      encodeLine(bsr_config, table, dest_line, codes, output_p, level_p->width, store_mode);
+    }
+    setLevelBandDone(bsr_state, task);
+  }
+
+  free(src_line[0]);
+  free(src_line[1]);
+  free(dest_line);
+  free(codes);
+
+  return(0);
+}
+
+//
+// all threads: convert and encode the bands of a streamed image (stream_output). Bands are claimed in order from
+// the band scheduler and converted into a ring slot of image_output_buf once the band that used it before has been
+// written. The main thread writes finished bands in order between its own bands and finishes the file at the end
+//
+static int sequenceStreamBands(bsr_config_t *bsr_config, bsr_state_t *bsr_state, double *sequence_line, void *code_line) {
+  unsigned char *slot_p;
+  size_t row_bytes;
+  int band;
+  int first_row;
+  int last_row;
+  int prefix_lines;
+
+  row_bytes=bsr_state->stream_slot_size / (size_t)(bsr_state->stream_prefix_lines + bsr_state->stream_band_lines);
+  for (band=claimBandTask(bsr_state); band < bsr_state->stream_num_bands; band=claimBandTask(bsr_state)) {
+    waitForStreamSlot(bsr_config, bsr_state, band);
+    first_row=band * bsr_state->stream_band_lines;
+    last_row=first_row + bsr_state->stream_band_lines;
+    if (last_row > bsr_state->current_image_res_y) {
+      last_row=bsr_state->current_image_res_y;
+    }
+    // PNG bands also convert the rows before them to continue the deflate window, these end where the band starts
+    prefix_lines=bsr_state->stream_prefix_lines;
+    if (prefix_lines > first_row) {
+      prefix_lines=first_row;
+    }
+    slot_p=bsr_state->image_output_buf + ((size_t)(band % bsr_state->stream_num_slots) * bsr_state->stream_slot_size)\
+           + ((size_t)(bsr_state->stream_prefix_lines - prefix_lines) * row_bytes);
+    sequenceRows(bsr_config, bsr_state, (first_row - prefix_lines), last_row, slot_p, sequence_line, code_line);
+    encodeStreamBand(bsr_config, bsr_state, band);
+    setBandDone(bsr_state, 0, band);
+    if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+      writeStreamBands(bsr_config, bsr_state, band, 0);
+    }
+  }
+
+  if (bsr_state->perthread->my_pid == bsr_state->main_pid) {
+    closeStreamOutput(bsr_config, bsr_state);
+  }
+
+  return(0);
+}
 
 int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   //
@@ -72,6 +804,12 @@ int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   int bytes_per_color=0;
   double hdr_normalization_factor;
   double Ym1;
+  double inv_camera_pixel_limit;
+  double *sequence_line=NULL;
+  void *code_line=NULL;
+  int use_rows;
+  int first_row;
+  int last_row;
 
   // Rec. 2100 PQ constants
   const double m1=0.1593017578125;
@@ -85,7 +823,9 @@ int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
   //
   if ((bsr_state->perthread->my_pid == bsr_state->main_pid) && (bsr_config->cgi_mode != 1) && (bsr_config->print_status == 1)) {
     clock_gettime(CLOCK_REALTIME, &starttime);
-    if (bsr_config->image_number_format == 0) {
+    if (bsr_state->stream_num_bands > 0) {
+      printf("Converting and writing %s...", bsr_config->output_file_name);
+    } else if (bsr_config->image_number_format == 0) {
       if (bsr_config->bits_per_color == 8) { 
         printf("Converting to 8-bit unsigned integer per color...");
       } else if (bsr_config->bits_per_color == 10) {
@@ -117,6 +857,27 @@ int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     lines_per_thread=1;
   }
   hdr_normalization_factor=(double)bsr_config->hdr_neutral_white_ref / 10000.0;
+  inv_camera_pixel_limit=bsr_state->composition_scale / bsr_state->camera_pixel_limit;
+
+  //
+  // all threads: allocate line buffers if camera gamma and intensity limit are applied here or rows are converted
+  // with the transfer function table
+  //
+  use_rows=((bsr_state->transfer_table.num_codes > 0) || (bsr_config->image_format == 1) || ((bsr_config->image_format == 5) && (bsr_config->image_number_format == 1))\
+          || (bsr_state->stream_num_bands > 0));
+  if (use_rows == 1) {
+    code_line=malloc((size_t)output_res_x * 3 * sizeof(uint16_t) + (size_t)output_res_x * sizeof(float));
+  }
+  if ((bsr_state->post_process_stage == 3) || (use_rows == 1)) {
+    sequence_line=(double *)malloc((size_t)output_res_x * 3 * sizeof(double));
+    if ((sequence_line == NULL) || ((use_rows == 1) && (code_line == NULL))) {
+      if (bsr_config->cgi_mode != 1) {
+        printf("Error: could not allocate memory for pixel conversion line buffer\n");
+        fflush(stdout);
+      }
+      exit(1);
+    }
+  }
 
   //
   // worker threads:  wait for main thread to say go
@@ -126,15 +887,27 @@ int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     waitForMainThread(bsr_state, THREAD_STATUS_SEQUENCE_PIXELS_BEGIN);
   } else {
     // main thread
+    if ((bsr_state->deep_zoom_num_bands > 0) || (bsr_state->stream_num_bands > 0)) {
+      initBandSchedule(bsr_state);
+    }
+    if (bsr_state->stream_num_bands > 0) {
+      openStreamOutput(bsr_config, bsr_state);
+    }
     for (i=1; i <= bsr_state->num_worker_threads; i++) {
       bsr_state->status_array[i].status=THREAD_STATUS_SEQUENCE_PIXELS_BEGIN;
     }
   } // end if not main thread
 
   //
-  // all threads: convert current_image_buf to unsigned char byte sequence and store
-  // in image_output_buf. Also update row_pointers if PNG or JPG image format
+  // all threads: convert this thread's rows. The transfer function table (and EXR and floating-point TIFF, which have no transfer function)
+  // use the row based conversion, other cases use the general per pixel conversion below. Streamed images are
+  // converted, encoded and written band by band instead
   //
+  first_row=bsr_state->perthread->my_thread_id * lines_per_thread;
+  last_row=first_row + lines_per_thread;
+  if (last_row > output_res_y) {
+    last_row=output_res_y;
+  }
   if (bsr_config->bits_per_color == 8) {
     bytes_per_color=1;
     bytes_per_pixel=3;
@@ -145,274 +918,299 @@ int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     bytes_per_color=4;
     bytes_per_pixel=12;
   }
-  output_x=0;
-  output_y=bsr_state->perthread->my_thread_id * lines_per_thread;
-  image_output_p=bsr_state->image_output_buf + ((uint64_t)output_res_x * (uint64_t)output_y * (uint64_t)bytes_per_pixel);
-  if (bsr_config->image_format == 1) {
-    // EXR groups same channel pixel data together
-    image_output_B_p=image_output_p;
-    image_output_G_p=image_output_p + ((uint64_t)bytes_per_color * (uint64_t)output_res_x);
-    image_output_R_p=image_output_p + (2ll * (uint64_t)bytes_per_color * (uint64_t)output_res_x);
-  }
-  current_image_p=bsr_state->current_image_buf + ((uint64_t)output_res_x * (uint64_t)output_y);
-  // only update row_pointers if PNG or JPG output format
-  if (((bsr_config->image_format == 0) || (bsr_config->image_format == 2)) && (output_y < output_res_y)) {
-    bsr_state->row_pointers[output_y]=image_output_p;
-  }
-  for (image_offset=0; ((image_offset < ((uint64_t)output_res_x * (uint64_t)lines_per_thread)) && (output_y < output_res_y)); image_offset++) {
-    //
-    // copy pixel data from current_image_buf
-    //
-    pixel_r=current_image_p->r;
-    pixel_g=current_image_p->g;
-    pixel_b=current_image_p->b;
-
+  if (bsr_state->stream_num_bands > 0) {
+    sequenceStreamBands(bsr_config, bsr_state, sequence_line, code_line);
+  } else if (use_rows == 1) {
+    sequenceRows(bsr_config, bsr_state, first_row, last_row, (bsr_state->image_output_buf + ((uint64_t)output_res_x * (uint64_t)first_row * (uint64_t)bytes_per_pixel)), sequence_line, code_line);
+  } else {
     //
-    // renormalize and/or limit intensity and apply transfer function (encoding gamma) for formats that use it
+    // all threads: convert current_image_buf to unsigned char byte sequence and store
+    // in image_output_buf. Also update row_pointers if PNG or JPG image format
     //
-    if (bsr_config->image_format != 1) { // EXR does not use encoding gamma
-      if ((bsr_config->color_profile == 1) || (bsr_config->color_profile == 2)) { // sRGB, and Display-P3
-        // limit pixel intensity to range [0..1]
-        if (bsr_config->camera_pixel_limit_mode == 0) {
-          limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
-        } else if (bsr_config->camera_pixel_limit_mode == 1) {
-          limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+    output_x=0;
+    output_y=bsr_state->perthread->my_thread_id * lines_per_thread;
+    image_output_p=bsr_state->image_output_buf + ((uint64_t)output_res_x * (uint64_t)output_y * (uint64_t)bytes_per_pixel);
+    if (bsr_config->image_format == 1) {
+      // EXR groups same channel pixel data together
+      image_output_B_p=image_output_p;
+      image_output_G_p=image_output_p + ((uint64_t)bytes_per_color * (uint64_t)output_res_x);
+      image_output_R_p=image_output_p + (2ll * (uint64_t)bytes_per_color * (uint64_t)output_res_x);
+    }
+    current_image_p=bsr_state->current_image_buf + ((uint64_t)output_res_x * (uint64_t)output_y);
+    // only update row_pointers if interleaved (not EXR) output format
+    if ((bsr_config->image_format != 1) && (output_y < output_res_y)) {
+      bsr_state->row_pointers[output_y]=image_output_p;
+    }
+    for (image_offset=0; ((image_offset < ((uint64_t)output_res_x * (uint64_t)lines_per_thread)) && (output_y < output_res_y)); image_offset++) {
+      //
+      // copy pixel data from current_image_buf
+      //
+      // if there was no blur, resize or overlay, apply camera gamma and intensity limit here one line at a time (post_process_stage)
+      if (bsr_state->post_process_stage == 3) {
+        if (output_x == 0) {
+          postProcessLine(bsr_config, inv_camera_pixel_limit, current_image_p, sequence_line, output_res_x);
         }
+        pixel_r=sequence_line[(output_x * 3)];
+        pixel_g=sequence_line[(output_x * 3) + 1];
+        pixel_b=sequence_line[(output_x * 3) + 2];
+      } else {
+        pixel_r=BSR_GET_PIXEL(current_image_p->r);
+        pixel_g=BSR_GET_PIXEL(current_image_p->g);
+        pixel_b=BSR_GET_PIXEL(current_image_p->b);
+      }
 
-        // apply transfer function
-        if (pixel_r <= 0.0031308) {
-          pixel_r=pixel_r * 12.92;
-        } else {
-          pixel_r=(1.055 * pow(pixel_r, one_over_2dot4) - 0.055);
-        }
-        if (pixel_g <= 0.0031308) {
-          pixel_g=pixel_g * 12.92;
-        } else {
-          pixel_g=(1.055 * pow(pixel_g, one_over_2dot4) - 0.055);
-        }
-        if (pixel_b <= 0.0031308) {
-          pixel_b=pixel_b * 12.92;
-        } else {
-          pixel_b=(1.055 * pow(pixel_b, one_over_2dot4) - 0.055);
-        }
-      } else if ((bsr_config->color_profile == 3) || (bsr_config->color_profile == 4)\
-              || (bsr_config->color_profile == 5) || (bsr_config->color_profile == 6)) { // Rec. 2020, Rec. 601 NTSC, Rec. 601 PAL, Rec. 709
-        // limit pixel intensity to range [0..1]
-        if (bsr_config->camera_pixel_limit_mode == 0) {
-          limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
-        } else if (bsr_config->camera_pixel_limit_mode == 1) {
-          limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
-        }
+      //
+      // renormalize and/or limit intensity and apply transfer function (encoding gamma) for formats that use it
+      //
+      if (bsr_config->image_format != 1) { // EXR does not use encoding gamma
+        if ((bsr_config->color_profile == 1) || (bsr_config->color_profile == 2)) { // sRGB, and Display-P3
+          // limit pixel intensity to range [0..1]
+          if (bsr_config->camera_pixel_limit_mode == 0) {
+            limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+          } else if (bsr_config->camera_pixel_limit_mode == 1) {
+            limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+          }
 
-        // apply transfer function
-        if (pixel_r < 0.018053968510807) {
-          pixel_r=pixel_r * 4.5;
-        } else {
-          pixel_r=(1.09929682680944 * pow(pixel_r, 0.45) - 0.09929682680944);
-        }
-        if (pixel_g < 0.018053968510807) {
-          pixel_g=pixel_g * 4.5;
-        } else {
-          pixel_g=(1.09929682680944 * pow(pixel_g, 0.45) - 0.09929682680944);
-        }
-        if (pixel_b < 0.018053968510807) {
-          pixel_b=pixel_b * 4.5;
-        } else {
-          pixel_b=(1.09929682680944 * pow(pixel_b, 0.45) - 0.09929682680944);
-        }
-      } else if (bsr_config->color_profile == 7) { // flat 2.0 gamma
-        pixel_r=pow(pixel_r, 0.5);
-        pixel_g=pow(pixel_g, 0.5);
-        pixel_b=pow(pixel_b, 0.5);
-      } else if (bsr_config->color_profile == 8) { //Rec. 2100 PQ
-        // renormalize to hdr_neutral_white_ref for PQ transform
-        pixel_r *= hdr_normalization_factor;
-        pixel_g *= hdr_normalization_factor;
-        pixel_b *= hdr_normalization_factor;
-
-        // limit pixel intensity to range [0..1] 
-        if (bsr_config->camera_pixel_limit_mode == 0) {
-          limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
-        } else if (bsr_config->camera_pixel_limit_mode == 1) {
-          limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
-        }
+          // apply transfer function
+          if (pixel_r <= 0.0031308) {
+            pixel_r=pixel_r * 12.92;
+          } else {
+            pixel_r=(1.055 * pow(pixel_r, one_over_2dot4) - 0.055);
+          }
+          if (pixel_g <= 0.0031308) {
+            pixel_g=pixel_g * 12.92;
+          } else {
+            pixel_g=(1.055 * pow(pixel_g, one_over_2dot4) - 0.055);
+          }
+          if (pixel_b <= 0.0031308) {
+            pixel_b=pixel_b * 12.92;
+          } else {
+            pixel_b=(1.055 * pow(pixel_b, one_over_2dot4) - 0.055);
+          }
+        } else if ((bsr_config->color_profile == 3) || (bsr_config->color_profile == 4)\
+                || (bsr_config->color_profile == 5) || (bsr_config->color_profile == 6)) { // Rec. 2020, Rec. 601 NTSC, Rec. 601 PAL, Rec. 709
+          // limit pixel intensity to range [0..1]
+          if (bsr_config->camera_pixel_limit_mode == 0) {
+            limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+          } else if (bsr_config->camera_pixel_limit_mode == 1) {
+            limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+          }
 
-        // apply transfer function        
-        Ym1=pow(pixel_r, m1);
-        pixel_r=pow(((c1 + (c2 * Ym1)) / (1.0 + (c3 * Ym1))), m2);
-        Ym1=pow(pixel_g, m1);
-        pixel_g=pow(((c1 + (c2 * Ym1)) / (1.0 + (c3 * Ym1))), m2);
-        Ym1=pow(pixel_b, m1);
-        pixel_b=pow(((c1 + (c2 * Ym1)) / (1.0 + (c3 * Ym1))), m2);
-      } // end if color_profile
-    } // end if image_format
+          // apply transfer function
+          if (pixel_r < 0.018053968510807) {
+            pixel_r=pixel_r * 4.5;
+          } else {
+            pixel_r=(1.09929682680944 * pow(pixel_r, 0.45) - 0.09929682680944);
+          }
+          if (pixel_g < 0.018053968510807) {
+            pixel_g=pixel_g * 4.5;
+          } else {
+            pixel_g=(1.09929682680944 * pow(pixel_g, 0.45) - 0.09929682680944);
+          }
+          if (pixel_b < 0.018053968510807) {
+            pixel_b=pixel_b * 4.5;
+          } else {
+            pixel_b=(1.09929682680944 * pow(pixel_b, 0.45) - 0.09929682680944);
+          }
+        } else if (bsr_config->color_profile == 7) { // flat 2.0 gamma
+          pixel_r=pow(pixel_r, 0.5);
+          pixel_g=pow(pixel_g, 0.5);
+          pixel_b=pow(pixel_b, 0.5);
+        } else if (bsr_config->color_profile == 8) { //Rec. 2100 PQ
+          // renormalize to hdr_neutral_white_ref for PQ transform
+          pixel_r *= hdr_normalization_factor;
+          pixel_g *= hdr_normalization_factor;
+          pixel_b *= hdr_normalization_factor;
 
-    //
-    // convert r,g,b to output byte sequence and store in output buffer
-    //
-    if ((bsr_config->image_format == 0) || (bsr_config->image_format == 2)) {
-      // PNG, JPG formats. Channels are RGB RGB RGB order and stored big-endian
-      if (bsr_config->bits_per_color == 8) {
-        *image_output_p=(unsigned char)((pixel_r * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-        *image_output_p=(unsigned char)((pixel_g * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-        *image_output_p=(unsigned char)((pixel_b * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-      } else if (bsr_config->bits_per_color == 16) {
-        storeU16BE(image_output_p,  (uint16_t)((pixel_r * 65535.0) + 0.5));
-        image_output_p+=bytes_per_color;
-        storeU16BE(image_output_p,  (uint16_t)((pixel_g * 65535.0) + 0.5));
-        image_output_p+=bytes_per_color;
-        storeU16BE(image_output_p,  (uint16_t)((pixel_b * 65535.0) + 0.5));
-        image_output_p+=bytes_per_color;
-      } // end if bits_per_color
-    } else if (bsr_config->image_format == 1) {
-      // EXR format. Channels are in BBB GGG RRR order and stored little-endian
-      if (bsr_config->image_number_format == 1) {
-        // floating-point
-        if (bsr_config->bits_per_color == 16) {
-          storeHalfLE(image_output_B_p, (float)pixel_b);
-          image_output_B_p+=bytes_per_color;
-          storeHalfLE(image_output_G_p, (float)pixel_g);
-          image_output_G_p+=bytes_per_color;
-          storeHalfLE(image_output_R_p, (float)pixel_r);
-          image_output_R_p+=bytes_per_color;
-          image_output_p+=bytes_per_pixel; // to keep beginning of row in sync
-        } else if (bsr_config->bits_per_color == 32) {
-          storeFloatLE(image_output_B_p, (float)pixel_b);
+          // limit pixel intensity to range [0..1] 
+          if (bsr_config->camera_pixel_limit_mode == 0) {
+            limitIntensity(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+          } else if (bsr_config->camera_pixel_limit_mode == 1) {
+            limitIntensityPreserveColor(bsr_config, &pixel_r, &pixel_g, &pixel_b);
+          }
+
+          // apply transfer function        
+          Ym1=pow(pixel_r, m1);
+          pixel_r=pow(((c1 + (c2 * Ym1)) / (1.0 + (c3 * Ym1))), m2);
+          Ym1=pow(pixel_g, m1);
+          pixel_g=pow(((c1 + (c2 * Ym1)) / (1.0 + (c3 * Ym1))), m2);
+          Ym1=pow(pixel_b, m1);
+          pixel_b=pow(((c1 + (c2 * Ym1)) / (1.0 + (c3 * Ym1))), m2);
+        } // end if color_profile
+      } // end if image_format
+
+      //
+      // convert r,g,b to output byte sequence and store in output buffer
+      //
+      if ((bsr_config->image_format == 0) || (bsr_config->image_format == 2) || (bsr_config->image_format == 5)) {
+        // PNG, JPG, TIFF integer formats. Channels are RGB RGB RGB order and stored big-endian
+        if (bsr_config->bits_per_color == 8) {
+          *image_output_p=(unsigned char)((pixel_r * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+          *image_output_p=(unsigned char)((pixel_g * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+          *image_output_p=(unsigned char)((pixel_b * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+        } else if (bsr_config->bits_per_color == 16) {
+          storeU16BE(image_output_p,  (uint16_t)((pixel_r * 65535.0) + 0.5));
+          image_output_p+=bytes_per_color;
+          storeU16BE(image_output_p,  (uint16_t)((pixel_g * 65535.0) + 0.5));
+          image_output_p+=bytes_per_color;
+          storeU16BE(image_output_p,  (uint16_t)((pixel_b * 65535.0) + 0.5));
+          image_output_p+=bytes_per_color;
+        } // end if bits_per_color
+      } else if (bsr_config->image_format == 1) {
+        // EXR format. Channels are in BBB GGG RRR order and stored little-endian
+        if (bsr_config->image_number_format == 1) {
+          // floating-point
+          if (bsr_config->bits_per_color == 16) {
+            storeHalfLE(image_output_B_p, (float)pixel_b);
+            image_output_B_p+=bytes_per_color;
+            storeHalfLE(image_output_G_p, (float)pixel_g);
+            image_output_G_p+=bytes_per_color;
+            storeHalfLE(image_output_R_p, (float)pixel_r);
+            image_output_R_p+=bytes_per_color;
+            image_output_p+=bytes_per_pixel; // to keep beginning of row in sync
+          } else if (bsr_config->bits_per_color == 32) {
+            storeFloatLE(image_output_B_p, (float)pixel_b);
+            image_output_B_p+=bytes_per_color;
+            storeFloatLE(image_output_G_p, (float)pixel_g);
+            image_output_G_p+=bytes_per_color;
+            storeFloatLE(image_output_R_p, (float)pixel_r);
+            image_output_R_p+=bytes_per_color;
+            image_output_p+=bytes_per_pixel; // to keep beginning of row in sync
+          } // end if bits_per_color
+        } else if (bsr_config->image_number_format == 0) {
+          // unsigned integer 
+          storeU32LE(image_output_B_p, (uint32_t)((pixel_b * 4294967295.0) + 0.5));
           image_output_B_p+=bytes_per_color;
-          storeFloatLE(image_output_G_p, (float)pixel_g);
+          storeU32LE(image_output_G_p, (uint32_t)((pixel_g * 4294967295.0) + 0.5));
           image_output_G_p+=bytes_per_color;
-          storeFloatLE(image_output_R_p, (float)pixel_r);
+          storeU32LE(image_output_R_p, (uint32_t)((pixel_r * 4294967295.0) + 0.5));
           image_output_R_p+=bytes_per_color;
           image_output_p+=bytes_per_pixel; // to keep beginning of row in sync
+        } // end if image_number_format
+      } else if (bsr_config->image_format == 3) {
+        // AVIF format. Channels are in RGB RGB RGB order and stored system-endian
+        if (bsr_config->bits_per_color == 8) {
+          *image_output_p=(unsigned char)((pixel_r * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+          *image_output_p=(unsigned char)((pixel_g * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+          *image_output_p=(unsigned char)((pixel_b * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+        } else if (bsr_config->bits_per_color == 10) {
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeU16BE(image_output_p,  (uint16_t)((pixel_r * 1023.0) + 0.5));
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeU16LE(image_output_p,  (uint16_t)((pixel_r * 1023.0) + 0.5));
+  #endif
+          image_output_p+=bytes_per_color;
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeU16BE(image_output_p,  (uint16_t)((pixel_g * 1023.0) + 0.5));
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeU16LE(image_output_p,  (uint16_t)((pixel_g * 1023.0) + 0.5));
+  #endif
+          image_output_p+=bytes_per_color;
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeU16BE(image_output_p,  (uint16_t)((pixel_b * 1023.0) + 0.5));
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeU16LE(image_output_p,  (uint16_t)((pixel_b * 1023.0) + 0.5));
+  #endif
+          image_output_p+=bytes_per_color;
+        } else if (bsr_config->bits_per_color == 12) {
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeU16BE(image_output_p,  (uint16_t)((pixel_r * 4095.0) + 0.5));
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeU16LE(image_output_p,  (uint16_t)((pixel_r * 4095.0) + 0.5));
+  #endif
+          image_output_p+=bytes_per_color;
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeU16BE(image_output_p,  (uint16_t)((pixel_g * 4095.0) + 0.5));
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeU16LE(image_output_p,  (uint16_t)((pixel_g * 4095.0) + 0.5));
+  #endif
+          image_output_p+=bytes_per_color;
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeU16BE(image_output_p,  (uint16_t)((pixel_b * 4095.0) + 0.5));
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeU16LE(image_output_p,  (uint16_t)((pixel_b * 4095.0) + 0.5));
+  #endif
+          image_output_p+=bytes_per_color;
+        } else if (bsr_config->bits_per_color == 16) { // note: 16-bit half
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeHalfBE(image_output_p, (float)pixel_r);
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeHalfLE(image_output_p, (float)pixel_r);
+  #endif
+          image_output_p+=bytes_per_color;
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeHalfBE(image_output_p, (float)pixel_g);
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeHalfLE(image_output_p, (float)pixel_g);
+  #endif
+          image_output_p+=bytes_per_color;
+  #ifdef BSR_BIG_ENDIAN_COMPILE
+          storeHalfBE(image_output_p, (float)pixel_b);
+  #elif defined BSR_LITTLE_ENDIAN_COMPILE
+          storeHalfLE(image_output_p, (float)pixel_b);
+  #endif
+          image_output_p+=bytes_per_color;
+        } // end if bits_per_color
+      } else if (bsr_config->image_format == 4) {
+        // HEIF format. Channels are RGB RGB RGB order and stored little-endian
+        if (bsr_config->bits_per_color == 8) {
+          *image_output_p=(unsigned char)((pixel_r * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+          *image_output_p=(unsigned char)((pixel_g * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+          *image_output_p=(unsigned char)((pixel_b * 255.0) + 0.5);
+          image_output_p+=bytes_per_color;
+        } else if (bsr_config->bits_per_color == 10) {
+          storeU16LE(image_output_p,  (uint16_t)((pixel_r * 1023.0) + 0.5));
+          image_output_p+=bytes_per_color;
+          storeU16LE(image_output_p,  (uint16_t)((pixel_g * 1023.0) + 0.5));
+          image_output_p+=bytes_per_color;
+          storeU16LE(image_output_p,  (uint16_t)((pixel_b * 1023.0) + 0.5));
+          image_output_p+=bytes_per_color;
+        } else if (bsr_config->bits_per_color == 12) {
+          storeU16LE(image_output_p,  (uint16_t)((pixel_r * 4095.0) + 0.5));
+          image_output_p+=bytes_per_color;
+          storeU16LE(image_output_p,  (uint16_t)((pixel_g * 4095.0) + 0.5));
+          image_output_p+=bytes_per_color;
+          storeU16LE(image_output_p,  (uint16_t)((pixel_b * 4095.0) + 0.5));
+          image_output_p+=bytes_per_color;
         } // end if bits_per_color
-      } else if (bsr_config->image_number_format == 0) {
-        // unsigned integer 
-        storeU32LE(image_output_B_p, (uint32_t)((pixel_b * 4294967295.0) + 0.5));
-        image_output_B_p+=bytes_per_color;
-        storeU32LE(image_output_G_p, (uint32_t)((pixel_g * 4294967295.0) + 0.5));
-        image_output_G_p+=bytes_per_color;
-        storeU32LE(image_output_R_p, (uint32_t)((pixel_r * 4294967295.0) + 0.5));
-        image_output_R_p+=bytes_per_color;
-        image_output_p+=bytes_per_pixel; // to keep beginning of row in sync
-      } // end if image_number_format
-    } else if (bsr_config->image_format == 3) {
-      // AVIF format. Channels are in RGB RGB RGB order and stored system-endian
-      if (bsr_config->bits_per_color == 8) {
-        *image_output_p=(unsigned char)((pixel_r * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-        *image_output_p=(unsigned char)((pixel_g * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-        *image_output_p=(unsigned char)((pixel_b * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-      } else if (bsr_config->bits_per_color == 10) {
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeU16BE(image_output_p,  (uint16_t)((pixel_r * 1023.0) + 0.5));
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeU16LE(image_output_p,  (uint16_t)((pixel_r * 1023.0) + 0.5));
-#endif
-        image_output_p+=bytes_per_color;
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeU16BE(image_output_p,  (uint16_t)((pixel_g * 1023.0) + 0.5));
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeU16LE(image_output_p,  (uint16_t)((pixel_g * 1023.0) + 0.5));
-#endif
-        image_output_p+=bytes_per_color;
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeU16BE(image_output_p,  (uint16_t)((pixel_b * 1023.0) + 0.5));
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeU16LE(image_output_p,  (uint16_t)((pixel_b * 1023.0) + 0.5));
-#endif
-        image_output_p+=bytes_per_color;
-      } else if (bsr_config->bits_per_color == 12) {
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeU16BE(image_output_p,  (uint16_t)((pixel_r * 4095.0) + 0.5));
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeU16LE(image_output_p,  (uint16_t)((pixel_r * 4095.0) + 0.5));
-#endif
-        image_output_p+=bytes_per_color;
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeU16BE(image_output_p,  (uint16_t)((pixel_g * 4095.0) + 0.5));
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeU16LE(image_output_p,  (uint16_t)((pixel_g * 4095.0) + 0.5));
-#endif
-        image_output_p+=bytes_per_color;
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeU16BE(image_output_p,  (uint16_t)((pixel_b * 4095.0) + 0.5));
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeU16LE(image_output_p,  (uint16_t)((pixel_b * 4095.0) + 0.5));
-#endif
-        image_output_p+=bytes_per_color;
-      } else if (bsr_config->bits_per_color == 16) { // note: 16-bit half
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeHalfBE(image_output_p, (float)pixel_r);
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeHalfLE(image_output_p, (float)pixel_r);
-#endif
-        image_output_p+=bytes_per_color;
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeHalfBE(image_output_p, (float)pixel_g);
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeHalfLE(image_output_p, (float)pixel_g);
-#endif
-        image_output_p+=bytes_per_color;
-#ifdef BSR_BIG_ENDIAN_COMPILE
-        storeHalfBE(image_output_p, (float)pixel_b);
-#elif defined BSR_LITTLE_ENDIAN_COMPILE
-        storeHalfLE(image_output_p, (float)pixel_b);
-#endif
-        image_output_p+=bytes_per_color;
-      } // end if bits_per_color
-    } else if (bsr_config->image_format == 4) {
-      // HEIF format. Channels are RGB RGB RGB order and stored little-endian
-      if (bsr_config->bits_per_color == 8) {
-        *image_output_p=(unsigned char)((pixel_r * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-        *image_output_p=(unsigned char)((pixel_g * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-        *image_output_p=(unsigned char)((pixel_b * 255.0) + 0.5);
-        image_output_p+=bytes_per_color;
-      } else if (bsr_config->bits_per_color == 10) {
-        storeU16LE(image_output_p,  (uint16_t)((pixel_r * 1023.0) + 0.5));
-        image_output_p+=bytes_per_color;
-        storeU16LE(image_output_p,  (uint16_t)((pixel_g * 1023.0) + 0.5));
-        image_output_p+=bytes_per_color;
-        storeU16LE(image_output_p,  (uint16_t)((pixel_b * 1023.0) + 0.5));
-        image_output_p+=bytes_per_color;
-      } else if (bsr_config->bits_per_color == 12) {
-        storeU16LE(image_output_p,  (uint16_t)((pixel_r * 4095.0) + 0.5));
-        image_output_p+=bytes_per_color;
-        storeU16LE(image_output_p,  (uint16_t)((pixel_g * 4095.0) + 0.5));
-        image_output_p+=bytes_per_color;
-        storeU16LE(image_output_p,  (uint16_t)((pixel_b * 4095.0) + 0.5));
-        image_output_p+=bytes_per_color;
-      } // end if bits_per_color
-    } // end if image_format
-
-    //
-    // if we have reached end of row, update x,y and image format specific variables
-    //
-    output_x++;
-    if (output_x == output_res_x) {
-      output_x=0;
-      output_y++;
-      if ((bsr_config->image_format == 0) || (bsr_config->image_format == 2)) {
-        // update row_pointers if PNG or JPG output format
-        if (((image_offset + (uint64_t)1) < ((uint64_t)output_res_x * (uint64_t)lines_per_thread)) && (output_y < output_res_y)) {
-          bsr_state->row_pointers[output_y]=image_output_p;
-        }
-      } else if (bsr_config->image_format == 1) {
-        // EXR, update local channel pointers
-        image_output_B_p=image_output_p;
-        image_output_G_p=image_output_p + ((uint64_t)bytes_per_color * (uint64_t)output_res_x);
-        image_output_R_p=image_output_p + (2ll * (uint64_t)bytes_per_color * (uint64_t)output_res_x);
       } // end if image_format
-    } //end if output_x
 
-    current_image_p++;
-  } // end for i
+      //
+      // if we have reached end of row, update x,y and image format specific variables
+      //
+      output_x++;
+      if (output_x == output_res_x) {
+        output_x=0;
+        output_y++;
+        if (bsr_config->image_format != 1) {
+          // update row_pointers if interleaved (not EXR) output format
+          if (((image_offset + (uint64_t)1) < ((uint64_t)output_res_x * (uint64_t)lines_per_thread)) && (output_y < output_res_y)) {
+            bsr_state->row_pointers[output_y]=image_output_p;
+          }
+        } else if (bsr_config->image_format == 1) {
+          // EXR, update local channel pointers
+          image_output_B_p=image_output_p;
+          image_output_G_p=image_output_p + ((uint64_t)bytes_per_color * (uint64_t)output_res_x);
+          image_output_R_p=image_output_p + (2ll * (uint64_t)bytes_per_color * (uint64_t)output_res_x);
+        } // end if image_format
+      } //end if output_x
+
+      current_image_p++;
+    } // end for i
+  } // end if use_rows
+
+  //
+  // all threads: build and encode reduced deep zoom levels
+  //
+  sequenceDeepZoomLevels(bsr_config, bsr_state);
 
   //
   // worker threads: signal this thread is done and wait until main thread says we can continue to next step.
@@ -439,5 +1237,8 @@ int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state) {
     fflush(stdout);
   }
 
+  free(sequence_line);
+  free(code_line);
+
   return(0);
 }
@@ -39,6 +39,9 @@
 #ifndef BSR_SEQUENCE_PIXELS_H
 #define BSR_SEQUENCE_PIXELS_H
 
+int initTransferTable(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 int sequencePixels(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int sequencePixels16(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
+int sequencePixels64(bsr_config_t *bsr_config, bsr_state_t *bsr_state);
 
 #endif // BSR_SEQUENCE_PIXELS_H
@@ -55,7 +55,14 @@ Command line only options:\n\
 \n\
 Privileged options - these cannot be changed by remote users in CGI mode:\n\
      --data_file_directory=DIR, -d        Path to galaxy-* data files, limit 255 characters\n\
+     --data_cache_directory=DIR           Optional path to cached copies of data files created by bsrcache, usually\n\
+                                          on hugetlbfs or tmpfs. Data files are used if empty or cache is stale\n\
      --output_file_name=FILE, -o          Output filename, may include path, limit 255 characters\n\
+     --extra_output=FILE,OPTION=VALUE,... Also write FILE from the same render, with output options for this file\n\
+                                          only, for example extra_output=preview.jpg,output_format=5,\n\
+                                          output_scaling_factor=0.25. Output format, color profile, scaling and\n\
+                                          encoder options can be set. May be repeated up to 8 times. Stars, blur\n\
+                                          and camera settings are shared. Not supported in CGI mode\n\
      --print_status=BOOL, -q              yes = sppress non-error status messages (also -q)\n\
                                           no = will allow informational status messages\n\
                                           All messages are always suppressed in CGI mode\n\
@@ -67,12 +74,34 @@ Privileged options - these cannot be changed by remote users in CGI mode:\n\
      --per_thread_buffer_Airy=NUM         Number of stars to buffer between each worker thread and main thread\n\
                                           when Airy disks are enabled\n\
                                           Also sets size of dedup buffer for each thread\n\
+     --huge_pages=NUM                     Back image composition, blur, resize, and output buffers with huge pages\n\
+                                          0 = normal pages, 1 = transparent huge pages, 2 = 2MB huge pages\n\
+                                          3 = 1GB huge pages. 2MB/1GB pages must be reserved with vm.nr_hugepages\n\
+                                          or the hugepagesz= kernel option. If not available, falls back to the\n\
+                                          next smaller option\n\
+     --numa_mode=NUM                      0 = disabled, 1 = pin threads to NUMA nodes and interleave image buffers\n\
+                                          over all nodes, 2 = pin threads to NUMA nodes and place each row band\n\
+                                          of the image buffers on the node of the thread that processes it\n\
+                                          Ignored on single node systems\n\
+     --numa_replicate_max_size=NUM        If numa_mode is enabled, copy data files up to NUM MB in size to each\n\
+                                          NUMA node so worker threads read stars from local memory\n\
+                                          0 = do not replicate\n\
+     --max_memory=NUM                     Refuse to render if the planned peak memory for image, star and dedup\n\
+                                          buffers exceeds NUM MB. 0 = no limit\n\
+     --composition_precision=NUM          Bits per color in image composition, blur, and resize buffers\n\
+                                          16 = half-float (smallest, for very large previews), 32 = float\n\
+                                          64 = double (archival)\n\
+     --input_backend=NUM                  0 = mmap data files, 1 = stream data files with a reader thread per worker\n\
+                                          thread (for datasets larger than ram), 2 = same as 1 but with O_DIRECT\n\
+                                          to bypass the page cache. data_cache_directory is ignored if not 0\n\
+     --input_chunk_size=NUM               Size of each read in MB for input_backend 1 and 2\n\
      --cgi_mode=BOOL                      yes = enable CGI mode (html headers and png data written to stdout)\n\
      --cgi_max_res_x=NUM                  Maximum allowed horizontal resolution for CGI users\n\
      --cgi_max_res_y=NUM                  Maximum allowed vertical resolution for CGI users\n\
      --cgi_Gaia_min_parallax_quality=NUM  Minimum allowed parallax quality of Gaia stars for CGI users\n\
      --cgi_allow_Airy_disk=BOOL           yes = Airy disk mode is allowed for CGI users\n\
      --cgi_allow_anti_alias=BOOL          yes = anti-aliasing mode is allowed for CGI users\n\
+     --cgi_min_encoder_speed=NUM          Minimum allowed AVIF/HEIF encoder_speed for CGI users\n\
      --cgi_min_Airy_disk_first_null=FLOAT Minimum allowed first null distance for CGI users\n\
      --cgi_max_Airy_disk_min_extent=NUM   Maximum allowed Airy disk minimum extent for CGI users\n\
      --cgi_max_Airy_disk_max_extent=NUM   Maximum allowed Airy disk extent for CGI users\n\
@@ -152,8 +181,11 @@ Post-processing\n\
      --pre_limit_intensity=yes            Apply pixel intensity limit before blur/resize/encoding gamma. This is\n\
                                           disabled automatically when an HDR color profile is selected\n\
      --Gaussian_blur_radius=FLOAT         Optional Gaussian blur with this radius in pixels\n\
+     --Gaussian_blur_method=NUM           0 = auto, 1 = direct kernel, 2 = recursive filter (time independent of radius)\n\
      --output_scaling_factor=FLOAT        Optional output scaling using Lanczos2 interpolation\n\
      --Lanczos_order=NUM                  Lanczos order parameter for output scaling\n\
+     --resize_method=NUM                  0 = Lanczos, 1 = area average when output_scaling_factor is 1/N for integer N\n\
+                                          (for supersampled renders, falls back to Lanczos otherwise)\n\
 \n\
 Overlays\n\
      --draw_crosshairs=BOOL               Draw small crosshairs in center of image. Note: This will not be\n\
@@ -174,12 +206,16 @@ Output\n\
                                           10 = HEIF 8-bit unsigned integer per color\n\
                                           11 = HEIF 10-bit unsigned integer per color\n\
                                           12 = HEIF 12-bit unsigned integer per color\n\
-                                          Note: HEIF is not yet supported in CGI mode\n\
+                                          13 = TIFF 8-bit unsigned integer per color\n\
+                                          14 = TIFF 16-bit unsigned integer per color\n\
+                                          15 = TIFF 32-bit floating-point per color\n\
+                                          Note: HEIF and TIFF are not supported in CGI mode\n\
      --color_profile=NUM                  0 = linear gamma, 1 = sRGB, 2 = Display-P3, 3 = Rec. 2020,\n\
                                           4 = Rec. 601 NTSC, 5 = Rec. 601 PAL, 6 = Rec. 709,\n\
                                           7 = 2.0 gamma, 8 = Rec. 2100 PQ (HDR),\n\
-                                         -1 = default: PNG,JPG,AVIF,HEIF = 1 (sRGB), EXR = 0 (linear)\n\
-                                          PNG, JPG formats use open source ICC profiles\n\
+                                         -1 = default: PNG,JPG,AVIF,HEIF,TIFF integer = 1 (sRGB),\n\
+                                              EXR,TIFF floating-point = 0 (linear)\n\
+                                          PNG, JPG, TIFF formats use open source ICC profiles\n\
                                           from https://github.com/saucecontrol/Compact-ICC-Profiles\n\
                                           EXR, AVIF, and HEIF formats use built-in signaling in the container\n\
                                           Rec. 2100 PQ profile is experimental and will appear very washed out\n\
@@ -188,6 +224,31 @@ Output\n\
      --exr_compression=NUM                Compression format for OpenEXR files\n\
                                           0 = uncompressed, 2 = ZIPS (one line per block)\n\
                                           3 = ZIP (16 lines per block)\n\
+     --exr_tile_size=NUM                  Size in pixels of tiles for OpenEXR files\n\
+                                          0 = scanline image (no tiles)\n\
+     --exr_mipmap=BOOL                    Add mipmap levels to tiled OpenEXR files\n\
+     --tiff_compression=NUM               Compression for TIFF files\n\
+                                          0 = uncompressed, 1 = deflate with predictor\n\
+     --tiff_tile_size=NUM                 Size in pixels of tiles for TIFF files (multiple of 16)\n\
+     --tiff_pyramid=BOOL                  Add reduced resolution pyramid levels to TIFF files\n\
+     --deep_zoom=NUM                      Write a tile pyramid for web viewers instead of a single image\n\
+                                          0 = single image, 1 = DZI (name.dzi and name_files/)\n\
+                                          2 = XYZ (name/z/x/y), PNG, JPG and integer AVIF only\n\
+     --deep_zoom_tile_size=NUM            Size in pixels of deep zoom tiles\n\
+     --stream_output=BOOL                 Write the image while it is converted instead of after\n\
+                                          PNG (png_compression=1 or 2), JPG (jpeg_encoding=1) and scanline EXR\n\
+     --png_compression=NUM                Compression for PNG files\n\
+                                          0 = libpng encoder (main thread only)\n\
+                                          1 = multi-threaded, fast (deflate level 1)\n\
+                                          2 = multi-threaded, default (deflate level 6)\n\
+     --jpeg_encoding=NUM                  Encoder for JPG files\n\
+                                          0 = libjpeg encoder (main thread only)\n\
+                                          1 = multi-threaded, standard Huffman tables\n\
+                                          2 = multi-threaded, optimized Huffman tables (slower)\n\
+     --encoder_speed=NUM                  Speed of AVIF/HEIF encoders, 0 (slowest) - 10 (fastest),\n\
+                                         -1 = encoder default\n\
+     --grid_tile_size=NUM                 Size in pixels of tiles encoded in parallel for AVIF/HEIF files\n\
+                                          0 = encode as a single image (main thread only)\n\
      --hdr_neutral_white_ref=NUM          Brightness of neutral white for HDR profiles in nits. camera_pixel_limit_mag\n\
                                           is normalized to this value before encoding. Pixels brighter than this\n\
                                           will be displayed brighter (up to 10,000 nits for PQ profile) on supported\n\
@@ -41,6 +41,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <errno.h>
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#include <immintrin.h>
+#endif
 
 int littleEndianTest() {
   uint64_t tmp64;
@@ -204,6 +208,42 @@ int storeU32LE(unsigned char *dest, uint32_t src) {
   return(4);
 }
 
+int storeU32BE(unsigned char *dest, uint32_t src) {
+  unsigned char *src_p;
+  unsigned char *dest_p;
+
+  dest_p=dest;
+#ifdef BSR_BIG_ENDIAN_COMPILE
+  src_p=(unsigned char *)&src;
+  *dest_p=*src_p;
+  dest_p++;
+  src_p++;
+  *dest_p=*src_p;
+  dest_p++;
+  src_p++;
+  *dest_p=*src_p;
+  dest_p++;
+  src_p++;
+  *dest_p=*src_p;
+#elif defined BSR_LITTLE_ENDIAN_COMPILE
+  src_p=(unsigned char *)&src;
+  src_p+=3;
+  *dest_p=*src_p;
+  dest_p++;
+  src_p--;
+  *dest_p=*src_p;
+  dest_p++;
+  src_p--;
+  *dest_p=*src_p;
+  dest_p++;
+  src_p--;
+  *dest_p=*src_p;
+#endif
+
+  // return number of bytes stored
+  return(4);
+}
+
 int storeU64LE(unsigned char *dest, uint64_t src) {
   unsigned char *src_p;
   unsigned char *dest_p;
@@ -264,9 +304,39 @@ int storeU64LE(unsigned char *dest, uint64_t src) {
   return(8);
 }
 
-int storeHalfLE(unsigned char *dest, float src) {
-  unsigned char *src_p;
-  unsigned char *dest_p;
+int storeU64BE(unsigned char *dest, uint64_t src) {
+  storeU32BE(dest, (uint32_t)(src >> 32));
+  storeU32BE(dest + 4, (uint32_t)(src & 0xFFFFFFFF));
+
+  // return number of bytes stored
+  return(8);
+}
+
+uint16_t loadU16LE(unsigned char *src) {
+  return((uint16_t)((uint16_t)src[0] | ((uint16_t)src[1] << 8)));
+}
+
+uint32_t loadU32LE(unsigned char *src) {
+  return((uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24));
+}
+
+uint64_t loadU64LE(unsigned char *src) {
+  return((uint64_t)loadU32LE(src) | ((uint64_t)loadU32LE(src + 4) << 32));
+}
+
+uint16_t loadU16BE(unsigned char *src) {
+  return((uint16_t)(((uint16_t)src[0] << 8) | (uint16_t)src[1]));
+}
+
+uint32_t loadU32BE(unsigned char *src) {
+  return(((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | (uint32_t)src[3]);
+}
+
+uint64_t loadU64BE(unsigned char *src) {
+  return(((uint64_t)loadU32BE(src) << 32) | (uint64_t)loadU32BE(src + 4));
+}
+
+uint16_t floatToHalf(float src) {
   uint32_t *src32_p;
   uint32_t tmp32;
   int32_t tmp32i;
@@ -274,10 +344,9 @@ int storeHalfLE(unsigned char *dest, float src) {
   uint32_t float_fraction;
   uint16_t half_exponent;
   uint16_t half_fraction;
-  uint16_t half;
 
   //
-  // convert float to half first
+  // convert float to half, truncating extra fraction bits
   //
 
   // convert to uint32 for general bit manipulation
@@ -294,7 +363,7 @@ int storeHalfLE(unsigned char *dest, float src) {
   half_exponent=(uint16_t)tmp32i;
   if (tmp32i <= 0) {
     half_exponent=0;
-    if (float_fraction == 0) { // zero case
+    if (float_exponent == 0) { // zero case (float subnormals are flushed)
       half_fraction=0;
       }  else if (tmp32i >= -9) { // subnormal (in half) case
         half_fraction |= 0x400; // add leading 1
@@ -308,26 +377,111 @@ int storeHalfLE(unsigned char *dest, float src) {
   }
 
   // note: sign bit is always 0 in bsrender
-  half=(half_exponent << 10) | half_fraction;
+  return((half_exponent << 10) | half_fraction);
+}
 
-  dest_p=dest;
+float halfToFloat(uint16_t src) {
+  uint32_t half_exponent;
+  uint32_t half_fraction;
+  uint32_t tmp32;
+  float dest;
+
+  //
+  // convert half to float, exact for all half values
+  //
+  half_exponent=(src >> 10) & 0x1f;
+  half_fraction=src & 0x3ff;
+  if (half_exponent == 0) {
+    // zero or subnormal, value is fraction * 2^-24
+    dest=(float)half_fraction * 5.9604644775390625E-8f;
+    if ((src & 0x8000) != 0) {
+      dest=-dest;
+    }
+    return(dest);
+  } else if (half_exponent == 31) {
+    // inf or nan
+    tmp32=((uint32_t)(src & 0x8000) << 16) | 0x7f800000 | (half_fraction << 13);
+  } else {
+    tmp32=((uint32_t)(src & 0x8000) << 16) | ((half_exponent + 112) << 23) | (half_fraction << 13);
+  }
+  memcpy(&dest, &tmp32, 4);
+
+  return(dest);
+}
+
+float loadFloatLE(unsigned char *src) {
+  uint32_t tmp32;
+  float dest;
+
+  tmp32=loadU32LE(src);
+  memcpy(&dest, &tmp32, 4);
+
+  return(dest);
+}
+
+float loadFloatBE(unsigned char *src) {
+  uint32_t tmp32;
+  float dest;
+
+  tmp32=loadU32BE(src);
+  memcpy(&dest, &tmp32, 4);
+
+  return(dest);
+}
+
+int storeHalfLE(unsigned char *dest, float src) {
+  return(storeU16LE(dest, floatToHalf(src)));
+}
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+__attribute__((target("avx,f16c")))
+static void storeHalfLineF16C(unsigned char *dest, float *src, int count) {
+  int i;
+  __m256 in;
+  __m128i out;
+  const __m256 half_max=_mm256_set1_ps(65504.0f);
+
+  //
+  // convert 8 floats per instruction, truncating like floatToHalf().  Input is clamped to the
+  // largest half first so overflow saturates instead of becoming inf
+  //
+  for (i=0; i < (count - 7); i+=8) {
+    in=_mm256_min_ps(_mm256_loadu_ps(src + i), half_max);
+    out=_mm256_cvtps_ph(in, _MM_FROUND_TO_ZERO);
+    _mm_storeu_si128((__m128i *)(dest + (i * 2)), out);
+  }
+  for (; i < count; i++) {
+    storeHalfLE(dest + (i * 2), src[i]);
+  }
+}
+#endif
+
+int storeHalfLineLE(unsigned char *dest, float *src, int count) {
+  int i;
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+  static int have_f16c=-1;
+
+  //
+  // use F16C conversion instructions if this cpu has them
+  //
+  if (have_f16c == -1) {
+    __builtin_cpu_init();
+    have_f16c=(__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"));
+  }
 #ifdef BSR_LITTLE_ENDIAN_COMPILE
-  src_p=(unsigned char *)&half;
-  *dest_p=*src_p;
-  dest_p++;
-  src_p++;
-  *dest_p=*src_p;
-#elif defined BSR_BIG_ENDIAN_COMPILE
-  src_p=(unsigned char *)&half;
-  src_p++;
-  *dest_p=*src_p;
-  dest_p++;
-  src_p--;
-  *dest_p=*src_p;
+  if (have_f16c == 1) {
+    storeHalfLineF16C(dest, src, count);
+    return(count * 2);
+  }
 #endif
+#endif
+
+  for (i=0; i < count; i++) {
+    storeHalfLE(dest + (i * 2), src[i]);
+  }
 
   // return number of bytes stored
-  return(2);
+  return(count * 2);
 }
 
 int storeFloatLE(unsigned char *dest, float src) {
@@ -366,6 +520,14 @@ int storeFloatLE(unsigned char *dest, float src) {
   return(4);
 }
 
+int storeFloatBE(unsigned char *dest, float src) {
+  uint32_t tmp32;
+
+  memcpy(&tmp32, &src, 4);
+
+  return(storeU32BE(dest, tmp32));
+}
+
 int getQueryString(bsr_config_t *bsr_config) {
   //
   // used to suppress output before config file is loaded and to load config options from CGI users
@@ -450,6 +612,50 @@ int checkExceptions(bsr_state_t *bsr_state) {
   return(0);
 }
 
+//
+// write all buffers in iov to fd at offset, or at the current file position if offset is negative.
+// Partial writes are continued and interrupted writes retried, iov is modified. Returns 1 on error
+//
+int writeVector(int fd, struct iovec *iov, int iovcnt, int64_t offset) {
+  ssize_t result;
+  size_t written=0;
+
+  while (1) {
+    // skip buffers that were written completely, then advance into a partially written one
+    while ((iovcnt > 0) && (written >= iov->iov_len)) {
+      written-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt <= 0) {
+      break;
+    }
+    iov->iov_base=(char *)iov->iov_base + written;
+    iov->iov_len-=written;
+
+    if (offset >= 0) {
+      result=pwritev(fd, iov, iovcnt, (off_t)offset);
+    } else {
+      result=writev(fd, iov, iovcnt);
+    }
+    if (result < 0) {
+      if (errno != EINTR) {
+        return(1);
+      }
+      written=0;
+      continue;
+    } else if (result == 0) {
+      return(1);
+    }
+    if (offset >= 0) {
+      offset+=(int64_t)result;
+    }
+    written=(size_t)result;
+  }
+
+  return(0);
+}
+
 int waitForWorkerThreads(bsr_state_t *bsr_state, int min_status) {
   int i;
   int loop_count;
@@ -502,6 +708,34 @@ int waitForMainThread(bsr_state_t *bsr_state, int min_status) {
   return(0);
 }
 
+//
+// like waitForMainThread() but for a status that goes backwards: wait until the main thread changes this
+// thread's status from wait_status to anything else, for example to repeat earlier steps for another output
+//
+int waitForMainThreadRewind(bsr_state_t *bsr_state, int wait_status) {
+  volatile int cont;
+  int loop_count;
+
+  loop_count=0;
+  cont=0;
+  while (cont == 0) {
+
+    // periodically check for exceptions
+    loop_count++;
+    if ((loop_count % 10000) == 0) {
+      checkExceptions(bsr_state);
+      loop_count=1;
+    }
+
+    // see if main thread has rewound our status
+    if (bsr_state->status_array[bsr_state->perthread->my_thread_id].status != wait_status) {
+      cont=1;
+    }
+  }
+
+  return(0);
+}
+
 int limitIntensity(bsr_config_t *bsr_config, double *pixel_r, double *pixel_g, double *pixel_b) {
   //
   // limit pixel to range 0.0-1.0 without regard to color
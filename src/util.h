@@ -46,13 +46,29 @@ int storeU16LE(unsigned char *dest, uint16_t src);
 int storeU16BE(unsigned char *dest, uint16_t src);
 int storeI32LE(unsigned char *dest, int32_t src);
 int storeU32LE(unsigned char *dest, uint32_t src);
+int storeU32BE(unsigned char *dest, uint32_t src);
 int storeU64LE(unsigned char *dest, uint64_t src);
+int storeU64BE(unsigned char *dest, uint64_t src);
+uint16_t loadU16LE(unsigned char *src);
+uint32_t loadU32LE(unsigned char *src);
+uint64_t loadU64LE(unsigned char *src);
+uint16_t loadU16BE(unsigned char *src);
+uint32_t loadU32BE(unsigned char *src);
+uint64_t loadU64BE(unsigned char *src);
+uint16_t floatToHalf(float src);
+float halfToFloat(uint16_t src);
+float loadFloatLE(unsigned char *src);
+float loadFloatBE(unsigned char *src);
 int storeHalfLE(unsigned char *dest, float src);
+int storeHalfLineLE(unsigned char *dest, float *src, int count);
 int storeFloatLE(unsigned char *dest, float src);
+int storeFloatBE(unsigned char *dest, float src);
 int getQueryString(bsr_config_t *bsr_config);
 int printVersion(bsr_config_t *bsr_config);
+int writeVector(int fd, struct iovec *iov, int iovcnt, int64_t offset);
 int waitForWorkerThreads(bsr_state_t *bsr_state, int min_status);
 int waitForMainThread(bsr_state_t *bsr_state, int min_status);
+int waitForMainThreadRewind(bsr_state_t *bsr_state, int wait_status);
 int checkExceptions(bsr_state_t *bsr_state);
 int limitIntensity(bsr_config_t *bsr_config, double *pixel_r, double *pixel_g, double *pixel_b);
 int limitIntensityPreserveColor(bsr_config_t *bsr_config, double *pixel_r, double *pixel_g, double *pixel_b);